@@ -0,0 +1,95 @@
+#include <stdlib.h>
+#include "ehlo-shared.h"
+#include "ehlo-admission.h"
+
+#define ADMISSION_MIN_BITS 4
+#define ADMISSION_PROBES 8
+#define TOKEN 1000
+
+/*
+ * Sets up a table of at least num_entries buckets (rounded up to a power
+ * of two) that admits rate connections per second from each address, with
+ * bursts of up to burst. Returns 0 or an error code.
+ */
+int admission_init(struct admission *admission,
+                   int num_entries,
+                   int rate,
+                   int burst)
+{
+  int bits = ADMISSION_MIN_BITS;
+
+  while ((1 << bits) < num_entries && bits < 30) {
+    bits++;
+  }
+  admission->entries = calloc((size_t)1 << bits, sizeof(*admission->entries));
+  if (admission->entries == NULL) {
+    return ENOMEM;
+  }
+  admission->bits = bits;
+  admission->rate = (uint32_t)rate;
+  admission->burst = (uint32_t)burst;
+  return create_mutex(&admission->lock);
+}
+
+void admission_free(struct admission *admission)
+{
+  free(admission->entries);
+  admission->entries = NULL;
+  destroy_mutex(&admission->lock);
+}
+
+static struct admission_entry *find_entry(struct admission *admission,
+                                          uint32_t addr,
+                                          uint32_t now)
+{
+  uint32_t mask = ((uint32_t)1 << admission->bits) - 1;
+  uint32_t index = (addr * 2654435769u) >> (32 - admission->bits);
+  struct admission_entry *oldest = NULL;
+  struct admission_entry *entry;
+  int i;
+
+  /* Entries are replaced but never emptied, so a gap ends the search */
+  for (i = 0; i < ADMISSION_PROBES; i++) {
+    entry = &admission->entries[(index + i) & mask];
+    if (entry->addr == addr) {
+      return entry;
+    }
+    if (entry->addr == 0) {
+      oldest = entry;
+      break;
+    }
+    if (oldest == NULL || now - entry->time_ms > now - oldest->time_ms) {
+      oldest = entry;
+    }
+  }
+  oldest->addr = addr;
+  oldest->time_ms = now;
+  oldest->tokens = admission->burst * TOKEN;
+  return oldest;
+}
+
+/*
+ * Takes a token from the bucket of addr (in network byte order). Returns
+ * non-zero if the connection should be let in.
+ */
+int admission_check(struct admission *admission,
+                    uint32_t addr,
+                    uint64_t now_ms)
+{
+  struct admission_entry *entry;
+  uint32_t now = (uint32_t)now_ms;
+  uint64_t tokens;
+  int admitted;
+
+  lock_mutex(&admission->lock);
+  entry = find_entry(admission, addr, now);
+  tokens = entry->tokens + (uint64_t)(now - entry->time_ms) * admission->rate;
+  if (tokens > (uint64_t)admission->burst * TOKEN) {
+    tokens = (uint64_t)admission->burst * TOKEN;
+  }
+  admitted = tokens >= TOKEN;
+  entry->tokens = (uint32_t)(admitted ? tokens - TOKEN : tokens);
+  entry->time_ms = now;
+  unlock_mutex(&admission->lock);
+  return admitted;
+}
@@ -0,0 +1,46 @@
+#ifndef EHLO_ADMISSION_H
+#define EHLO_ADMISSION_H
+
+/*
+ * Admission control for new connections: a token bucket for each source
+ * address, so that one host reconnecting in a loop can't take the slots
+ * and the accept path from everyone else. Each bucket holds up to burst
+ * tokens and gains rate tokens per second, a connection takes one.
+ *
+ * Buckets live in a fixed-size open addressing table of 12-byte entries.
+ * An address is looked up within a short probe window and, if it isn't
+ * there and the window is full, takes over the entry that has been idle
+ * the longest. A host that gets evicted starts over with a full bucket,
+ * which errs on the side of letting it in. The table is shared by all
+ * event loops and protected by its own lock.
+ */
+
+#include <stdint.h>
+
+/* Keeps a full bucket, in thousandths of a token, within 32 bits */
+#define ADMISSION_MAX_RATE 1000000
+
+struct admission_entry {
+  uint32_t addr;    /* in network byte order, 0 for an empty entry */
+  uint32_t time_ms; /* of the last refill, wraps around */
+  uint32_t tokens;  /* in thousandths */
+};
+
+struct admission {
+  struct admission_entry *entries;
+  int bits; /* log2 of the number of entries */
+  uint32_t rate;
+  uint32_t burst;
+  mutex_t lock;
+};
+
+int admission_init(struct admission *admission,
+                   int num_entries,
+                   int rate,
+                   int burst);
+void admission_free(struct admission *admission);
+int admission_check(struct admission *admission,
+                    uint32_t addr,
+                    uint64_t now_ms);
+
+#endif /* EHLO_ADMISSION_H */
@@ -0,0 +1,638 @@
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "ehlo-shared.h"
+#include "ehlo-histogram.h"
+#ifdef _WIN32
+  #define poll WSAPoll
+#else
+  #include <netinet/tcp.h>
+#endif
+
+#define DEFAULT_THREADS 4
+#define DEFAULT_RATE 1000
+#define DEFAULT_SIZE 64
+#define DEFAULT_DURATION 10
+#define DEFAULT_WARMUP 2
+
+#define MAX_STEPS 32
+
+/* Maximum number of messages a thread sends before polling again */
+#define MAX_SEND_BATCH 64
+
+#define HANDSHAKE_TIMEOUT_MS 5000
+
+/*
+ * Every message starts with a tag and the time it was sent at, so that
+ * receivers can tell benchmark traffic apart and work out its latency.
+ * All clients live in this process and share the same clock.
+ */
+#define MESSAGE_TAG "ehlo-bench "
+#define MESSAGE_TAG_LEN (sizeof(MESSAGE_TAG) - 1)
+#define MIN_MESSAGE_SIZE (MESSAGE_TAG_LEN + 21)
+
+enum output_format {
+  OUTPUT_TEXT,
+  OUTPUT_JSON
+};
+
+/* What the worker threads should be doing, set by the main thread */
+enum bench_phase {
+  PHASE_CONNECT,
+  PHASE_WARMUP,  /* traffic flows but isn't counted */
+  PHASE_MEASURE,
+  PHASE_STOP
+};
+
+struct bench_client {
+  socket_t sock;
+  struct recv_buffer in;
+};
+
+struct bench_thread {
+  int index;
+  thread_t thread;
+  int num_clients;
+  struct bench_client *clients;
+  struct pollfd *fds;
+  double rate; /* messages per second sent by this thread's clients */
+  int error;
+  uint64_t sent;
+  uint64_t received;
+  struct histogram latency; /* in microseconds */
+};
+
+static struct sockaddr_storage server_addr;
+static socklen_t server_addr_len;
+static int message_size = DEFAULT_SIZE;
+static int phase;
+static int num_ready;
+
+static int send_frame(socket_t sock, int cmd, const char *payload, int len)
+{
+  char buf[EHLO_MAX_FRAME_LEN];
+
+  encode_frame_header(buf, cmd, EHLO_LOBBY_ROOM, 0, 0, len);
+  memcpy(buf + EHLO_FRAME_HEADER_LEN, payload, len);
+  if (send_n(sock, buf, EHLO_FRAME_HEADER_LEN + len, 0) <= 0) {
+    return socket_error();
+  }
+  return 0;
+}
+
+static int send_bench_message(struct bench_client *client)
+{
+  char payload[EHLO_MAX_MESSAGE_LEN];
+  int len;
+
+  len = snprintf(payload,
+                 sizeof(payload),
+                 MESSAGE_TAG "%llu ",
+                 (unsigned long long)get_time_us());
+  memset(payload + len, 'x', message_size - len);
+  return send_frame(client->sock, EHLO_CMD_MESSAGE, payload, message_size);
+}
+
+/* Connects the client and waits for the server to answer its HELLO */
+static int connect_client(struct bench_client *client)
+{
+  char buf[EHLO_MAX_FRAME_LEN];
+  struct frame_header header;
+  struct buffer_view payload;
+  int opt_nodelay = 1;
+  int len;
+  int recv_size;
+
+  client->sock = socket(server_addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+  if (client->sock == INVALID_SOCKET) {
+    return socket_error();
+  }
+  if (connect(client->sock,
+              (struct sockaddr *)&server_addr,
+              server_addr_len) != 0) {
+    return socket_error();
+  }
+  /* Don't let Nagle's algorithm hold back messages sent in a row */
+  setsockopt(client->sock,
+             IPPROTO_TCP,
+             TCP_NODELAY,
+             (char *)&opt_nodelay,
+             sizeof(opt_nodelay));
+
+  len = encode_hello_frame(buf, sizeof(buf), 0, 0);
+  if (send_n(client->sock, buf, len, 0) <= 0) {
+    return socket_error();
+  }
+  for (;;) {
+    if (socket_wait_readable(client->sock, HANDSHAKE_TIMEOUT_MS) <= 0) {
+      return ETIMEDOUT;
+    }
+    recv_size = recv_buffer_fill(&client->in, client->sock);
+    if (recv_size <= 0) {
+      return recv_size == 0 ? ECONNRESET : socket_error();
+    }
+    len = recv_buffer_parse_frame(&client->in, &header, &payload);
+    if (len < 0 || (len > 0 && header.cmd != EHLO_CMD_HELLO)) {
+      return EPROTO;
+    }
+    if (len > 0) {
+      recv_buffer_consume(&client->in, len);
+      return 0;
+    }
+  }
+}
+
+/*
+ * Handles everything buffered for the client. Returns 0 or an error code
+ * if the server sent something that isn't a valid frame.
+ */
+static int process_client_input(struct bench_thread *thread,
+                                struct bench_client *client,
+                                int counting)
+{
+  struct frame_header header;
+  struct buffer_view payload;
+  char scratch[EHLO_MAX_MESSAGE_LEN + 1];
+  const char *data;
+  uint64_t sent_us;
+  uint64_t now;
+  int len;
+  int error;
+
+  now = get_time_us();
+  for (;;) {
+    len = recv_buffer_parse_frame(&client->in, &header, &payload);
+    if (len == 0) {
+      break;
+    }
+    if (len < 0) {
+      return EPROTO;
+    }
+
+    data = buffer_view_linearize(&payload, scratch);
+    switch (header.cmd) {
+      case EHLO_CMD_PING:
+        error = send_frame(client->sock,
+                           EHLO_CMD_PONG,
+                           data,
+                           buffer_view_len(&payload));
+        if (error != 0) {
+          return error;
+        }
+        break;
+      case EHLO_CMD_MESSAGE:
+        if (!counting
+            || header.sender_id == EHLO_SERVER_ID
+            || buffer_view_len(&payload) < (int)MIN_MESSAGE_SIZE
+            || memcmp(data, MESSAGE_TAG, MESSAGE_TAG_LEN) != 0) {
+          break;
+        }
+        if (data != scratch) {
+          memcpy(scratch, data, buffer_view_len(&payload));
+        }
+        scratch[buffer_view_len(&payload)] = '\0';
+        sent_us = strtoull(scratch + MESSAGE_TAG_LEN, NULL, 10);
+        thread->received++;
+        histogram_add(&thread->latency, now > sent_us ? now - sent_us : 0);
+        break;
+    }
+    recv_buffer_consume(&client->in, len);
+  }
+
+  recv_buffer_trim(&client->in);
+  return 0;
+}
+
+/*
+ * Sends messages from the thread's clients in turn at the thread's rate
+ * and receives what the server delivers to them, until told to stop.
+ */
+static int run_clients(struct bench_thread *thread)
+{
+  uint64_t start_time = get_time_us();
+  uint64_t total_sent = 0;
+  uint64_t due;
+  int next_client = 0;
+  int current_phase;
+  int num_events;
+  int batch;
+  int recv_size;
+  int error;
+  int i;
+
+  for (i = 0; i < thread->num_clients; i++) {
+    thread->fds[i].fd = thread->clients[i].sock;
+    thread->fds[i].events = POLLIN;
+  }
+
+  for (;;) {
+    current_phase = atomic_load_acquire(&phase);
+    if (current_phase == PHASE_STOP) {
+      return 0;
+    }
+
+    due = (uint64_t)((get_time_us() - start_time) * thread->rate / 1000000);
+    for (batch = 0; total_sent < due && batch < MAX_SEND_BATCH; batch++) {
+      error = send_bench_message(&thread->clients[next_client]);
+      if (error != 0) {
+        return error;
+      }
+      next_client = (next_client + 1) % thread->num_clients;
+      total_sent++;
+      if (current_phase == PHASE_MEASURE) {
+        thread->sent++;
+      }
+    }
+
+    num_events = poll(thread->fds,
+                      thread->num_clients,
+                      total_sent < due ? 0 : 1);
+    if (num_events < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return socket_error();
+    }
+
+    for (i = 0; i < thread->num_clients && num_events > 0; i++) {
+      if (thread->fds[i].revents == 0) {
+        continue;
+      }
+      num_events--;
+      recv_size = recv_buffer_fill(&thread->clients[i].in,
+                                   thread->clients[i].sock);
+      if (recv_size <= 0) {
+        return recv_size == 0 ? ECONNRESET : socket_error();
+      }
+      error = process_client_input(thread,
+                                   &thread->clients[i],
+                                   current_phase == PHASE_MEASURE);
+      if (error != 0) {
+        return error;
+      }
+    }
+  }
+}
+
+static void *bench_thread(void *arg)
+{
+  struct bench_thread *thread = arg;
+  int error = 0;
+  int i;
+
+  for (i = 0; i < thread->num_clients; i++) {
+    error = connect_client(&thread->clients[i]);
+    if (error != 0) {
+      fprintf_locked(stderr,
+                     "Failed to connect client %d of thread %d: %s\n",
+                     i,
+                     thread->index,
+                     error_to_str(error, NULL, 0));
+      break;
+    }
+  }
+  thread->error = error;
+  atomic_inc(&num_ready);
+  if (error != 0) {
+    return NULL;
+  }
+
+  while (atomic_load_acquire(&phase) == PHASE_CONNECT) {
+    sleep_ms(1);
+  }
+  error = run_clients(thread);
+  if (error != 0) {
+    fprintf_locked(stderr,
+                   "Thread %d stopped: %s\n",
+                   thread->index,
+                   error_to_str(error, NULL, 0));
+  }
+  thread->error = error;
+
+  return NULL;
+}
+
+static void print_result(enum output_format format,
+                         int num_clients,
+                         int num_threads,
+                         double rate,
+                         double duration,
+                         uint64_t sent,
+                         uint64_t received,
+                         const struct histogram *latency)
+{
+  if (format == OUTPUT_JSON) {
+    printf("{\"clients\":%d,\"threads\":%d,\"rate\":%.0f,\"size\":%d,"
+           "\"duration\":%.3f,\"sent\":%llu,\"received\":%llu,"
+           "\"sent_per_sec\":%.1f,\"received_per_sec\":%.1f,"
+           "\"latency_us\":{\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,"
+           "\"max\":%llu,\"mean\":%.1f}}\n",
+           num_clients,
+           num_threads,
+           rate,
+           message_size,
+           duration,
+           (unsigned long long)sent,
+           (unsigned long long)received,
+           sent / duration,
+           received / duration,
+           (unsigned long long)histogram_percentile(latency, 0.5),
+           (unsigned long long)histogram_percentile(latency, 0.99),
+           (unsigned long long)histogram_percentile(latency, 0.999),
+           (unsigned long long)latency->max,
+           latency->total > 0 ? (double)latency->sum / latency->total : 0.0);
+  } else {
+    printf("%8d %10.1f %12.1f %9llu %9llu %9llu %9llu\n",
+           num_clients,
+           sent / duration,
+           received / duration,
+           (unsigned long long)histogram_percentile(latency, 0.5),
+           (unsigned long long)histogram_percentile(latency, 0.99),
+           (unsigned long long)histogram_percentile(latency, 0.999),
+           (unsigned long long)latency->max);
+  }
+  fflush(stdout);
+}
+
+/*
+ * Connects the given number of clients, lets them exchange messages for a
+ * while and prints what was measured. Returns 0 or an error code.
+ */
+static int run_step(int num_clients,
+                    int num_threads,
+                    double rate,
+                    int warmup,
+                    int duration,
+                    enum output_format format)
+{
+  struct bench_thread *threads;
+  struct histogram *latency;
+  uint64_t start_time = 0;
+  uint64_t sent = 0;
+  uint64_t received = 0;
+  int num_started = 0;
+  int error = 0;
+  int i;
+  int j;
+
+  if (num_threads > num_clients) {
+    num_threads = num_clients;
+  }
+  threads = calloc(num_threads, sizeof(*threads));
+  latency = calloc(1, sizeof(*latency));
+  if (threads == NULL || latency == NULL) {
+    free(threads);
+    free(latency);
+    return ENOMEM;
+  }
+
+  atomic_store_release(&phase, PHASE_CONNECT);
+  atomic_store_release(&num_ready, 0);
+
+  for (i = 0; i < num_threads; i++) {
+    struct bench_thread *thread = &threads[i];
+
+    thread->index = i;
+    thread->num_clients = num_clients / num_threads
+        + (i < num_clients % num_threads);
+    thread->rate = rate * thread->num_clients / num_clients;
+    thread->clients = calloc(thread->num_clients, sizeof(*thread->clients));
+    thread->fds = calloc(thread->num_clients, sizeof(*thread->fds));
+    if (thread->clients == NULL || thread->fds == NULL) {
+      error = ENOMEM;
+      break;
+    }
+    for (j = 0; j < thread->num_clients; j++) {
+      thread->clients[j].sock = INVALID_SOCKET;
+      recv_buffer_init(&thread->clients[j].in, EHLO_RECV_BUFFER_SIZE);
+    }
+
+    error = create_thread(&thread->thread, bench_thread, thread);
+    if (error != 0) {
+      break;
+    }
+    num_started++;
+  }
+
+  while (atomic_load_acquire(&num_ready) < num_started) {
+    sleep_ms(10);
+  }
+  for (i = 0; i < num_started && error == 0; i++) {
+    error = threads[i].error;
+  }
+
+  if (error == 0) {
+    atomic_store_release(&phase, PHASE_WARMUP);
+    sleep_ms(warmup * 1000);
+    start_time = get_time_us();
+    atomic_store_release(&phase, PHASE_MEASURE);
+    sleep_ms(duration * 1000);
+  }
+  atomic_store_release(&phase, PHASE_STOP);
+
+  for (i = 0; i < num_started; i++) {
+    join_thread(threads[i].thread);
+    if (error == 0) {
+      error = threads[i].error;
+    }
+    sent += threads[i].sent;
+    received += threads[i].received;
+    histogram_merge(latency, &threads[i].latency);
+  }
+
+  if (error == 0) {
+    print_result(format,
+                 num_clients,
+                 num_threads,
+                 rate,
+                 (get_time_us() - start_time) / 1e6,
+                 sent,
+                 received,
+                 latency);
+  }
+
+  for (i = 0; i < num_threads; i++) {
+    for (j = 0; j < threads[i].num_clients && threads[i].clients != NULL; j++) {
+      if (threads[i].clients[j].sock != INVALID_SOCKET) {
+        close_socket(threads[i].clients[j].sock);
+      }
+      recv_buffer_free(&threads[i].clients[j].in);
+    }
+    free(threads[i].clients);
+    free(threads[i].fds);
+  }
+  free(threads);
+  free(latency);
+
+  return error;
+}
+
+/* Parses a comma-separated list of client counts, returns their number */
+static int parse_steps(const char *str, int *steps, int max_steps)
+{
+  char *end;
+  long value;
+  int count = 0;
+
+  for (;;) {
+    value = strtol(str, &end, 10);
+    if (end == str || value <= 0 || value > INT_MAX || count == max_steps) {
+      return -1;
+    }
+    steps[count++] = (int)value;
+    if (*end == '\0') {
+      return count;
+    }
+    if (*end != ',') {
+      return -1;
+    }
+    str = end + 1;
+  }
+}
+
+static void print_usage(const char *program_name)
+{
+  fprintf(stderr,
+      "Usage: %s [options] <host> <port>\n"
+      "Options:\n"
+      "  --clients <n[,n...]>   number of clients, a list runs one step per\n"
+      "                         count (100)\n"
+      "  --threads <n>          number of threads driving the clients (%d)\n"
+      "  --rate <n>             messages per second sent by all clients\n"
+      "                         together (%d)\n"
+      "  --size <bytes>         size of each message, %d to %d (%d)\n"
+      "  --duration <s>         how long each step is measured (%d)\n"
+      "  --warmup <s>           how long traffic flows before measuring (%d)\n"
+      "  --format <format>      text (default) or json, one object per step\n",
+      program_name,
+      DEFAULT_THREADS,
+      DEFAULT_RATE,
+      (int)MIN_MESSAGE_SIZE,
+      EHLO_MAX_MESSAGE_LEN,
+      DEFAULT_SIZE,
+      DEFAULT_DURATION,
+      DEFAULT_WARMUP);
+}
+
+int main(int argc, char **argv)
+{
+  const char *host = NULL, *port = NULL;
+  const char *program_name = get_program_name(argv[0]);
+  struct addrinfo ai_hints, *ai_result = NULL;
+  enum output_format format = OUTPUT_TEXT;
+  int steps[MAX_STEPS] = {100};
+  int num_steps = 1;
+  int num_threads = DEFAULT_THREADS;
+  double rate = DEFAULT_RATE;
+  int duration = DEFAULT_DURATION;
+  int warmup = DEFAULT_WARMUP;
+  int error;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--clients") == 0 && i + 1 < argc) {
+      num_steps = parse_steps(argv[++i], steps, MAX_STEPS);
+      if (num_steps < 0) {
+        fprintf(stderr, "Invalid list of client counts: %s\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      num_threads = atoi(argv[++i]);
+      if (num_threads <= 0) {
+        fprintf(stderr, "Number of threads must be positive\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+      rate = atof(argv[++i]);
+      if (rate <= 0) {
+        fprintf(stderr, "Rate must be positive\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+      message_size = atoi(argv[++i]);
+      if (message_size < (int)MIN_MESSAGE_SIZE
+          || message_size > EHLO_MAX_MESSAGE_LEN) {
+        fprintf(stderr,
+                "Message size must be between %d and %d bytes\n",
+                (int)MIN_MESSAGE_SIZE,
+                EHLO_MAX_MESSAGE_LEN);
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+      duration = atoi(argv[++i]);
+      if (duration <= 0) {
+        fprintf(stderr, "Duration must be positive\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+      warmup = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "text") == 0) {
+        format = OUTPUT_TEXT;
+      } else if (strcmp(argv[i], "json") == 0) {
+        format = OUTPUT_JSON;
+      } else {
+        fprintf(stderr, "Unknown output format: %s\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (argv[i][0] == '-' && argv[i][1] == '-') {
+      print_usage(program_name);
+      exit(EXIT_FAILURE);
+    } else if (host == NULL) {
+      host = argv[i];
+    } else if (port == NULL) {
+      port = argv[i];
+    }
+  }
+
+  if (host == NULL || port == NULL) {
+    print_usage(program_name);
+    exit(EXIT_FAILURE);
+  }
+
+  socket_init();
+  atexit(socket_cleanup);
+
+#ifndef _WIN32
+  signal(SIGPIPE, SIG_IGN);
+#endif
+
+  memset(&ai_hints, 0, sizeof(ai_hints));
+  ai_hints.ai_family = AF_UNSPEC;
+  ai_hints.ai_socktype = SOCK_STREAM;
+  ai_hints.ai_protocol = IPPROTO_TCP;
+  error = getaddrinfo(host, port, &ai_hints, &ai_result);
+  if (error != 0) {
+    fprintf(stderr, "Failed to resolve address: %s\n", gai_strerror(error));
+    exit(EXIT_FAILURE);
+  }
+  memcpy(&server_addr, ai_result->ai_addr, ai_result->ai_addrlen);
+  server_addr_len = (socklen_t)ai_result->ai_addrlen;
+  freeaddrinfo(ai_result);
+
+  if (format == OUTPUT_TEXT) {
+    printf("%8s %10s %12s %9s %9s %9s %9s\n",
+           "clients",
+           "sent/s",
+           "received/s",
+           "p50 us",
+           "p99 us",
+           "p99.9 us",
+           "max us");
+  }
+
+  for (i = 0; i < num_steps; i++) {
+    error = run_step(steps[i], num_threads, rate, warmup, duration, format);
+    if (error != 0) {
+      fprintf(stderr,
+              "Benchmark with %d clients failed: %s\n",
+              steps[i],
+              error_to_str(error, NULL, 0));
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
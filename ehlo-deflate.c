@@ -0,0 +1,130 @@
+#include <stdlib.h>
+#include <zlib.h>
+#include "ehlo-shared.h"
+#include "ehlo-deflate.h"
+
+/*
+ * A small window is enough for payloads of EHLO_MAX_MESSAGE_LEN bytes and
+ * keeps a codec under 32 KiB. The dictionary has to fit in the window, less
+ * the 262 bytes deflate keeps for lookahead.
+ */
+#define DEFLATE_WINDOW_BITS 10
+#define DEFLATE_MEM_LEVEL 4
+
+/*
+ * Changing the dictionary breaks compatibility with existing peers. The
+ * most common strings go at the end, where they are the cheapest to refer
+ * to.
+ */
+static const char dictionary[] =
+    "http://https://www. .com .org thanks thank you please sorry "
+    "what when where which would could should there their about "
+    "because really think know just like have this that with from "
+    "going been will they them your you're I'm it's don't can't "
+    "yes no ok okay lol haha good morning night bye hello hi hey "
+    " has left the chat has joined the chat has joined the room Client "
+    " the and to of a in is it for on ";
+
+int deflate_codec_init(struct deflate_codec *codec)
+{
+  z_stream *deflater = calloc(1, sizeof(*deflater));
+  z_stream *inflater = calloc(1, sizeof(*inflater));
+
+  codec->deflater = NULL;
+  codec->inflater = NULL;
+  if (deflater == NULL || inflater == NULL) {
+    free(deflater);
+    free(inflater);
+    return ENOMEM;
+  }
+  if (deflateInit2(deflater,
+                   Z_DEFAULT_COMPRESSION,
+                   Z_DEFLATED,
+                   -DEFLATE_WINDOW_BITS,
+                   DEFLATE_MEM_LEVEL,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    free(deflater);
+    free(inflater);
+    return ENOMEM;
+  }
+  if (inflateInit2(inflater, -DEFLATE_WINDOW_BITS) != Z_OK) {
+    deflateEnd(deflater);
+    free(deflater);
+    free(inflater);
+    return ENOMEM;
+  }
+  codec->deflater = deflater;
+  codec->inflater = inflater;
+  return 0;
+}
+
+void deflate_codec_free(struct deflate_codec *codec)
+{
+  if (codec->deflater != NULL) {
+    deflateEnd(codec->deflater);
+    free(codec->deflater);
+    codec->deflater = NULL;
+  }
+  if (codec->inflater != NULL) {
+    inflateEnd(codec->inflater);
+    free(codec->inflater);
+    codec->inflater = NULL;
+  }
+}
+
+/*
+ * Compresses len bytes of data into out, which must have room for len
+ * bytes. Returns the compressed length, or 0 if it wouldn't be shorter.
+ */
+int deflate_payload(struct deflate_codec *codec,
+                    const char *data,
+                    int len,
+                    char *out)
+{
+  z_stream *stream = codec->deflater;
+
+  if (len <= 1
+      || deflateReset(stream) != Z_OK
+      || deflateSetDictionary(stream,
+                              (const Bytef *)dictionary,
+                              sizeof(dictionary) - 1) != Z_OK) {
+    return 0;
+  }
+  stream->next_in = (Bytef *)data;
+  stream->avail_in = len;
+  stream->next_out = (Bytef *)out;
+  stream->avail_out = len - 1;
+  /* Running out of room means it doesn't get any shorter */
+  if (deflate(stream, Z_FINISH) != Z_STREAM_END) {
+    return 0;
+  }
+  return len - 1 - (int)stream->avail_out;
+}
+
+/*
+ * Decompresses a payload into out. Returns its length or -1 if the data is
+ * corrupt or wouldn't fit in size bytes.
+ */
+int inflate_payload(struct deflate_codec *codec,
+                    const char *data,
+                    int len,
+                    char *out,
+                    int size)
+{
+  z_stream *stream = codec->inflater;
+
+  if (inflateReset(stream) != Z_OK
+      || inflateSetDictionary(stream,
+                              (const Bytef *)dictionary,
+                              sizeof(dictionary) - 1) != Z_OK) {
+    return -1;
+  }
+  stream->next_in = (Bytef *)data;
+  stream->avail_in = len;
+  stream->next_out = (Bytef *)out;
+  stream->avail_out = size;
+  if (inflate(stream, Z_FINISH) != Z_STREAM_END || stream->avail_in != 0) {
+    return -1;
+  }
+  return size - (int)stream->avail_out;
+}
@@ -0,0 +1,34 @@
+#ifndef EHLO_DEFLATE_H
+#define EHLO_DEFLATE_H
+
+/*
+ * Compression of frame payloads. Every payload is compressed on its own as
+ * raw deflate data, starting from a preset dictionary of common chat text
+ * that both sides have built in. Since nothing carries over from one
+ * payload to the next, a message compressed once can go to every peer that
+ * negotiated compression.
+ *
+ * A codec is used by one thread at a time.
+ */
+
+/* Shorter payloads hardly ever get smaller */
+#define DEFLATE_DEFAULT_MIN_LEN 48
+
+struct deflate_codec {
+  void *deflater; /* z_stream */
+  void *inflater; /* z_stream */
+};
+
+int deflate_codec_init(struct deflate_codec *codec);
+void deflate_codec_free(struct deflate_codec *codec);
+int deflate_payload(struct deflate_codec *codec,
+                    const char *data,
+                    int len,
+                    char *out);
+int inflate_payload(struct deflate_codec *codec,
+                    const char *data,
+                    int len,
+                    char *out,
+                    int size);
+
+#endif /* EHLO_DEFLATE_H */
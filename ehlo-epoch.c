@@ -0,0 +1,65 @@
+#include <string.h>
+#include "ehlo-shared.h"
+#include "ehlo-epoch.h"
+
+int epoch_init(struct epoch *epoch)
+{
+  memset(epoch, 0, sizeof(*epoch));
+  return create_mutex(&epoch->lock);
+}
+
+void epoch_free(struct epoch *epoch)
+{
+  destroy_mutex(&epoch->lock);
+}
+
+/*
+ * Starts a read-side section, anything published before it stays valid
+ * until the matching epoch_exit(). Returns a token to pass to that call.
+ * Sections don't nest.
+ */
+int epoch_enter(struct epoch *epoch, int hint)
+{
+  int stripe = (int)((unsigned)hint % EPOCH_STRIPES);
+  int index = atomic_load_acquire(&epoch->current);
+
+  /* A full barrier, so the caller's loads can't move before it */
+  atomic_inc(&epoch->stripes[stripe].readers[index]);
+  return stripe * 2 + index;
+}
+
+void epoch_exit(struct epoch *epoch, int token)
+{
+  atomic_dec(&epoch->stripes[token / 2].readers[token % 2]);
+}
+
+static int count_readers(struct epoch *epoch, int index)
+{
+  int count = 0;
+  int i;
+
+  for (i = 0; i < EPOCH_STRIPES; i++) {
+    count += atomic_load_acquire(&epoch->stripes[i].readers[index]);
+  }
+  return count;
+}
+
+/*
+ * Waits until all read-side sections that started before the call have
+ * ended. Must not be called from within one.
+ */
+void epoch_synchronize(struct epoch *epoch)
+{
+  int index;
+  int pass;
+
+  lock_mutex(&epoch->lock);
+  for (pass = 0; pass < 2; pass++) {
+    index = epoch->current;
+    atomic_exchange_int(&epoch->current, !index);
+    while (count_readers(epoch, index) > 0) {
+      sleep_ms(1);
+    }
+  }
+  unlock_mutex(&epoch->lock);
+}
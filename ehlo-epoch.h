@@ -0,0 +1,41 @@
+#ifndef EHLO_EPOCH_H
+#define EHLO_EPOCH_H
+
+/*
+ * Epochs let readers use data that writers replace without either side
+ * taking a lock on the read path. A writer publishes a new version with an
+ * atomic pointer store and then waits in epoch_synchronize() until every
+ * reader that could still see the old version has left, after which the
+ * old version may be freed.
+ *
+ * Readers announce themselves on one of two counters, the one that is
+ * current when they enter. Synchronizing switches the current counter and
+ * waits for the other one to drain, twice, so that readers who picked a
+ * counter just before a switch are waited for as well. New readers never
+ * hold up a writer because they go to the counter that isn't waited on.
+ *
+ * The counters are spread over stripes on separate cache lines and readers
+ * pick a stripe by a hint such as their client ID, so that threads reading
+ * at the same time mostly don't touch the same line.
+ */
+
+#define EPOCH_STRIPES 16
+
+struct epoch_stripe {
+  int readers[2];
+  char padding[64 - 2 * sizeof(int)];
+};
+
+struct epoch {
+  int current; /* counter that new readers take, 0 or 1 */
+  mutex_t lock; /* one writer synchronizes at a time */
+  struct epoch_stripe stripes[EPOCH_STRIPES];
+};
+
+int epoch_init(struct epoch *epoch);
+void epoch_free(struct epoch *epoch);
+int epoch_enter(struct epoch *epoch, int hint);
+void epoch_exit(struct epoch *epoch, int token);
+void epoch_synchronize(struct epoch *epoch);
+
+#endif /* EHLO_EPOCH_H */
@@ -0,0 +1,654 @@
+#include <stdlib.h>
+#include "ehlo-shared.h"
+#include "ehlo-federation.h"
+#include "ehlo-log.h"
+#ifdef _WIN32
+  #define poll WSAPoll
+#else
+  #include <netinet/tcp.h>
+#endif
+#ifdef HAVE_EVENTFD
+  #include <sys/eventfd.h>
+#endif
+
+/* Most records taken from the queue at a time */
+#define RELAY_MAX_BATCH 1024
+
+/* Records waiting for the writer, what comes on top is dropped */
+#define RELAY_MAX_QUEUED (64 * 1024)
+
+/* Frames waiting to be written to a peer, what doesn't fit is dropped */
+#define PEER_BUFFER_SIZE (256 * 1024)
+
+#define PEER_RETRY_INTERVAL_MS 1000
+
+/* For connecting and again for the answer to PEER */
+#define PEER_HANDSHAKE_TIMEOUT_MS 1000
+
+/*
+ * How long the writer waits for peers when there's nothing to relay,
+ * unless federation_relay() can wake it up
+ */
+#define RELAY_IDLE_WAIT_MS 1
+
+int federation_init(struct federation *federation,
+                    int node_id,
+                    relay_release_t release)
+{
+  memset(federation, 0, sizeof(*federation));
+  federation->node_id = node_id;
+  federation->release = release;
+  mpsc_queue_init(&federation->queue);
+  federation->batch = malloc(RELAY_MAX_BATCH * sizeof(*federation->batch));
+  if (federation->batch == NULL) {
+    return ENOMEM;
+  }
+#ifdef HAVE_EVENTFD
+  federation->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (federation->wake_fd < 0) {
+    return errno;
+  }
+#endif
+  return 0;
+}
+
+/*
+ * Adds a peer given as host:port, returns 0 or an error code. The host has
+ * to resolve now, EHOSTUNREACH means it doesn't.
+ */
+int federation_add_peer(struct federation *federation, const char *address)
+{
+  struct addrinfo hints;
+  struct peer_link *peer;
+  const char *colon = strrchr(address, ':');
+
+  if (colon == NULL || colon == address || colon[1] == '\0') {
+    return EINVAL;
+  }
+  if (federation->num_peers == FEDERATION_MAX_PEERS) {
+    return ENOBUFS;
+  }
+  peer = &federation->peers[federation->num_peers];
+  peer->host = malloc(colon - address + 1);
+  peer->port = strdup(colon + 1);
+  peer->out = malloc(PEER_BUFFER_SIZE);
+  if (peer->host == NULL || peer->port == NULL || peer->out == NULL) {
+    free(peer->host);
+    free(peer->port);
+    free(peer->out);
+    return ENOMEM;
+  }
+  memcpy(peer->host, address, colon - address);
+  peer->host[colon - address] = '\0';
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+  if (getaddrinfo(peer->host, peer->port, &hints, &peer->addresses) != 0) {
+    free(peer->host);
+    free(peer->port);
+    free(peer->out);
+    return EHOSTUNREACH;
+  }
+  peer->sock = INVALID_SOCKET;
+  peer->state = PEER_DOWN;
+  peer->node_id = -1;
+  recv_buffer_init(&peer->in, EHLO_RECV_BUFFER_SIZE);
+  federation->num_peers++;
+  return 0;
+}
+
+/* Returns non-zero if one of the peers resolved to the address */
+int federation_is_peer_address(const struct federation *federation,
+                               const struct sockaddr_in *addr)
+{
+  const struct addrinfo *cur;
+  const struct sockaddr_in *peer_addr;
+  int i;
+
+  if (addr->sin_family != AF_INET) {
+    return 0;
+  }
+  for (i = 0; i < federation->num_peers; i++) {
+    for (cur = federation->peers[i].addresses; cur != NULL;
+         cur = cur->ai_next) {
+      peer_addr = (const struct sockaddr_in *)cur->ai_addr;
+      if (cur->ai_family == AF_INET
+          && peer_addr->sin_addr.s_addr == addr->sin_addr.s_addr) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/* Closes whatever there is of the link, it's tried again after a while */
+static void disconnect_peer(struct peer_link *peer)
+{
+  if (peer->sock != INVALID_SOCKET) {
+    close_socket(peer->sock);
+  }
+  peer->sock = INVALID_SOCKET;
+  peer->state = PEER_DOWN;
+  peer->node_id = -1;
+  peer->deadline = get_time_ms() + PEER_RETRY_INTERVAL_MS;
+  peer->in.start = 0;
+  peer->in.len = 0;
+  recv_buffer_trim(&peer->in);
+  peer->out_len = 0;
+}
+
+/*
+ * Starts connecting to the next of the peer's addresses without waiting
+ * for the connection. When there are none left, the peer is tried again
+ * later from the first one.
+ */
+static void connect_peer(struct peer_link *peer)
+{
+  const struct addrinfo *address;
+  int opt_nodelay = 1;
+  int error;
+
+  while ((address = peer->address) != NULL) {
+    peer->address = address->ai_next;
+    peer->sock = socket(address->ai_family, SOCK_STREAM, IPPROTO_TCP);
+    if (peer->sock == INVALID_SOCKET) {
+      continue;
+    }
+
+    /* Batches are written as soon as they're framed */
+    setsockopt(peer->sock,
+               IPPROTO_TCP,
+               TCP_NODELAY,
+               (char *)&opt_nodelay,
+               sizeof(opt_nodelay));
+
+    error = set_socket_nonblocking(peer->sock);
+    if (error == 0
+        && connect(peer->sock, address->ai_addr, (int)address->ai_addrlen)
+           != 0) {
+      error = socket_error();
+      if (error == EINPROGRESS || socket_would_block(error)) {
+        error = 0;
+      }
+    }
+    if (error == 0) {
+      peer->state = PEER_CONNECTING;
+      peer->deadline = get_time_ms() + PEER_HANDSHAKE_TIMEOUT_MS;
+      return;
+    }
+    close_socket(peer->sock);
+    peer->sock = INVALID_SOCKET;
+  }
+  disconnect_peer(peer);
+}
+
+/* Frames a command for the peer, returns ENOBUFS if there's no room */
+static int queue_peer_frame(struct peer_link *peer,
+                            int cmd,
+                            int sender_id,
+                            uint32_t seq,
+                            const char *payload,
+                            int len)
+{
+  char *buf = peer->out + peer->out_len;
+
+  if (PEER_BUFFER_SIZE - peer->out_len < EHLO_FRAME_HEADER_LEN + len) {
+    return ENOBUFS;
+  }
+  encode_frame_header(buf, cmd, EHLO_LOBBY_ROOM, sender_id, seq, len);
+  memcpy(buf + EHLO_FRAME_HEADER_LEN, payload, len);
+  peer->out_len += EHLO_FRAME_HEADER_LEN + len;
+  return 0;
+}
+
+/* Writes as much of the peer's buffer as the socket takes */
+static int flush_peer(struct peer_link *peer)
+{
+  int len;
+  int error;
+
+  if (peer->out_len == 0) {
+    return 0;
+  }
+  len = send(peer->sock, peer->out, peer->out_len, 0);
+  if (len < 0) {
+    error = socket_error();
+    return socket_would_block(error) ? 0 : error;
+  }
+  memmove(peer->out, peer->out + len, peer->out_len - len);
+  peer->out_len -= len;
+  return 0;
+}
+
+/*
+ * The connection attempt is over. If it worked, this node introduces
+ * itself, otherwise the next address is tried.
+ */
+static void finish_connect(struct federation *federation,
+                           struct peer_link *peer)
+{
+  char version[16];
+  socklen_t error_len = sizeof(int);
+  int error = 0;
+  int len;
+
+  if (getsockopt(peer->sock,
+                 SOL_SOCKET,
+                 SO_ERROR,
+                 (char *)&error,
+                 &error_len) != 0) {
+    error = socket_error();
+  }
+  if (error != 0) {
+    close_socket(peer->sock);
+    peer->sock = INVALID_SOCKET;
+    connect_peer(peer);
+    return;
+  }
+
+  len = snprintf(version,
+                 sizeof(version),
+                 "ehlo/%d",
+                 EHLO_PROTOCOL_VERSION);
+  queue_peer_frame(peer,
+                   EHLO_CMD_PEER,
+                   federation->node_id,
+                   0,
+                   version,
+                   len);
+  peer->state = PEER_INTRODUCING;
+  peer->deadline = get_time_ms() + PEER_HANDSHAKE_TIMEOUT_MS;
+}
+
+/* Takes the peer's answer to PEER, returns non-zero if it isn't a link */
+static int handle_peer_answer(struct federation *federation,
+                              struct peer_link *peer,
+                              const struct frame_header *header,
+                              const char *payload,
+                              int len)
+{
+  if (header->cmd == EHLO_CMD_ERROR) {
+    log_warning("Node at %s:%s refused the link: %.*s",
+                peer->host,
+                peer->port,
+                len,
+                payload);
+    return 1;
+  }
+  if (header->cmd != EHLO_CMD_PEER || header->sender_id < 0) {
+    log_warning("Server at %s:%s is not a cluster node",
+                peer->host,
+                peer->port);
+    return 1;
+  }
+  if (header->sender_id == federation->node_id) {
+    log_error("Node at %s:%s has the same ID as this one",
+              peer->host,
+              peer->port);
+    return 1;
+  }
+
+  peer->state = PEER_LINKED;
+  peer->node_id = header->sender_id;
+  log_info("Linked to node %d at %s:%s",
+           peer->node_id,
+           peer->host,
+           peer->port);
+  return 0;
+}
+
+/* Handles what the peer sent, returns non-zero if the link is gone */
+static int read_peer(struct federation *federation, struct peer_link *peer)
+{
+  struct frame_header header;
+  struct buffer_view payload;
+  char scratch[EHLO_MAX_MESSAGE_LEN];
+  const char *data;
+  int recv_size;
+  int len;
+
+  recv_size = recv_buffer_fill(&peer->in, peer->sock);
+  if (recv_size <= 0) {
+    if (recv_size < 0 && socket_would_block(socket_error())) {
+      return 0;
+    }
+    return 1;
+  }
+
+  while ((len = recv_buffer_parse_frame(&peer->in, &header, &payload)) > 0) {
+    data = buffer_view_linearize(&payload, scratch);
+    if (peer->state == PEER_INTRODUCING) {
+      if (handle_peer_answer(federation,
+                             peer,
+                             &header,
+                             data,
+                             buffer_view_len(&payload)) != 0) {
+        return 1;
+      }
+      recv_buffer_consume(&peer->in, len);
+      continue;
+    }
+    switch (header.cmd) {
+      case EHLO_CMD_PING:
+        queue_peer_frame(peer,
+                         EHLO_CMD_PONG,
+                         EHLO_SERVER_ID,
+                         0,
+                         data,
+                         buffer_view_len(&payload));
+        break;
+      case EHLO_CMD_ERROR:
+        log_warning("Node %d reported an error: %.*s",
+                    peer->node_id,
+                    buffer_view_len(&payload),
+                    data);
+        break;
+      default:
+        break;
+    }
+    recv_buffer_consume(&peer->in, len);
+  }
+  recv_buffer_trim(&peer->in);
+  return len < 0;
+}
+
+/*
+ * Frames what has been queued so far for every linked peer, returns the
+ * number of records.
+ */
+static int relay_batch(struct federation *federation)
+{
+  struct mpsc_node *node;
+  struct relay_record *record;
+  struct peer_link *peer;
+  uint64_t dropped = 0;
+  int count = 0;
+  int i;
+  int j;
+
+  while (count < RELAY_MAX_BATCH
+         && (node = mpsc_queue_pop(&federation->queue)) != NULL) {
+    record = (struct relay_record *)node;
+    federation->batch[count++] = record;
+    federation->last_seq++;
+    for (i = 0; i < federation->num_peers; i++) {
+      peer = &federation->peers[i];
+      if (peer->node_id >= 0
+          && queue_peer_frame(peer,
+                              EHLO_CMD_MESSAGE,
+                              record->sender_id,
+                              federation->last_seq,
+                              record->text,
+                              record->len) != 0) {
+        dropped++;
+      }
+    }
+  }
+
+  for (j = 0; j < count; j++) {
+    federation->release(federation->batch[j]);
+  }
+  if (count > 0) {
+    federation->num_taken += count;
+    atomic_store_u64(&federation->num_taken, federation->num_taken);
+    atomic_add_u64(&federation->num_relayed, count);
+  }
+  if (dropped > 0) {
+    atomic_add_u64(&federation->num_dropped, dropped);
+  }
+  return count;
+}
+
+/*
+ * Gives up on connections that take too long and connects again to peers
+ * that have been down for a while
+ */
+static void check_peer(struct peer_link *peer, uint64_t now)
+{
+  if (peer->state == PEER_LINKED || now < peer->deadline) {
+    return;
+  }
+  switch (peer->state) {
+    case PEER_DOWN:
+      peer->address = peer->addresses;
+      connect_peer(peer);
+      break;
+    case PEER_CONNECTING:
+      close_socket(peer->sock);
+      peer->sock = INVALID_SOCKET;
+      connect_peer(peer);
+      break;
+    default:
+      log_warning("Node at %s:%s didn't answer", peer->host, peer->port);
+      disconnect_peer(peer);
+      break;
+  }
+}
+
+/* Returns how long poll() may wait for the peer, -1 means any time */
+static int get_peer_timeout(const struct peer_link *peer, uint64_t now)
+{
+  if (peer->state == PEER_LINKED) {
+    return -1;
+  }
+  return peer->deadline > now ? (int)(peer->deadline - now) : 0;
+}
+
+#ifdef HAVE_EVENTFD
+
+/*
+ * Tells federation_relay() to wake the writer up. Returns non-zero if
+ * there's already something to do, in which case the writer mustn't wait.
+ */
+static int want_records(struct federation *federation)
+{
+  atomic_store_int(&federation->writer_waiting, 1);
+  /* Pairs with the fence in federation_relay() */
+  atomic_fence();
+  if (atomic_load_u64(&federation->num_pushed) != federation->num_taken
+      || atomic_load_int(&federation->stopping)) {
+    atomic_store_int(&federation->writer_waiting, 0);
+    return 1;
+  }
+  return 0;
+}
+
+#endif /* HAVE_EVENTFD */
+
+static void *relay_thread(void *arg)
+{
+  struct federation *federation = arg;
+  struct pollfd fds[FEDERATION_MAX_PEERS + 1];
+  struct peer_link *polled[FEDERATION_MAX_PEERS + 1];
+  struct peer_link *peer;
+  uint64_t now;
+  int num_fds;
+  int first_peer_fd;
+  int timeout;
+  int peer_timeout;
+  int ready;
+  int count;
+  int error;
+  int i;
+#ifdef HAVE_EVENTFD
+  uint64_t value;
+#endif
+
+  for (;;) {
+    now = get_time_ms();
+    for (i = 0; i < federation->num_peers; i++) {
+      check_peer(&federation->peers[i], now);
+    }
+
+    count = relay_batch(federation);
+
+    num_fds = 0;
+#ifdef HAVE_EVENTFD
+    fds[num_fds].fd = federation->wake_fd;
+    fds[num_fds].events = POLLIN;
+    fds[num_fds].revents = 0;
+    num_fds++;
+#endif
+    first_peer_fd = num_fds;
+    timeout = -1;
+    for (i = 0; i < federation->num_peers; i++) {
+      peer = &federation->peers[i];
+      if (peer->state != PEER_CONNECTING && peer->out_len > 0) {
+        error = flush_peer(peer);
+        if (error != 0) {
+          if (peer->state == PEER_LINKED) {
+            log_warning("Lost the link to node %d: %s",
+                        peer->node_id,
+                        error_to_str(error, NULL, 0));
+          }
+          disconnect_peer(peer);
+        } else if (peer->state == PEER_LINKED) {
+          atomic_add_u64(&federation->num_writes, 1);
+        }
+      }
+      peer_timeout = get_peer_timeout(peer, now);
+      if (peer_timeout >= 0 && (timeout < 0 || peer_timeout < timeout)) {
+        timeout = peer_timeout;
+      }
+      if (peer->state == PEER_DOWN) {
+        continue;
+      }
+      fds[num_fds].fd = peer->sock;
+      if (peer->state == PEER_CONNECTING) {
+        fds[num_fds].events = POLLOUT;
+      } else {
+        fds[num_fds].events = POLLIN;
+        if (peer->out_len > 0) {
+          fds[num_fds].events |= POLLOUT;
+        }
+      }
+      fds[num_fds].revents = 0;
+      polled[num_fds++] = peer;
+    }
+
+    if (count == 0 && atomic_load_int(&federation->stopping)) {
+      break;
+    }
+
+    /* Whatever gets relayed in the meantime goes out together */
+    if (count == RELAY_MAX_BATCH) {
+      timeout = 0;
+    }
+#ifdef HAVE_EVENTFD
+    if (timeout != 0 && want_records(federation)) {
+      timeout = 0;
+    }
+#else
+    if (timeout < 0 || timeout > RELAY_IDLE_WAIT_MS) {
+      timeout = RELAY_IDLE_WAIT_MS;
+    }
+    if (num_fds == 0) {
+      sleep_ms(timeout);
+      continue;
+    }
+#endif
+    ready = poll(fds, num_fds, timeout);
+#ifdef HAVE_EVENTFD
+    atomic_store_int(&federation->writer_waiting, 0);
+    if (ready > 0
+        && fds[0].revents != 0
+        && read(federation->wake_fd, &value, sizeof(value)) < 0) {
+      /* Nothing to clear */
+    }
+#endif
+    if (ready <= 0) {
+      continue;
+    }
+    for (i = first_peer_fd; i < num_fds; i++) {
+      peer = polled[i];
+      if (fds[i].revents == 0) {
+        continue;
+      }
+      if (peer->state == PEER_CONNECTING) {
+        finish_connect(federation, peer);
+        continue;
+      }
+      if ((fds[i].revents & ~POLLOUT) != 0
+          && read_peer(federation, peer) != 0) {
+        if (peer->state == PEER_LINKED) {
+          log_warning("Node %d closed the link", peer->node_id);
+        }
+        disconnect_peer(peer);
+      }
+    }
+  }
+  return NULL;
+}
+
+/* Starts the writer thread, which links up with the peers as it goes */
+int federation_start(struct federation *federation)
+{
+  return create_thread(&federation->thread, relay_thread, federation);
+}
+
+/*
+ * Queues the record for all peers, never blocks. If too many records are
+ * waiting already, it's released right away and counted as dropped.
+ */
+void federation_relay(struct federation *federation,
+                      struct relay_record *record)
+{
+#ifdef HAVE_EVENTFD
+  uint64_t value = 1;
+#endif
+
+  /* Concurrent relays may go a little over the limit, that's fine */
+  if (atomic_load_u64(&federation->num_pushed)
+      - atomic_load_u64(&federation->num_taken) >= RELAY_MAX_QUEUED) {
+    federation->release(record);
+    atomic_add_u64(&federation->num_dropped, federation->num_peers);
+    return;
+  }
+  atomic_add_u64(&federation->num_pushed, 1);
+  mpsc_queue_push(&federation->queue, &record->node);
+
+#ifdef HAVE_EVENTFD
+  /* Pairs with the fence in want_records() */
+  atomic_fence();
+  if (atomic_load_int(&federation->writer_waiting)
+      && atomic_exchange_int(&federation->writer_waiting, 0)) {
+    if (write(federation->wake_fd, &value, sizeof(value)) < 0) {
+      /* The counter is full, so a wakeup is pending anyway */
+    }
+  }
+#endif
+}
+
+/* Relays everything queued so far and closes the links */
+void federation_stop(struct federation *federation)
+{
+  struct peer_link *peer;
+  int i;
+#ifdef HAVE_EVENTFD
+  uint64_t value = 1;
+#endif
+
+  atomic_store_int(&federation->stopping, 1);
+#ifdef HAVE_EVENTFD
+  if (write(federation->wake_fd, &value, sizeof(value)) < 0) {
+    /* The counter is full, so a wakeup is pending anyway */
+  }
+#endif
+  join_thread(federation->thread);
+  for (i = 0; i < federation->num_peers; i++) {
+    peer = &federation->peers[i];
+    if (peer->state != PEER_LINKED) {
+      continue;
+    }
+    while (peer->out_len > 0
+           && socket_wait(peer->sock,
+                          SOCKET_WRITABLE,
+                          PEER_HANDSHAKE_TIMEOUT_MS) > 0
+           && flush_peer(peer) == 0) {
+      continue;
+    }
+    close_socket_nicely(peer->sock);
+  }
+}
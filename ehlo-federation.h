@@ -0,0 +1,94 @@
+#ifndef EHLO_FEDERATION_H
+#define EHLO_FEDERATION_H
+
+/*
+ * Links from this server to the other nodes of a cluster. Every node
+ * connects to each of its peers and relays the lobby messages of its own
+ * clients over that link; the peer delivers them to its clients but never
+ * passes them on. A message therefore crosses at most one link, and the
+ * nodes have to form a full mesh, each of them listing all the others.
+ *
+ * Relaying only pushes the record onto a lock-free queue and wakes up a
+ * writer thread if it's waiting. The writer takes everything queued so
+ * far, numbers it, frames it once for every link and writes each link's
+ * batch with a single call. Records are handed back through the release
+ * callback as soon as they're framed, or right away if the queue is full.
+ *
+ * The peers' addresses are resolved once, when they're added, and a node
+ * only takes links from those addresses. The writer connects to them
+ * without blocking, so a peer that's slow to answer holds up no one else.
+ *
+ * A link that goes down is connected again every second. What is relayed
+ * in the meantime, or while a link's buffer is full, never reaches that
+ * peer; drops on a live link show up there as a gap in the numbers.
+ */
+
+#include "ehlo-queue.h"
+
+#define FEDERATION_MAX_PEERS 64
+
+struct relay_record {
+  struct mpsc_node node;
+  int sender_id;
+  const char *text;
+  int len;
+};
+
+typedef void (*relay_release_t)(struct relay_record *record);
+
+enum {
+  PEER_DOWN,        /* until it's time to connect again */
+  PEER_CONNECTING,  /* connect() is in progress */
+  PEER_INTRODUCING, /* PEER has been sent, the answer hasn't come */
+  PEER_LINKED
+};
+
+struct peer_link {
+  char *host;
+  char *port;
+  struct addrinfo *addresses;
+  const struct addrinfo *address; /* the next one to connect to */
+  socket_t sock;
+  int state;
+  int node_id; /* of the other end, once linked */
+  uint64_t deadline; /* to connect again, or to give up if not linked */
+  struct recv_buffer in;
+  char *out;
+  int out_len;
+};
+
+struct federation {
+  int node_id;
+  relay_release_t release;
+  struct peer_link peers[FEDERATION_MAX_PEERS];
+  int num_peers;
+  struct mpsc_queue queue;
+  uint64_t num_pushed;
+  uint64_t num_taken; /* written by the writer only */
+#ifdef HAVE_EVENTFD
+  int wake_fd;
+  int writer_waiting;
+#endif
+  /* Owned by the writer thread */
+  uint32_t last_seq;
+  struct relay_record **batch;
+  int stopping;
+  thread_t thread;
+  /* Statistics, readable from any thread */
+  uint64_t num_relayed;
+  uint64_t num_writes;
+  uint64_t num_dropped; /* frames, one for every peer a record missed */
+};
+
+int federation_init(struct federation *federation,
+                    int node_id,
+                    relay_release_t release);
+int federation_add_peer(struct federation *federation, const char *address);
+int federation_is_peer_address(const struct federation *federation,
+                               const struct sockaddr_in *addr);
+int federation_start(struct federation *federation);
+void federation_relay(struct federation *federation,
+                      struct relay_record *record);
+void federation_stop(struct federation *federation);
+
+#endif /* EHLO_FEDERATION_H */
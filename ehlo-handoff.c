@@ -0,0 +1,179 @@
+#include <stdlib.h>
+#include <sys/time.h>
+#include "ehlo-shared.h"
+#include "ehlo-handoff.h"
+
+struct record_header {
+  uint16_t type;
+  uint16_t num_fds;
+  uint32_t len;
+};
+
+/* Socket timeouts report themselves as EAGAIN */
+static int get_channel_error(void)
+{
+  return errno == EAGAIN || errno == EWOULDBLOCK ? ETIMEDOUT : errno;
+}
+
+static void close_unclaimed_fds(struct handoff *handoff)
+{
+  while (handoff->fd_pos < handoff->num_fds) {
+    close(handoff->fds[handoff->fd_pos++]);
+  }
+  handoff->num_fds = 0;
+  handoff->fd_pos = 0;
+}
+
+/*
+ * Takes over sock, one end of a SOCK_SEQPACKET pair. Sending and receiving
+ * give up after timeout_ms. Returns 0 or an error code.
+ */
+int handoff_open(struct handoff *handoff, socket_t sock, int timeout_ms)
+{
+  struct timeval timeout;
+
+  memset(handoff, 0, sizeof(*handoff));
+  handoff->sock = sock;
+  handoff->buf = malloc(HANDOFF_PACKET_SIZE);
+  if (handoff->buf == NULL) {
+    return ENOMEM;
+  }
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_usec = (timeout_ms % 1000) * 1000;
+  if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout))
+          != 0
+      || setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout))
+          != 0) {
+    return errno;
+  }
+  return 0;
+}
+
+/* Closes the channel and any received descriptors nobody took */
+void handoff_close(struct handoff *handoff)
+{
+  close_unclaimed_fds(handoff);
+  free(handoff->buf);
+  handoff->buf = NULL;
+  close_socket(handoff->sock);
+  handoff->sock = INVALID_SOCKET;
+}
+
+/* Sends the records collected so far. Returns 0 or an error code. */
+int handoff_flush(struct handoff *handoff)
+{
+  int result;
+
+  if (handoff->len == 0) {
+    return 0;
+  }
+  result = send_fds(handoff->sock,
+                    handoff->buf,
+                    handoff->len,
+                    handoff->fds,
+                    handoff->num_fds);
+  if (result < 0) {
+    return get_channel_error();
+  }
+  handoff->len = 0;
+  handoff->num_fds = 0;
+  return 0;
+}
+
+/*
+ * Adds a record to the current packet, sending the packet first if the
+ * record doesn't fit. The descriptors stay open on this side. Whatever is
+ * left of a packet received before is dropped. Returns 0 or an error code.
+ */
+int handoff_put(struct handoff *handoff,
+                int type,
+                const void *data,
+                int len,
+                const int *fds,
+                int num_fds)
+{
+  struct record_header header;
+  int error;
+
+  if (len > HANDOFF_MAX_RECORD_LEN || num_fds > EHLO_MAX_PASSED_FDS) {
+    return EMSGSIZE;
+  }
+  if (handoff->pos > 0) {
+    /* Done with the packet received last, the buffer is free again */
+    close_unclaimed_fds(handoff);
+    handoff->pos = 0;
+    handoff->len = 0;
+  }
+  if (handoff->len + HANDOFF_RECORD_HEADER_LEN + len > HANDOFF_PACKET_SIZE
+      || handoff->num_fds + num_fds > EHLO_MAX_PASSED_FDS) {
+    error = handoff_flush(handoff);
+    if (error != 0) {
+      return error;
+    }
+  }
+
+  header.type = (uint16_t)type;
+  header.num_fds = (uint16_t)num_fds;
+  header.len = (uint32_t)len;
+  memcpy(handoff->buf + handoff->len, &header, sizeof(header));
+  memcpy(handoff->buf + handoff->len + HANDOFF_RECORD_HEADER_LEN, data, len);
+  handoff->len += HANDOFF_RECORD_HEADER_LEN + len;
+  memcpy(handoff->fds + handoff->num_fds, fds, num_fds * sizeof(*fds));
+  handoff->num_fds += num_fds;
+  return 0;
+}
+
+/*
+ * Takes the next record, receiving another packet when the current one is
+ * used up. data points into the channel's buffer until the next call. fds
+ * must have room for EHLO_MAX_PASSED_FDS descriptors, which belong to the
+ * caller. Records put before must have been flushed. Returns 0, EPIPE if
+ * the other end has closed the channel or another error code.
+ */
+int handoff_get(struct handoff *handoff,
+                int *type,
+                const char **data,
+                int *len,
+                int *fds,
+                int *num_fds)
+{
+  struct record_header header;
+  int result;
+
+  if (handoff->pos == handoff->len) {
+    close_unclaimed_fds(handoff);
+    handoff->pos = 0;
+    handoff->len = 0;
+    result = recv_fds(handoff->sock,
+                      handoff->buf,
+                      HANDOFF_PACKET_SIZE,
+                      handoff->fds,
+                      &handoff->num_fds);
+    if (result < 0) {
+      return get_channel_error();
+    }
+    if (result == 0) {
+      return EPIPE;
+    }
+    handoff->len = result;
+  }
+
+  if (handoff->len - handoff->pos < HANDOFF_RECORD_HEADER_LEN) {
+    return EPROTO;
+  }
+  memcpy(&header, handoff->buf + handoff->pos, sizeof(header));
+  if (header.len > (uint32_t)(handoff->len - handoff->pos
+                              - HANDOFF_RECORD_HEADER_LEN)
+      || header.num_fds > handoff->num_fds - handoff->fd_pos) {
+    return EPROTO;
+  }
+
+  *type = header.type;
+  *data = handoff->buf + handoff->pos + HANDOFF_RECORD_HEADER_LEN;
+  *len = (int)header.len;
+  memcpy(fds, handoff->fds + handoff->fd_pos, header.num_fds * sizeof(*fds));
+  *num_fds = header.num_fds;
+  handoff->pos += HANDOFF_RECORD_HEADER_LEN + (int)header.len;
+  handoff->fd_pos += header.num_fds;
+  return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef EHLO_HANDOFF_H
+#define EHLO_HANDOFF_H
+
+/*
+ * Channel over which a running server hands its sockets and state over to
+ * the process that replaces it. It's one end of a SOCK_SEQPACKET socket
+ * pair, so packets arrive whole or not at all. Records are collected into
+ * packets of up to HANDOFF_PACKET_SIZE bytes and the descriptors of all
+ * records in a packet go with it as SCM_RIGHTS, so that thousands of
+ * clients take a few dozen system calls.
+ *
+ * A record starts with a header in host byte order (both ends run on the
+ * same machine):
+ *
+ *   uint16_t type
+ *   uint16_t num_fds (passed along with the record)
+ *   uint32_t len (of the data that follows)
+ *
+ * What the types mean is up to the two ends. A record never spans packets.
+ */
+
+#define HANDOFF_PACKET_SIZE 65536
+#define HANDOFF_RECORD_HEADER_LEN 8
+#define HANDOFF_MAX_RECORD_LEN (HANDOFF_PACKET_SIZE - HANDOFF_RECORD_HEADER_LEN)
+
+struct handoff {
+  socket_t sock;
+  char *buf;
+  int len; /* of the packet being filled or taken apart */
+  int pos; /* of the next record to take */
+  int fds[EHLO_MAX_PASSED_FDS];
+  int num_fds;
+  int fd_pos; /* of the next descriptor to take */
+};
+
+int handoff_open(struct handoff *handoff, socket_t sock, int timeout_ms);
+void handoff_close(struct handoff *handoff);
+int handoff_put(struct handoff *handoff,
+                int type,
+                const void *data,
+                int len,
+                const int *fds,
+                int num_fds);
+int handoff_flush(struct handoff *handoff);
+int handoff_get(struct handoff *handoff,
+                int *type,
+                const char **data,
+                int *len,
+                int *fds,
+                int *num_fds);
+
+#endif /* EHLO_HANDOFF_H */
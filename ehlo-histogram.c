@@ -0,0 +1,107 @@
+#include "ehlo-shared.h"
+#ifdef _MSC_VER
+  #include <intrin.h>
+#endif
+#include "ehlo-histogram.h"
+
+/* Returns the position of the highest bit set, value must not be 0 */
+static int find_last_set(uint64_t value)
+{
+#ifdef _MSC_VER
+  unsigned long index;
+
+  _BitScanReverse64(&index, value);
+  return (int)index;
+#else
+  return 63 - __builtin_clzll(value);
+#endif
+}
+
+static int get_histogram_bucket(uint64_t value)
+{
+  int exponent;
+
+  if (value < HISTOGRAM_SUB_BUCKETS) {
+    return (int)value;
+  }
+  /* Keep HISTOGRAM_SUB_BITS bits below the highest one */
+  exponent = find_last_set(value) - HISTOGRAM_SUB_BITS;
+  return (exponent + 1) * HISTOGRAM_SUB_BUCKETS
+      + (int)((value >> exponent) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/* Returns the highest value that falls into the bucket */
+static uint64_t get_histogram_bucket_max(int bucket)
+{
+  int exponent = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+  uint64_t sub_bucket = bucket % HISTOGRAM_SUB_BUCKETS;
+
+  if (bucket < HISTOGRAM_SUB_BUCKETS) {
+    return bucket;
+  }
+  return ((HISTOGRAM_SUB_BUCKETS + sub_bucket + 1) << exponent) - 1;
+}
+
+void histogram_add(struct histogram *histogram, uint64_t value)
+{
+  uint64_t *count = &histogram->counts[get_histogram_bucket(value)];
+
+  atomic_store_u64(count, *count + 1);
+  atomic_store_u64(&histogram->total, histogram->total + 1);
+  atomic_store_u64(&histogram->sum, histogram->sum + value);
+  if (value > histogram->max) {
+    atomic_store_u64(&histogram->max, value);
+  }
+}
+
+/* The maximum may miss a value recorded by two threads at the same time */
+void histogram_add_shared(struct histogram *histogram, uint64_t value)
+{
+  atomic_add_u64(&histogram->counts[get_histogram_bucket(value)], 1);
+  atomic_add_u64(&histogram->total, 1);
+  atomic_add_u64(&histogram->sum, value);
+  if (value > atomic_load_u64(&histogram->max)) {
+    atomic_store_u64(&histogram->max, value);
+  }
+}
+
+void histogram_merge(struct histogram *histogram,
+                     const struct histogram *other)
+{
+  uint64_t max = atomic_load_u64(&other->max);
+  int i;
+
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    histogram->counts[i] += atomic_load_u64(&other->counts[i]);
+  }
+  histogram->total += atomic_load_u64(&other->total);
+  histogram->sum += atomic_load_u64(&other->sum);
+  if (max > histogram->max) {
+    histogram->max = max;
+  }
+}
+
+/* Returns the value below which the given fraction of the samples lie */
+uint64_t histogram_percentile(const struct histogram *histogram,
+                              double fraction)
+{
+  uint64_t rank = (uint64_t)(fraction * histogram->total);
+  uint64_t count = 0;
+  uint64_t value;
+  int i;
+
+  if (histogram->total == 0) {
+    return 0;
+  }
+  if (rank >= histogram->total) {
+    rank = histogram->total - 1;
+  }
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    count += histogram->counts[i];
+    if (count > rank) {
+      break;
+    }
+  }
+  value = get_histogram_bucket_max(i);
+  return value < histogram->max ? value : histogram->max;
+}
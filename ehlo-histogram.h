@@ -0,0 +1,34 @@
+#ifndef EHLO_HISTOGRAM_H
+#define EHLO_HISTOGRAM_H
+
+/*
+ * Log-linear histogram with HISTOGRAM_SUB_BUCKETS buckets for every power
+ * of two, which keeps the error of a percentile under 7% over the whole
+ * 64-bit range.
+ *
+ * histogram_add() is meant for a histogram that only one thread records
+ * to; other threads may read it at any time and see a close enough picture.
+ * Histograms shared by several recording threads use histogram_add_shared().
+ */
+
+#include <stdint.h>
+
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (64 * HISTOGRAM_SUB_BUCKETS)
+
+struct histogram {
+  uint64_t counts[HISTOGRAM_BUCKETS];
+  uint64_t total;
+  uint64_t sum;
+  uint64_t max;
+};
+
+void histogram_add(struct histogram *histogram, uint64_t value);
+void histogram_add_shared(struct histogram *histogram, uint64_t value);
+void histogram_merge(struct histogram *histogram,
+                     const struct histogram *other);
+uint64_t histogram_percentile(const struct histogram *histogram,
+                              double fraction);
+
+#endif /* EHLO_HISTOGRAM_H */
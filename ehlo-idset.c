@@ -0,0 +1,242 @@
+#include <stdlib.h>
+#include <string.h>
+#ifdef _MSC_VER
+  #include <intrin.h>
+#endif
+#include "ehlo-idset.h"
+
+#define ID_SET_MIN_CAPACITY 4
+#define WORD_BITS 32
+
+static int count_trailing_zeros(uint32_t word)
+{
+#ifdef _MSC_VER
+  unsigned long index;
+
+  _BitScanForward(&index, word);
+  return (int)index;
+#else
+  return __builtin_ctz(word);
+#endif
+}
+
+void id_set_init(struct id_set *set)
+{
+  set->data = NULL;
+  set->count = 0;
+  set->capacity = 0;
+  set->is_bitset = 0;
+}
+
+void id_set_free(struct id_set *set)
+{
+  free(set->data);
+  id_set_init(set);
+}
+
+/* Returns the position of the first ID in the array not less than id */
+static int find_index(const struct id_set *set, int id)
+{
+  int low = 0;
+  int high = set->count;
+  int middle;
+
+  while (low < high) {
+    middle = (low + high) / 2;
+    if ((int)set->data[middle] < id) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+static int convert_to_bitset(struct id_set *set, int num_words)
+{
+  uint32_t *bits;
+  int i;
+
+  bits = calloc(num_words, sizeof(*bits));
+  if (bits == NULL) {
+    return -1;
+  }
+  for (i = 0; i < set->count; i++) {
+    bits[set->data[i] / WORD_BITS] |= 1u << (set->data[i] % WORD_BITS);
+  }
+  free(set->data);
+  set->data = bits;
+  set->capacity = num_words;
+  set->is_bitset = 1;
+  return 0;
+}
+
+static int convert_to_array(struct id_set *set)
+{
+  uint32_t *ids;
+  int capacity = set->count * 2;
+  int pos = 0;
+  int id;
+  int i = 0;
+
+  if (capacity < ID_SET_MIN_CAPACITY) {
+    capacity = ID_SET_MIN_CAPACITY;
+  }
+  ids = malloc(capacity * sizeof(*ids));
+  if (ids == NULL) {
+    return -1;
+  }
+  while ((id = id_set_next(set, &pos)) >= 0) {
+    ids[i++] = id;
+  }
+  free(set->data);
+  set->data = ids;
+  set->capacity = capacity;
+  set->is_bitset = 0;
+  return 0;
+}
+
+static int add_to_bitset(struct id_set *set, int id)
+{
+  uint32_t *bits;
+  uint32_t mask = 1u << (id % WORD_BITS);
+  int word = id / WORD_BITS;
+  int num_words;
+
+  if (word >= set->capacity) {
+    num_words = set->capacity * 2 > word + 1 ? set->capacity * 2 : word + 1;
+    bits = realloc(set->data, num_words * sizeof(*bits));
+    if (bits == NULL) {
+      return -1;
+    }
+    memset(bits + set->capacity,
+           0,
+           (num_words - set->capacity) * sizeof(*bits));
+    set->data = bits;
+    set->capacity = num_words;
+  }
+  if (set->data[word] & mask) {
+    return 0;
+  }
+  set->data[word] |= mask;
+  set->count++;
+  return 1;
+}
+
+/* Returns 1 if the ID was added, 0 if it was there already or -1 on error */
+int id_set_add(struct id_set *set, int id)
+{
+  uint32_t *ids;
+  int capacity;
+  int max_id;
+  int index;
+
+  if (set->is_bitset) {
+    return add_to_bitset(set, id);
+  }
+
+  index = find_index(set, id);
+  if (index < set->count && (int)set->data[index] == id) {
+    return 0;
+  }
+
+  if (set->count == set->capacity) {
+    capacity = set->capacity > 0 ? set->capacity * 2 : ID_SET_MIN_CAPACITY;
+    max_id = set->count > 0 && (int)set->data[set->count - 1] > id
+        ? (int)set->data[set->count - 1]
+        : id;
+    /* Switch over once a bitset would take no more room than the array */
+    if (max_id / WORD_BITS + 1 <= capacity) {
+      if (convert_to_bitset(set, max_id / WORD_BITS + 1) != 0) {
+        return -1;
+      }
+      return add_to_bitset(set, id);
+    }
+    ids = realloc(set->data, capacity * sizeof(*ids));
+    if (ids == NULL) {
+      return -1;
+    }
+    set->data = ids;
+    set->capacity = capacity;
+  }
+
+  memmove(set->data + index + 1,
+          set->data + index,
+          (set->count - index) * sizeof(*set->data));
+  set->data[index] = id;
+  set->count++;
+  return 1;
+}
+
+/* Returns 1 if the ID was removed or 0 if it wasn't in the set */
+int id_set_remove(struct id_set *set, int id)
+{
+  uint32_t mask = 1u << (id % WORD_BITS);
+  int word = id / WORD_BITS;
+  int index;
+
+  if (set->is_bitset) {
+    if (word >= set->capacity || !(set->data[word] & mask)) {
+      return 0;
+    }
+    set->data[word] &= ~mask;
+    set->count--;
+    /* Go back to an array when the set has become sparse, if possible */
+    if (set->count * 4 < set->capacity) {
+      convert_to_array(set);
+    }
+    return 1;
+  }
+
+  index = find_index(set, id);
+  if (index == set->count || (int)set->data[index] != id) {
+    return 0;
+  }
+  memmove(set->data + index,
+          set->data + index + 1,
+          (set->count - index - 1) * sizeof(*set->data));
+  set->count--;
+  return 1;
+}
+
+int id_set_contains(const struct id_set *set, int id)
+{
+  int index;
+
+  if (set->is_bitset) {
+    return id / WORD_BITS < set->capacity
+        && (set->data[id / WORD_BITS] & (1u << (id % WORD_BITS))) != 0;
+  }
+  index = find_index(set, id);
+  return index < set->count && (int)set->data[index] == id;
+}
+
+/*
+ * Returns the next ID of the set in ascending order or -1 at the end. pos
+ * must be 0 for the first call and is advanced by each call. The set must
+ * not be changed in between.
+ */
+int id_set_next(const struct id_set *set, int *pos)
+{
+  uint32_t bits;
+  int word;
+
+  if (!set->is_bitset) {
+    return *pos < set->count ? (int)set->data[(*pos)++] : -1;
+  }
+
+  word = *pos / WORD_BITS;
+  if (word >= set->capacity) {
+    return -1;
+  }
+  bits = set->data[word] & (~0u << (*pos % WORD_BITS));
+  while (bits == 0) {
+    if (++word == set->capacity) {
+      *pos = word * WORD_BITS;
+      return -1;
+    }
+    bits = set->data[word];
+  }
+  *pos = word * WORD_BITS + count_trailing_zeros(bits) + 1;
+  return *pos - 1;
+}
@@ -0,0 +1,28 @@
+#ifndef EHLO_IDSET_H
+#define EHLO_IDSET_H
+
+/*
+ * Set of small non-negative integers, such as registry slots. Small sets
+ * are kept as sorted arrays. Once an array would take more memory than a
+ * bitset covering the same range, the set is turned into a bitset, so that
+ * even sets with most IDs in their range stay compact and are iterated in
+ * order, one word at a time.
+ */
+
+#include <stdint.h>
+
+struct id_set {
+  uint32_t *data; /* sorted IDs or one bit per ID */
+  int count;
+  int capacity;   /* in IDs for an array, in words for a bitset */
+  int is_bitset;
+};
+
+void id_set_init(struct id_set *set);
+void id_set_free(struct id_set *set);
+int id_set_add(struct id_set *set, int id);
+int id_set_remove(struct id_set *set, int id);
+int id_set_contains(const struct id_set *set, int id);
+int id_set_next(const struct id_set *set, int *pos);
+
+#endif /* EHLO_IDSET_H */
@@ -0,0 +1,542 @@
+#include <dirent.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef HAVE_EVENTFD
+  #include <sys/eventfd.h>
+#endif
+#include "ehlo-shared.h"
+#include "ehlo-journal.h"
+#include "ehlo-log.h"
+
+/* Most records taken from the queue for a single write */
+#define JOURNAL_MAX_BATCH 1024
+#define JOURNAL_MAX_RECORD_LEN \
+    (JOURNAL_RECORD_HEADER_LEN + EHLO_MAX_MESSAGE_LEN)
+
+/* Records waiting for the writer, what comes on top is dropped */
+#define JOURNAL_MAX_QUEUED (64 * 1024)
+
+/*
+ * How long the writer sleeps when there's nothing to write, unless
+ * journal_append() can wake it up
+ */
+#define JOURNAL_IDLE_SLEEP_MS 2
+
+static const char segment_magic[8] = {'E', 'H', 'L', 'O', 'J', 'N', 'L', 1};
+
+static uint32_t get_checksum(const char *data, size_t len)
+{
+  uint32_t hash = 2166136261u;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    hash = (hash ^ (uint8_t)data[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static void put_u32(char *buf, uint32_t value)
+{
+  value = htonl(value);
+  memcpy(buf, &value, sizeof(value));
+}
+
+static uint32_t get_u32(const char *buf)
+{
+  uint32_t value;
+
+  memcpy(&value, buf, sizeof(value));
+  return ntohl(value);
+}
+
+/* Returns the length of the encoded record */
+static int encode_record(char *buf, const struct journal_record *record)
+{
+  uint16_t room = htons((uint16_t)record->room);
+  uint16_t reserved = 0;
+
+  put_u32(buf, record->len);
+  put_u32(buf + 8, record->seq);
+  put_u32(buf + 12, (uint32_t)record->sender_id);
+  put_u32(buf + 16, (uint32_t)(record->time_ms >> 32));
+  put_u32(buf + 20, (uint32_t)record->time_ms);
+  memcpy(buf + 24, &room, sizeof(room));
+  memcpy(buf + 26, &reserved, sizeof(reserved));
+  memcpy(buf + JOURNAL_RECORD_HEADER_LEN, record->text, record->len);
+  put_u32(buf + 4,
+          get_checksum(buf + 8, JOURNAL_RECORD_HEADER_LEN - 8 + record->len));
+  return JOURNAL_RECORD_HEADER_LEN + record->len;
+}
+
+/*
+ * Reads the record at offset and moves offset past it. Returns 1, 0 at the
+ * end of the segment (including a record that is cut short) or -1 if the
+ * record is corrupt. The text points into the mapped segment.
+ */
+int journal_next_record(const struct journal_segment *segment,
+                        size_t *offset,
+                        struct journal_record *record)
+{
+  const char *data = segment->data + *offset;
+  size_t left = segment->size - *offset;
+  uint16_t room;
+  uint32_t len;
+
+  if (*offset >= segment->size || left < JOURNAL_RECORD_HEADER_LEN) {
+    return 0;
+  }
+  len = get_u32(data);
+  if (len > EHLO_MAX_MESSAGE_LEN) {
+    return -1;
+  }
+  if (left < JOURNAL_RECORD_HEADER_LEN + len) {
+    return 0;
+  }
+  if (get_u32(data + 4)
+      != get_checksum(data + 8, JOURNAL_RECORD_HEADER_LEN - 8 + len)) {
+    return -1;
+  }
+  memcpy(&room, data + 24, sizeof(room));
+  record->seq = get_u32(data + 8);
+  record->sender_id = (int32_t)get_u32(data + 12);
+  record->time_ms = (uint64_t)get_u32(data + 16) << 32 | get_u32(data + 20);
+  record->room = ntohs(room);
+  record->text = data + JOURNAL_RECORD_HEADER_LEN;
+  record->len = (int)len;
+  *offset += JOURNAL_RECORD_HEADER_LEN + len;
+  return 1;
+}
+
+/* Maps a segment for reading, returns 0 or an error code */
+int journal_map_segment(const char *path, struct journal_segment *segment)
+{
+  struct stat st;
+  void *data;
+  int fd;
+  int error = 0;
+
+  segment->data = NULL;
+  segment->size = 0;
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return errno;
+  }
+  if (fstat(fd, &st) != 0) {
+    error = errno;
+  } else if (st.st_size < JOURNAL_SEGMENT_HEADER_LEN) {
+    /* Nothing to read yet */
+  } else {
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+      error = errno;
+    } else if (memcmp(data, segment_magic, sizeof(segment_magic)) != 0) {
+      munmap(data, st.st_size);
+      error = EINVAL;
+    } else {
+      madvise(data, st.st_size, MADV_SEQUENTIAL);
+      segment->data = data;
+      segment->size = st.st_size;
+    }
+  }
+  close(fd);
+  return error;
+}
+
+void journal_unmap_segment(struct journal_segment *segment)
+{
+  if (segment->data != NULL) {
+    munmap((void *)segment->data, segment->size);
+  }
+  segment->data = NULL;
+  segment->size = 0;
+}
+
+static char *get_segment_path(const struct journal *journal,
+                              unsigned long index)
+{
+  char *path;
+
+  if (asprintf(&path, "%s/" JOURNAL_SEGMENT_NAME_FORMAT, journal->dir, index) < 0) {
+    return NULL;
+  }
+  return path;
+}
+
+static int compare_indexes(const void *a, const void *b)
+{
+  unsigned long index1 = *(const unsigned long *)a;
+  unsigned long index2 = *(const unsigned long *)b;
+
+  return index1 < index2 ? -1 : index1 > index2;
+}
+
+/* Finds the existing segments, creating the directory if needed */
+static int find_segments(struct journal *journal)
+{
+  struct dirent *entry;
+  unsigned long *segments;
+  unsigned long index;
+  int capacity = 0;
+  DIR *dir;
+
+  if (mkdir(journal->dir, 0755) != 0 && errno != EEXIST) {
+    return errno;
+  }
+  dir = opendir(journal->dir);
+  if (dir == NULL) {
+    return errno;
+  }
+  while ((entry = readdir(dir)) != NULL) {
+    if (sscanf(entry->d_name, JOURNAL_SEGMENT_NAME_FORMAT, &index) != 1) {
+      continue;
+    }
+    if (journal->num_segments == capacity) {
+      capacity = capacity > 0 ? capacity * 2 : 16;
+      segments = realloc(journal->segments, capacity * sizeof(*segments));
+      if (segments == NULL) {
+        closedir(dir);
+        return ENOMEM;
+      }
+      journal->segments = segments;
+    }
+    journal->segments[journal->num_segments++] = index;
+  }
+  closedir(dir);
+  if (journal->num_segments > 0) {
+    qsort(journal->segments,
+          journal->num_segments,
+          sizeof(*journal->segments),
+          compare_indexes);
+  }
+  return 0;
+}
+
+/*
+ * Opens the journal in the given directory. The records already there can
+ * be read with journal_replay() before journal_start() begins a new
+ * segment. Returns 0 or an error code.
+ */
+int journal_open(struct journal *journal,
+                 const char *dir,
+                 enum journal_sync sync,
+                 size_t segment_size,
+                 journal_release_t release)
+{
+  memset(journal, 0, sizeof(*journal));
+  journal->fd = -1;
+  journal->sync = sync;
+  journal->segment_size = segment_size;
+  journal->release = release;
+  mpsc_queue_init(&journal->queue);
+  journal->dir = strdup(dir);
+  journal->buf = malloc(JOURNAL_MAX_BATCH * JOURNAL_MAX_RECORD_LEN);
+  journal->batch = malloc(JOURNAL_MAX_BATCH * sizeof(*journal->batch));
+  if (journal->dir == NULL || journal->buf == NULL || journal->batch == NULL) {
+    return ENOMEM;
+  }
+#ifdef HAVE_EVENTFD
+  journal->wake_fd = eventfd(0, EFD_CLOEXEC);
+  if (journal->wake_fd < 0) {
+    return errno;
+  }
+#endif
+  return find_segments(journal);
+}
+
+/* Calls handler for every record of the segment, returns their number */
+static int read_segment(struct journal *journal,
+                        unsigned long index,
+                        int skip,
+                        journal_handler_t handler,
+                        void *arg)
+{
+  struct journal_segment segment;
+  struct journal_record record;
+  size_t offset = JOURNAL_SEGMENT_HEADER_LEN;
+  char *path;
+  int count = 0;
+  int error;
+  int result;
+
+  path = get_segment_path(journal, index);
+  if (path == NULL) {
+    return 0;
+  }
+  error = journal_map_segment(path, &segment);
+  if (error != 0) {
+    log_warning("Failed to read journal segment %s: %s",
+                path,
+                error_to_str(error, NULL, 0));
+    free(path);
+    return 0;
+  }
+  while ((result = journal_next_record(&segment, &offset, &record)) > 0) {
+    if (handler != NULL && count >= skip) {
+      handler(&record, arg);
+    }
+    count++;
+  }
+  if (result < 0) {
+    log_warning("Journal segment %s is corrupt after %d records",
+                path,
+                count);
+  }
+  journal_unmap_segment(&segment);
+  free(path);
+  return count;
+}
+
+/*
+ * Calls handler for the newest max_records records in the journal, oldest
+ * first. Returns the number of records read.
+ */
+int journal_replay(struct journal *journal,
+                   int max_records,
+                   journal_handler_t handler,
+                   void *arg)
+{
+  int total = 0;
+  int first;
+  int i;
+
+  /* Count backwards to find where the newest records begin */
+  for (first = journal->num_segments; first > 0 && total < max_records;) {
+    first--;
+    total += read_segment(journal, journal->segments[first], 0, NULL, NULL);
+  }
+  if (total == 0) {
+    return 0;
+  }
+  for (i = first; i < journal->num_segments; i++) {
+    read_segment(journal,
+                 journal->segments[i],
+                 i == first && total > max_records ? total - max_records : 0,
+                 handler,
+                 arg);
+  }
+  return total < max_records ? total : max_records;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+  ssize_t result;
+
+  while (len > 0) {
+    result = write(fd, buf, len);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    }
+    buf += result;
+    len -= result;
+  }
+  return 0;
+}
+
+static int sync_segment(struct journal *journal)
+{
+  atomic_add_u64(&journal->num_syncs, 1);
+  return fdatasync(journal->fd) == 0 ? 0 : errno;
+}
+
+/* Seals the current segment, if any, and begins the next one */
+static int open_next_segment(struct journal *journal)
+{
+  char header[JOURNAL_SEGMENT_HEADER_LEN];
+  char *path;
+  int error;
+
+  if (journal->fd >= 0) {
+    if (journal->sync != JOURNAL_SYNC_NONE) {
+      sync_segment(journal);
+    }
+    close(journal->fd);
+    journal->fd = -1;
+  }
+
+  journal->index++;
+  path = get_segment_path(journal, journal->index);
+  if (path == NULL) {
+    return ENOMEM;
+  }
+  journal->fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+  free(path);
+  if (journal->fd < 0) {
+    return errno;
+  }
+
+  memcpy(header, segment_magic, sizeof(segment_magic));
+  put_u32(header + 8, (uint32_t)journal->index);
+  put_u32(header + 12, 0);
+  error = write_all(journal->fd, header, sizeof(header));
+  journal->size = sizeof(header);
+  return error;
+}
+
+static void report_error(struct journal *journal, const char *what, int error)
+{
+  atomic_add_u64(&journal->num_errors, 1);
+  log_error("Failed to %s journal segment %lu: %s",
+            what,
+            journal->index,
+            error_to_str(error, NULL, 0));
+}
+
+/* Writes out what has been queued so far, returns the number of records */
+static int write_batch(struct journal *journal)
+{
+  struct mpsc_node *node;
+  size_t len = 0;
+  int count = 0;
+  int error;
+  int i;
+
+  while (count < JOURNAL_MAX_BATCH
+         && (node = mpsc_queue_pop(&journal->queue)) != NULL) {
+    journal->batch[count] = (struct journal_record *)node;
+    len += encode_record(journal->buf + len, journal->batch[count]);
+    count++;
+    if (journal->sync == JOURNAL_SYNC_ALWAYS) {
+      break;
+    }
+  }
+  if (count == 0) {
+    return 0;
+  }
+
+  if (journal->fd < 0 || journal->size >= journal->segment_size) {
+    error = open_next_segment(journal);
+    if (error != 0) {
+      report_error(journal, "open", error);
+    }
+  }
+  if (journal->fd >= 0) {
+    error = write_all(journal->fd, journal->buf, len);
+    if (error != 0) {
+      report_error(journal, "write", error);
+    } else if (journal->sync != JOURNAL_SYNC_NONE) {
+      error = sync_segment(journal);
+      if (error != 0) {
+        report_error(journal, "sync", error);
+      }
+    }
+    journal->size += len;
+  }
+
+  for (i = 0; i < count; i++) {
+    journal->release(journal->batch[i]);
+  }
+  journal->num_taken += count;
+  atomic_store_u64(&journal->num_taken, journal->num_taken);
+  atomic_add_u64(&journal->num_records, count);
+  return count;
+}
+
+/* Sleeps until there's something to write or the writer has to stop */
+static void wait_for_records(struct journal *journal)
+{
+#ifdef HAVE_EVENTFD
+  uint64_t value;
+
+  atomic_store_int(&journal->writer_waiting, 1);
+  /* Pairs with the fence in journal_append() */
+  atomic_fence();
+  if (atomic_load_u64(&journal->num_pushed) == journal->num_taken
+      && !atomic_load_int(&journal->stopping)) {
+    if (read(journal->wake_fd, &value, sizeof(value)) < 0) {
+      /* Interrupted, just look again */
+    }
+  }
+  atomic_store_int(&journal->writer_waiting, 0);
+#else
+  sleep_ms(JOURNAL_IDLE_SLEEP_MS);
+#endif
+}
+
+static void *journal_thread(void *arg)
+{
+  struct journal *journal = arg;
+
+  for (;;) {
+    if (write_batch(journal) == 0) {
+      if (atomic_load_int(&journal->stopping)) {
+        break;
+      }
+      /* Whatever arrives while a batch is synced is committed together */
+      wait_for_records(journal);
+    }
+  }
+  return NULL;
+}
+
+static void wake_writer(struct journal *journal)
+{
+#ifdef HAVE_EVENTFD
+  uint64_t value = 1;
+
+  if (write(journal->wake_fd, &value, sizeof(value)) < 0) {
+    /* The counter is full, so a wakeup is pending anyway */
+  }
+#else
+  (void)journal;
+#endif
+}
+
+/* Starts the writer thread with a new segment, returns 0 or an error code */
+int journal_start(struct journal *journal)
+{
+  int error;
+
+  if (journal->num_segments > 0) {
+    journal->index = journal->segments[journal->num_segments - 1];
+  }
+  error = open_next_segment(journal);
+  if (error != 0) {
+    return error;
+  }
+  return create_thread(&journal->thread, journal_thread, journal);
+}
+
+/*
+ * Queues the record for writing, never blocks. If too many records are
+ * waiting already, it's released right away and counted as dropped.
+ */
+void journal_append(struct journal *journal, struct journal_record *record)
+{
+  /* Concurrent appends may go a little over the limit, that's fine */
+  if (atomic_load_u64(&journal->num_pushed)
+      - atomic_load_u64(&journal->num_taken) >= JOURNAL_MAX_QUEUED) {
+    journal->release(record);
+    atomic_add_u64(&journal->num_dropped, 1);
+    return;
+  }
+  atomic_add_u64(&journal->num_pushed, 1);
+  mpsc_queue_push(&journal->queue, &record->node);
+
+#ifdef HAVE_EVENTFD
+  /* Pairs with the fence in wait_for_records() */
+  atomic_fence();
+  if (atomic_load_int(&journal->writer_waiting)
+      && atomic_exchange_int(&journal->writer_waiting, 0)) {
+    wake_writer(journal);
+  }
+#endif
+}
+
+/* Writes out everything appended so far and stops the writer thread */
+void journal_stop(struct journal *journal)
+{
+  atomic_store_int(&journal->stopping, 1);
+  wake_writer(journal);
+  join_thread(journal->thread);
+  if (journal->fd >= 0) {
+    if (journal->sync != JOURNAL_SYNC_NONE) {
+      sync_segment(journal);
+    }
+    close(journal->fd);
+    journal->fd = -1;
+  }
+}
@@ -0,0 +1,123 @@
+#ifndef EHLO_JOURNAL_H
+#define EHLO_JOURNAL_H
+
+/*
+ * Append-only journal of chat messages, kept as numbered segment files in
+ * a directory. Appending only pushes the record onto a lock-free queue and
+ * wakes up a writer thread if it's waiting. The writer takes everything
+ * queued so far, writes it with one call and, depending on the sync mode,
+ * flushes it to disk with one fsync for the whole batch. Records are
+ * handed back through the release callback once they're written (and
+ * synced), or right away if the queue is full; those never make it into
+ * the journal.
+ *
+ * A segment is sealed when it reaches the size limit, and every start of
+ * the writer begins a new one, so only the newest segment ever changes.
+ * The next segment always has the next index. Segments are read through
+ * mmap().
+ *
+ * A segment starts with a header:
+ *
+ *   char magic[8] ("EHLOJNL" and the format version)
+ *   uint32_t index
+ *   uint32_t reserved
+ *
+ * followed by records, all fields in network byte order:
+ *
+ *   uint32_t len (of the text)
+ *   uint32_t checksum (FNV-1a of everything after it up to the next record)
+ *   uint32_t seq
+ *   int32_t sender_id
+ *   uint32_t time_ms_high
+ *   uint32_t time_ms_low
+ *   uint16_t room
+ *   uint16_t reserved
+ *   char text[len]
+ *
+ * A record that is cut short or doesn't match its checksum ends the
+ * segment, as happens when the server dies halfway through a write.
+ */
+
+#include <stddef.h>
+#include "ehlo-queue.h"
+
+#define JOURNAL_SEGMENT_NAME_FORMAT "segment-%08lu.log"
+#define JOURNAL_SEGMENT_HEADER_LEN 16
+#define JOURNAL_RECORD_HEADER_LEN 28
+
+enum journal_sync {
+  JOURNAL_SYNC_NONE,  /* leave flushing to the system */
+  JOURNAL_SYNC_BATCH, /* fsync once per batch of records */
+  JOURNAL_SYNC_ALWAYS /* fsync after every record */
+};
+
+struct journal_record {
+  struct mpsc_node node;
+  uint32_t seq;
+  int sender_id;
+  int room;
+  uint64_t time_ms;
+  const char *text;
+  int len;
+};
+
+typedef void (*journal_release_t)(struct journal_record *record);
+typedef void (*journal_handler_t)(const struct journal_record *record,
+                                  void *arg);
+
+struct journal {
+  char *dir;
+  enum journal_sync sync;
+  size_t segment_size;
+  journal_release_t release;
+  /* Segments found when the journal was opened, oldest first */
+  unsigned long *segments;
+  int num_segments;
+  struct mpsc_queue queue;
+  uint64_t num_pushed;
+  uint64_t num_taken; /* written by the writer only */
+#ifdef HAVE_EVENTFD
+  int wake_fd;
+  int writer_waiting;
+#endif
+  /* Owned by the writer thread */
+  int fd;
+  unsigned long index;
+  size_t size;
+  char *buf;
+  struct journal_record **batch;
+  int stopping;
+  thread_t thread;
+  /* Statistics, readable from any thread */
+  uint64_t num_records;
+  uint64_t num_syncs;
+  uint64_t num_errors;
+  uint64_t num_dropped;
+};
+
+/* A segment mapped into memory */
+struct journal_segment {
+  const char *data;
+  size_t size;
+};
+
+int journal_open(struct journal *journal,
+                 const char *dir,
+                 enum journal_sync sync,
+                 size_t segment_size,
+                 journal_release_t release);
+int journal_replay(struct journal *journal,
+                   int max_records,
+                   journal_handler_t handler,
+                   void *arg);
+int journal_start(struct journal *journal);
+void journal_append(struct journal *journal, struct journal_record *record);
+void journal_stop(struct journal *journal);
+
+int journal_map_segment(const char *path, struct journal_segment *segment);
+void journal_unmap_segment(struct journal_segment *segment);
+int journal_next_record(const struct journal_segment *segment,
+                        size_t *offset,
+                        struct journal_record *record);
+
+#endif /* EHLO_JOURNAL_H */
@@ -0,0 +1,442 @@
+#include <stdlib.h>
+#include <time.h>
+#ifdef _WIN32
+  #include <fcntl.h>
+  #include <io.h>
+#endif
+#include "ehlo-shared.h"
+#include "ehlo-log.h"
+
+/*
+ * Threads start with a small ring which is replaced by one twice as big
+ * whenever it fills up, until the maximum size is reached. Sizes must be
+ * powers of two.
+ */
+#define LOG_MIN_RING_SIZE 64
+#define LOG_MAX_RING_SIZE 8192
+#define LOG_MAX_TEXT 224 /* longer lines are truncated */
+#define LOG_IDLE_SLEEP_MS 10
+
+struct log_record {
+  uint64_t time_ms;
+  int level;
+  int kind;
+  int sender_id;
+  int len;
+  char text[LOG_MAX_TEXT];
+};
+
+struct log_ring {
+  struct log_ring *next;
+  unsigned size;
+  unsigned head; /* next record to fill, owned by the logging thread */
+  unsigned tail; /* next record to write out, owned by the writer */
+  int closed;    /* set when the thread exits or moves to a bigger ring */
+  struct log_record records[1];
+};
+
+static int log_started;
+static enum log_level min_level = LOG_INFO;
+static enum log_format log_format;
+static uint64_t dropped;
+static uint64_t reported_dropped;
+
+/*
+ * Protects the list of rings and serializes writing records out. New rings
+ * go to the end of the list so that a thread's old ring is written out
+ * before the one that replaced it.
+ */
+static mutex_t rings_lock;
+static struct log_ring *rings;
+static struct log_ring **rings_tail = &rings;
+
+#ifdef _WIN32
+  static DWORD ring_key;
+#else
+  static pthread_key_t ring_key;
+#endif
+
+/* Called when a thread exits, the writer frees its ring once it's drained */
+#ifdef _WIN32
+static void WINAPI release_thread_ring(void *arg)
+#else
+static void release_thread_ring(void *arg)
+#endif
+{
+  struct log_ring *ring = arg;
+
+  if (ring != NULL) {
+    atomic_store_release(&ring->closed, 1);
+  }
+}
+
+static struct log_ring *get_thread_ring(void)
+{
+#ifdef _WIN32
+  return FlsGetValue(ring_key);
+#else
+  return pthread_getspecific(ring_key);
+#endif
+}
+
+/*
+ * Gives the calling thread a new ring of the given size. The old one, if
+ * any, is freed by the writer once it has been drained. Returns NULL if
+ * there's not enough memory.
+ */
+static struct log_ring *replace_thread_ring(struct log_ring *old_ring,
+                                            unsigned size)
+{
+  struct log_ring *ring;
+
+  ring = malloc(sizeof(*ring) + (size - 1) * sizeof(struct log_record));
+  if (ring == NULL) {
+    return NULL;
+  }
+  ring->next = NULL;
+  ring->size = size;
+  ring->head = 0;
+  ring->tail = 0;
+  ring->closed = 0;
+#ifdef _WIN32
+  FlsSetValue(ring_key, ring);
+#else
+  pthread_setspecific(ring_key, ring);
+#endif
+
+  lock_mutex(&rings_lock);
+  *rings_tail = ring;
+  rings_tail = &ring->next;
+  unlock_mutex(&rings_lock);
+
+  if (old_ring != NULL) {
+    atomic_store_release(&old_ring->closed, 1);
+  }
+  return ring;
+}
+
+static int is_ring_full(struct log_ring *ring)
+{
+  return ring->head - atomic_load_acquire(&ring->tail) >= ring->size;
+}
+
+/*
+ * Returns the next free record of the calling thread's ring or NULL if it's
+ * full. The record is handed to the writer by commit_record().
+ */
+static struct log_record *begin_record(struct log_ring **ring_ptr,
+                                       enum log_level level,
+                                       int kind)
+{
+  struct log_ring *ring;
+  struct log_record *record;
+
+  ring = get_thread_ring();
+  if (ring == NULL) {
+    ring = replace_thread_ring(NULL, LOG_MIN_RING_SIZE);
+  } else if (is_ring_full(ring) && ring->size < LOG_MAX_RING_SIZE) {
+    ring = replace_thread_ring(ring, ring->size * 2);
+  }
+  if (ring == NULL || is_ring_full(ring)) {
+    atomic_add_u64(&dropped, 1);
+    return NULL;
+  }
+
+  record = &ring->records[ring->head & (ring->size - 1)];
+  record->time_ms = get_wall_time_ms();
+  record->level = level;
+  record->kind = kind;
+  record->sender_id = 0;
+  *ring_ptr = ring;
+  return record;
+}
+
+static void commit_record(struct log_ring *ring)
+{
+  atomic_store_release(&ring->head, ring->head + 1);
+}
+
+static void write_record(const struct log_record *record)
+{
+  char header[LOG_RECORD_HEADER_LEN];
+  uint32_t value;
+  uint16_t len;
+  FILE *file;
+
+  if (log_format == LOG_FORMAT_BINARY) {
+    value = htonl((uint32_t)(record->time_ms >> 32));
+    memcpy(header, &value, 4);
+    value = htonl((uint32_t)record->time_ms);
+    memcpy(header + 4, &value, 4);
+    header[8] = (char)record->level;
+    header[9] = (char)record->kind;
+    len = htons((uint16_t)record->len);
+    memcpy(header + 10, &len, 2);
+    value = htonl((uint32_t)record->sender_id);
+    memcpy(header + 12, &value, 4);
+    fwrite(header, 1, sizeof(header), stdout);
+    fwrite(record->text, 1, record->len, stdout);
+    return;
+  }
+
+  file = record->level >= LOG_WARNING ? stderr : stdout;
+  if (record->kind == LOG_RECORD_MESSAGE) {
+    if (record->sender_id == EHLO_SERVER_ID) {
+      fprintf(file, "[server]: %.*s\n", record->len, record->text);
+    } else {
+      fprintf(file,
+              "[%d]: %.*s\n",
+              record->sender_id,
+              record->len,
+              record->text);
+    }
+  } else {
+    fprintf(file, "%.*s\n", record->len, record->text);
+  }
+}
+
+/* Writes out everything in the ring. Returns the number of records. */
+static int drain_ring(struct log_ring *ring)
+{
+  unsigned head = atomic_load_acquire(&ring->head);
+  unsigned tail;
+  int count = (int)(head - ring->tail);
+
+  for (tail = ring->tail; tail != head; tail++) {
+    write_record(&ring->records[tail & (ring->size - 1)]);
+  }
+  atomic_store_release(&ring->tail, tail);
+  return count;
+}
+
+/* Writes a warning if records were dropped since the last call */
+static int report_dropped(void)
+{
+  struct log_record record;
+  uint64_t total = atomic_load_u64(&dropped);
+
+  if (total == reported_dropped) {
+    return 0;
+  }
+  record.time_ms = get_wall_time_ms();
+  record.level = LOG_WARNING;
+  record.kind = LOG_RECORD_TEXT;
+  record.sender_id = 0;
+  record.len = snprintf(record.text,
+                        sizeof(record.text),
+                        "%llu log messages were dropped",
+                        (unsigned long long)(total - reported_dropped));
+  write_record(&record);
+  reported_dropped = total;
+  return 1;
+}
+
+/*
+ * Writes out the records of every thread and frees the rings of threads
+ * that have exited. Must be called with rings_lock held. Returns the
+ * number of records written.
+ */
+static int drain_rings(void)
+{
+  struct log_ring **link = &rings;
+  struct log_ring *ring;
+  int closed;
+  int count = 0;
+
+  while (*link != NULL) {
+    ring = *link;
+    /* Everything logged before the thread exited is visible after this */
+    closed = atomic_load_acquire(&ring->closed);
+    count += drain_ring(ring);
+    if (closed) {
+      *link = ring->next;
+      if (rings_tail == &ring->next) {
+        rings_tail = link;
+      }
+      free(ring);
+    } else {
+      link = &ring->next;
+    }
+  }
+
+  count += report_dropped();
+  if (count > 0) {
+    fflush(stdout);
+    fflush(stderr);
+  }
+  return count;
+}
+
+static void *writer_thread(void *arg)
+{
+  int count;
+
+  (void)arg;
+
+  for (;;) {
+    lock_mutex(&rings_lock);
+    count = drain_rings();
+    unlock_mutex(&rings_lock);
+    if (count == 0) {
+      sleep_ms(LOG_IDLE_SLEEP_MS);
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Starts the writer thread. Records below the given level are discarded
+ * without being formatted. Returns 0 or an error code.
+ */
+int log_start(enum log_level level, enum log_format format)
+{
+  thread_t thread;
+  int error;
+
+  min_level = level;
+  log_format = format;
+
+  error = create_mutex(&rings_lock);
+  if (error != 0) {
+    return error;
+  }
+#ifdef _WIN32
+  ring_key = FlsAlloc(release_thread_ring);
+  if (ring_key == FLS_OUT_OF_INDEXES) {
+    return GetLastError();
+  }
+  if (format == LOG_FORMAT_BINARY) {
+    _setmode(_fileno(stdout), _O_BINARY);
+  }
+#else
+  error = pthread_key_create(&ring_key, release_thread_ring);
+  if (error != 0) {
+    return error;
+  }
+#endif
+
+  error = create_thread(&thread, writer_thread, NULL);
+  if (error != 0) {
+    return error;
+  }
+  atexit(log_flush);
+  atomic_store_release(&log_started, 1);
+  return 0;
+}
+
+/* Writes out everything logged so far */
+void log_flush(void)
+{
+  if (!atomic_load_acquire(&log_started)) {
+    fflush(stdout);
+    return;
+  }
+  lock_mutex(&rings_lock);
+  drain_rings();
+  unlock_mutex(&rings_lock);
+}
+
+int log_enabled(enum log_level level)
+{
+  return level >= min_level;
+}
+
+uint64_t log_get_dropped(void)
+{
+  return atomic_load_u64(&dropped);
+}
+
+static void log_vwrite(enum log_level level, const char *format, va_list args)
+{
+  struct log_ring *ring;
+  struct log_record *record;
+  char text[LOG_MAX_TEXT];
+
+  if (level < min_level) {
+    return;
+  }
+
+  if (!atomic_load_acquire(&log_started)) {
+    vsnprintf(text, sizeof(text), format, args);
+    fprintf_locked(level >= LOG_WARNING ? stderr : stdout, "%s\n", text);
+    return;
+  }
+
+  record = begin_record(&ring, level, LOG_RECORD_TEXT);
+  if (record == NULL) {
+    return;
+  }
+  record->len = vsnprintf(record->text, sizeof(record->text), format, args);
+  if (record->len < 0) {
+    record->len = 0;
+  } else if (record->len >= (int)sizeof(record->text)) {
+    record->len = sizeof(record->text) - 1;
+  }
+  commit_record(ring);
+}
+
+void log_debug(const char *format, ...)
+{
+  va_list args;
+
+  va_start(args, format);
+  log_vwrite(LOG_DEBUG, format, args);
+  va_end(args);
+}
+
+void log_info(const char *format, ...)
+{
+  va_list args;
+
+  va_start(args, format);
+  log_vwrite(LOG_INFO, format, args);
+  va_end(args);
+}
+
+void log_warning(const char *format, ...)
+{
+  va_list args;
+
+  va_start(args, format);
+  log_vwrite(LOG_WARNING, format, args);
+  va_end(args);
+}
+
+void log_error(const char *format, ...)
+{
+  va_list args;
+
+  va_start(args, format);
+  log_vwrite(LOG_ERROR, format, args);
+  va_end(args);
+}
+
+/* Logs a chat message, it's copied as is and formatted by the writer */
+void log_message(int sender_id, const char *text, int len)
+{
+  struct log_ring *ring;
+  struct log_record *record;
+
+  if (LOG_INFO < min_level) {
+    return;
+  }
+
+  if (!atomic_load_acquire(&log_started)) {
+    if (sender_id == EHLO_SERVER_ID) {
+      printf_locked("[server]: %.*s\n", len, text);
+    } else {
+      printf_locked("[%d]: %.*s\n", sender_id, len, text);
+    }
+    return;
+  }
+
+  record = begin_record(&ring, LOG_INFO, LOG_RECORD_MESSAGE);
+  if (record == NULL) {
+    return;
+  }
+  record->sender_id = sender_id;
+  record->len = len < LOG_MAX_TEXT ? len : LOG_MAX_TEXT;
+  memcpy(record->text, text, record->len);
+  commit_record(ring);
+}
@@ -0,0 +1,55 @@
+#ifndef EHLO_LOG_H
+#define EHLO_LOG_H
+
+/*
+ * Asynchronous logging. Each thread that logs gets its own ring of records
+ * which only it writes to, so logging takes no locks and does no stdio:
+ * a background thread drains the rings in batches and writes the records
+ * out. Records that don't fit in a full ring are dropped and counted.
+ *
+ * Chat messages are copied raw and only formatted by the writer thread.
+ * In binary format nothing is formatted at all; every record is written
+ * as a header (see below) followed by its text:
+ *
+ *   uint64_t time_ms (since the Unix epoch)
+ *   uint8_t level
+ *   uint8_t kind (LOG_RECORD_*)
+ *   uint16_t len
+ *   int32_t sender_id (chat messages only)
+ *
+ * Until log_start() is called everything is printed right away.
+ */
+
+#include <stdint.h>
+
+enum log_level {
+  LOG_DEBUG,
+  LOG_INFO,
+  LOG_WARNING, /* warnings and errors go to stderr in text format */
+  LOG_ERROR
+};
+
+enum log_format {
+  LOG_FORMAT_TEXT,
+  LOG_FORMAT_BINARY
+};
+
+enum {
+  LOG_RECORD_TEXT,
+  LOG_RECORD_MESSAGE
+};
+
+#define LOG_RECORD_HEADER_LEN 16
+
+int log_start(enum log_level level, enum log_format format);
+void log_flush(void);
+int log_enabled(enum log_level level);
+uint64_t log_get_dropped(void);
+
+void log_debug(const char *format, ...);
+void log_info(const char *format, ...);
+void log_warning(const char *format, ...);
+void log_error(const char *format, ...);
+void log_message(int sender_id, const char *text, int len);
+
+#endif /* EHLO_LOG_H */
@@ -0,0 +1,156 @@
+#include "ehlo-shared.h"
+#include "ehlo-metrics.h"
+
+struct metric_info {
+  const char *name;
+  const char *help;
+};
+
+static const struct metric_info counter_info[NUM_METRIC_COUNTERS] = {
+  {"ehlo_connections_accepted_total", "Connections accepted"},
+  {"ehlo_connections_rejected_total",
+   "Connections turned away by admission control"},
+  {"ehlo_messages_received_total", "Frames and legacy commands received"},
+  {"ehlo_messages_sent_total", "Messages written to clients"},
+  {"ehlo_received_bytes_total", "Bytes of commands received"},
+  {"ehlo_sent_bytes_total", "Bytes written to clients"},
+  {"ehlo_broadcasts_total", "Messages broadcast"},
+  {"ehlo_send_calls_total", "Calls made to write to clients"},
+  {"ehlo_messages_dropped_total", "Messages dropped from full queues"},
+  {"ehlo_ring_submits_total", "io_uring submissions"}
+};
+
+static const struct metric_info gauge_info[NUM_METRIC_GAUGES] = {
+  {"ehlo_connections", "Connected clients"},
+  {"ehlo_queued_messages", "Messages waiting in client queues"},
+  {"ehlo_max_queue_depth", "Messages in the deepest client queue"},
+  {"ehlo_pooled_bytes", "Memory held by message and event pools"}
+};
+
+/* Values are divided by the scale, nanoseconds are shown in seconds */
+static const struct {
+  struct metric_info info;
+  double scale;
+} histogram_info[NUM_METRIC_HISTOGRAMS] = {
+  {{"ehlo_fan_out_seconds", "Time to deliver a message to a loop's clients"},
+   1e9},
+  {{"ehlo_queue_depth", "Client queue depth after adding a message"}, 1}
+};
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+void metrics_init(struct metrics *metrics, int shared)
+{
+  memset(metrics, 0, sizeof(*metrics));
+  metrics->shared = shared;
+}
+
+void metrics_record(struct metrics *metrics,
+                    enum metric_histogram histogram,
+                    uint64_t value)
+{
+  if (metrics->shared) {
+    histogram_add_shared(&metrics->histograms[histogram], value);
+  } else {
+    histogram_add(&metrics->histograms[histogram], value);
+  }
+}
+
+/* Adds the counters and histograms of other, which may be recorded to */
+void metrics_merge(struct metrics *metrics, const struct metrics *other)
+{
+  int i;
+
+  for (i = 0; i < NUM_METRIC_COUNTERS; i++) {
+    metrics->counters[i] += atomic_load_u64(&other->counters[i]);
+  }
+  for (i = 0; i < NUM_METRIC_HISTOGRAMS; i++) {
+    histogram_merge(&metrics->histograms[i], &other->histograms[i]);
+  }
+}
+
+/* Appends to the text in buf, which is cut short if it doesn't fit */
+static void append_text(char *buf, int size, int *len, const char *format, ...)
+{
+  va_list args;
+  int result;
+
+  if (*len >= size - 1) {
+    return;
+  }
+  va_start(args, format);
+  result = vsnprintf(buf + *len, size - *len, format, args);
+  va_end(args);
+  if (result < 0 || result >= size - *len) {
+    *len = size - 1;
+  } else {
+    *len += result;
+  }
+}
+
+static void append_header(char *buf,
+                          int size,
+                          int *len,
+                          const struct metric_info *info,
+                          const char *type)
+{
+  append_text(buf, size, len, "# HELP %s %s\n", info->name, info->help);
+  append_text(buf, size, len, "# TYPE %s %s\n", info->name, type);
+}
+
+/*
+ * Writes the metrics in the Prometheus text exposition format, one line at
+ * a time. Returns the length of the text, which is always NUL-terminated.
+ */
+int metrics_format(const struct metrics *metrics, char *buf, int size)
+{
+  const struct histogram *histogram;
+  const char *name;
+  double scale;
+  int len = 0;
+  int i;
+  int j;
+
+  buf[0] = '\0';
+  for (i = 0; i < NUM_METRIC_COUNTERS; i++) {
+    append_header(buf, size, &len, &counter_info[i], "counter");
+    append_text(buf,
+                size,
+                &len,
+                "%s %llu\n",
+                counter_info[i].name,
+                (unsigned long long)metrics->counters[i]);
+  }
+  for (i = 0; i < NUM_METRIC_GAUGES; i++) {
+    append_header(buf, size, &len, &gauge_info[i], "gauge");
+    append_text(buf,
+                size,
+                &len,
+                "%s %llu\n",
+                gauge_info[i].name,
+                (unsigned long long)metrics->gauges[i]);
+  }
+  for (i = 0; i < NUM_METRIC_HISTOGRAMS; i++) {
+    histogram = &metrics->histograms[i];
+    name = histogram_info[i].info.name;
+    scale = histogram_info[i].scale;
+    append_header(buf, size, &len, &histogram_info[i].info, "summary");
+    for (j = 0; j < (int)(sizeof(quantiles) / sizeof(quantiles[0])); j++) {
+      append_text(buf,
+                  size,
+                  &len,
+                  "%s{quantile=\"%g\"} %g\n",
+                  name,
+                  quantiles[j],
+                  histogram_percentile(histogram, quantiles[j]) / scale);
+    }
+    append_text(buf, size, &len, "%s_sum %g\n", name, histogram->sum / scale);
+    append_text(buf,
+                size,
+                &len,
+                "%s_count %llu\n",
+                name,
+                (unsigned long long)histogram->total);
+  }
+  return len;
+}
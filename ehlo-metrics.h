@@ -0,0 +1,67 @@
+#ifndef EHLO_METRICS_H
+#define EHLO_METRICS_H
+
+/*
+ * Server metrics: counters, gauges and histograms. Every event loop records
+ * into its own block with plain stores, a block shared by several threads
+ * (thread mode) is created as shared and recorded into with atomic adds.
+ * Other threads read blocks at any time by merging them into a snapshot.
+ * Gauges are only filled in on snapshots.
+ */
+
+#include "ehlo-histogram.h"
+
+enum metric_counter {
+  METRIC_ACCEPTS,
+  METRIC_REJECTS,
+  METRIC_MESSAGES_IN,
+  METRIC_MESSAGES_OUT,
+  METRIC_BYTES_IN,
+  METRIC_BYTES_OUT,
+  METRIC_BROADCASTS,
+  METRIC_SEND_CALLS,
+  METRIC_DROPPED,
+  METRIC_RING_SUBMITS,
+  NUM_METRIC_COUNTERS
+};
+
+enum metric_gauge {
+  METRIC_CONNECTIONS,
+  METRIC_QUEUED_MESSAGES,
+  METRIC_MAX_QUEUE_DEPTH,
+  METRIC_POOLED_BYTES,
+  NUM_METRIC_GAUGES
+};
+
+enum metric_histogram {
+  METRIC_FAN_OUT_NS,  /* delivering a message to an event loop's clients */
+  METRIC_QUEUE_DEPTH, /* of a client's queue after adding a message */
+  NUM_METRIC_HISTOGRAMS
+};
+
+struct metrics {
+  int shared;
+  uint64_t counters[NUM_METRIC_COUNTERS];
+  uint64_t gauges[NUM_METRIC_GAUGES];
+  struct histogram histograms[NUM_METRIC_HISTOGRAMS];
+};
+
+/* Adds n to a counter, it's a macro so that recording stays inline */
+#define metrics_add(metrics, counter, n)                                   \
+  do {                                                                     \
+    uint64_t *counter_ = &(metrics)->counters[counter];                    \
+    if ((metrics)->shared) {                                               \
+      atomic_add_u64(counter_, (n));                                       \
+    } else {                                                               \
+      atomic_store_u64(counter_, *counter_ + (n));                         \
+    }                                                                      \
+  } while (0)
+
+void metrics_init(struct metrics *metrics, int shared);
+void metrics_record(struct metrics *metrics,
+                    enum metric_histogram histogram,
+                    uint64_t value);
+void metrics_merge(struct metrics *metrics, const struct metrics *other);
+int metrics_format(const struct metrics *metrics, char *buf, int size);
+
+#endif /* EHLO_METRICS_H */
@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include "ehlo-shared.h"
+#include "ehlo-nicks.h"
+
+#define NICK_TABLE_MIN_CAPACITY 64
+
+static int to_lower(int c)
+{
+  return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+/* FNV-1a of the lower case name */
+static uint32_t hash_name(const char *name, int len)
+{
+  uint32_t hash = 2166136261u;
+  int i;
+
+  for (i = 0; i < len; i++) {
+    hash ^= (uint32_t)to_lower((unsigned char)name[i]);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static int names_match(const char *stored, const char *name, int len)
+{
+  int i;
+
+  for (i = 0; i < len; i++) {
+    if (to_lower((unsigned char)stored[i])
+        != to_lower((unsigned char)name[i])) {
+      return 0;
+    }
+  }
+  return stored[len] == '\0';
+}
+
+/* Returns the entry holding the name or the empty entry where it would go */
+static struct nick_entry *find_entry(const struct nick_table *table,
+                                     const char *name,
+                                     int len,
+                                     uint32_t hash)
+{
+  uint32_t mask = (uint32_t)table->capacity - 1;
+  uint32_t index = hash & mask;
+  struct nick_entry *entry;
+
+  for (;;) {
+    entry = &table->entries[index];
+    if (entry->id < 0
+        || (entry->hash == hash && names_match(entry->name, name, len))) {
+      return entry;
+    }
+    index = (index + 1) & mask;
+  }
+}
+
+static int grow_table(struct nick_table *table)
+{
+  struct nick_entry *old_entries = table->entries;
+  struct nick_entry *entry;
+  int old_capacity = table->capacity;
+  int capacity;
+  int i;
+
+  capacity = old_capacity > 0 ? old_capacity * 2 : NICK_TABLE_MIN_CAPACITY;
+  table->entries = malloc(capacity * sizeof(*table->entries));
+  if (table->entries == NULL) {
+    table->entries = old_entries;
+    return ENOMEM;
+  }
+  for (i = 0; i < capacity; i++) {
+    table->entries[i].id = -1;
+  }
+  table->capacity = capacity;
+
+  for (i = 0; i < old_capacity; i++) {
+    if (old_entries[i].id >= 0) {
+      entry = find_entry(table,
+                         old_entries[i].name,
+                         (int)strlen(old_entries[i].name),
+                         old_entries[i].hash);
+      *entry = old_entries[i];
+    }
+  }
+  free(old_entries);
+  return 0;
+}
+
+void nick_table_init(struct nick_table *table)
+{
+  table->entries = NULL;
+  table->capacity = 0;
+  table->count = 0;
+}
+
+void nick_table_free(struct nick_table *table)
+{
+  free(table->entries);
+  nick_table_init(table);
+}
+
+/*
+ * Gives the name (at most EHLO_MAX_NICK_LEN bytes) to the client with the
+ * given ID. Returns 0, EEXIST if someone has the name already or ENOMEM.
+ */
+int nick_table_add(struct nick_table *table,
+                   const char *name,
+                   int len,
+                   int id)
+{
+  uint32_t hash = hash_name(name, len);
+  struct nick_entry *entry;
+  int error;
+
+  if ((table->count + 1) * 2 > table->capacity) {
+    error = grow_table(table);
+    if (error != 0) {
+      return error;
+    }
+  }
+  entry = find_entry(table, name, len, hash);
+  if (entry->id >= 0) {
+    return EEXIST;
+  }
+  entry->hash = hash;
+  entry->id = id;
+  memcpy(entry->name, name, len);
+  entry->name[len] = '\0';
+  table->count++;
+  return 0;
+}
+
+/* Returns the ID of the client with the name or -1 if there is none */
+int nick_table_find(const struct nick_table *table, const char *name, int len)
+{
+  if (table->count == 0 || len > EHLO_MAX_NICK_LEN) {
+    return -1;
+  }
+  return find_entry(table, name, len, hash_name(name, len))->id;
+}
+
+void nick_table_remove(struct nick_table *table, const char *name, int len)
+{
+  uint32_t mask = (uint32_t)table->capacity - 1;
+  struct nick_entry *hole;
+  struct nick_entry *entry;
+  uint32_t hole_index;
+  uint32_t index;
+  uint32_t home;
+
+  if (table->count == 0) {
+    return;
+  }
+  hole = find_entry(table, name, len, hash_name(name, len));
+  if (hole->id < 0) {
+    return;
+  }
+  hole->id = -1;
+  table->count--;
+
+  /*
+   * Move back every entry of the cluster that the hole now separates from
+   * its home position, so that lookups never stop short of it.
+   */
+  hole_index = (uint32_t)(hole - table->entries);
+  index = hole_index;
+  for (;;) {
+    index = (index + 1) & mask;
+    entry = &table->entries[index];
+    if (entry->id < 0) {
+      break;
+    }
+    home = entry->hash & mask;
+    if (((index - home) & mask) >= ((index - hole_index) & mask)) {
+      *hole = *entry;
+      entry->id = -1;
+      hole = entry;
+      hole_index = index;
+    }
+  }
+}
@@ -0,0 +1,36 @@
+#ifndef EHLO_NICKS_H
+#define EHLO_NICKS_H
+
+/*
+ * Index of nicknames to client IDs, so that a direct message finds its
+ * recipient with a single lookup. It's an open addressing table with
+ * linear probing, kept at most half full. Names are compared without
+ * regard to ASCII case and stored in the entries along with their hash,
+ * so a probe rarely has to look at a name that doesn't match. Removal
+ * shifts the following entries back instead of leaving tombstones.
+ */
+
+#include <stdint.h>
+
+struct nick_entry {
+  uint32_t hash;
+  int id; /* -1 for an empty entry */
+  char name[EHLO_MAX_NICK_LEN + 1];
+};
+
+struct nick_table {
+  struct nick_entry *entries;
+  int capacity; /* a power of two */
+  int count;
+};
+
+void nick_table_init(struct nick_table *table);
+void nick_table_free(struct nick_table *table);
+int nick_table_add(struct nick_table *table,
+                   const char *name,
+                   int len,
+                   int id);
+int nick_table_find(const struct nick_table *table, const char *name, int len);
+void nick_table_remove(struct nick_table *table, const char *name, int len);
+
+#endif /* EHLO_NICKS_H */
@@ -0,0 +1,87 @@
+#include <stdlib.h>
+#include "ehlo-shared.h"
+#include "ehlo-pool.h"
+
+/* Precedes every object, the queue node is only used while it's free */
+struct pool_object {
+  struct mpsc_node node;
+  struct pool *pool;
+};
+
+/* Keeps objects aligned for any member type */
+#define POOL_ALIGNMENT 16
+
+int pool_init(struct pool *pool, int object_size, int slab_objects, int locked)
+{
+  object_size += sizeof(struct pool_object);
+  pool->object_size =
+      (object_size + POOL_ALIGNMENT - 1) & ~(POOL_ALIGNMENT - 1);
+  pool->slab_objects = slab_objects;
+  pool->slab = NULL;
+  pool->slab_used = 0;
+  mpsc_queue_init(&pool->free_objects);
+  pool->locked = locked;
+  pool->num_slabs = 0;
+  pool->num_allocs = 0;
+  pool->num_frees = 0;
+  if (locked) {
+    return create_mutex(&pool->lock);
+  }
+  return 0;
+}
+
+/* Returns NULL if there's not enough memory for another slab */
+void *pool_alloc(struct pool *pool)
+{
+  struct pool_object *object;
+
+  if (pool->locked) {
+    lock_mutex(&pool->lock);
+  }
+
+  object = (struct pool_object *)mpsc_queue_pop(&pool->free_objects);
+  if (object == NULL) {
+    if (pool->slab == NULL || pool->slab_used == pool->slab_objects) {
+      pool->slab = malloc((size_t)pool->object_size * pool->slab_objects);
+      if (pool->slab == NULL) {
+        if (pool->locked) {
+          unlock_mutex(&pool->lock);
+        }
+        return NULL;
+      }
+      pool->slab_used = 0;
+      atomic_add_u64(&pool->num_slabs, 1);
+    }
+    object = (struct pool_object *)
+        (pool->slab + (size_t)pool->object_size * pool->slab_used++);
+    object->pool = pool;
+  }
+  atomic_add_u64(&pool->num_allocs, 1);
+
+  if (pool->locked) {
+    unlock_mutex(&pool->lock);
+  }
+  return object + 1;
+}
+
+void pool_free(void *ptr)
+{
+  struct pool_object *object = (struct pool_object *)ptr - 1;
+  struct pool *pool = object->pool;
+
+  atomic_add_u64(&pool->num_frees, 1);
+  mpsc_queue_push(&pool->free_objects, &object->node);
+}
+
+/* Adds the pool's numbers to stats */
+void pool_add_stats(struct pool *pool, struct pool_stats *stats)
+{
+  uint64_t slabs = atomic_load_u64(&pool->num_slabs);
+  uint64_t allocs = atomic_load_u64(&pool->num_allocs);
+  uint64_t frees = atomic_load_u64(&pool->num_frees);
+
+  stats->slabs += slabs;
+  stats->bytes += slabs * pool->slab_objects * pool->object_size;
+  stats->allocs += allocs;
+  stats->in_use += allocs > frees ? allocs - frees : 0;
+}
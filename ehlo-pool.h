@@ -0,0 +1,44 @@
+#ifndef EHLO_POOL_H
+#define EHLO_POOL_H
+
+/*
+ * Pool of fixed size objects carved out of larger slabs. A pool belongs to
+ * the thread that allocates from it, but objects may be freed by any
+ * thread: they go back through a lock-free queue that the owner takes them
+ * from again. Slabs are kept for the life of the pool, so once it has grown
+ * to the working set objects come and go without touching the heap. Pools
+ * live as long as the program.
+ *
+ * A pool shared by several allocating threads is created as locked, its
+ * allocations then take the pool's lock. Freeing is lock-free either way.
+ */
+
+#include "ehlo-queue.h"
+
+struct pool {
+  int object_size; /* including the header */
+  int slab_objects;
+  char *slab;      /* the newest slab */
+  int slab_used;   /* objects handed out from it */
+  struct mpsc_queue free_objects;
+  int locked;
+  mutex_t lock;
+  /* Statistics, readable from any thread */
+  uint64_t num_slabs;
+  uint64_t num_allocs;
+  uint64_t num_frees;
+};
+
+struct pool_stats {
+  uint64_t slabs;
+  uint64_t bytes;
+  uint64_t allocs;
+  uint64_t in_use;
+};
+
+int pool_init(struct pool *pool, int object_size, int slab_objects, int locked);
+void *pool_alloc(struct pool *pool);
+void pool_free(void *object);
+void pool_add_stats(struct pool *pool, struct pool_stats *stats);
+
+#endif /* EHLO_POOL_H */
@@ -0,0 +1,53 @@
+#include <stddef.h>
+#include "ehlo-shared.h"
+#include "ehlo-queue.h"
+
+void mpsc_queue_init(struct mpsc_queue *queue)
+{
+  queue->stub.next = NULL;
+  queue->head = &queue->stub;
+  queue->tail = &queue->stub;
+}
+
+void mpsc_queue_push(struct mpsc_queue *queue, struct mpsc_node *node)
+{
+  struct mpsc_node *prev;
+
+  node->next = NULL;
+  prev = atomic_exchange_ptr(&queue->head, node);
+  /* Until this store the node is unreachable from the consumer's side */
+  atomic_store_ptr(&prev->next, node);
+}
+
+/* Returns NULL if the queue is empty or the next push hasn't completed */
+struct mpsc_node *mpsc_queue_pop(struct mpsc_queue *queue)
+{
+  struct mpsc_node *tail = queue->tail;
+  struct mpsc_node *next = atomic_load_ptr(&tail->next);
+
+  if (tail == &queue->stub) {
+    if (next == NULL) {
+      return NULL;
+    }
+    queue->tail = next;
+    tail = next;
+    next = atomic_load_ptr(&tail->next);
+  }
+  if (next != NULL) {
+    queue->tail = next;
+    return tail;
+  }
+
+  if (tail != atomic_load_ptr(&queue->head)) {
+    return NULL;
+  }
+
+  /* The last node can't be popped while it's the head, queue the stub */
+  mpsc_queue_push(queue, &queue->stub);
+  next = atomic_load_ptr(&tail->next);
+  if (next != NULL) {
+    queue->tail = next;
+    return tail;
+  }
+  return NULL;
+}
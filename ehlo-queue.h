@@ -0,0 +1,25 @@
+#ifndef EHLO_QUEUE_H
+#define EHLO_QUEUE_H
+
+/*
+ * Intrusive lock-free queue with multiple producers and a single consumer.
+ * Pushing is wait-free: a single atomic exchange. The consumer may see
+ * the queue as empty while a push is still in progress; producers must
+ * therefore wake the consumer after pushing rather than before.
+ */
+
+struct mpsc_node {
+  struct mpsc_node *next;
+};
+
+struct mpsc_queue {
+  struct mpsc_node *head; /* last pushed node, shared by producers */
+  struct mpsc_node *tail; /* next node to pop, owned by the consumer */
+  struct mpsc_node stub;
+};
+
+void mpsc_queue_init(struct mpsc_queue *queue);
+void mpsc_queue_push(struct mpsc_queue *queue, struct mpsc_node *node);
+struct mpsc_node *mpsc_queue_pop(struct mpsc_queue *queue);
+
+#endif /* EHLO_QUEUE_H */
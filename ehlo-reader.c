@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "ehlo-shared.h"
+#include "ehlo-journal.h"
+
+/* How often a followed segment is checked for new records */
+#define FOLLOW_INTERVAL_MS 200
+
+static void print_record(const struct journal_record *record)
+{
+  time_t seconds = (time_t)(record->time_ms / 1000);
+  struct tm tm;
+  char time_str[32];
+
+  localtime_r(&seconds, &tm);
+  strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &tm);
+  printf("%lu [%s.%03d] %d",
+         (unsigned long)record->seq,
+         time_str,
+         (int)(record->time_ms % 1000),
+         record->sender_id);
+  if (record->room != EHLO_LOBBY_ROOM) {
+    printf(" #%d", record->room);
+  }
+  printf(": %.*s\n", record->len, record->text);
+}
+
+/*
+ * Returns the path of the segment that the journal writes after the one at
+ * path, or NULL if path isn't named like a segment
+ */
+static char *get_next_segment_path(const char *path)
+{
+  const char *name = strrchr(path, '/');
+  unsigned long index;
+  char *next_path;
+
+  name = name != NULL ? name + 1 : path;
+  if (sscanf(name, JOURNAL_SEGMENT_NAME_FORMAT, &index) != 1) {
+    return NULL;
+  }
+  if (asprintf(&next_path,
+               "%.*s" JOURNAL_SEGMENT_NAME_FORMAT,
+               (int)(name - path),
+               path,
+               index + 1) < 0) {
+    return NULL;
+  }
+  return next_path;
+}
+
+static int file_exists(const char *path)
+{
+  return path != NULL && access(path, F_OK) == 0;
+}
+
+/*
+ * Prints the records of a segment. When following, the segment is mapped
+ * again whenever it grows and records are printed as they're written.
+ * Once the writer has moved on to the next segment, that one is followed.
+ */
+static int read_segment(const char *path, int follow)
+{
+  struct journal_segment segment;
+  struct journal_record record;
+  size_t offset = JOURNAL_SEGMENT_HEADER_LEN;
+  size_t size = 0;
+  size_t corrupt_size = 0;
+  char *followed_path = NULL;
+  char *next_path = follow ? get_next_segment_path(path) : NULL;
+  int sealed = 0;
+  int result;
+  int error;
+
+  for (;;) {
+    /* Nothing is added to a segment after the next one exists */
+    sealed = file_exists(next_path);
+    error = journal_map_segment(path, &segment);
+    if (error != 0) {
+      fprintf(stderr, "%s: %s\n", path, error_to_str(error, NULL, 0));
+      break;
+    }
+    while ((result = journal_next_record(&segment, &offset, &record)) > 0) {
+      print_record(&record);
+    }
+    size = segment.size;
+    journal_unmap_segment(&segment);
+
+    /*
+     * A record being written may not add up yet, but if it still doesn't
+     * once the segment has stopped growing it never will
+     */
+    if (result < 0) {
+      if (!follow || sealed || size == corrupt_size) {
+        fprintf(stderr, "%s: corrupt record at offset %lu\n",
+                path,
+                (unsigned long)offset);
+        error = EINVAL;
+        break;
+      }
+      corrupt_size = size;
+    }
+    if (!follow) {
+      break;
+    }
+
+    if (sealed) {
+      free(followed_path);
+      followed_path = next_path;
+      path = followed_path;
+      next_path = get_next_segment_path(path);
+      offset = JOURNAL_SEGMENT_HEADER_LEN;
+      corrupt_size = 0;
+      continue;
+    }
+
+    fflush(stdout);
+    do {
+      sleep_ms(FOLLOW_INTERVAL_MS);
+      error = journal_map_segment(path, &segment);
+      if (error == 0) {
+        result = result < 0 || segment.size > size;
+        journal_unmap_segment(&segment);
+      }
+    } while (error == 0 && !result && !file_exists(next_path));
+  }
+
+  free(followed_path);
+  free(next_path);
+  return error;
+}
+
+static void print_usage(const char *program_name)
+{
+  fprintf(stderr,
+      "Usage: %s [options] <segment>...\n"
+      "Prints the messages in journal segments written by ehlo-server.\n"
+      "Options:\n"
+      "  --follow               keep printing messages as they are added to\n"
+      "                         the last segment and the ones after it\n",
+      program_name);
+}
+
+int main(int argc, char **argv)
+{
+  const char *program_name = get_program_name(argv[0]);
+  int follow = 0;
+  int first = 0;
+  int last = 0;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--follow") == 0) {
+      follow = 1;
+    } else if (argv[i][0] == '-' && argv[i][1] == '-') {
+      print_usage(program_name);
+      exit(EXIT_FAILURE);
+    } else {
+      if (first == 0) {
+        first = i;
+      }
+      last = i;
+    }
+  }
+
+  if (first == 0) {
+    print_usage(program_name);
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = first; i <= last; i++) {
+    if (argv[i][0] == '-' && argv[i][1] == '-') {
+      continue;
+    }
+    if (read_segment(argv[i], follow && i == last) != 0) {
+      exit(EXIT_FAILURE);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,213 @@
+#include <stdlib.h>
+#include "ehlo-registry.h"
+
+#define REGISTRY_MIN_SLOTS 64
+
+void registry_init(struct registry *registry, int max_entries)
+{
+  registry_init_range(registry, 0, max_entries);
+}
+
+/* Slots past REGISTRY_MAX_SLOTS are never handed out */
+void registry_init_range(struct registry *registry,
+                         int first_slot,
+                         int max_entries)
+{
+  registry->slots = NULL;
+  registry->first_slot = first_slot;
+  registry->num_slots = 0;
+  registry->max_slots = max_entries < REGISTRY_MAX_SLOTS - first_slot
+      ? max_entries
+      : REGISTRY_MAX_SLOTS - first_slot;
+  registry->free_head = -1;
+  registry->free_stale = 0;
+  registry->active = NULL;
+  registry->active_ids = NULL;
+  registry->num_active = 0;
+}
+
+void registry_destroy(struct registry *registry)
+{
+  free(registry->slots);
+  free(registry->active);
+  free(registry->active_ids);
+  registry_init_range(registry, registry->first_slot, registry->max_slots);
+}
+
+static int grow_registry(struct registry *registry)
+{
+  struct registry_slot *slots;
+  void **active;
+  int *active_ids;
+  int num_slots;
+  int i;
+
+  if (registry->num_slots >= registry->max_slots) {
+    return -1;
+  }
+  num_slots = registry->num_slots > 0
+      ? registry->num_slots * 2
+      : REGISTRY_MIN_SLOTS;
+  if (num_slots > registry->max_slots) {
+    num_slots = registry->max_slots;
+  }
+
+  slots = realloc(registry->slots, num_slots * sizeof(*slots));
+  if (slots == NULL) {
+    return -1;
+  }
+  registry->slots = slots;
+  active = realloc(registry->active, num_slots * sizeof(*active));
+  if (active == NULL) {
+    return -1;
+  }
+  registry->active = active;
+  active_ids = realloc(registry->active_ids, num_slots * sizeof(*active_ids));
+  if (active_ids == NULL) {
+    return -1;
+  }
+  registry->active_ids = active_ids;
+
+  /* Chain the new slots so that lower indices are handed out first */
+  for (i = num_slots - 1; i >= registry->num_slots; i--) {
+    slots[i].entry = NULL;
+    slots[i].generation = 0;
+    slots[i].next_free = registry->free_head;
+    slots[i].active_index = -1;
+    registry->free_head = i;
+  }
+  registry->num_slots = num_slots;
+  return 0;
+}
+
+/* Chains all free slots again, lower indices first */
+static void rebuild_free_list(struct registry *registry)
+{
+  int i;
+
+  registry->free_head = -1;
+  for (i = registry->num_slots - 1; i >= 0; i--) {
+    if (registry->slots[i].entry == NULL) {
+      registry->slots[i].next_free = registry->free_head;
+      registry->free_head = i;
+    }
+  }
+  registry->free_stale = 0;
+}
+
+static void activate_slot(struct registry *registry, int index, int id)
+{
+  struct registry_slot *slot = &registry->slots[index];
+
+  slot->next_free = -1;
+  slot->active_index = registry->num_active;
+  registry->active[registry->num_active] = slot->entry;
+  registry->active_ids[registry->num_active] = id;
+  registry->num_active++;
+}
+
+/* Returns the ID of the new entry or -1 if the registry is full */
+int registry_add(struct registry *registry, void *entry)
+{
+  struct registry_slot *slot;
+  int index;
+  int id;
+
+  if (registry->free_stale) {
+    rebuild_free_list(registry);
+  }
+  if (registry->free_head == -1 && grow_registry(registry) != 0) {
+    return -1;
+  }
+
+  index = registry->free_head;
+  slot = &registry->slots[index];
+  registry->free_head = slot->next_free;
+
+  id = (slot->generation << REGISTRY_SLOT_BITS)
+      | (registry->first_slot + index);
+  slot->entry = entry;
+  activate_slot(registry, index, id);
+
+  return id;
+}
+
+/*
+ * Adds the entry under an ID handed out before, by another process for
+ * example. The slot must be free. Returns 0 or -1 if the ID can't be used.
+ *
+ * The slot isn't taken off the free list, that would mean walking the
+ * list; the list is rebuilt by the next registry_add() instead.
+ */
+int registry_add_id(struct registry *registry, int id, void *entry)
+{
+  struct registry_slot *slot;
+  int index = registry_id_index(registry, id);
+
+  if (id < 0 || index < 0 || index >= registry->max_slots) {
+    return -1;
+  }
+  while (index >= registry->num_slots) {
+    if (grow_registry(registry) != 0) {
+      return -1;
+    }
+  }
+  slot = &registry->slots[index];
+  if (slot->entry != NULL) {
+    return -1;
+  }
+
+  slot->entry = entry;
+  slot->generation = id >> REGISTRY_SLOT_BITS;
+  activate_slot(registry, index, id);
+  registry->free_stale = 1;
+  return 0;
+}
+
+void registry_remove(struct registry *registry, int id)
+{
+  struct registry_slot *slot;
+  int index = registry_id_index(registry, id);
+  int last;
+
+  if (registry_lookup(registry, id) == NULL) {
+    return;
+  }
+  slot = &registry->slots[index];
+
+  /* Move the last active entry into the hole */
+  last = registry->num_active - 1;
+  if (slot->active_index != last) {
+    registry->active[slot->active_index] = registry->active[last];
+    registry->active_ids[slot->active_index] = registry->active_ids[last];
+    registry->slots[registry_id_index(registry, registry->active_ids[last])]
+        .active_index = slot->active_index;
+  }
+  registry->num_active--;
+
+  slot->entry = NULL;
+  slot->generation = (slot->generation + 1) & REGISTRY_GENERATION_MASK;
+  slot->active_index = -1;
+  slot->next_free = registry->free_head;
+  registry->free_head = index;
+}
+
+void *registry_lookup(const struct registry *registry, int id)
+{
+  const struct registry_slot *slot;
+  int index;
+
+  if (id < 0) {
+    return NULL;
+  }
+  index = registry_id_index(registry, id);
+  if (index < 0 || index >= registry->num_slots) {
+    return NULL;
+  }
+  slot = &registry->slots[index];
+  if (slot->entry == NULL
+      || slot->generation != (id >> REGISTRY_SLOT_BITS)) {
+    return NULL;
+  }
+  return slot->entry;
+}
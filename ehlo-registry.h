@@ -0,0 +1,57 @@
+#ifndef EHLO_REGISTRY_H
+#define EHLO_REGISTRY_H
+
+/*
+ * Registry of connected clients. IDs are made of a slot index and the
+ * generation of that slot, which changes every time the slot is freed, so
+ * an ID that outlives its client never resolves to the next client that
+ * gets the same slot. IDs are always non-negative.
+ *
+ * Free slots are kept in a list for O(1) allocation and active entries are
+ * also stored in a dense array so that iterating over them costs as much
+ * as the number of clients actually connected.
+ *
+ * A registry may number its slots from first_slot on, so that registries
+ * of different processes hand out IDs that never collide.
+ */
+
+#define REGISTRY_SLOT_BITS 20
+#define REGISTRY_MAX_SLOTS (1 << REGISTRY_SLOT_BITS)
+#define REGISTRY_GENERATION_MASK 0x7ff
+
+#define registry_id_slot(id) ((id) & (REGISTRY_MAX_SLOTS - 1))
+
+/* Position of an ID's slot in registry->slots */
+#define registry_id_index(registry, id) \
+    (registry_id_slot(id) - (registry)->first_slot)
+
+struct registry_slot {
+  void *entry;
+  int generation;
+  int next_free;    /* next free slot while this one is free */
+  int active_index; /* position in the dense array while used */
+};
+
+struct registry {
+  struct registry_slot *slots;
+  int first_slot;
+  int num_slots;
+  int max_slots;
+  int free_head;
+  int free_stale; /* entries were added without taking them off the list */
+  void **active;
+  int *active_ids;
+  int num_active;
+};
+
+void registry_init(struct registry *registry, int max_entries);
+void registry_init_range(struct registry *registry,
+                         int first_slot,
+                         int max_entries);
+void registry_destroy(struct registry *registry);
+int registry_add(struct registry *registry, void *entry);
+int registry_add_id(struct registry *registry, int id, void *entry);
+void registry_remove(struct registry *registry, int id);
+void *registry_lookup(const struct registry *registry, int id);
+
+#endif /* EHLO_REGISTRY_H */
@@ -1,266 +1,6474 @@
+#include <limits.h>
+#include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include "ehlo-shared.h"
+#include "ehlo-queue.h"
+#include "ehlo-registry.h"
+#include "ehlo-log.h"
+#include "ehlo-timer.h"
+#include "ehlo-idset.h"
+#include "ehlo-pool.h"
+#include "ehlo-metrics.h"
+#include "ehlo-federation.h"
+#include "ehlo-admission.h"
+#include "ehlo-nicks.h"
+#include "ehlo-epoch.h"
+#ifndef _WIN32
+  #include <netinet/tcp.h>
+  #include <sys/stat.h>
+  #include <sys/un.h>
+#endif
+#ifdef HAVE_EPOLL
+  #include <sched.h>
+  #include <sys/epoll.h>
+  #include <sys/eventfd.h>
+#endif
+#ifdef HAVE_IO_URING
+  #include "ehlo-uring.h"
+#endif
+#ifdef HAVE_ZLIB
+  #include "ehlo-deflate.h"
+#endif
+#ifdef HAVE_JOURNAL
+  #include "ehlo-journal.h"
+#endif
+#ifdef HAVE_SHM
+  #include "ehlo-shm.h"
+#endif
+#ifdef HAVE_HANDOFF
+  #include <sys/wait.h>
+  #include "ehlo-handoff.h"
+#endif
 
-static struct client {
+#define EVENT_LOOP_MAX_EVENTS 256
+
+/* Maximum number of connections taken from a listener at a time */
+#define MAX_ACCEPT_BATCH 64
+
+/* How often retired client lists and clients are freed in thread mode */
+#define RECLAIM_INTERVAL_MS 10
+
+/* Connections the kernel queues up before they are accepted */
+#define DEFAULT_LISTEN_BACKLOG 1024
+
+/* Source addresses tracked by admission control, see ehlo-admission.h */
+#define ADMISSION_ENTRIES 16384
+
+/* Maximum number of events taken from a shard's inbox at a time */
+#define MAX_INBOX_BATCH 256
+
+/* Number of messages or shard events allocated from the heap at a time */
+#define POOL_SLAB_OBJECTS 256
+
+/* Maximum number of queued messages written with a single call */
+#define MAX_WRITE_BATCH 64
+
+#define DEFAULT_QUEUE_LIMIT 1024
+
+/* Batched output is written out early once this much has piled up */
+#define DEFAULT_FLUSH_BYTES 16384
+
+#define DEFAULT_HISTORY_LIMIT 100
+
+/* Journal segments are sealed once they reach this size in MiB */
+#define DEFAULT_JOURNAL_SEGMENT_SIZE 64
+
+/* Room for the text exposition of the metrics */
+#define METRICS_TEXT_SIZE 8192
+
+/* How long the admin port waits for a request before answering anyway */
+#define ADMIN_REQUEST_TIMEOUT_MS 100
+
+#define DEFAULT_HEARTBEAT_INTERVAL 30
+#define DEFAULT_HEARTBEAT_TIMEOUT 90
+
+/* Resolution of the heartbeat timers in event mode */
+#define HEARTBEAT_TICK_MS 100
+
+/* Ring size and receive buffers of each io_uring event loop */
+#define URING_ENTRIES 1024
+#define URING_RECV_BUFFERS 1024
+#define URING_RECV_BUFFER_SIZE 4096
+#define URING_RECV_BUFFER_GROUP 0
+#define URING_SEND_BATCH 1024 /* IOV_MAX */
+
+/*
+ * How often a client thread checks for messages queued while its socket
+ * was not being watched for writability.
+ */
+#define QUEUE_CHECK_INTERVAL_MS 100
+
+/* How long either side of a hot upgrade waits for the other */
+#define HANDOFF_TIMEOUT_MS 10000
+
+/* Format of the state passed on by a hot upgrade, both sides must agree */
+#define HANDOFF_VERSION 2
+
+/* Where seq goes in a frame header, see encode_frame_header() */
+#define FRAME_SEQ_OFFSET 8
+
+/*
+ * Legacy message: command byte, client ID, text and the trailing NUL. The
+ * legacy client reads text and NUL into EHLO_MAX_MESSAGE_LEN bytes, so the
+ * text is cut one byte short of that.
+ */
+#define MAX_LEGACY_TEXT_LEN (EHLO_MAX_MESSAGE_LEN - 1)
+#define MAX_LEGACY_MESSAGE_LEN (1 + 2 + MAX_LEGACY_TEXT_LEN + 1)
+
+enum server_mode {
+  SERVER_MODE_THREAD,
+  SERVER_MODE_EVENT
+};
+
+/* How connections are spread across event loop threads */
+enum shard_balance {
+  BALANCE_REUSEPORT,   /* every shard listens, the kernel picks one */
+  BALANCE_LEAST_LOADED /* the first shard accepts and hands clients out */
+};
+
+enum io_backend {
+  IO_BACKEND_EPOLL,
+  IO_BACKEND_URING
+};
+
+/* What to do when a client's output queue reaches its limit */
+enum overflow_policy {
+  OVERFLOW_DROP_OLDEST,
+  OVERFLOW_DISCONNECT,
+  OVERFLOW_COALESCE
+};
+
+/*
+ * A message encoded once for each protocol and shared by all recipients.
+ * It's never modified after creation and goes back to the pool it came
+ * from when the last reference is released.
+ */
+struct message {
+  int refcount;
+  int room;
+  int sender_id;
+  int recipient_id; /* of a direct message */
+  uint32_t seq; /* number in the history or 0 */
+  int frame_len;
+  int legacy_len;
+  char frame[EHLO_MAX_FRAME_LEN];
+  char legacy[MAX_LEGACY_MESSAGE_LEN];
+#ifdef HAVE_ZLIB
+  /* The frame with a compressed payload, if anyone could use it */
+  int deflated_len;
+  char deflated[EHLO_MAX_FRAME_LEN];
+#endif
+#ifdef HAVE_JOURNAL
+  /* History messages hold a reference while they wait for the journal */
+  struct journal_record journal_record;
+#endif
+  /* Lobby messages hold a reference while they wait to be relayed */
+  struct relay_record relay_record;
+};
+
+struct client {
   int id;
   socket_t sock;
+  int protocol;
+  int caps; /* EHLO_CAP_* flags agreed on in the handshake */
+  int local; /* connected through the Unix domain socket */
+  int joined;
+  /* Another node of the cluster, see handle_peer() */
+  int peer;
+  int peer_node;
+  uint32_t peer_seq; /* of the last message relayed over the link */
+  struct id_set rooms; /* rooms joined besides the lobby */
+  char nick[EHLO_MAX_NICK_LEN + 1]; /* empty if the client has none */
+  /* Event loop that owns the client and its ID in that loop's own list */
+  struct shard *shard;
+  int local_id;
+  /*
+   * Buffers are allocated only while there is a partial message or unsent
+   * data so that idle connections stay small.
+   */
+  struct recv_buffer in;
+  /*
+   * Output queue, a bounded ring of message references. In thread mode it
+   * is protected by out_lock because any client's thread may broadcast.
+   */
+  mutex_t out_lock;
+  struct message **out_queue;
+  int out_head;
+  int out_count;
+  int out_capacity;
+  int out_offset; /* bytes of the first queued message already sent */
+  int out_pinned; /* messages handed to the kernel that can't be dropped */
+  int out_overflowed;
+  int out_max_count;
+  uint64_t out_dropped;
+  uint64_t out_dropped_reported;
+  int write_blocked;
+  /* History queued on joining, the same messages may still be on the way */
+  uint32_t replay_seq;
+  int replay_count;
+  /* Batched output waiting for the end of the loop iteration or deadline */
+  int flush_pending;
+  int flush_len;           /* bytes queued since the client was scheduled */
+  uint64_t flush_deadline; /* in microseconds, 0 means right away */
+  struct client *flush_next;
+  /* Clients that haven't picked a protocol yet, ordered by deadline */
+  uint64_t hello_deadline;
+  struct client *hello_prev;
+  struct client *hello_next;
+  /*
+   * Heartbeats (framed clients only). The timer isn't moved on every read,
+   * it goes off at the earliest time a check could be due and the check
+   * works out the next one from last_recv_ms.
+   */
+  struct timer heartbeat_timer;
+  uint64_t last_recv_ms;
+  uint64_t ping_sent_ms;
+  /*
+   * Closed clients waiting to be freed at the end of a loop iteration, or
+   * in thread mode after the next grace period
+   */
+  struct client *closed_next;
+#ifdef HAVE_IO_URING
+  /* Requests that may still complete, the client is freed after them */
+  int uring_ops;
+  struct uring_send *uring_send;
+#endif
+#ifdef HAVE_SHM
+  /* Frames from a local client that negotiated "shm" come through here */
+  struct shm_ring ring;
+  int ring_watched;
+#endif
+#ifdef HAVE_HANDOFF
+  /* Handed over by the previous process, see resume_client() */
+  int restored;
+#endif
+};
+
+/*
+ * All connected clients, used to assign IDs and for statistics. It's only
+ * accessed under clients_lock. In event mode broadcasts go through each
+ * shard's own list of clients instead.
+ */
+static struct registry clients;
+static mutex_t clients_lock;
+
+/*
+ * Thread mode: a copy of the active clients that lobby broadcasts walk
+ * without taking clients_lock, so that client threads broadcasting at the
+ * same time don't wait for each other. Each change to the registry
+ * publishes a new copy. If a copy can't be allocated the list is NULL and
+ * broadcasts walk the registry under the lock instead.
+ *
+ * Replaced lists and closed clients may still be in use by a broadcast, so
+ * they're retired rather than freed. reclaim_thread() frees whatever has
+ * been retired in one go after each grace period, so that connecting and
+ * disconnecting never wait for broadcasts to finish.
+ */
+struct client_list {
+  struct client_list *next_retired;
+  int num_clients;
+  struct client *clients[1];
+};
+
+static struct client_list *client_list;
+static struct epoch client_list_epoch;
+static struct client_list *retired_lists;
+static struct client *retired_clients; /* linked through closed_next */
+static mutex_t retired_lock;
+
+/*
+ * Rooms other than the lobby, by number. They're created by the first JOIN
+ * and go away when the last member leaves. Names are only looked up when
+ * joining, so a linear search under rooms_lock is enough.
+ */
+struct room {
+  int num_members;
+  char name[EHLO_MAX_ROOM_NAME_LEN + 1];
+};
+
+static struct room *rooms[EHLO_MAX_ROOMS];
+static int next_room_id = EHLO_LOBBY_ROOM + 1;
+static mutex_t rooms_lock;
+
+/*
+ * Registry slots of the members of each room, so that messages for a room
+ * only visit its members. In event mode every shard keeps its own index for
+ * its clients, this one is used in thread mode under clients_lock.
+ */
+static struct id_set *room_members;
+
+/* Nicknames of the clients that have one, protected by nicks_lock */
+static struct nick_table nicks;
+static mutex_t nicks_lock;
+
+/*
+ * Messages created by client threads or restored from the journal, event
+ * loops have their own pools.
+ */
+static struct pool message_pool;
+
+/* Recorded to by all client threads, event loops have their own metrics */
+static struct metrics thread_metrics;
+
+#ifdef HAVE_ZLIB
+/*
+ * Messages are compressed only while some client has asked for it. Client
+ * threads share a codec, event loops have their own.
+ */
+static int compress_min_len = DEFLATE_DEFAULT_MIN_LEN;
+static int num_deflate_clients;
+static struct deflate_codec thread_codec;
+static mutex_t thread_codec_lock;
+#endif
+
+#ifdef HAVE_EPOLL
+
+/*
+ * An event loop running in its own thread with its own clients. Other
+ * shards talk to it only through its inbox.
+ */
+struct shard {
+  int index;
+  int event_fd;
+  int wake_fd;
+  int wake_pending;
+  socket_t server_sock;
+  socket_t local_sock; /* the Unix domain socket, first shard only */
+  struct mpsc_queue inbox;
+  struct registry clients;
+  struct id_set *room_members; /* local IDs of members, by room */
+  struct pool message_pool;
+  struct pool event_pool;      /* for events posted to other shards */
+  struct metrics metrics;
+#ifdef HAVE_ZLIB
+  struct deflate_codec codec;
+#endif
+  int num_clients;
+  struct client *hello_head;
+  struct client *hello_tail;
+  struct client *flush_head;
+  struct client *closed_head;
+  struct timer_wheel timers;
+  int frozen; /* for a hot upgrade, see freeze_shard() */
+#ifdef HAVE_IO_URING
+  int uring_enabled;
+  struct uring ring;
+  struct uring_buf_ring recv_bufs;
+  int uring_polls; /* multishot accepts and wakeup polls in flight */
+#endif
+};
+
+enum {
+  SHARD_EVENT_BROADCAST,
+  SHARD_EVENT_CLIENT,
+  SHARD_EVENT_DIRECT
+};
+
+struct shard_event {
+  struct mpsc_node node;
+  int type;
+  struct message *message;
+  struct client *client;
+};
+
+#endif /* HAVE_EPOLL */
+
+#ifdef HAVE_IO_URING
+
+/* What a completion is for, stored in the low bits of its user data */
+enum {
+  URING_OP_ACCEPT = 1,
+  URING_OP_WAKE,
+  URING_OP_RECV,
+  URING_OP_SEND,
+  URING_OP_ACCEPT_LOCAL,
+  URING_OP_RING
+};
+
+#define URING_OP_MASK 7
+
+/* Arguments of a send in flight, they must stay put until it completes */
+struct uring_send {
+  struct msghdr msg;
+  io_vec_t vec[URING_SEND_BATCH];
+};
+
+#endif /* HAVE_IO_URING */
+
+#ifdef HAVE_SHM
+/* Ring wakeups are told apart from socket events by this bit of the data */
+#define RING_EVENT_TAG 1
+#endif
+
+#ifdef HAVE_EPOLL
+  static enum server_mode server_mode = SERVER_MODE_EVENT;
+  static struct shard *shards;
+  static int num_shards = 1;
+  static int pin_cpus;
+  #ifdef HAVE_IO_URING
+    static enum io_backend io_backend = IO_BACKEND_URING;
+  #endif
+  #ifdef SO_REUSEPORT
+    static enum shard_balance shard_balance = BALANCE_REUSEPORT;
+  #else
+    static enum shard_balance shard_balance = BALANCE_LEAST_LOADED;
+  #endif
+#else
+  static enum server_mode server_mode = SERVER_MODE_THREAD;
+#endif
+
+static int batch_writes;
+static int flush_delay_us;
+static int flush_bytes = DEFAULT_FLUSH_BYTES;
+static int max_clients = EHLO_MAX_CLIENTS;
+static int listen_backlog = DEFAULT_LISTEN_BACKLOG;
+/* Connections per second and burst allowed from one address, 0 is no limit */
+static int accept_rate;
+static int accept_burst;
+static struct admission admission;
+static int queue_limit = DEFAULT_QUEUE_LIMIT;
+static enum overflow_policy overflow_policy = OVERFLOW_DROP_OLDEST;
+static int stats_interval;
+static const char *admin_port;
+static socket_t admin_sock = INVALID_SOCKET;
+#ifndef _WIN32
+/* Local clients can also connect through a Unix domain socket here */
+static const char *local_path;
+static socket_t local_sock = INVALID_SOCKET;
+#endif
+static uint64_t heartbeat_interval_ms = DEFAULT_HEARTBEAT_INTERVAL * 1000;
+static uint64_t heartbeat_timeout_ms = DEFAULT_HEARTBEAT_TIMEOUT * 1000;
+static int history_limit = DEFAULT_HISTORY_LIMIT;
+static uint64_t history_age_ms;
+
+/*
+ * Cluster membership. Every node hands out client IDs from its own range of
+ * max_clients registry slots, so IDs are unique across the cluster as long
+ * as all nodes use the same limit.
+ */
+static int node_id = -1;
+static struct federation federation;
+
+#ifdef HAVE_HANDOFF
+
+/*
+ * Hot upgrade. SIGUSR2 makes the server start a new instance of itself,
+ * freeze its event loops and pass the listeners, the rooms, the history
+ * and every client over to it, see upgrade_server(). The new process gets
+ * the channel as --inherit-fd and picks up where this one stopped.
+ */
+enum upgrade_stage {
+  UPGRADE_IDLE,
+  UPGRADE_FREEZING
+};
+
+static char **server_argv;
+static int upgrade_fd = -1; /* written by the signal handler */
+static int frozen_fd = -1;  /* written by the last shard to freeze */
+static int upgrade_stage = UPGRADE_IDLE;
+static int num_quiet_shards;
+static int num_frozen_shards;
+
+/* What the new process got from the old one until the shards are up */
+static socket_t inherit_sock = INVALID_SOCKET;
+static socket_t *inherited_listeners; /* one for each shard */
+
+struct restored_client {
+  struct client *client;
+  int shard;
+};
+
+static struct restored_client *restored_clients;
+static int num_restored_clients;
+
+#endif /* HAVE_HANDOFF */
+
+#ifdef HAVE_JOURNAL
+/* Keeps the history across restarts if a directory is given */
+static const char *journal_dir;
+static enum journal_sync journal_sync = JOURNAL_SYNC_BATCH;
+static size_t journal_segment_size =
+    (size_t)DEFAULT_JOURNAL_SEGMENT_SIZE << 20;
+static struct journal journal;
+#endif
+
+/*
+ * Recent lobby messages from clients, replayed to everyone who joins. The
+ * ring holds references to the messages as they were encoded for the
+ * broadcast, so a replay queues the very same frames again. Numbers have
+ * no gaps, the oldest entry is last_seq - count + 1.
+ */
+struct history_entry {
+  struct message *message;
+  uint64_t time_ms;
+};
+
+static struct {
+  struct history_entry *entries; /* history_limit of them */
+  int head;
+  int count;
+  uint32_t last_seq;
+} history;
+static mutex_t history_lock;
+
+/* Returns the pool for messages created by the given event loop or thread */
+static struct pool *get_message_pool(struct shard *shard)
+{
+#ifdef HAVE_EPOLL
+  if (shard != NULL) {
+    return &shard->message_pool;
+  }
+#else
+  (void)shard;
+#endif
+  return &message_pool;
+}
+
+/* Returns the metrics recorded to by the given event loop or thread */
+static struct metrics *get_metrics(struct shard *shard)
+{
+#ifdef HAVE_EPOLL
+  if (shard != NULL) {
+    return &shard->metrics;
+  }
+#else
+  (void)shard;
+#endif
+  return &thread_metrics;
+}
+
+#ifdef HAVE_ZLIB
+
+/* Returns the codec of the given event loop or thread, ready for use */
+static struct deflate_codec *lock_codec(struct shard *shard)
+{
+#ifdef HAVE_EPOLL
+  if (shard != NULL) {
+    return &shard->codec;
+  }
+#endif
+  lock_mutex(&thread_codec_lock);
+  return &thread_codec;
+}
+
+static void unlock_codec(struct shard *shard)
+{
+  if (shard == NULL) {
+    unlock_mutex(&thread_codec_lock);
+  }
+}
+
+/* Adds the compressed frame if compression makes the payload shorter */
+static void deflate_message(struct shard *shard,
+                            struct message *message,
+                            const char *payload,
+                            int len)
+{
+  char *frame = message->deflated;
+  int deflated_len;
+
+  deflated_len = deflate_payload(lock_codec(shard),
+                                 payload,
+                                 len,
+                                 frame + EHLO_FRAME_HEADER_LEN);
+  unlock_codec(shard);
+  if (deflated_len > 0) {
+    encode_frame_header(frame,
+                        (uint8_t)message->frame[0],
+                        message->room,
+                        message->sender_id,
+                        message->seq,
+                        deflated_len);
+    set_frame_flags(frame, EHLO_FLAG_DEFLATE);
+    message->deflated_len = EHLO_FRAME_HEADER_LEN + deflated_len;
+  }
+}
+
+/*
+ * Decompresses a payload from the client into buf, which has room for
+ * EHLO_MAX_MESSAGE_LEN bytes. Returns its length or -1 if it's malformed.
+ */
+static int inflate_client_payload(struct client *client,
+                                  const char *payload,
+                                  int len,
+                                  char *buf)
+{
+  int result;
+
+  if (!(client->caps & EHLO_CAP_DEFLATE)) {
+    return -1;
+  }
+  result = inflate_payload(lock_codec(client->shard),
+                           payload,
+                           len,
+                           buf,
+                           EHLO_MAX_MESSAGE_LEN);
+  unlock_codec(client->shard);
+  return result;
+}
+
+#endif /* HAVE_ZLIB */
+
+/*
+ * Creates a message for the given event loop or thread (NULL). A message
+ * is compressed as well while any clients take compressed messages.
+ */
+static struct message *create_message(struct shard *shard,
+                                      int cmd,
+                                      int room,
+                                      int sender_id,
+                                      uint32_t seq,
+                                      const char *payload,
+                                      int len)
+{
+  struct message *message;
+  int16_t client_id;
+  int legacy_len;
+
+  message = pool_alloc(get_message_pool(shard));
+  if (message == NULL) {
+    return NULL;
+  }
+  message->refcount = 1;
+  message->room = room;
+  message->sender_id = sender_id;
+  message->seq = seq;
+
+  encode_frame_header(message->frame, cmd, room, sender_id, seq, len);
+  memcpy(message->frame + EHLO_FRAME_HEADER_LEN, payload, len);
+  message->frame_len = EHLO_FRAME_HEADER_LEN + len;
+
+  /*
+   * Legacy peers only understand messages, errors and direct messages are
+   * shown as such. They stay in the lobby, so nothing else has to be
+   * encoded for them.
+   */
+  message->legacy_len = 0;
+  if ((cmd == EHLO_CMD_MESSAGE
+       || cmd == EHLO_CMD_DIRECT
+       || cmd == EHLO_CMD_ERROR)
+      && room == EHLO_LOBBY_ROOM) {
+    if (cmd == EHLO_CMD_ERROR) {
+      sender_id = EHLO_SERVER_ID;
+    } else if (sender_id != EHLO_SERVER_ID
+               && (sender_id < 0 || sender_id >= EHLO_LEGACY_UNKNOWN_ID)) {
+      sender_id = EHLO_LEGACY_UNKNOWN_ID;
+    }
+    legacy_len = len < MAX_LEGACY_TEXT_LEN ? len : MAX_LEGACY_TEXT_LEN;
+    client_id = htons((int16_t)sender_id);
+    message->legacy[0] = EHLO_CMD_MESSAGE;
+    memcpy(message->legacy + 1, &client_id, sizeof(client_id));
+    memcpy(message->legacy + 1 + sizeof(client_id), payload, legacy_len);
+    message->legacy[1 + sizeof(client_id) + legacy_len] = '\0';
+    message->legacy_len = (int)(1 + sizeof(client_id) + legacy_len + 1);
+  }
+
+#ifdef HAVE_ZLIB
+  message->deflated_len = 0;
+  if (cmd == EHLO_CMD_MESSAGE
+      && compress_min_len > 0
+      && len >= compress_min_len
+      && atomic_load_int(&num_deflate_clients) > 0) {
+    deflate_message(shard, message, payload, len);
+  }
+#endif
+
+  return message;
+}
+
+static void retain_message(struct message *message)
+{
+  atomic_inc(&message->refcount);
+}
+
+static void release_message(struct message *message)
+{
+  if (atomic_dec(&message->refcount) == 0) {
+    pool_free(message);
+  }
+}
+
+/* Drops the oldest history entry, called under history_lock */
+static void pop_history(void)
+{
+  release_message(history.entries[history.head].message);
+  history.head = (history.head + 1) % history_limit;
+  history.count--;
+}
+
+/* Drops entries older than the retention time, called under history_lock */
+static void expire_history(uint64_t now)
+{
+  if (history_age_ms == 0) {
+    return;
+  }
+  while (history.count > 0
+         && now - history.entries[history.head].time_ms >= history_age_ms) {
+    pop_history();
+  }
+}
+
+/* Adds a message to the history, called under history_lock */
+static void push_history(struct message *message, uint64_t time_ms)
+{
+  struct history_entry *entry;
+
+  history.last_seq = message->seq;
+  expire_history(time_ms);
+  if (history.count == history_limit) {
+    pop_history();
+  }
+  entry = &history.entries[(history.head + history.count) % history_limit];
+  retain_message(message);
+  entry->message = message;
+  entry->time_ms = time_ms;
+  history.count++;
+}
+
+#ifdef HAVE_JOURNAL
+
+static void release_journal_record(struct journal_record *record)
+{
+  release_message((struct message *)((char *)record
+      - offsetof(struct message, journal_record)));
+}
+
+/* Queues the message for the journal, called under history_lock */
+static void append_to_journal(struct message *message)
+{
+  struct journal_record *record = &message->journal_record;
+
+  record->seq = message->seq;
+  record->sender_id = message->sender_id;
+  record->room = message->room;
+  record->time_ms = get_wall_time_ms();
+  record->text = message->frame + EHLO_FRAME_HEADER_LEN;
+  record->len = message->frame_len - EHLO_FRAME_HEADER_LEN;
+  retain_message(message);
+  journal_append(&journal, record);
+}
+
+/*
+ * Puts a message from the journal back into the history. The journal has
+ * wall clock times, which are turned into times of the monotonic clock
+ * that the history uses to tell the age of its messages.
+ */
+static void restore_history_message(const struct journal_record *record,
+                                    void *arg)
+{
+  struct message *message;
+  uint64_t now = get_time_ms();
+  uint64_t wall_now = get_wall_time_ms();
+  uint64_t age = 0;
+
+  (void)arg;
+  /* The wall clock may have been set back since */
+  if (record->time_ms < wall_now) {
+    age = wall_now - record->time_ms;
+  }
+  if (age > now) {
+    age = now;
+  }
+  message = create_message(NULL,
+                           EHLO_CMD_MESSAGE,
+                           EHLO_LOBBY_ROOM,
+                           record->sender_id,
+                           record->seq,
+                           record->text,
+                           record->len);
+  if (message == NULL) {
+    return;
+  }
+  lock_mutex(&history_lock);
+  push_history(message, now - age);
+  unlock_mutex(&history_lock);
+  release_message(message);
+}
+
+#endif /* HAVE_JOURNAL */
+
+/* Numbers a message that has no one to see it yet, in every encoding */
+static void set_message_seq(struct message *message, uint32_t seq)
+{
+  uint32_t net_seq = htonl(seq);
+
+  message->seq = seq;
+  memcpy(message->frame + FRAME_SEQ_OFFSET, &net_seq, sizeof(net_seq));
+#ifdef HAVE_ZLIB
+  if (message->deflated_len > 0) {
+    memcpy(message->deflated + FRAME_SEQ_OFFSET, &net_seq, sizeof(net_seq));
+  }
+#endif
+}
+
+/*
+ * Creates the next message of the history and adds it there. It's encoded
+ * and compressed before taking the history lock, which only covers giving
+ * it a number and keeps the journal in the same order.
+ */
+static struct message *create_history_message(struct shard *shard,
+                                              int sender_id,
+                                              const char *text,
+                                              int len)
+{
+  struct message *message;
+  uint64_t now = get_time_ms();
+
+  message = create_message(shard,
+                           EHLO_CMD_MESSAGE,
+                           EHLO_LOBBY_ROOM,
+                           sender_id,
+                           0,
+                           text,
+                           len);
+  if (message == NULL) {
+    return NULL;
+  }
+
+  lock_mutex(&history_lock);
+  set_message_seq(message,
+                  history.last_seq + 1 != 0 ? history.last_seq + 1 : 1);
+  push_history(message, now);
+#ifdef HAVE_JOURNAL
+  if (journal_dir != NULL) {
+    append_to_journal(message);
+  }
+#endif
+  unlock_mutex(&history_lock);
+  return message;
+}
+
+static void release_relay_record(struct relay_record *record)
+{
+  release_message((struct message *)((char *)record
+      - offsetof(struct message, relay_record)));
+}
+
+/* Passes a lobby message on to the other nodes of the cluster */
+static void relay_message(struct message *message)
+{
+  struct relay_record *record = &message->relay_record;
+
+  record->sender_id = message->sender_id;
+  record->text = message->frame + EHLO_FRAME_HEADER_LEN;
+  record->len = message->frame_len - EHLO_FRAME_HEADER_LEN;
+  retain_message(message);
+  federation_relay(&federation, record);
+}
+
+/* Returns the encoding of the message that suits the client */
+static const char *get_message_data(const struct message *message,
+                                    const struct client *client,
+                                    int *len)
+{
+#ifdef HAVE_ZLIB
+  if (message->deflated_len > 0 && (client->caps & EHLO_CAP_DEFLATE)) {
+    *len = message->deflated_len;
+    return message->deflated;
+  }
+#endif
+  if (client->protocol == EHLO_PROTOCOL_FRAMED) {
+    *len = message->frame_len;
+    return message->frame;
+  }
+  *len = message->legacy_len;
+  return message->legacy;
+}
+
+#ifdef HAVE_EPOLL
+
+static int update_client_events(struct client *client, int op)
+{
+  struct epoll_event event;
+
+  event.events = EPOLLIN;
+  if (client->write_blocked) {
+    event.events |= EPOLLOUT;
+  }
+  event.data.ptr = client;
+  return epoll_ctl(client->shard->event_fd, op, client->sock, &event);
+}
+
+static int set_write_blocked(struct client *client, int blocked)
+{
+  if (client->write_blocked == blocked) {
+    return 0;
+  }
+  client->write_blocked = blocked;
+  if (update_client_events(client, EPOLL_CTL_MOD) != 0) {
+    return socket_error();
+  }
+  return 0;
+}
+
+#endif /* HAVE_EPOLL */
+
+static int push_client_message(struct client *client, struct message *message)
+{
+  struct message **queue;
+  int capacity;
+  int i;
+
+  if (client->out_count == client->out_capacity) {
+    capacity = client->out_capacity > 0 ? client->out_capacity * 2 : 8;
+    queue = malloc(capacity * sizeof(*queue));
+    if (queue == NULL) {
+      return ENOMEM;
+    }
+    for (i = 0; i < client->out_count; i++) {
+      queue[i] = client->out_queue[
+          (client->out_head + i) & (client->out_capacity - 1)];
+    }
+    free(client->out_queue);
+    client->out_queue = queue;
+    client->out_head = 0;
+    client->out_capacity = capacity;
+  }
+
+  retain_message(message);
+  client->out_queue[
+      (client->out_head + client->out_count) & (client->out_capacity - 1)] =
+      message;
+  atomic_store_int(&client->out_count, client->out_count + 1);
+  if (client->out_count > client->out_max_count) {
+    atomic_store_int(&client->out_max_count, client->out_count);
+  }
+  return 0;
+}
+
+static void pop_client_message(struct client *client)
+{
+  release_message(client->out_queue[client->out_head]);
+  client->out_head = (client->out_head + 1) & (client->out_capacity - 1);
+  atomic_store_int(&client->out_count, client->out_count - 1);
+  client->out_offset = 0;
+}
+
+static void clear_client_queue(struct client *client)
+{
+  while (client->out_count > 0) {
+    pop_client_message(client);
+  }
+  free(client->out_queue);
+  client->out_queue = NULL;
+  client->out_head = 0;
+  client->out_capacity = 0;
+}
+
+/*
+ * Returns the number of messages at the front of the queue that can't be
+ * dropped: a partially sent message must be completed to keep the stream
+ * intact and messages handed to the kernel must stay until it's done.
+ */
+static int get_pinned_count(const struct client *client)
+{
+  if (client->out_pinned > 0) {
+    return client->out_pinned;
+  }
+  return client->out_offset > 0 ? 1 : 0;
+}
+
+static void count_dropped_message(struct client *client)
+{
+  atomic_add_u64(&client->out_dropped, 1);
+  metrics_add(get_metrics(client->shard), METRIC_DROPPED, 1);
+}
+
+/* Drops the oldest queued message that isn't pinned */
+static void drop_oldest_message(struct client *client)
+{
+  int mask = client->out_capacity - 1;
+  int pinned = get_pinned_count(client);
+  int i;
+
+  release_message(client->out_queue[(client->out_head + pinned) & mask]);
+  for (i = pinned; i > 0; i--) {
+    client->out_queue[(client->out_head + i) & mask] =
+        client->out_queue[(client->out_head + i - 1) & mask];
+  }
+  client->out_head = (client->out_head + 1) & mask;
+  atomic_store_int(&client->out_count, client->out_count - 1);
+  count_dropped_message(client);
+}
+
+/*
+ * Makes room in a full queue according to the overflow policy. Returns
+ * non-zero if the new message should not be queued.
+ */
+static int handle_queue_overflow(struct client *client)
+{
+  struct message *notice;
+  char text[64];
+  int len;
+  int count;
+
+  if (overflow_policy != OVERFLOW_DISCONNECT
+      && client->out_count <= get_pinned_count(client)) {
+    /* Everything queued is being sent already, drop the new message */
+    count_dropped_message(client);
+    return 1;
+  }
+
+  switch (overflow_policy) {
+    case OVERFLOW_DROP_OLDEST:
+      drop_oldest_message(client);
+      return 0;
+    case OVERFLOW_DISCONNECT:
+      log_warning("Disconnecting client %d because its output queue is full",
+                  client->id);
+      client->out_overflowed = 1;
+      /* The read side notices the shutdown and closes the connection */
+      shutdown(client->sock, SHUT_RDWR);
+      return 1;
+    case OVERFLOW_COALESCE:
+      /* Replace the backlog with a single notice */
+      count = 0;
+      while (client->out_count > get_pinned_count(client)) {
+        drop_oldest_message(client);
+        count++;
+      }
+      len = snprintf(text,
+                     sizeof(text),
+                     "%d messages were skipped because you fell behind",
+                     count);
+      notice = create_message(client->shard,
+                              EHLO_CMD_MESSAGE,
+                              EHLO_LOBBY_ROOM,
+                              EHLO_SERVER_ID,
+                              0,
+                              text,
+                              len);
+      if (notice != NULL) {
+        push_client_message(client, notice);
+        release_message(notice);
+      }
+      return 0;
+  }
+  return 0;
+}
+
+static int client_uses_uring(const struct client *client)
+{
+#ifdef HAVE_IO_URING
+  return client->shard != NULL && client->shard->uring_enabled;
+#else
+  (void)client;
+  return 0;
+#endif
+}
+
+static int wait_client_writable(struct client *client)
+{
+#ifdef HAVE_EPOLL
+  if (server_mode == SERVER_MODE_EVENT && !client_uses_uring(client)) {
+    return set_write_blocked(client, 1);
+  }
+#endif
+  /*
+   * Client threads watch for writability while their queue isn't empty
+   * and io_uring sends wait for the socket on their own.
+   */
+  (void)client;
+  return 0;
+}
+
+/*
+ * Points vec at up to max_vec queued messages, leaving out the part of the
+ * first one that has been sent already. Returns the number of vectors.
+ */
+static int get_client_output(const struct client *client,
+                             io_vec_t *vec,
+                             int max_vec,
+                             int *total_len)
+{
+  struct message *message;
+  const char *data;
+  int num_vec;
+  int len;
+
+  *total_len = 0;
+  for (num_vec = 0;
+       num_vec < client->out_count && num_vec < max_vec;
+       num_vec++) {
+    message = client->out_queue[
+        (client->out_head + num_vec) & (client->out_capacity - 1)];
+    data = get_message_data(message, client, &len);
+    if (num_vec == 0) {
+      data += client->out_offset;
+      len -= client->out_offset;
+    }
+    io_vec_set(&vec[num_vec], data, len);
+    *total_len += len;
+  }
+  return num_vec;
+}
+
+/* Takes len bytes of sent data off the front of the queue */
+static void consume_client_output(struct client *client, int len)
+{
+  struct metrics *metrics = get_metrics(client->shard);
+  int message_len;
+
+  metrics_add(metrics, METRIC_BYTES_OUT, len);
+  while (len > 0) {
+    get_message_data(client->out_queue[client->out_head],
+                     client,
+                     &message_len);
+    message_len -= client->out_offset;
+    if (len < message_len) {
+      client->out_offset += len;
+      break;
+    }
+    len -= message_len;
+    pop_client_message(client);
+    metrics_add(metrics, METRIC_MESSAGES_OUT, 1);
+  }
+}
+
+static void set_client_corked(struct client *client, int corked)
+{
+#ifdef TCP_CORK
+  setsockopt(client->sock,
+             IPPROTO_TCP,
+             TCP_CORK,
+             (char *)&corked,
+             sizeof(corked));
+#else
+  (void)client;
+  (void)corked;
+#endif
+}
+
+/*
+ * Writes as many queued messages as the socket accepts, up to
+ * MAX_WRITE_BATCH of them per call. Returns 0 or an error code.
+ */
+static int flush_client(struct client *client)
+{
+  io_vec_t vec[MAX_WRITE_BATCH];
+  int num_vec;
+  int batch_len;
+  int send_len;
+  int corked;
+  int error = 0;
+
+  /*
+   * When it takes more than one call, cork the socket so that the end of
+   * one batch and the start of the next share full-sized packets.
+   */
+  corked = client->out_count > MAX_WRITE_BATCH;
+  if (corked) {
+    set_client_corked(client, 1);
+  }
+
+  while (client->out_count > 0) {
+    num_vec = get_client_output(client, vec, MAX_WRITE_BATCH, &batch_len);
+    send_len = send_vec(client->sock, vec, num_vec);
+    metrics_add(get_metrics(client->shard), METRIC_SEND_CALLS, 1);
+    if (send_len < 0) {
+      error = socket_error();
+      if (socket_would_block(error)) {
+        error = wait_client_writable(client);
+      }
+      break;
+    }
+
+    consume_client_output(client, send_len);
+    if (send_len < batch_len) {
+      /* The socket buffer is full, wait until it becomes writable */
+      error = wait_client_writable(client);
+      break;
+    }
+  }
+
+  /* Uncorking pushes out whatever the kernel was holding back */
+  if (corked) {
+    set_client_corked(client, 0);
+  }
+  if (client->out_count > 0 || error != 0) {
+    return error;
+  }
+
+  clear_client_queue(client);
+#ifdef HAVE_EPOLL
+  if (server_mode == SERVER_MODE_EVENT && !client_uses_uring(client)) {
+    return set_write_blocked(client, 0);
+  }
+#endif
+  return 0;
+}
+
+#ifdef HAVE_EPOLL
+
+/*
+ * Puts the client on its shard's flush list. Its output is held back until
+ * flush_delay_us have passed since the first message was queued or until
+ * flush_bytes have piled up, whichever comes first. Without a delay it's
+ * written at the end of the loop iteration.
+ */
+static void schedule_flush(struct client *client, int len)
+{
+  struct shard *shard = client->shard;
+
+  if (!client->flush_pending) {
+    client->flush_pending = 1;
+    client->flush_len = 0;
+    client->flush_deadline = flush_delay_us > 0
+        ? get_time_us() + flush_delay_us
+        : 0;
+    client->flush_next = shard->flush_head;
+    shard->flush_head = client;
+  }
+  client->flush_len += len;
+  if (client->flush_len >= flush_bytes) {
+    client->flush_deadline = 0;
+  }
+}
+
+#endif /* HAVE_EPOLL */
+
+/*
+ * Sends the message right away if nothing is queued for the client,
+ * otherwise queues it until the socket becomes writable. With batched
+ * writes (and io_uring) everything is queued and flushed once per loop
+ * iteration.
+ */
+static int queue_client_message(struct client *client, struct message *message)
+{
+  struct metrics *metrics = get_metrics(client->shard);
+  const char *data;
+  int batched = batch_writes || client_uses_uring(client);
+  int send_len = 0;
+  int len;
+  int error;
+
+  data = get_message_data(message, client, &len);
+  if (len == 0 || client->out_overflowed) {
+    return 0;
+  }
+
+  if (client->out_count == 0 && !batched) {
+    send_len = send(client->sock, data, len, 0);
+    metrics_add(metrics, METRIC_SEND_CALLS, 1);
+    if (send_len == len) {
+      metrics_add(metrics, METRIC_MESSAGES_OUT, 1);
+      metrics_add(metrics, METRIC_BYTES_OUT, len);
+      return 0;
+    }
+    if (send_len < 0) {
+      error = socket_error();
+      if (!socket_would_block(error)) {
+        return error;
+      }
+      send_len = 0;
+    }
+    metrics_add(metrics, METRIC_BYTES_OUT, send_len);
+  }
+
+  if (client->out_count >= queue_limit && handle_queue_overflow(client)) {
+    return 0;
+  }
+  error = push_client_message(client, message);
+  if (error != 0) {
+    return error;
+  }
+  metrics_record(metrics, METRIC_QUEUE_DEPTH, client->out_count);
+  if (send_len > 0 || (!batched && client->out_count == 1)) {
+    client->out_offset = send_len;
+    return wait_client_writable(client);
+  }
+#ifdef HAVE_EPOLL
+  if (batched && !client->write_blocked) {
+    schedule_flush(client, len);
+  }
+#endif
+  return 0;
+}
+
+#ifdef HAVE_EPOLL
+
+static void link_hello_client(struct client *client)
+{
+  struct shard *shard = client->shard;
+
+  client->hello_deadline = get_time_ms() + EHLO_HELLO_TIMEOUT_MS;
+  client->hello_prev = shard->hello_tail;
+  client->hello_next = NULL;
+  if (shard->hello_tail != NULL) {
+    shard->hello_tail->hello_next = client;
+  } else {
+    shard->hello_head = client;
+  }
+  shard->hello_tail = client;
+}
+
+static void unlink_hello_client(struct client *client)
+{
+  struct shard *shard = client->shard;
+
+  if (client->hello_deadline == 0) {
+    return;
+  }
+  if (client->hello_prev != NULL) {
+    client->hello_prev->hello_next = client->hello_next;
+  } else {
+    shard->hello_head = client->hello_next;
+  }
+  if (client->hello_next != NULL) {
+    client->hello_next->hello_prev = client->hello_prev;
+  } else {
+    shard->hello_tail = client->hello_prev;
+  }
+  client->hello_prev = NULL;
+  client->hello_next = NULL;
+  client->hello_deadline = 0;
+}
+
+#endif /* HAVE_EPOLL */
+
+#ifdef HAVE_SHM
+
+static int client_has_ring(const struct client *client)
+{
+  return client->ring.header != NULL;
+}
+
+/*
+ * Creates a ring for a local client and passes it on with the answer to
+ * its HELLO, which is written right away: nothing can be queued for the
+ * client before it. The event loop starts watching the ring once it's done
+ * with the client's input. Returns 0 or an error code.
+ */
+static int open_client_ring(struct client *client, const char *hello, int len)
+{
+  struct shm_ring *ring = &client->ring;
+  int fds[3];
+  int result;
+  int error;
+
+  error = shm_ring_create(ring, SHM_RING_DEFAULT_SIZE);
+  if (error != 0) {
+    return error;
+  }
+  /* Before the client can write anything, so that it wakes us up */
+  shm_ring_want_data(ring);
+  fds[0] = ring->mem_fd;
+  fds[1] = ring->data_fd;
+  fds[2] = ring->space_fd;
+  result = send_fds(client->sock, hello, len, fds, 3);
+  if (result != len) {
+    error = result < 0 ? socket_error() : EAGAIN;
+    shm_ring_close(ring);
+    return error;
+  }
+  return 0;
+}
+
+#endif /* HAVE_SHM */
+
+/* Legacy peers have no way to answer a PING, so they're never checked */
+static int client_needs_heartbeat(const struct client *client)
+{
+  return heartbeat_interval_ms > 0 && client->protocol == EHLO_PROTOCOL_FRAMED;
+}
+
+static int send_message(struct client *client, struct message *message)
+{
+  int error;
+
+  if (server_mode == SERVER_MODE_EVENT) {
+    return queue_client_message(client, message);
+  }
+
+  lock_mutex(&client->out_lock);
+  if (client->sock != INVALID_SOCKET) {
+    error = queue_client_message(client, message);
+  } else {
+    error = 0;
+  }
+  unlock_mutex(&client->out_lock);
+  return error;
+}
+
+static int send_frame(struct client *client,
+                      int cmd,
+                      int room,
+                      int sender_id,
+                      const char *payload,
+                      int len)
+{
+  struct message *message;
+  int error;
+
+  message = create_message(client->shard,
+                           cmd,
+                           room,
+                           sender_id,
+                           0,
+                           payload,
+                           len);
+  if (message == NULL) {
+    return ENOMEM;
+  }
+  error = send_message(client, message);
+  release_message(message);
+  return error;
+}
+
+static int send_server_message(struct client *client, const char *message)
+{
+  return send_frame(client,
+                    EHLO_CMD_MESSAGE,
+                    EHLO_LOBBY_ROOM,
+                    EHLO_SERVER_ID,
+                    message,
+                    (int)strlen(message));
+}
+
+static int send_error(struct client *client, const char *message)
+{
+  return send_frame(client,
+                    EHLO_CMD_ERROR,
+                    EHLO_LOBBY_ROOM,
+                    EHLO_SERVER_ID,
+                    message,
+                    (int)strlen(message));
+}
+
+/*
+ * Pings the client once it has been quiet for the heartbeat interval and
+ * gives up on it after the heartbeat timeout. Returns the time of the next
+ * check or 0 if the connection should be closed.
+ */
+static uint64_t check_heartbeat(struct client *client, uint64_t now)
+{
+  char token[32];
+  uint64_t idle = now - client->last_recv_ms;
+  uint64_t next_check;
+  int len;
+
+  if (idle >= heartbeat_timeout_ms) {
+    log_info("Client %d timed out", client->id);
+    return 0;
+  }
+  if (idle < heartbeat_interval_ms) {
+    return client->last_recv_ms + heartbeat_interval_ms;
+  }
+
+  /* One PING per quiet period, the PONG counts as activity */
+  if (client->ping_sent_ms <= client->last_recv_ms) {
+    len = snprintf(token, sizeof(token), "%llu", (unsigned long long)now);
+    if (send_frame(client,
+                   EHLO_CMD_PING,
+                   EHLO_LOBBY_ROOM,
+                   EHLO_SERVER_ID,
+                   token,
+                   len) != 0) {
+      return 0;
+    }
+    client->ping_sent_ms = now;
+  }
+
+  next_check = now + heartbeat_interval_ms;
+  if (next_check > client->last_recv_ms + heartbeat_timeout_ms) {
+    next_check = client->last_recv_ms + heartbeat_timeout_ms;
+  }
+  return next_check;
+}
+
+static void deliver_message(struct client *client, struct message *message)
+{
+  int error = 0;
+
+  if (!atomic_load_int(&client->joined) || client->id == message->sender_id) {
+    return;
+  }
+  /* In thread mode the history replay is set up under out_lock */
+  if (server_mode == SERVER_MODE_THREAD) {
+    lock_mutex(&client->out_lock);
+  }
+  if ((message->seq == 0
+       || message->seq - client->replay_seq >= (uint32_t)client->replay_count)
+      && client->sock != INVALID_SOCKET) {
+    error = queue_client_message(client, message);
+  }
+  if (server_mode == SERVER_MODE_THREAD) {
+    unlock_mutex(&client->out_lock);
+  }
+  if (error != 0) {
+    log_error("Error sending message to client %d: %s",
+              client->id,
+              error_to_str(error, NULL, 0));
+  }
+}
+
+#ifdef HAVE_EPOLL
+
+static void wake_shard(struct shard *shard)
+{
+  uint64_t value = 1;
+
+  /* One wakeup is enough until the shard gets to its inbox */
+  if (atomic_exchange_int(&shard->wake_pending, 1) == 0) {
+    if (write(shard->wake_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+      log_error("Failed to wake up shard %d: %s",
+                shard->index,
+                error_to_str(errno, NULL, 0));
+    }
+  }
+}
+
+/* The event comes from the pool of from, the calling shard */
+static int post_shard_event(struct shard *from,
+                            struct shard *shard,
+                            int type,
+                            struct message *message,
+                            struct client *client)
+{
+  struct shard_event *event;
+
+  event = pool_alloc(&from->event_pool);
+  if (event == NULL) {
+    return ENOMEM;
+  }
+  event->type = type;
+  event->message = message;
+  event->client = client;
+  mpsc_queue_push(&shard->inbox, &event->node);
+  wake_shard(shard);
+  return 0;
+}
+
+static void fan_out_message(struct shard *shard, struct message *message)
+{
+  const struct id_set *members;
+  uint64_t start = get_time_ns();
+  int pos = 0;
+  int slot;
+  int i;
+
+  if (message->room == EHLO_LOBBY_ROOM) {
+    for (i = 0; i < shard->clients.num_active; i++) {
+      deliver_message(shard->clients.active[i], message);
+    }
+  } else {
+    members = &shard->room_members[message->room];
+    while ((slot = id_set_next(members, &pos)) >= 0) {
+      deliver_message(shard->clients.slots[slot].entry, message);
+    }
+  }
+  metrics_record(&shard->metrics, METRIC_FAN_OUT_NS, get_time_ns() - start);
+}
+
+#endif /* HAVE_EPOLL */
+
+/*
+ * Sends the message to everyone in the room except the sender. In event
+ * mode, shard is the calling event loop: it delivers to its own clients and
+ * forwards the message to the other shards. Thread mode passes NULL.
+ *
+ * Lobby messages of clients here are relayed to the other nodes too, those
+ * that came from another node (relay == 0) go no further.
+ */
+static void broadcast_message(struct shard *shard,
+                              int room,
+                              int sender_id,
+                              const char *text,
+                              int len,
+                              int relay)
+{
+  const struct id_set *members;
+  struct client_list *list;
+  struct message *message;
+  uint64_t start;
+  int pos = 0;
+  int token;
+  int slot;
+  int i;
+
+  log_message(sender_id, text, len);
+
+  /* Encode the message once, every recipient gets a reference to it */
+  if (room == EHLO_LOBBY_ROOM
+      && sender_id != EHLO_SERVER_ID
+      && history_limit > 0) {
+    message = create_history_message(shard,
+                                     sender_id,
+                                     text,
+                                     len);
+  } else {
+    message = create_message(shard,
+                             EHLO_CMD_MESSAGE,
+                             room,
+                             sender_id,
+                             0,
+                             text,
+                             len);
+  }
+  if (message == NULL) {
+    log_error("Out of memory broadcasting message");
+    return;
+  }
+  metrics_add(get_metrics(shard), METRIC_BROADCASTS, 1);
+  if (relay
+      && room == EHLO_LOBBY_ROOM
+      && sender_id != EHLO_SERVER_ID
+      && federation.num_peers > 0) {
+    relay_message(message);
+  }
+
+#ifdef HAVE_EPOLL
+  if (shard != NULL) {
+    for (i = 0; i < num_shards; i++) {
+      if (&shards[i] == shard) {
+        continue;
+      }
+      retain_message(message);
+      if (post_shard_event(shard,
+                           &shards[i],
+                           SHARD_EVENT_BROADCAST,
+                           message,
+                           NULL) != 0) {
+        log_error("Out of memory forwarding message to shard %d", i);
+        release_message(message);
+      }
+    }
+    fan_out_message(shard, message);
+    release_message(message);
+    return;
+  }
+#else
+  (void)shard;
+#endif
+
+  start = get_time_ns();
+  list = NULL;
+  if (room == EHLO_LOBBY_ROOM) {
+    /*
+     * Pairs with the barrier in join_client(): a client that joins now
+     * either looks like it has joined or finds the message in the history.
+     */
+    atomic_fence();
+    token = epoch_enter(&client_list_epoch, sender_id);
+    list = atomic_load_ptr(&client_list);
+    if (list != NULL) {
+      for (i = 0; i < list->num_clients; i++) {
+        deliver_message(list->clients[i], message);
+      }
+    }
+    epoch_exit(&client_list_epoch, token);
+  }
+  if (list == NULL) {
+    lock_mutex(&clients_lock);
+    if (room == EHLO_LOBBY_ROOM) {
+      for (i = 0; i < clients.num_active; i++) {
+        deliver_message(clients.active[i], message);
+      }
+    } else {
+      members = &room_members[room];
+      while ((slot = id_set_next(members, &pos)) >= 0) {
+        deliver_message(clients.slots[slot].entry, message);
+      }
+    }
+    unlock_mutex(&clients_lock);
+  }
+  metrics_record(&thread_metrics, METRIC_FAN_OUT_NS, get_time_ns() - start);
+
+  release_message(message);
+}
+
+static void send_broadcast_message(struct shard *shard,
+                                   int room,
+                                   int sender_id,
+                                   const char *text,
+                                   int len)
+{
+  broadcast_message(shard, room, sender_id, text, len, 1);
+}
+
+static void send_connect_message(struct client *client)
+{
+  char buf[64];
+  int len;
+
+  len = snprintf(buf, sizeof(buf), "Client %d has joined the chat", client->id);
+  send_broadcast_message(client->shard,
+                         EHLO_LOBBY_ROOM,
+                         EHLO_SERVER_ID,
+                         buf,
+                         len);
+}
+
+static void send_disconnect_message(struct client *client)
+{
+  char buf[64];
+  int len;
+
+  len = snprintf(buf, sizeof(buf), "Client %d has left the chat", client->id);
+  send_broadcast_message(client->shard,
+                         EHLO_LOBBY_ROOM,
+                         EHLO_SERVER_ID,
+                         buf,
+                         len);
+}
+
+static int is_valid_room_name(const char *name, int len)
+{
+  int i;
+
+  if (len == 0 || len > EHLO_MAX_ROOM_NAME_LEN) {
+    return 0;
+  }
+  for (i = 0; i < len; i++) {
+    if ((unsigned char)name[i] <= ' ' || name[i] == 0x7f) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Returns the number of the room with the given name, creating the room if
+ * it doesn't exist, or -1 if it can't be created. Called under rooms_lock.
+ */
+static int find_room(const char *name, int len)
+{
+  struct room *room;
+  int id;
+  int i;
+
+  for (id = 0; id < EHLO_MAX_ROOMS; id++) {
+    if (rooms[id] != NULL
+        && (int)strlen(rooms[id]->name) == len
+        && memcmp(rooms[id]->name, name, len) == 0) {
+      return id;
+    }
+  }
+
+  /* Hand out numbers round-robin so that old ones aren't reused soon */
+  for (i = 0; i < EHLO_MAX_ROOMS - 1; i++) {
+    id = next_room_id;
+    next_room_id = next_room_id + 1 < EHLO_MAX_ROOMS
+        ? next_room_id + 1
+        : EHLO_LOBBY_ROOM + 1;
+    if (rooms[id] == NULL) {
+      room = malloc(sizeof(*room));
+      if (room == NULL) {
+        return -1;
+      }
+      room->num_members = 0;
+      memcpy(room->name, name, len);
+      room->name[len] = '\0';
+      rooms[id] = room;
+      return id;
+    }
+  }
+  return -1;
+}
+
+/* Called under rooms_lock */
+static void release_room(int id)
+{
+  if (rooms[id]->num_members == 0) {
+    free(rooms[id]);
+    rooms[id] = NULL;
+  }
+}
+
+/* Adds the client to the index its messages are fanned out from */
+static int add_room_member(struct client *client, int room)
+{
+  int result;
+
+#ifdef HAVE_EPOLL
+  if (client->shard != NULL) {
+    return id_set_add(&client->shard->room_members[room],
+                      registry_id_slot(client->local_id));
+  }
+#endif
+  lock_mutex(&clients_lock);
+  result = id_set_add(&room_members[room],
+                      registry_id_index(&clients, client->id));
+  unlock_mutex(&clients_lock);
+  return result;
+}
+
+static void remove_room_member(struct client *client, int room)
+{
+#ifdef HAVE_EPOLL
+  if (client->shard != NULL) {
+    id_set_remove(&client->shard->room_members[room],
+                  registry_id_slot(client->local_id));
+    return;
+  }
+#endif
+  lock_mutex(&clients_lock);
+  id_set_remove(&room_members[room], registry_id_index(&clients, client->id));
+  unlock_mutex(&clients_lock);
+}
+
+/*
+ * Takes the client out of a room it's in and copies the room's name to name
+ * unless it's NULL.
+ */
+static void leave_room(struct client *client, int room, char *name)
+{
+  remove_room_member(client, room);
+  id_set_remove(&client->rooms, room);
+
+  lock_mutex(&rooms_lock);
+  if (name != NULL) {
+    strcpy(name, rooms[room]->name);
+  }
+  rooms[room]->num_members--;
+  release_room(room);
+  unlock_mutex(&rooms_lock);
+}
+
+/* Must be called while the client's slot in the registry is still taken */
+static void leave_all_rooms(struct client *client)
+{
+  int pos;
+  int room;
+
+  for (;;) {
+    pos = 0;
+    room = id_set_next(&client->rooms, &pos);
+    if (room < 0) {
+      break;
+    }
+    leave_room(client, room, NULL);
+  }
+  id_set_free(&client->rooms);
+}
+
+/*
+ * Adds the client to the named room and confirms with a JOIN frame. Returns
+ * non-zero if the connection should be closed.
+ */
+static int join_room(struct client *client, const char *name, int len)
+{
+  char text[64];
+  int room;
+  int added;
+
+  if (!is_valid_room_name(name, len)) {
+    send_error(client, "Invalid room name");
+    return 0;
+  }
+
+  lock_mutex(&rooms_lock);
+  room = find_room(name, len);
+  added = 0;
+  if (room >= 0) {
+    added = id_set_add(&client->rooms, room);
+    if (added > 0) {
+      rooms[room]->num_members++;
+    } else if (added < 0) {
+      release_room(room);
+    }
+  }
+  unlock_mutex(&rooms_lock);
+  if (room < 0 || added < 0) {
+    send_error(client, "Failed to create room");
+    return 0;
+  }
+
+  if (added && add_room_member(client, room) < 0) {
+    leave_room(client, room, NULL);
+    send_error(client, "Failed to join room");
+    return 0;
+  }
+
+  if (send_frame(client,
+                 EHLO_CMD_JOIN,
+                 room,
+                 EHLO_SERVER_ID,
+                 name,
+                 len) != 0) {
+    return 1;
+  }
+  if (added) {
+    len = snprintf(text,
+                   sizeof(text),
+                   "Client %d has joined the room",
+                   client->id);
+    send_broadcast_message(client->shard, room, EHLO_SERVER_ID, text, len);
+  }
+  return 0;
+}
+
+/* Returns non-zero if the connection should be closed */
+static int handle_leave(struct client *client, int room)
+{
+  char name[EHLO_MAX_ROOM_NAME_LEN + 1];
+  char text[64];
+  int len;
+
+  if (room == EHLO_LOBBY_ROOM) {
+    send_error(client, "You can't leave the lobby");
+    return 0;
+  }
+  if (!id_set_contains(&client->rooms, room)) {
+    send_error(client, "You're not in that room");
+    return 0;
+  }
+
+  leave_room(client, room, name);
+  if (send_frame(client,
+                 EHLO_CMD_LEAVE,
+                 room,
+                 EHLO_SERVER_ID,
+                 name,
+                 (int)strlen(name)) != 0) {
+    return 1;
+  }
+  len = snprintf(text, sizeof(text), "Client %d has left the room", client->id);
+  send_broadcast_message(client->shard, room, EHLO_SERVER_ID, text, len);
+  return 0;
+}
+
+/* Letters, digits, '-' and '_', starting with a letter so it's no ID */
+static int is_valid_nick(const char *name, int len)
+{
+  int c;
+  int i;
+
+  if (len == 0 || len > EHLO_MAX_NICK_LEN) {
+    return 0;
+  }
+  for (i = 0; i < len; i++) {
+    c = (unsigned char)name[i];
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
+      continue;
+    }
+    if (i == 0 || !((c >= '0' && c <= '9') || c == '-' || c == '_')) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Gives the client the nickname in the payload, or drops its nickname if
+ * the payload is empty, and confirms with a NICK frame. Returns non-zero if
+ * the connection should be closed.
+ */
+static int handle_nick(struct client *client, const char *name, int len)
+{
+  char text[64 + EHLO_MAX_NICK_LEN];
+  int owner;
+  int error = 0;
+
+  if (len > 0 && !is_valid_nick(name, len)) {
+    send_error(client, "Invalid nickname");
+    return 0;
+  }
+
+  lock_mutex(&nicks_lock);
+  owner = len > 0 ? nick_table_find(&nicks, name, len) : -1;
+  if (owner >= 0 && owner != client->id) {
+    unlock_mutex(&nicks_lock);
+    send_error(client, "Nickname is taken");
+    return 0;
+  }
+  /* Taking the same name again may only change its case */
+  if (client->nick[0] != '\0') {
+    nick_table_remove(&nicks, client->nick, (int)strlen(client->nick));
+    client->nick[0] = '\0';
+  }
+  if (len > 0) {
+    error = nick_table_add(&nicks, name, len, client->id);
+    if (error == 0) {
+      memcpy(client->nick, name, len);
+      client->nick[len] = '\0';
+    }
+  }
+  unlock_mutex(&nicks_lock);
+  if (error != 0) {
+    log_error("Failed to register nickname of client %d: %s",
+              client->id,
+              error_to_str(error, NULL, 0));
+    send_error(client, "Failed to set nickname");
+    return 0;
+  }
+
+  if (send_frame(client,
+                 EHLO_CMD_NICK,
+                 EHLO_LOBBY_ROOM,
+                 EHLO_SERVER_ID,
+                 client->nick,
+                 (int)strlen(client->nick)) != 0) {
+    return 1;
+  }
+  if (len > 0) {
+    len = snprintf(text,
+                   sizeof(text),
+                   "Client %d is now known as %s",
+                   client->id,
+                   client->nick);
+    send_broadcast_message(client->shard,
+                           EHLO_LOBBY_ROOM,
+                           EHLO_SERVER_ID,
+                           text,
+                           len);
+  }
+  return 0;
+}
+
+/*
+ * Returns the ID of the client that the nickname or decimal ID refers to,
+ * or -1 if there is no such client.
+ */
+static int find_recipient(const char *name, int len)
+{
+  char buf[16];
+  long id;
+  int nick_id;
+  int i;
+
+  for (i = 0; i < len && name[i] >= '0' && name[i] <= '9'; i++) {
+  }
+  if (i < len) {
+    lock_mutex(&nicks_lock);
+    nick_id = nick_table_find(&nicks, name, len);
+    unlock_mutex(&nicks_lock);
+    return nick_id;
+  }
+  if (len >= (int)sizeof(buf)) {
+    return -1;
+  }
+  memcpy(buf, name, len);
+  buf[len] = '\0';
+  /* IDs are non-negative ints, anything larger names no one */
+  errno = 0;
+  id = strtol(buf, NULL, 10);
+  if (errno == ERANGE || id > INT_MAX) {
+    return -1;
+  }
+  return (int)id;
+}
+
+#ifdef HAVE_EPOLL
+
+/*
+ * Delivers a direct message forwarded by another shard, if the recipient
+ * is still there and still belongs to this shard.
+ */
+static void deliver_direct_message(struct shard *shard,
+                                   struct message *message)
+{
+  struct client *client;
+
+  lock_mutex(&clients_lock);
+  client = registry_lookup(&clients, message->recipient_id);
+  if (client != NULL && atomic_load_ptr(&client->shard) != shard) {
+    client = NULL;
+  }
+  unlock_mutex(&clients_lock);
+  if (client != NULL) {
+    deliver_message(client, message);
+  }
+}
+
+#endif /* HAVE_EPOLL */
+
+/*
+ * Sends the text that follows the recipient's nickname or ID in the
+ * payload to that client alone. The recipient is found in the registry in
+ * constant time, in event mode the message then goes straight to the
+ * recipient's shard. Returns non-zero if the connection should be closed.
+ */
+static int send_direct_message(struct client *client,
+                               const char *payload,
+                               int len)
+{
+  struct client *recipient;
+  struct message *message;
+  const char *text;
+  int recipient_id;
+  int name_len;
+#ifdef HAVE_EPOLL
+  struct shard *shard;
+#endif
+
+  text = memchr(payload, ' ', len);
+  if (text == NULL || text == payload || text == payload + len - 1) {
+    send_error(client, "Expected a recipient and a message");
+    return 0;
+  }
+  name_len = (int)(text - payload);
+  text++;
+
+  recipient_id = find_recipient(payload, name_len);
+  if (recipient_id < 0) {
+    return send_error(client, "No such client");
+  }
+  /* Delivery skips the sender, so this would go nowhere */
+  if (recipient_id == client->id) {
+    return send_error(client, "You can't send a direct message to yourself");
+  }
+  message = create_message(client->shard,
+                           EHLO_CMD_DIRECT,
+                           EHLO_LOBBY_ROOM,
+                           client->id,
+                           0,
+                           text,
+                           len - name_len - 1);
+  if (message == NULL) {
+    log_error("Out of memory sending direct message");
+    return 0;
+  }
+  message->recipient_id = recipient_id;
+  log_debug("Client %d sent a direct message to client %d",
+            client->id,
+            recipient_id);
+
+  lock_mutex(&clients_lock);
+  recipient = registry_lookup(&clients, recipient_id);
+#ifdef HAVE_EPOLL
+  if (recipient != NULL && client->shard != NULL) {
+    /* NULL until the recipient has been handed to its shard */
+    shard = atomic_load_ptr(&recipient->shard);
+    unlock_mutex(&clients_lock);
+    if (shard == client->shard) {
+      deliver_message(recipient, message);
+    } else if (shard != NULL) {
+      if (post_shard_event(client->shard,
+                           shard,
+                           SHARD_EVENT_DIRECT,
+                           message,
+                           NULL) == 0) {
+        return 0;
+      }
+      log_error("Out of memory forwarding direct message");
+    }
+    release_message(message);
+    return 0;
+  }
+#endif
+  if (recipient != NULL) {
+    deliver_message(recipient, message);
+  }
+  unlock_mutex(&clients_lock);
+  release_message(message);
+  if (recipient == NULL) {
+    return send_error(client, "No such client");
+  }
+  return 0;
+}
+
+static void destroy_client(struct client *client)
+{
+#ifdef HAVE_IO_URING
+  free(client->uring_send);
+#endif
+  if (server_mode == SERVER_MODE_THREAD) {
+    destroy_mutex(&client->out_lock);
+  }
+  free(client);
+}
+
+/* In thread mode the client is freed once no broadcast can reach it */
+static void free_client(struct client *client)
+{
+  if (server_mode == SERVER_MODE_THREAD) {
+    lock_mutex(&retired_lock);
+    client->closed_next = retired_clients;
+    retired_clients = client;
+    unlock_mutex(&retired_lock);
+    return;
+  }
+  destroy_client(client);
+}
+
+/*
+ * Publishes a copy of the registry's active clients for broadcasts in
+ * thread mode. Called under clients_lock after each change to the registry,
+ * returns the list that was replaced. The caller passes it on to
+ * retire_client_list() once it has released the lock.
+ */
+static struct client_list *publish_client_list(void)
+{
+  struct client_list *list;
+  int num_clients = clients.num_active;
+
+  if (server_mode != SERVER_MODE_THREAD) {
+    return NULL;
+  }
+  list = malloc(sizeof(*list)
+                + (num_clients > 0 ? num_clients - 1 : 0)
+                  * sizeof(list->clients[0]));
+  if (list != NULL) {
+    list->num_clients = num_clients;
+    memcpy(list->clients,
+           clients.active,
+           num_clients * sizeof(list->clients[0]));
+  } else {
+    log_error("Out of memory copying the list of clients");
+  }
+  return atomic_exchange_ptr(&client_list, list);
+}
+
+static void retire_client_list(struct client_list *list)
+{
+  if (list == NULL) {
+    return;
+  }
+  lock_mutex(&retired_lock);
+  list->next_retired = retired_lists;
+  retired_lists = list;
+  unlock_mutex(&retired_lock);
+}
+
+/*
+ * Frees the client lists and clients retired in thread mode. One grace
+ * period covers everything retired before it started.
+ */
+static void *reclaim_thread(void *arg)
+{
+  struct client_list *lists;
+  struct client_list *list;
+  struct client *closed;
+  struct client *client;
+
+  (void)arg;
+
+  for (;;) {
+    sleep_ms(RECLAIM_INTERVAL_MS);
+    lock_mutex(&retired_lock);
+    lists = retired_lists;
+    closed = retired_clients;
+    retired_lists = NULL;
+    retired_clients = NULL;
+    unlock_mutex(&retired_lock);
+    if (lists == NULL && closed == NULL) {
+      continue;
+    }
+
+    epoch_synchronize(&client_list_epoch);
+    while (lists != NULL) {
+      list = lists;
+      lists = list->next_retired;
+      free(list);
+    }
+    while (closed != NULL) {
+      client = closed;
+      closed = client->closed_next;
+      destroy_client(client);
+    }
+  }
+  return NULL;
+}
+
+/* Returns NULL if there are too many clients or not enough memory */
+static struct client *allocate_client(socket_t sock)
+{
+  struct client_list *old_list = NULL;
+  struct client *client;
+
+  client = calloc(1, sizeof(*client));
+  if (client == NULL) {
+    return NULL;
+  }
+  client->sock = sock;
+  client->protocol = EHLO_PROTOCOL_UNKNOWN;
+  client->last_recv_ms = get_time_ms();
+  timer_init(&client->heartbeat_timer, client);
+  recv_buffer_init(&client->in, EHLO_RECV_BUFFER_SIZE);
+  if (server_mode == SERVER_MODE_THREAD) {
+    create_mutex(&client->out_lock);
+  }
+
+  lock_mutex(&clients_lock);
+  client->id = registry_add(&clients, client);
+  if (client->id >= 0) {
+    old_list = publish_client_list();
+  }
+  unlock_mutex(&clients_lock);
+  if (client->id < 0) {
+    free_client(client);
+    return NULL;
+  }
+  retire_client_list(old_list);
+  return client;
+}
+
+/*
+ * Takes the client out of the registry. Once this returns, the client's ID
+ * can't be resolved anymore and new broadcasts no longer reach it. Those
+ * already under way may still do so until the client is freed, in thread
+ * mode they find its socket closed.
+ */
+static void remove_client(struct client *client)
+{
+  struct client_list *old_list;
+
+  lock_mutex(&clients_lock);
+  registry_remove(&clients, client->id);
+  old_list = publish_client_list();
+  unlock_mutex(&clients_lock);
+  retire_client_list(old_list);
+  if (client->nick[0] != '\0') {
+    lock_mutex(&nicks_lock);
+    nick_table_remove(&nicks, client->nick, (int)strlen(client->nick));
+    unlock_mutex(&nicks_lock);
+  }
+#ifdef HAVE_ZLIB
+  if (client->caps & EHLO_CAP_DEFLATE) {
+    atomic_dec(&num_deflate_clients);
+  }
+#endif
+}
+
+/*
+ * Queues the history after last_seq (all of it for 0) and writes it out
+ * with as few calls as possible. Messages from the history that are still
+ * on their way to the client are skipped when they arrive. Called under
+ * the client's out_lock in thread mode.
+ */
+static void replay_history(struct client *client, uint32_t last_seq)
+{
+  struct history_entry *entry;
+  uint32_t first_seq;
+  int start;
+  int count;
+  int i;
+
+  lock_mutex(&history_lock);
+  expire_history(get_time_ms());
+  first_seq = history.last_seq - history.count + 1;
+  start = last_seq - first_seq < (uint32_t)history.count
+      ? (int)(last_seq - first_seq) + 1
+      : 0;
+  /* Only the newest part of the history if it doesn't fit in the queue */
+  count = history.count - start;
+  if (count > queue_limit - client->out_count) {
+    count = queue_limit > client->out_count
+        ? queue_limit - client->out_count
+        : 0;
+    start = history.count - count;
+  }
+  for (i = 0; i < count; i++) {
+    entry = &history.entries[(history.head + start + i) % history_limit];
+    if (push_client_message(client, entry->message) != 0) {
+      break;
+    }
+  }
+  client->replay_seq = first_seq + start;
+  client->replay_count = i;
+  unlock_mutex(&history_lock);
+
+  if (client->replay_count > 0) {
+#ifdef HAVE_EPOLL
+    if (server_mode == SERVER_MODE_EVENT) {
+      /* Everything goes out together at the end of the loop iteration */
+      if (!client->write_blocked) {
+        schedule_flush(client, 0);
+        client->flush_deadline = 0;
+      }
+    } else
+#endif
+    {
+      flush_client(client);
+    }
+  }
+}
+
+/* last_seq is the last message of the history the client has seen */
+static void join_client(struct client *client, uint32_t last_seq)
+{
+  send_server_message(client, "Welcome to the chat!");
+
+  /*
+   * Other client threads deliver under out_lock, holding it keeps new
+   * messages from getting ahead of the history. They check whether the
+   * client has joined without it, after adding their message to the
+   * history, so the barrier makes sure that either the message is in the
+   * history read below or its sender sees the client as joined.
+   */
+  if (server_mode == SERVER_MODE_THREAD) {
+    lock_mutex(&client->out_lock);
+  }
+  atomic_store_int(&client->joined, 1);
+  atomic_fence();
+  if (history_limit > 0) {
+    replay_history(client, last_seq);
+  }
+  if (server_mode == SERVER_MODE_THREAD) {
+    unlock_mutex(&client->out_lock);
+  }
+
+#ifdef HAVE_EPOLL
+  if (server_mode == SERVER_MODE_EVENT) {
+    unlink_hello_client(client);
+    if (client_needs_heartbeat(client)) {
+      timer_add(&client->shard->timers,
+                &client->heartbeat_timer,
+                client->last_recv_ms + heartbeat_interval_ms);
+    }
+  }
+#endif
+  send_connect_message(client);
+}
+
+static void detect_protocol(struct client *client, int first_byte)
+{
+  /*
+   * Only framed clients start with HELLO (or PEER for other nodes), legacy
+   * ones start with a message.
+   */
+  if (first_byte == EHLO_CMD_HELLO || first_byte == EHLO_CMD_PEER) {
+    client->protocol = EHLO_PROTOCOL_FRAMED;
+  } else {
+    client->protocol = EHLO_PROTOCOL_LEGACY;
+  }
+}
+
+static void report_too_long(struct client *client)
+{
+  char message[64];
+
+  log_warning("Client %d sent a message longer than %d bytes",
+              client->id,
+              EHLO_MAX_MESSAGE_LEN);
+  snprintf(message,
+           sizeof(message),
+           "Message is too long (maximum is %d bytes)",
+           EHLO_MAX_MESSAGE_LEN);
+  send_error(client, message);
+}
+
+/* Adds up the pools of all event loops or the one used in thread mode */
+static void get_pool_stats(struct pool_stats *pool_stats)
+{
+  int i;
+
+  memset(pool_stats, 0, sizeof(*pool_stats));
+  if (server_mode == SERVER_MODE_THREAD) {
+    pool_add_stats(&message_pool, pool_stats);
+    return;
+  }
+#ifdef HAVE_EPOLL
+  if (shards != NULL) {
+    for (i = 0; i < num_shards; i++) {
+      pool_add_stats(&shards[i].message_pool, pool_stats);
+      pool_add_stats(&shards[i].event_pool, pool_stats);
+    }
+  }
+#else
+  (void)i;
+#endif
+}
+
+/*
+ * Adds up the metrics of all event loops (or client threads) and fills in
+ * the gauges. Safe to call from any thread.
+ */
+static void get_metrics_snapshot(struct metrics *snapshot)
+{
+  struct pool_stats pool_stats;
+  struct client *client;
+  uint64_t count;
+  int i;
+
+  metrics_init(snapshot, 0);
+  if (server_mode == SERVER_MODE_THREAD) {
+    metrics_merge(snapshot, &thread_metrics);
+  }
+#ifdef HAVE_EPOLL
+  if (server_mode == SERVER_MODE_EVENT && shards != NULL) {
+    for (i = 0; i < num_shards; i++) {
+      metrics_merge(snapshot, &shards[i].metrics);
+    }
+  }
+#endif
+
+  lock_mutex(&clients_lock);
+  snapshot->gauges[METRIC_CONNECTIONS] = clients.num_active;
+  for (i = 0; i < clients.num_active; i++) {
+    client = clients.active[i];
+    count = atomic_load_int(&client->out_count);
+    snapshot->gauges[METRIC_QUEUED_MESSAGES] += count;
+    if (count > snapshot->gauges[METRIC_MAX_QUEUE_DEPTH]) {
+      snapshot->gauges[METRIC_MAX_QUEUE_DEPTH] = count;
+    }
+  }
+  unlock_mutex(&clients_lock);
+
+  get_pool_stats(&pool_stats);
+  snapshot->gauges[METRIC_POOLED_BYTES] = pool_stats.bytes;
+}
+
+/* Formats a snapshot of the metrics, returns NULL if out of memory */
+static char *format_metrics(int *len)
+{
+  struct metrics *snapshot;
+  char *text;
+
+  snapshot = malloc(sizeof(*snapshot));
+  text = malloc(METRICS_TEXT_SIZE);
+  if (snapshot == NULL || text == NULL) {
+    free(snapshot);
+    free(text);
+    return NULL;
+  }
+  get_metrics_snapshot(snapshot);
+  *len = metrics_format(snapshot, text, METRICS_TEXT_SIZE);
+  free(snapshot);
+  return text;
+}
+
+/*
+ * Sends the metrics one line per STATS frame, followed by an empty frame.
+ * Returns non-zero if the connection should be closed.
+ */
+static int send_stats(struct client *client)
+{
+  char *text;
+  char *line;
+  char *end;
+  int len;
+  int error = 0;
+
+  text = format_metrics(&len);
+  if (text == NULL) {
+    send_error(client, "Out of memory");
+    return 0;
+  }
+  for (line = text; error == 0 && line < text + len; line = end + 1) {
+    end = memchr(line, '\n', text + len - line);
+    if (end == NULL) {
+      end = text + len;
+    }
+    error = send_frame(client,
+                       EHLO_CMD_STATS,
+                       EHLO_LOBBY_ROOM,
+                       EHLO_SERVER_ID,
+                       line,
+                       (int)(end - line) < EHLO_MAX_MESSAGE_LEN
+                           ? (int)(end - line)
+                           : EHLO_MAX_MESSAGE_LEN);
+  }
+  free(text);
+  if (error == 0) {
+    error = send_frame(client,
+                       EHLO_CMD_STATS,
+                       EHLO_LOBBY_ROOM,
+                       EHLO_SERVER_ID,
+                       "",
+                       0);
+  }
+  return error != 0;
+}
+
+/*
+ * Names the other end of a connection for the log. Addresses of the Unix
+ * domain socket are read into a sockaddr_in too, only the family counts.
+ */
+static const char *get_address_name(const struct sockaddr_in *addr)
+{
+#ifndef _WIN32
+  if (addr->sin_family == AF_UNIX) {
+    return "local";
+  }
+#endif
+  return inet_ntoa(addr->sin_addr);
+}
+
+/*
+ * Turns the connection into a link from another node of the cluster. The
+ * link is never joined, so nothing is sent over it but the answer; what
+ * this node relays goes over its own link to the other end. Links are only
+ * taken from the addresses of the configured peers.
+ */
+static int handle_peer(struct client *client,
+                       const struct frame_header *header,
+                       const char *payload,
+                       int len)
+{
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  char buf[32];
+
+  if (client->joined || client->peer) {
+    return 0;
+  }
+  if (node_id < 0) {
+    log_warning("Client %d wants to link a node, but there's no cluster",
+                client->id);
+    send_error(client, "Not a cluster node");
+    return 1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  if (client->local
+      || getpeername(client->sock, (struct sockaddr *)&addr, &addr_len) != 0
+      || !federation_is_peer_address(&federation, &addr)) {
+    log_warning("Client %d from %s wants to link a node, but isn't a peer",
+                client->id,
+                client->local ? "local" : get_address_name(&addr));
+    send_error(client, "Not a peer");
+    return 1;
+  }
+  if (parse_hello(payload, len, NULL, NULL) != EHLO_PROTOCOL_VERSION) {
+    send_error(client, "Unsupported protocol version");
+    return 1;
+  }
+  if (header->sender_id < 0
+      || header->sender_id == node_id
+      || header->sender_id >= REGISTRY_MAX_SLOTS / max_clients) {
+    log_warning("Client %d sent invalid node ID %d",
+                client->id,
+                header->sender_id);
+    send_error(client, "Invalid node ID");
+    return 1;
+  }
+
+  client->peer = 1;
+  client->peer_node = header->sender_id;
+  client->peer_seq = 0;
+#ifdef HAVE_EPOLL
+  if (server_mode == SERVER_MODE_EVENT) {
+    unlink_hello_client(client);
+  }
+#endif
+  len = snprintf(buf, sizeof(buf), "ehlo/%d", EHLO_PROTOCOL_VERSION);
+  if (send_frame(client, EHLO_CMD_PEER, EHLO_LOBBY_ROOM, node_id, buf, len)
+      != 0) {
+    return 1;
+  }
+  log_info("Client %d is a link from node %d", client->id, client->peer_node);
+  return 0;
+}
+
+/*
+ * Delivers a lobby message relayed by another node to the clients of this
+ * one. A gap in the numbers means the other node dropped messages for us.
+ */
+static void handle_relayed_message(struct client *client,
+                                   const struct frame_header *header,
+                                   const char *payload,
+                                   int len)
+{
+  int first_slot = client->peer_node * max_clients;
+  int slot = registry_id_slot(header->sender_id);
+
+  /* Anything not newer than the last message is a duplicate */
+  if (client->peer_seq != 0 && (int32_t)(header->seq - client->peer_seq) <= 0) {
+    return;
+  }
+  if (client->peer_seq != 0 && header->seq != client->peer_seq + 1) {
+    log_warning("Missed %lu messages from node %d",
+                (unsigned long)(header->seq - client->peer_seq - 1),
+                client->peer_node);
+  }
+  client->peer_seq = header->seq;
+
+  /*
+   * Relays go one hop, only the node's own clients can be senders. Nodes
+   * don't relay their own notices, so nothing may pass for this server.
+   */
+  if (header->sender_id < 0
+      || slot < first_slot
+      || slot >= first_slot + max_clients) {
+    log_warning("Node %d relayed a message from client %d of another node",
+                client->peer_node,
+                header->sender_id);
+    return;
+  }
+  broadcast_message(client->shard,
+                    EHLO_LOBBY_ROOM,
+                    header->sender_id,
+                    payload,
+                    len,
+                    0);
+}
+
+/* Returns non-zero if the connection should be closed */
+static int handle_command(struct client *client,
+                          const struct frame_header *header,
+                          const char *payload,
+                          int len)
+{
+  char buf[EHLO_MAX_FRAME_LEN];
+  uint64_t sent_ms;
+  uint32_t last_seq;
+  int room = header->room;
+  int version;
+  int caps;
+#ifdef HAVE_SHM
+  int error;
+#endif
+
+  switch (header->cmd) {
+    case EHLO_CMD_HELLO:
+      if (client->joined) {
+        break;
+      }
+      version = parse_hello(payload, len, &last_seq, &caps);
+      if (version != EHLO_PROTOCOL_VERSION) {
+        log_warning("Client %d requested unsupported protocol version %d",
+                    client->id,
+                    version);
+        send_error(client, "Unsupported protocol version");
+        return 1;
+      }
+#ifdef HAVE_ZLIB
+      if ((caps & EHLO_CAP_DEFLATE) && compress_min_len > 0) {
+        client->caps |= EHLO_CAP_DEFLATE;
+        atomic_inc(&num_deflate_clients);
+      }
+#endif
+#ifdef HAVE_SHM
+      /* Thread mode has nothing to wait on the ring with */
+      if ((caps & EHLO_CAP_SHM)
+          && client->local
+          && server_mode == SERVER_MODE_EVENT) {
+        client->caps |= EHLO_CAP_SHM;
+      }
+#endif
+      len = encode_hello_frame(buf, sizeof(buf), 0, client->caps);
+#ifdef HAVE_SHM
+      if (client->caps & EHLO_CAP_SHM) {
+        error = open_client_ring(client, buf, len);
+        if (error != 0) {
+          log_error("Failed to set up a ring for client %d: %s",
+                    client->id,
+                    error_to_str(error, NULL, 0));
+          return 1;
+        }
+        log_info("Client %d writes through shared memory", client->id);
+        join_client(client, last_seq);
+        break;
+      }
+#endif
+      if (send_frame(client,
+                     EHLO_CMD_HELLO,
+                     EHLO_LOBBY_ROOM,
+                     0,
+                     buf + EHLO_FRAME_HEADER_LEN,
+                     len - EHLO_FRAME_HEADER_LEN) != 0) {
+        return 1;
+      }
+      join_client(client, last_seq);
+      break;
+    case EHLO_CMD_PEER:
+      if (client->protocol != EHLO_PROTOCOL_FRAMED) {
+        break;
+      }
+      return handle_peer(client, header, payload, len);
+    case EHLO_CMD_PING:
+      if (client->protocol == EHLO_PROTOCOL_FRAMED
+          && send_frame(client,
+                        EHLO_CMD_PONG,
+                        EHLO_LOBBY_ROOM,
+                        EHLO_SERVER_ID,
+                        payload,
+                        len) != 0) {
+        return 1;
+      }
+      break;
+    case EHLO_CMD_PONG:
+      /* Our PINGs carry the time they were sent at */
+      if (log_enabled(LOG_DEBUG) && len < (int)sizeof(buf)) {
+        memcpy(buf, payload, len);
+        buf[len] = '\0';
+        sent_ms = strtoull(buf, NULL, 10);
+        log_debug("Client %d answered PING in %llu ms",
+                  client->id,
+                  (unsigned long long)(get_time_ms() - sent_ms));
+      }
+      break;
+    case EHLO_CMD_MESSAGE:
+      if (client->peer) {
+        handle_relayed_message(client, header, payload, len);
+        break;
+      }
+      if (!client->joined) {
+        send_error(client, "Expected HELLO");
+        return 1;
+      }
+      if (room != EHLO_LOBBY_ROOM && !id_set_contains(&client->rooms, room)) {
+        send_error(client, "You're not in that room");
+        break;
+      }
+      send_broadcast_message(client->shard, room, client->id, payload, len);
+      break;
+    case EHLO_CMD_JOIN:
+    case EHLO_CMD_LEAVE:
+      /* Legacy clients have no way to talk to a room */
+      if (client->protocol != EHLO_PROTOCOL_FRAMED) {
+        break;
+      }
+      if (!client->joined) {
+        send_error(client, "Expected HELLO");
+        return 1;
+      }
+      if (header->cmd == EHLO_CMD_JOIN) {
+        return join_room(client, payload, len);
+      }
+      return handle_leave(client, room);
+    case EHLO_CMD_NICK:
+    case EHLO_CMD_DIRECT:
+      if (client->protocol != EHLO_PROTOCOL_FRAMED) {
+        break;
+      }
+      if (!client->joined) {
+        send_error(client, "Expected HELLO");
+        return 1;
+      }
+      if (header->cmd == EHLO_CMD_NICK) {
+        return handle_nick(client, payload, len);
+      }
+      return send_direct_message(client, payload, len);
+    case EHLO_CMD_STATS:
+      if (client->protocol == EHLO_PROTOCOL_FRAMED && client->joined) {
+        return send_stats(client);
+      }
+      break;
+    default:
+      log_warning("Received unknown command %d from client %d",
+                  header->cmd,
+                  client->id);
+      break;
+  }
+  return 0;
+}
+
+/*
+ * Dispatches all complete frames or legacy commands buffered for the client.
+ * Returns non-zero if the connection should be closed.
+ */
+static int process_client_input(struct client *client)
+{
+  struct metrics *metrics = get_metrics(client->shard);
+  struct frame_header header;
+  struct buffer_view payload;
+  char scratch[EHLO_MAX_MESSAGE_LEN];
+#ifdef HAVE_ZLIB
+  char inflated[EHLO_MAX_MESSAGE_LEN];
+#endif
+  const char *data;
+  char first_byte;
+  int data_len;
+  int len;
+  int result;
+
+  client->last_recv_ms = get_time_ms();
+
+  while (client->in.len > 0) {
+    if (client->protocol == EHLO_PROTOCOL_UNKNOWN) {
+      recv_buffer_peek(&client->in, &first_byte, 1);
+      detect_protocol(client, first_byte);
+    }
+
+    if (client->protocol == EHLO_PROTOCOL_FRAMED) {
+      len = recv_buffer_parse_frame(&client->in, &header, &payload);
+    } else {
+      len = recv_buffer_parse_legacy(&client->in, 1, &payload);
+      recv_buffer_peek(&client->in, &first_byte, 1);
+      header.cmd = (int8_t)first_byte;
+      header.flags = 0;
+      header.room = EHLO_LOBBY_ROOM;
+      header.sender_id = 0;
+      header.seq = 0;
+      if (len > 0 && !client->joined) {
+        join_client(client, 0);
+      }
+    }
+    if (len == 0) {
+      break;
+    }
+    if (len < 0) {
+      report_too_long(client);
+      return 1;
+    }
+
+    metrics_add(metrics, METRIC_MESSAGES_IN, 1);
+    metrics_add(metrics, METRIC_BYTES_IN, len);
+    data = buffer_view_linearize(&payload, scratch);
+    data_len = buffer_view_len(&payload);
+    if (header.flags & EHLO_FLAG_DEFLATE) {
+#ifdef HAVE_ZLIB
+      data_len = inflate_client_payload(client, data, data_len, inflated);
+      data = inflated;
+#else
+      data_len = -1;
+#endif
+      if (data_len < 0) {
+        send_error(client, "Malformed compressed message");
+        return 1;
+      }
+    }
+    result = handle_command(client, &header, data, data_len);
+    recv_buffer_consume(&client->in, len);
+    if (result != 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static void *client_thread(void *arg)
+{
+  struct client *client = arg;
+  uint64_t next_heartbeat = 0;
+  uint64_t now;
+  int events;
+  int recv_size;
+  int error;
+
+  /*
+   * The socket is nonblocking so that broadcasts from other threads never
+   * wait for this client; whatever they can't send right away is queued
+   * and written from here once the socket becomes writable.
+   */
+  error = set_socket_nonblocking(client->sock);
+  if (error != 0) {
+    log_error("Failed to set up client %d: %s",
+              client->id,
+              error_to_str(error, NULL, 0));
+    goto out;
+  }
+
+  /* Clients that stay silent are assumed to speak the legacy protocol */
+  if (socket_wait_readable(client->sock, EHLO_HELLO_TIMEOUT_MS) == 0) {
+    client->protocol = EHLO_PROTOCOL_LEGACY;
+    join_client(client, 0);
+  }
+
+  for (;;) {
+    if (atomic_load_int(&client->out_count) > 0) {
+      events = socket_wait(client->sock,
+                           SOCKET_READABLE | SOCKET_WRITABLE,
+                           QUEUE_CHECK_INTERVAL_MS);
+    } else {
+      events = socket_wait(client->sock,
+                           SOCKET_READABLE,
+                           QUEUE_CHECK_INTERVAL_MS);
+    }
+    if (events < 0) {
+      log_info("Failed to wait for client %d: %s",
+               client->id,
+               error_to_str(socket_error(), NULL, 0));
+      break;
+    }
+
+    /* The wait times out often enough for this to be checked on time */
+    if (client->joined && client_needs_heartbeat(client)) {
+      now = get_time_ms();
+      if (next_heartbeat == 0) {
+        next_heartbeat = client->last_recv_ms + heartbeat_interval_ms;
+      } else if (now >= next_heartbeat) {
+        next_heartbeat = check_heartbeat(client, now);
+        if (next_heartbeat == 0) {
+          break;
+        }
+      }
+    }
+
+    if (events & SOCKET_WRITABLE) {
+      lock_mutex(&client->out_lock);
+      error = flush_client(client);
+      unlock_mutex(&client->out_lock);
+      if (error != 0) {
+        log_info("Failed to send data to client %d: %s",
+                 client->id,
+                 error_to_str(error, NULL, 0));
+        break;
+      }
+    }
+
+    if (events & SOCKET_READABLE) {
+      recv_size = recv_buffer_fill(&client->in, client->sock);
+      if (recv_size <= 0) {
+        if (recv_size == 0) {
+          log_info("Client %d disconnected", client->id);
+          break;
+        }
+        error = socket_error();
+        if (socket_would_block(error)) {
+          continue;
+        }
+        log_info("Failed to read command from client %d: %s",
+                 client->id,
+                 error_to_str(error, NULL, 0));
+        break;
+      }
+      if (process_client_input(client) != 0) {
+        break;
+      }
+    }
+  }
+
+out:
+  leave_all_rooms(client);
+  remove_client(client);
+  recv_buffer_free(&client->in);
+  lock_mutex(&client->out_lock);
+  close_socket_nicely(client->sock);
+  client->sock = INVALID_SOCKET;
+  clear_client_queue(client);
+  unlock_mutex(&client->out_lock);
+  if (client->joined) {
+    send_disconnect_message(client);
+  }
+  free_client(client);
+
+  return NULL;
+}
+
+/*
+ * Admission control, checked before a connection takes a client slot. A
+ * rejected connection is reset right away, which leaves nothing behind in
+ * TIME_WAIT. Local clients are always let in. Returns non-zero if the
+ * connection may stay.
+ */
+static int admit_connection(struct metrics *metrics,
+                            socket_t sock,
+                            const struct sockaddr_in *addr)
+{
+  struct linger linger;
+
+  if (accept_rate == 0
+      || addr->sin_family != AF_INET
+      || admission_check(&admission, addr->sin_addr.s_addr, get_time_ms())) {
+    return 1;
+  }
+  metrics_add(metrics, METRIC_REJECTS, 1);
+  log_debug("Rejecting connection from %s", get_address_name(addr));
+  linger.l_onoff = 1;
+  linger.l_linger = 0;
+  setsockopt(sock,
+             SOL_SOCKET,
+             SO_LINGER,
+             (const void *)&linger,
+             sizeof(linger));
+  close_socket(sock);
+  return 0;
+}
+
+static void run_thread_loop(socket_t server_sock)
+{
+  for (;;) {
+    socket_t client_sock;
+    struct sockaddr_in client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+    struct client *client;
+    thread_t thread;
+    int error;
+
+    client_sock = accept(server_sock,
+                         (struct sockaddr *)&client_addr,
+                         &client_addr_len);
+    if (client_sock == INVALID_SOCKET) {
+      log_error("Failed to accept connection: %s",
+                error_to_str(socket_error(), NULL, 0));
+      break;
+    }
+
+    if (!admit_connection(&thread_metrics, client_sock, &client_addr)) {
+      continue;
+    }
+    metrics_add(&thread_metrics, METRIC_ACCEPTS, 1);
+    client = allocate_client(client_sock);
+    if (client == NULL) {
+      log_warning("Aborting connection from %s because reached maximum "
+                  "number of clients",
+                  get_address_name(&client_addr));
+      close_socket_nicely(client_sock);
+      continue;
+    }
+
+#ifndef _WIN32
+    client->local = client_addr.sin_family == AF_UNIX;
+#endif
+    log_info("Client connected: %s (%d)",
+             get_address_name(&client_addr),
+             client->id);
+
+    /* The thread owns the client from now on and frees it when done */
+    error = create_thread(&thread, client_thread, client);
+    if (error != 0) {
+      log_error("Failed to create client thread: %s",
+                error_to_str(error, NULL, 0));
+      remove_client(client);
+      close_socket_nicely(client_sock);
+      free_client(client);
+    }
+  }
+}
+
+/*
+ * Opens a listening socket on the given port. reuse_port lets several
+ * sockets share the port, each getting its own share of the connections.
+ * A loopback socket only takes connections from the local machine.
+ */
+static socket_t open_server_socket(const char *port,
+                                   int reuse_port,
+                                   int loopback)
+{
+  socket_t server_sock;
+  int opt_reuseaddr;
+  struct sockaddr_in server_addr;
+  int error;
+
+  server_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (server_sock == INVALID_SOCKET) {
+    log_error("Failed to open socket: %s",
+              error_to_str(socket_error(), NULL, 0));
+    return INVALID_SOCKET;
+  }
+
+  /*
+   * Allow reuse of this socket address (port) - this makes restarts faster.
+   *
+   * Sockets are usually waited on for some time by the system after they are
+   * closed (netstat shows them in a TIME_WAIT state).
+   */
+  opt_reuseaddr = 1;
+  setsockopt(server_sock,
+             SOL_SOCKET,
+             SO_REUSEADDR,
+             (const void *)&opt_reuseaddr,
+             sizeof(opt_reuseaddr));
+#ifdef SO_REUSEPORT
+  if (reuse_port) {
+    setsockopt(server_sock,
+               SOL_SOCKET,
+               SO_REUSEPORT,
+               (const void *)&opt_reuseaddr,
+               sizeof(opt_reuseaddr));
+  }
+#else
+  (void)reuse_port;
+#endif
+
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_addr.s_addr = htonl(loopback ? INADDR_LOOPBACK : INADDR_ANY);
+  server_addr.sin_port = htons(atoi(port));
+
+  error = bind(server_sock,
+               (struct sockaddr *)&server_addr,
+               sizeof(server_addr));
+  if (error != 0) {
+    log_error("Failed to bind address: %s",
+              error_to_str(socket_error(), NULL, 0));
+    close_socket(server_sock);
+    return INVALID_SOCKET;
+  }
+
+  error = listen(server_sock, listen_backlog);
+  if (error != 0) {
+    log_error("Listen error: %s", error_to_str(socket_error(), NULL, 0));
+    close_socket(server_sock);
+    return INVALID_SOCKET;
+  }
+
+  return server_sock;
+}
+
+#ifndef _WIN32
+
+/*
+ * Opens a listening Unix domain socket at path. A socket that a previous
+ * run left behind is replaced, one that still takes connections is not.
+ */
+static socket_t open_local_socket(const char *path)
+{
+  struct sockaddr_un addr;
+  struct stat st;
+  socket_t sock;
+  int in_use;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    log_error("Socket path is too long: %s", path);
+    return INVALID_SOCKET;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    in_use = connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    close_socket(sock);
+    if (in_use) {
+      log_error("Another server is listening at %s", path);
+      return INVALID_SOCKET;
+    }
+    unlink(path);
+  }
+
+  sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock == INVALID_SOCKET) {
+    log_error("Failed to open socket: %s",
+              error_to_str(socket_error(), NULL, 0));
+    return INVALID_SOCKET;
+  }
+
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    log_error("Failed to bind socket to %s: %s",
+              path,
+              error_to_str(socket_error(), NULL, 0));
+    close_socket(sock);
+    return INVALID_SOCKET;
+  }
+  if (listen(sock, listen_backlog) != 0) {
+    log_error("Listen error: %s", error_to_str(socket_error(), NULL, 0));
+    close_socket(sock);
+    return INVALID_SOCKET;
+  }
+  return sock;
+}
+
+static void *local_accept_thread(void *arg)
+{
+  (void)arg;
+  run_thread_loop(local_sock);
+  return NULL;
+}
+
+#endif /* !_WIN32 */
+
+/* In thread mode the Unix domain socket gets an accept loop of its own */
+static void start_local_thread(void)
+{
+#ifndef _WIN32
+  thread_t thread;
+  int error;
+
+  if (local_sock == INVALID_SOCKET) {
+    return;
+  }
+  error = create_thread(&thread, local_accept_thread, NULL);
+  if (error != 0) {
+    log_error("Failed to create accept thread: %s",
+              error_to_str(error, NULL, 0));
+  }
+#endif
+}
+
+#ifdef HAVE_EPOLL
+
+#ifdef HAVE_IO_URING
+
+static void *get_uring_user_data(uint64_t user_data)
+{
+  return (void *)(uintptr_t)(user_data & ~(uint64_t)URING_OP_MASK);
+}
+
+static uint64_t make_uring_user_data(void *ptr, int op)
+{
+  return (uint64_t)(uintptr_t)ptr | op;
+}
+
+static struct io_uring_sqe *get_shard_sqe(struct shard *shard)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = uring_get_sqe(&shard->ring);
+  if (sqe == NULL) {
+    /* The submission queue is full, hand it over to the kernel */
+    uring_submit(&shard->ring, 0);
+    metrics_add(&shard->metrics, METRIC_RING_SUBMITS, 1);
+    sqe = uring_get_sqe(&shard->ring);
+  }
+  return sqe;
+}
+
+/*
+ * Accepts connections until the listener fails, op tells the TCP listener
+ * (URING_OP_ACCEPT) and the Unix domain socket apart.
+ */
+static void start_uring_accept(struct shard *shard, int op)
+{
+  struct io_uring_sqe *sqe = get_shard_sqe(shard);
+
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = op == URING_OP_ACCEPT ? shard->server_sock : shard->local_sock;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data = make_uring_user_data(shard, op);
+  shard->uring_polls++;
+}
+
+/* Reports every wakeup of the shard until cancelled */
+static void start_uring_wake_poll(struct shard *shard)
+{
+  struct io_uring_sqe *sqe = get_shard_sqe(shard);
+
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = shard->wake_fd;
+  sqe->poll32_events = POLLIN;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = make_uring_user_data(shard, URING_OP_WAKE);
+  shard->uring_polls++;
+}
+
+/*
+ * Receives into a buffer picked by the kernel from the shard's buffer ring.
+ * Like a level-triggered epoll loop this reads once per client and loop
+ * iteration, a multishot receive would let one client queue up more
+ * output for everyone else than their sockets can take in between.
+ */
+static void start_uring_recv(struct client *client)
+{
+  struct io_uring_sqe *sqe = get_shard_sqe(client->shard);
+
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = client->sock;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_RECV_BUFFER_GROUP;
+  sqe->user_data = make_uring_user_data(client, URING_OP_RECV);
+  client->uring_ops++;
+}
+
+/*
+ * Sends as many queued messages as fit in one request. Queued messages
+ * stay pinned until the request completes. Returns 0 or an error code.
+ */
+static int start_uring_send(struct client *client)
+{
+  struct uring_send *send;
+  struct io_uring_sqe *sqe;
+  int len;
+
+  if (client->uring_send == NULL) {
+    client->uring_send = malloc(sizeof(*client->uring_send));
+    if (client->uring_send == NULL) {
+      return ENOMEM;
+    }
+  }
+  send = client->uring_send;
+  memset(&send->msg, 0, sizeof(send->msg));
+  send->msg.msg_iov = send->vec;
+  send->msg.msg_iovlen =
+      get_client_output(client, send->vec, URING_SEND_BATCH, &len);
+  client->out_pinned = (int)send->msg.msg_iovlen;
+
+  sqe = get_shard_sqe(client->shard);
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = client->sock;
+  sqe->addr = (uint64_t)(uintptr_t)&send->msg;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = make_uring_user_data(client, URING_OP_SEND);
+  client->uring_ops++;
+  metrics_add(&client->shard->metrics, METRIC_SEND_CALLS, 1);
+  return 0;
+}
+
+#ifdef HAVE_SHM
+
+/* Waits for the next wakeup from the client's ring */
+static void start_uring_ring_poll(struct client *client)
+{
+  struct io_uring_sqe *sqe = get_shard_sqe(client->shard);
+
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = client->ring.data_fd;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = make_uring_user_data(client, URING_OP_RING);
+  client->uring_ops++;
+}
+
+/* The poll completes as cancelled, the removal itself goes unreported */
+static void stop_uring_ring_poll(struct client *client)
+{
+  struct io_uring_sqe *sqe = get_shard_sqe(client->shard);
+
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->addr = make_uring_user_data(client, URING_OP_RING);
+  sqe->user_data = 0;
+}
+
+#endif /* HAVE_SHM */
+
+#endif /* HAVE_IO_URING */
+
+/*
+ * The client may still be on the flush list or referenced by events that
+ * haven't been handled yet, so it's freed later by free_closed_clients().
+ */
+static void release_closed_client(struct client *client)
+{
+  client->closed_next = client->shard->closed_head;
+  client->shard->closed_head = client;
+}
+
+#ifdef HAVE_SHM
+
+/* Only this end of the ring goes away, the client still has it mapped */
+static void close_client_ring(struct client *client)
+{
+#ifdef HAVE_IO_URING
+  if (client->ring_watched && client_uses_uring(client)) {
+    stop_uring_ring_poll(client);
+    client->ring_watched = 0;
+  }
+#endif
+  /* The client's descriptor would keep the eventfd registered */
+  if (client->ring_watched) {
+    epoll_ctl(client->shard->event_fd,
+              EPOLL_CTL_DEL,
+              client->ring.data_fd,
+              NULL);
+    client->ring_watched = 0;
+  }
+  shm_ring_close(&client->ring);
+}
+
+#endif /* HAVE_SHM */
+
+static void close_client(struct client *client)
+{
+  struct shard *shard = client->shard;
+  int joined = client->joined;
+  int send_pending = client->out_pinned > 0;
+
+  /* Messages held back by batching may include the reason for closing */
+  if (client->out_count > 0 && !client->write_blocked && !send_pending) {
+    flush_client(client);
+  }
+
+  unlink_hello_client(client);
+  timer_remove(&shard->timers, &client->heartbeat_timer);
+  if (client_uses_uring(client)) {
+    /* This ends the requests in flight, their buffers are released then */
+    shutdown(client->sock, SHUT_RDWR);
+  } else {
+    epoll_ctl(shard->event_fd, EPOLL_CTL_DEL, client->sock, NULL);
+  }
+#ifdef HAVE_SHM
+  if (client_has_ring(client)) {
+    close_client_ring(client);
+  }
+#endif
+  close_socket(client->sock);
+  client->sock = INVALID_SOCKET;
+  client->joined = 0;
+
+  recv_buffer_free(&client->in);
+  if (!send_pending) {
+    clear_client_queue(client);
+  }
+  leave_all_rooms(client);
+  registry_remove(&shard->clients, client->local_id);
+  atomic_dec(&shard->num_clients);
+  remove_client(client);
+
+#ifdef HAVE_IO_URING
+  if (client->uring_ops == 0) {
+    release_closed_client(client);
+  }
+#else
+  release_closed_client(client);
+#endif
+
+  if (joined) {
+    send_disconnect_message(client);
+  }
+}
+
+static void free_closed_clients(struct shard *shard)
+{
+  struct client *client;
+
+  while (shard->closed_head != NULL) {
+    client = shard->closed_head;
+    shard->closed_head = client->closed_next;
+    free_client(client);
+  }
+}
+
+#ifdef HAVE_SHM
+
+/*
+ * Moves what the client has written into its ring over to its input
+ * buffer, a buffer's worth at a time, and handles it. Stops when the ring
+ * is empty or a ring's worth has been read. Returns non-zero if the
+ * connection should be closed.
+ */
+static int read_client_ring(struct client *client)
+{
+  struct shm_ring *ring = &client->ring;
+  const char *data;
+  uint32_t total = 0;
+  int len;
+  int error;
+
+  while (total < ring->size) {
+    len = shm_ring_peek(ring, &data);
+    if (len < 0) {
+      log_warning("Client %d corrupted its ring", client->id);
+      return 1;
+    }
+    if (len > client->in.size - client->in.len) {
+      len = client->in.size - client->in.len;
+    }
+    if (len == 0) {
+      break;
+    }
+    error = recv_buffer_append(&client->in, data, len);
+    if (error != 0) {
+      log_error("Failed to read from client %d: %s",
+                client->id,
+                error_to_str(error, NULL, 0));
+      return 1;
+    }
+    shm_ring_consume(ring, len);
+    total += len;
+    if (process_client_input(client) != 0) {
+      return 1;
+    }
+  }
+  recv_buffer_trim(&client->in);
+  return 0;
+}
+
+/* Starts waiting for the client to write into the ring it was given */
+static int watch_client_ring(struct client *client)
+{
+  struct epoll_event event;
+
+  client->ring_watched = 1;
+#ifdef HAVE_IO_URING
+  if (client_uses_uring(client)) {
+    start_uring_ring_poll(client);
+    return 0;
+  }
+#endif
+  event.events = EPOLLIN;
+  event.data.ptr = (char *)client + RING_EVENT_TAG;
+  if (epoll_ctl(client->shard->event_fd,
+                EPOLL_CTL_ADD,
+                client->ring.data_fd,
+                &event) != 0) {
+    client->ring_watched = 0;
+    return errno;
+  }
+  return 0;
+}
+
+/* Makes the loop read the client's ring as if the client had written */
+static void signal_client_ring(struct client *client)
+{
+  uint64_t value = 1;
+
+  if (write(client->ring.data_fd, &value, sizeof(value)) < 0) {
+    log_error("Failed to wake up ring of client %d: %s",
+              client->id,
+              error_to_str(errno, NULL, 0));
+  }
+}
+
+/* Handles a wakeup from the client's ring */
+static void handle_client_ring(struct client *client)
+{
+  shm_ring_clear_signal(client->ring.data_fd);
+  if (read_client_ring(client) != 0) {
+    close_client(client);
+    return;
+  }
+  /* What came in meanwhile waits for the next turn, like a socket would */
+  if (shm_ring_want_data(&client->ring)) {
+    signal_client_ring(client);
+  }
+}
+
+#endif /* HAVE_SHM */
+
+static void handle_client_readable(struct client *client)
+{
+  int recv_size;
+  int error;
+
+  recv_size = recv_buffer_fill(&client->in, client->sock);
+  if (recv_size > 0) {
+    if (process_client_input(client) != 0) {
+      close_client(client);
+      return;
+    }
+#ifdef HAVE_SHM
+    if (client_has_ring(client) && !client->ring_watched) {
+      error = watch_client_ring(client);
+      if (error != 0) {
+        log_error("Failed to watch ring of client %d: %s",
+                  client->id,
+                  error_to_str(error, NULL, 0));
+        close_client(client);
+        return;
+      }
+    }
+#endif
+    /* Give the buffer back if there's no partial frame left in it */
+    recv_buffer_trim(&client->in);
+    return;
+  }
+  if (recv_size == 0) {
+    log_info("Client %d disconnected", client->id);
+#ifdef HAVE_SHM
+    /* Whatever the client wrote before closing is still in its ring */
+    if (client_has_ring(client)) {
+      read_client_ring(client);
+    }
+#endif
+  } else {
+    error = socket_error();
+    if (socket_would_block(error)) {
+      return;
+    }
+    log_info("Failed to read from client %d: %s",
+             client->id,
+             error_to_str(error, NULL, 0));
+  }
+  close_client(client);
+}
+
+static void handle_client_writable(struct client *client)
+{
+  int error;
+
+  error = flush_client(client);
+  if (error != 0) {
+    log_error("Error sending data to client %d: %s",
+              client->id,
+              error_to_str(error, NULL, 0));
+    close_client(client);
+  }
+}
+
+#ifdef HAVE_HANDOFF
+
+/*
+ * Picks up a client from the previous process where it was left: puts it
+ * back into the rooms it had joined, restarts its heartbeat and handles
+ * what it had sent and what it was owed in the meantime.
+ */
+static void resume_client(struct client *client)
+{
+  int pos = 0;
+  int room;
+  int error = 0;
+
+  client->restored = 0;
+  if (!client->joined && !client->peer) {
+    link_hello_client(client);
+  }
+  while (error == 0 && (room = id_set_next(&client->rooms, &pos)) >= 0) {
+    error = add_room_member(client, room);
+  }
+  if (client->joined && client_needs_heartbeat(client)) {
+    timer_add(&client->shard->timers,
+              &client->heartbeat_timer,
+              client->last_recv_ms + heartbeat_interval_ms);
+  }
+#ifdef HAVE_SHM
+  if (error == 0 && client_has_ring(client)) {
+    error = watch_client_ring(client);
+    /* The client doesn't signal if it last saw the old process busy */
+    if (error == 0) {
+      signal_client_ring(client);
+    }
+  }
+#endif
+  if (error != 0) {
+    log_error("Failed to resume client %d: %s",
+              client->id,
+              error_to_str(error, NULL, 0));
+    close_client(client);
+    return;
+  }
+
+  if (client->out_count > 0) {
+    schedule_flush(client, 0);
+    client->flush_deadline = 0;
+  }
+  if (client->in.len > 0 && process_client_input(client) != 0) {
+    close_client(client);
+  }
+}
+
+#endif /* HAVE_HANDOFF */
+
+/* Starts watching a new client from the shard it was assigned to */
+static void attach_client(struct client *client)
+{
+  struct shard *shard = client->shard;
+  int error = 0;
+
+  client->local_id = registry_add(&shard->clients, client);
+  if (client->local_id < 0) {
+    error = ENOMEM;
+#ifdef HAVE_IO_URING
+  } else if (shard->uring_enabled) {
+    /* A frozen shard starts receiving when it's thawed */
+    if (!shard->frozen) {
+      start_uring_recv(client);
+    }
+#endif
+  } else if (update_client_events(client, EPOLL_CTL_ADD) != 0) {
+    error = socket_error();
+    registry_remove(&shard->clients, client->local_id);
+  }
+  if (error != 0) {
+    log_error("Failed to set up client %d: %s",
+              client->id,
+              error_to_str(error, NULL, 0));
+    atomic_dec(&shard->num_clients);
+    remove_client(client);
+    close_socket(client->sock);
+    free_client(client);
+    return;
+  }
+
+#ifdef HAVE_HANDOFF
+  if (client->restored) {
+    resume_client(client);
+    return;
+  }
+#endif
+  /* Wait for HELLO before greeting the client */
+  link_hello_client(client);
+}
+
+static struct shard *pick_shard(struct shard *shard, int least_loaded)
+{
+  struct shard *target = shard;
+  int i;
+
+  if (least_loaded) {
+    for (i = 0; i < num_shards; i++) {
+      if (atomic_load_int(&shards[i].num_clients)
+          < atomic_load_int(&target->num_clients)) {
+        target = &shards[i];
+      }
+    }
+  }
+  return target;
+}
+
+/*
+ * Registers a newly accepted connection and assigns it to a shard. The
+ * socket must have been accepted as non-blocking.
+ */
+static void add_client(struct shard *shard,
+                       socket_t client_sock,
+                       const struct sockaddr_in *addr)
+{
+  struct sockaddr_in client_addr = *addr;
+  struct client *client;
+  int opt_nodelay = 1;
+  int error;
+
+  if (!admit_connection(&shard->metrics, client_sock, &client_addr)) {
+    return;
+  }
+  metrics_add(&shard->metrics, METRIC_ACCEPTS, 1);
+  client = allocate_client(client_sock);
+  if (client == NULL) {
+    log_warning("Aborting connection from %s because reached maximum "
+                "number of clients",
+                get_address_name(&client_addr));
+    close_socket_nicely(client_sock);
+    return;
+  }
+
+  /* Batched output is already coalesced, Nagle's algorithm would delay it */
+  if (batch_writes) {
+    setsockopt(client_sock,
+               IPPROTO_TCP,
+               TCP_NODELAY,
+               (char *)&opt_nodelay,
+               sizeof(opt_nodelay));
+  }
+
+  client->local = client_addr.sin_family == AF_UNIX;
+  log_info("Client connected: %s (%d)",
+           get_address_name(&client_addr),
+           client->id);
+
+  /*
+   * Only the first shard takes local clients, it passes them around. Other
+   * shards may already look at the field to forward direct messages.
+   */
+  atomic_store_ptr(&client->shard,
+                   pick_shard(shard,
+                              shard_balance == BALANCE_LEAST_LOADED
+                              || client->local));
+  atomic_inc(&client->shard->num_clients);
+  if (client->shard == shard) {
+    attach_client(client);
+    return;
+  }
+  error = post_shard_event(shard,
+                           client->shard,
+                           SHARD_EVENT_CLIENT,
+                           NULL,
+                           client);
+  if (error != 0) {
+    log_error("Failed to hand over client %d: %s",
+              client->id,
+              error_to_str(error, NULL, 0));
+    atomic_dec(&client->shard->num_clients);
+    remove_client(client);
+    close_socket(client_sock);
+    free_client(client);
+  }
+}
+
+/*
+ * Takes the pending connections of listen_sock, the TCP listener or the
+ * Unix domain socket, up to MAX_ACCEPT_BATCH of them so that a flood of
+ * connections doesn't hold up the shard's clients. The listener is level
+ * triggered, the rest are picked up on the next iteration.
+ */
+static void handle_server_readable(struct shard *shard, socket_t listen_sock)
+{
+  socket_t client_sock;
+  struct sockaddr_in client_addr;
+  socklen_t client_addr_len;
+  int error;
+  int i;
+
+  for (i = 0; i < MAX_ACCEPT_BATCH; i++) {
+    client_addr_len = sizeof(client_addr);
+    client_sock = accept4(listen_sock,
+                          (struct sockaddr *)&client_addr,
+                          &client_addr_len,
+                          SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_sock == INVALID_SOCKET) {
+      error = socket_error();
+      if (!socket_would_block(error)) {
+        log_error("Failed to accept connection: %s",
+                  error_to_str(error, NULL, 0));
+      }
+      return;
+    }
+    add_client(shard, client_sock, &client_addr);
+  }
+}
+
+/*
+ * Handles broadcasts and new clients passed on by other shards. Returns
+ * the number of events handled.
+ */
+static int handle_shard_inbox(struct shard *shard)
+{
+  struct mpsc_node *node;
+  struct shard_event *event;
+  uint64_t value;
+  int count = 0;
+
+  if (read(shard->wake_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+    log_error("Failed to read wakeup of shard %d: %s",
+              shard->index,
+              error_to_str(errno, NULL, 0));
+  }
+  /* Anything pushed from now on wakes the shard again */
+  atomic_exchange_int(&shard->wake_pending, 0);
+
+  while (count < MAX_INBOX_BATCH
+         && (node = mpsc_queue_pop(&shard->inbox)) != NULL) {
+    count++;
+    event = (struct shard_event *)node;
+    switch (event->type) {
+      case SHARD_EVENT_BROADCAST:
+        fan_out_message(shard, event->message);
+        release_message(event->message);
+        break;
+      case SHARD_EVENT_CLIENT:
+        attach_client(event->client);
+        break;
+      case SHARD_EVENT_DIRECT:
+        deliver_direct_message(shard, event->message);
+        release_message(event->message);
+        break;
+    }
+    pool_free(event);
+  }
+
+  /*
+   * Let the loop write out what has been queued so far before going on,
+   * otherwise a long backlog could overflow the client queues at once.
+   */
+  if (count == MAX_INBOX_BATCH) {
+    wake_shard(shard);
+  }
+  return count;
+}
+
+/*
+ * Handles clients whose HELLO deadline has passed and returns the number
+ * of milliseconds until the next deadline, or -1 if there are none.
+ */
+static int expire_hello_clients(struct shard *shard)
+{
+  uint64_t now = get_time_ms();
+  struct client *client;
+
+  while (shard->hello_head != NULL
+         && shard->hello_head->hello_deadline <= now) {
+    client = shard->hello_head;
+    unlink_hello_client(client);
+    if (client->protocol == EHLO_PROTOCOL_UNKNOWN) {
+      client->protocol = EHLO_PROTOCOL_LEGACY;
+      join_client(client, 0);
+    } else {
+      log_warning("Client %d did not complete the handshake", client->id);
+      close_client(client);
+    }
+  }
+
+  return shard->hello_head != NULL
+      ? (int)(shard->hello_head->hello_deadline - now)
+      : -1;
+}
+
+/*
+ * Checks on the clients whose heartbeat timers went off and returns the
+ * number of milliseconds until the next tick, or -1 if no timer is pending.
+ */
+static int expire_heartbeats(struct shard *shard)
+{
+  uint64_t now = get_time_ms();
+  uint64_t next_check;
+  struct timer *timer;
+  struct client *client;
+
+  timer = timer_wheel_expire(&shard->timers, now);
+  while (timer != NULL) {
+    client = timer->data;
+    timer = timer->next;
+    /* Closing a client may have closed others along the way */
+    if (client->sock == INVALID_SOCKET) {
+      continue;
+    }
+    next_check = check_heartbeat(client, now);
+    if (next_check == 0) {
+      close_client(client);
+    } else {
+      timer_add(&shard->timers, &client->heartbeat_timer, next_check);
+    }
+  }
+
+  return timer_wheel_timeout(&shard->timers, now);
+}
+
+/* Returns the shorter of two event loop timeouts, -1 meaning infinite */
+static int min_timeout(int timeout1, int timeout2)
+{
+  if (timeout1 < 0) {
+    return timeout2;
+  }
+  if (timeout2 < 0) {
+    return timeout1;
+  }
+  return timeout1 < timeout2 ? timeout1 : timeout2;
+}
+
+/*
+ * Writes out the messages batched for clients whose flush deadline has
+ * passed, the others stay on the list. Returns the number of microseconds
+ * until the next deadline or -1 if there is none.
+ */
+static int flush_pending_clients(struct shard *shard)
+{
+  struct client *client;
+  struct client *waiting = NULL;
+  uint64_t now = flush_delay_us > 0 ? get_time_us() : 0;
+  uint64_t next_deadline = 0;
+
+  while (shard->flush_head != NULL) {
+    client = shard->flush_head;
+    shard->flush_head = client->flush_next;
+    if (client->flush_deadline > now
+        && client->sock != INVALID_SOCKET
+        && !client->write_blocked) {
+      if (waiting == NULL || client->flush_deadline < next_deadline) {
+        next_deadline = client->flush_deadline;
+      }
+      client->flush_next = waiting;
+      waiting = client;
+      continue;
+    }
+    client->flush_pending = 0;
+    if (client->sock == INVALID_SOCKET || client->write_blocked) {
+      continue;
+    }
+#ifdef HAVE_IO_URING
+    if (shard->uring_enabled) {
+      /* A send in flight picks up the rest when it completes */
+      if (client->out_pinned == 0 && start_uring_send(client) != 0) {
+        log_error("Out of memory sending to client %d", client->id);
+        close_client(client);
+      }
+      continue;
+    }
+#endif
+    handle_client_writable(client);
+  }
+
+  shard->flush_head = waiting;
+  return waiting != NULL ? (int)(next_deadline - now) : -1;
+}
+
+/* Waits with microsecond resolution where the kernel supports it */
+static int wait_epoll_events(struct shard *shard,
+                             struct epoll_event *events,
+                             int timeout_us)
+{
+#ifdef HAVE_EPOLL_PWAIT2
+  static int pwait2_unsupported;
+  struct timespec ts;
+  int result;
+
+  if (!atomic_load_int(&pwait2_unsupported)) {
+    ts.tv_sec = timeout_us / 1000000;
+    ts.tv_nsec = (long)(timeout_us % 1000000) * 1000;
+    result = epoll_pwait2(shard->event_fd,
+                          events,
+                          EVENT_LOOP_MAX_EVENTS,
+                          timeout_us >= 0 ? &ts : NULL,
+                          NULL);
+    if (result >= 0 || errno != ENOSYS) {
+      return result;
+    }
+    atomic_store_int(&pwait2_unsupported, 1);
+  }
+#endif
+  return epoll_wait(shard->event_fd,
+                    events,
+                    EVENT_LOOP_MAX_EVENTS,
+                    timeout_us > 0 ? (timeout_us + 999) / 1000 : timeout_us);
+}
+
+/*
+ * Runs everything that is due at the end of a loop iteration and returns
+ * the number of microseconds the loop may wait for events.
+ */
+static int get_shard_timeout(struct shard *shard)
+{
+  int timeout_ms;
+
+  timeout_ms = min_timeout(expire_hello_clients(shard),
+                           expire_heartbeats(shard));
+  return min_timeout(timeout_ms >= 0 ? timeout_ms * 1000 : -1,
+                     flush_pending_clients(shard));
+}
+
+static void pin_shard_thread(struct shard *shard)
+{
+  cpu_set_t cpus;
+  long num_cpus;
+  int error;
+
+  num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_cpus <= 0) {
+    return;
+  }
+  CPU_ZERO(&cpus);
+  CPU_SET(shard->index % num_cpus, &cpus);
+  error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  if (error != 0) {
+    log_warning("Failed to pin shard %d to CPU %ld: %s",
+                shard->index,
+                shard->index % num_cpus,
+                error_to_str(error, NULL, 0));
+  }
+}
+
+static int init_shard(struct shard *shard, int index, socket_t server_sock)
+{
+  shard->index = index;
+  shard->server_sock = server_sock;
+  shard->local_sock = INVALID_SOCKET;
+  shard->event_fd = -1;
+  mpsc_queue_init(&shard->inbox);
+  registry_init(&shard->clients, max_clients);
+  timer_wheel_init(&shard->timers, HEARTBEAT_TICK_MS, get_time_ms());
+
+  shard->room_members = calloc(EHLO_MAX_ROOMS, sizeof(*shard->room_members));
+  if (shard->room_members == NULL) {
+    return ENOMEM;
+  }
+  pool_init(&shard->message_pool, sizeof(struct message), POOL_SLAB_OBJECTS, 0);
+  pool_init(&shard->event_pool,
+            sizeof(struct shard_event),
+            POOL_SLAB_OBJECTS,
+            0);
+  metrics_init(&shard->metrics, 0);
+#ifdef HAVE_ZLIB
+  if (compress_min_len > 0 && deflate_codec_init(&shard->codec) != 0) {
+    return ENOMEM;
+  }
+#endif
+
+  shard->wake_fd = eventfd(0, EFD_NONBLOCK);
+  if (shard->wake_fd == -1) {
+    return errno;
+  }
+  if (server_sock != INVALID_SOCKET) {
+    set_socket_nonblocking(server_sock);
+  }
+  return 0;
+}
+
+static int init_epoll_shard(struct shard *shard)
+{
+  struct epoll_event event;
+
+  shard->event_fd = epoll_create1(0);
+  if (shard->event_fd == -1) {
+    return errno;
+  }
+
+  event.events = EPOLLIN;
+  event.data.ptr = &shard->wake_fd;
+  if (epoll_ctl(shard->event_fd, EPOLL_CTL_ADD, shard->wake_fd, &event) != 0) {
+    return errno;
+  }
+
+  /* With least-loaded balancing only the first shard accepts connections */
+  if (shard->server_sock != INVALID_SOCKET) {
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(shard->event_fd,
+                  EPOLL_CTL_ADD,
+                  shard->server_sock,
+                  &event) != 0) {
+      return errno;
+    }
+  }
+  if (shard->local_sock != INVALID_SOCKET) {
+    event.events = EPOLLIN;
+    event.data.ptr = &shard->local_sock;
+    if (epoll_ctl(shard->event_fd,
+                  EPOLL_CTL_ADD,
+                  shard->local_sock,
+                  &event) != 0) {
+      return errno;
+    }
+  }
+  return 0;
+}
+
+#ifdef HAVE_HANDOFF
+
+/*
+ * Stops the shard for a hot upgrade. Shards go quiet first, they stop
+ * taking connections and reading from clients (io_uring shards cancel
+ * their requests before this). Until all of them are quiet they keep
+ * handling their inboxes, after that nobody posts anything anymore. The
+ * last shard to freeze tells the upgrade thread, which then has the state
+ * of all shards to itself until it moves the stage on.
+ */
+static void freeze_shard(struct shard *shard)
+{
+  struct pollfd wake_poll;
+  uint64_t value = 1;
+  int i;
+
+  shard->frozen = 1;
+  wake_poll.fd = shard->wake_fd;
+  wake_poll.events = POLLIN;
+
+  if (atomic_inc(&num_quiet_shards) == num_shards) {
+    for (i = 0; i < num_shards; i++) {
+      wake_shard(&shards[i]);
+    }
+  }
+  while (atomic_load_int(&num_quiet_shards) < num_shards) {
+    poll(&wake_poll, 1, -1);
+    handle_shard_inbox(shard);
+  }
+  while (handle_shard_inbox(shard) == MAX_INBOX_BATCH) {
+    continue;
+  }
+
+  if (atomic_inc(&num_frozen_shards) == num_shards
+      && write(frozen_fd, &value, sizeof(value)) < 0) {
+    log_error("Failed to report frozen shards: %s",
+              error_to_str(errno, NULL, 0));
+  }
+  while (atomic_load_int(&upgrade_stage) == UPGRADE_FREEZING) {
+    poll(&wake_poll, 1, -1);
+    handle_shard_inbox(shard);
+  }
+  shard->frozen = 0;
+  atomic_dec(&num_frozen_shards);
+}
+
+#endif /* HAVE_HANDOFF */
+
+static void run_epoll_loop(struct shard *shard)
+{
+  struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+  int num_events;
+  int timeout;
+  int i;
+
+  for (;;) {
+#ifdef HAVE_HANDOFF
+    if (atomic_load_int(&upgrade_stage) == UPGRADE_FREEZING) {
+      freeze_shard(shard);
+    }
+#endif
+    timeout = get_shard_timeout(shard);
+    free_closed_clients(shard);
+    num_events = wait_epoll_events(shard, events, timeout);
+    if (num_events < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      log_error("Failed to wait for events: %s", error_to_str(errno, NULL, 0));
+      break;
+    }
+
+    for (i = 0; i < num_events; i++) {
+      struct client *client = events[i].data.ptr;
+
+      if (client == NULL) {
+        handle_server_readable(shard, shard->server_sock);
+        continue;
+      }
+      if (events[i].data.ptr == &shard->wake_fd) {
+        handle_shard_inbox(shard);
+        continue;
+      }
+      if (events[i].data.ptr == &shard->local_sock) {
+        handle_server_readable(shard, shard->local_sock);
+        continue;
+      }
+#ifdef HAVE_SHM
+      if ((uintptr_t)client & RING_EVENT_TAG) {
+        client = (struct client *)((char *)client - RING_EVENT_TAG);
+        if (client->sock != INVALID_SOCKET) {
+          handle_client_ring(client);
+        }
+        continue;
+      }
+#endif
+      if ((events[i].events & EPOLLOUT) != 0) {
+        handle_client_writable(client);
+      }
+      if (client->sock != INVALID_SOCKET
+          && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0) {
+        handle_client_readable(client);
+      }
+    }
+  }
+}
+
+#ifdef HAVE_IO_URING
+
+static void handle_uring_accept(struct shard *shard,
+                                const struct io_uring_cqe *cqe,
+                                int op)
+{
+  struct sockaddr_in client_addr;
+  socklen_t client_addr_len = sizeof(client_addr);
+
+  if (cqe->res >= 0) {
+    memset(&client_addr, 0, sizeof(client_addr));
+    getpeername(cqe->res, (struct sockaddr *)&client_addr, &client_addr_len);
+    add_client(shard, cqe->res, &client_addr);
+  } else if (!shard->frozen) {
+    log_error("Failed to accept connection: %s",
+              error_to_str(-cqe->res, NULL, 0));
+  }
+  if ((cqe->flags & IORING_CQE_F_MORE) == 0) {
+    shard->uring_polls--;
+    if (!shard->frozen) {
+      start_uring_accept(shard, op);
+    }
+  }
+}
+
+static void handle_uring_recv(struct client *client,
+                              const struct io_uring_cqe *cqe)
+{
+  struct uring_buf_ring *bufs = &client->shard->recv_bufs;
+  int buf_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  int closed = client->sock == INVALID_SOCKET;
+  int error;
+
+  client->uring_ops--;
+
+  if (cqe->res > 0) {
+    error = 0;
+    if (!closed) {
+      error = recv_buffer_append(&client->in,
+                                 uring_get_buf(bufs, buf_id),
+                                 cqe->res);
+    }
+    uring_recycle_buf(bufs, buf_id);
+    if (closed) {
+      /* Data that arrived after closing */
+    } else if (error != 0) {
+      log_error("Failed to read from client %d: %s",
+                client->id,
+                error_to_str(error, NULL, 0));
+      close_client(client);
+    } else if (client->shard->frozen) {
+      /* It's handled after thawing or by the next process */
+    } else if (process_client_input(client) != 0) {
+      close_client(client);
+    } else {
+      recv_buffer_trim(&client->in);
+#ifdef HAVE_SHM
+      if (client_has_ring(client) && !client->ring_watched) {
+        watch_client_ring(client);
+      }
+#endif
+      /* Get the output out before the next read, as the epoll loop does */
+      flush_pending_clients(client->shard);
+      if (client->sock != INVALID_SOCKET) {
+        start_uring_recv(client);
+      }
+    }
+  } else if (!closed) {
+    if (client->shard->frozen
+        && (cqe->res == -ECANCELED || cqe->res == -ENOBUFS)) {
+      /* Started again when the shard is thawed */
+    } else if (cqe->res == -ENOBUFS) {
+      /* All buffers are in use, try again once some are given back */
+      start_uring_recv(client);
+    } else {
+      if (cqe->res == 0) {
+        log_info("Client %d disconnected", client->id);
+#ifdef HAVE_SHM
+        /* Whatever the client wrote before closing is still in its ring */
+        if (client_has_ring(client)) {
+          read_client_ring(client);
+        }
+#endif
+      } else {
+        log_info("Failed to read from client %d: %s",
+                 client->id,
+                 error_to_str(-cqe->res, NULL, 0));
+      }
+      close_client(client);
+    }
+  }
+
+  /* Clients closed above were released by close_client() if possible */
+  if (closed && client->uring_ops == 0) {
+    release_closed_client(client);
+  }
+}
+
+static void handle_uring_send(struct client *client,
+                              const struct io_uring_cqe *cqe)
+{
+  client->uring_ops--;
+  client->out_pinned = 0;
+
+  if (client->sock == INVALID_SOCKET) {
+    clear_client_queue(client);
+    if (client->uring_ops == 0) {
+      release_closed_client(client);
+    }
+    return;
+  }
+  if (cqe->res == -ECANCELED && client->shard->frozen) {
+    /* Nothing was sent, the queue is sent again later */
+    return;
+  }
+  if (cqe->res < 0) {
+    log_error("Error sending data to client %d: %s",
+              client->id,
+              error_to_str(-cqe->res, NULL, 0));
+    close_client(client);
+    return;
+  }
+
+  consume_client_output(client, cqe->res);
+  if (client->shard->frozen) {
+    return;
+  }
+  if (client->out_count > 0) {
+    if (start_uring_send(client) != 0) {
+      log_error("Out of memory sending to client %d", client->id);
+      close_client(client);
+    }
+  } else {
+    clear_client_queue(client);
+    free(client->uring_send);
+    client->uring_send = NULL;
+  }
+}
+
+#ifdef HAVE_SHM
+
+static void handle_uring_ring(struct client *client,
+                              const struct io_uring_cqe *cqe)
+{
+  client->uring_ops--;
+
+  if (client->sock == INVALID_SOCKET) {
+    /* Cancelled when the client was closed */
+    if (client->uring_ops == 0) {
+      release_closed_client(client);
+    }
+    return;
+  }
+  client->ring_watched = 0;
+  if (client->shard->frozen) {
+    /* The ring is read when it's watched again */
+    return;
+  }
+  if (cqe->res < 0) {
+    log_error("Failed to wait for ring of client %d: %s",
+              client->id,
+              error_to_str(-cqe->res, NULL, 0));
+    close_client(client);
+    return;
+  }
+  handle_client_ring(client);
+  if (client->sock != INVALID_SOCKET) {
+    flush_pending_clients(client->shard);
+  }
+  if (client->sock != INVALID_SOCKET) {
+    watch_client_ring(client);
+  }
+}
+
+#endif /* HAVE_SHM */
+
+static void handle_uring_completion(struct shard *shard,
+                                    const struct io_uring_cqe *cqe)
+{
+  void *ptr = get_uring_user_data(cqe->user_data);
+
+  switch (cqe->user_data & URING_OP_MASK) {
+    case URING_OP_ACCEPT:
+    case URING_OP_ACCEPT_LOCAL:
+      handle_uring_accept(shard, cqe, cqe->user_data & URING_OP_MASK);
+      break;
+    case URING_OP_WAKE:
+      handle_shard_inbox(shard);
+      if ((cqe->flags & IORING_CQE_F_MORE) == 0) {
+        shard->uring_polls--;
+        if (!shard->frozen) {
+          start_uring_wake_poll(shard);
+        }
+      }
+      break;
+    case URING_OP_RECV:
+      handle_uring_recv(ptr, cqe);
+      break;
+    case URING_OP_SEND:
+      handle_uring_send(ptr, cqe);
+      break;
+#ifdef HAVE_SHM
+    case URING_OP_RING:
+      handle_uring_ring(ptr, cqe);
+      break;
+#endif
+  }
+}
+
+/*
+ * Sets up an io_uring instance for the shard. Single issuer rings need
+ * Linux 6.0, which also has everything else used here: multishot accept,
+ * multishot polls and provided buffer rings. Returns 0 or an error code.
+ */
+static int init_uring_shard(struct shard *shard)
+{
+  unsigned required_features = IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+  int error;
+
+  error = uring_init(&shard->ring, URING_ENTRIES, IORING_SETUP_SINGLE_ISSUER);
+  if (error != 0) {
+    return error;
+  }
+  if ((shard->ring.features & required_features) != required_features) {
+    uring_destroy(&shard->ring);
+    return ENOTSUP;
+  }
+  error = uring_init_buf_ring(&shard->ring,
+                              &shard->recv_bufs,
+                              URING_RECV_BUFFER_GROUP,
+                              URING_RECV_BUFFERS,
+                              URING_RECV_BUFFER_SIZE);
+  if (error != 0) {
+    uring_destroy(&shard->ring);
+    return error;
+  }
+
+  shard->uring_enabled = 1;
+  start_uring_wake_poll(shard);
+  if (shard->server_sock != INVALID_SOCKET) {
+    start_uring_accept(shard, URING_OP_ACCEPT);
+  }
+  if (shard->local_sock != INVALID_SOCKET) {
+    start_uring_accept(shard, URING_OP_ACCEPT_LOCAL);
+  }
+  return 0;
+}
+
+#ifdef HAVE_HANDOFF
+
+static int has_uring_requests(const struct shard *shard)
+{
+  int i;
+
+  if (shard->uring_polls > 0) {
+    return 1;
+  }
+  for (i = 0; i < shard->clients.num_active; i++) {
+    if (((struct client *)shard->clients.active[i])->uring_ops > 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Cancels everything the shard has in flight and handles the completions
+ * until nothing is left. What was received up to then stays in the input
+ * buffers, unsent output stays queued.
+ */
+static void cancel_uring_requests(struct shard *shard)
+{
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  struct io_uring_cqe completion;
+
+  shard->frozen = 1;
+  sqe = get_shard_sqe(shard);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+  sqe->user_data = 0;
+
+  while (has_uring_requests(shard)) {
+    if (uring_submit(&shard->ring, 1000) != 0) {
+      break;
+    }
+    while (uring_cq_ready(&shard->ring) > 0) {
+      cqe = uring_peek_cqe(&shard->ring);
+      completion = *cqe;
+      uring_cqe_seen(&shard->ring);
+      handle_uring_completion(shard, &completion);
+    }
+  }
+}
+
+/*
+ * Starts over after an upgrade that didn't happen: handles what came in
+ * while the shard was frozen and sets up its requests again.
+ */
+static void restart_uring_requests(struct shard *shard)
+{
+  struct client *client;
+  int i;
+
+  start_uring_wake_poll(shard);
+  if (shard->server_sock != INVALID_SOCKET) {
+    start_uring_accept(shard, URING_OP_ACCEPT);
+  }
+  if (shard->local_sock != INVALID_SOCKET) {
+    start_uring_accept(shard, URING_OP_ACCEPT_LOCAL);
+  }
+
+  /* Closing a client moves the last one into its place */
+  for (i = shard->clients.num_active - 1; i >= 0; i--) {
+    client = shard->clients.active[i];
+    if (client->in.len > 0 && process_client_input(client) != 0) {
+      close_client(client);
+      continue;
+    }
+    start_uring_recv(client);
+#ifdef HAVE_SHM
+    if (client_has_ring(client) && watch_client_ring(client) == 0) {
+      signal_client_ring(client);
+    }
+#endif
+    if (client->out_count > 0) {
+      schedule_flush(client, 0);
+      client->flush_deadline = 0;
+    }
+  }
+}
+
+#endif /* HAVE_HANDOFF */
+
+/*
+ * Same as run_epoll_loop() but every read and write is a request on the
+ * ring, so the requests made during one iteration (say, a send to every
+ * client for a broadcast) go to the kernel with a single system call.
+ */
+static void run_uring_loop(struct shard *shard)
+{
+  struct io_uring_cqe *cqe;
+  struct io_uring_cqe completion;
+  unsigned num_events;
+  unsigned i;
+  int timeout;
+  int error;
+
+  for (;;) {
+#ifdef HAVE_HANDOFF
+    if (atomic_load_int(&upgrade_stage) == UPGRADE_FREEZING) {
+      cancel_uring_requests(shard);
+      freeze_shard(shard);
+      restart_uring_requests(shard);
+    }
+#endif
+    timeout = get_shard_timeout(shard);
+    free_closed_clients(shard);
+    error = uring_submit(&shard->ring, timeout != 0 ? timeout : 1);
+    metrics_add(&shard->metrics, METRIC_RING_SUBMITS, 1);
+    if (error != 0) {
+      log_error("Failed to wait for completions: %s",
+                error_to_str(error, NULL, 0));
+      break;
+    }
+
+    /*
+     * Completions posted while handling these (a wakeup is posted as soon
+     * as the eventfd is written) wait until output has been flushed.
+     */
+    num_events = uring_cq_ready(&shard->ring);
+    if (num_events > EVENT_LOOP_MAX_EVENTS) {
+      num_events = EVENT_LOOP_MAX_EVENTS;
+    }
+    for (i = 0; i < num_events; i++) {
+      cqe = uring_peek_cqe(&shard->ring);
+      completion = *cqe;
+      uring_cqe_seen(&shard->ring);
+      handle_uring_completion(shard, &completion);
+    }
+  }
+}
+
+#endif /* HAVE_IO_URING */
+
+static void run_shard(struct shard *shard)
+{
+  int error;
+
+  if (pin_cpus) {
+    pin_shard_thread(shard);
+  }
+
+#ifdef HAVE_IO_URING
+  if (io_backend == IO_BACKEND_URING) {
+    error = init_uring_shard(shard);
+    if (error == 0) {
+      run_uring_loop(shard);
+      return;
+    }
+    log_warning("io_uring is not available, shard %d uses epoll: %s",
+                shard->index,
+                error_to_str(error, NULL, 0));
+  }
+#endif
+
+  error = init_epoll_shard(shard);
+  if (error != 0) {
+    log_error("Failed to set up event loop: %s", error_to_str(error, NULL, 0));
+    exit(EXIT_FAILURE);
+  }
+  run_epoll_loop(shard);
+}
+
+static void *shard_thread(void *arg)
+{
+  run_shard(arg);
+  return NULL;
+}
+
+/*
+ * Sets up all shards and starts every one but the first in its own thread,
+ * the caller runs the first one. Returns 0 or an error code.
+ */
+static int start_shards(socket_t server_sock, const char *port)
+{
+  socket_t shard_sock;
+  thread_t thread;
+  int error;
+  int i;
+
+  shards = calloc(num_shards, sizeof(*shards));
+  if (shards == NULL) {
+    return ENOMEM;
+  }
+
+  for (i = 0; i < num_shards; i++) {
+    if (i == 0) {
+      shard_sock = server_sock;
+#ifdef HAVE_HANDOFF
+    } else if (inherited_listeners != NULL
+               && inherited_listeners[i] != INVALID_SOCKET) {
+      shard_sock = inherited_listeners[i];
+#endif
+    } else if (shard_balance == BALANCE_REUSEPORT) {
+      shard_sock = open_server_socket(port, 1, 0);
+      if (shard_sock == INVALID_SOCKET) {
+        return socket_error();
+      }
+    } else {
+      shard_sock = INVALID_SOCKET;
+    }
+    error = init_shard(&shards[i], i, shard_sock);
+    if (error != 0) {
+      return error;
+    }
+  }
+  if (local_sock != INVALID_SOCKET) {
+    shards[0].local_sock = local_sock;
+    set_socket_nonblocking(local_sock);
+  }
+
+  for (i = 1; i < num_shards; i++) {
+    error = create_thread(&thread, shard_thread, &shards[i]);
+    if (error != 0) {
+      return error;
+    }
+  }
+  return 0;
+}
+
+#ifdef HAVE_HANDOFF
+
+/* Records of a hot upgrade, see ehlo-handoff.h for how they travel */
+enum {
+  HANDOFF_READY = 1, /* from the new process: uint32_t HANDOFF_VERSION */
+  HANDOFF_LISTENER,  /* struct handoff_listener and the socket */
+  HANDOFF_ROOM,      /* struct handoff_room */
+  HANDOFF_HISTORY,   /* struct handoff_history and the text */
+  HANDOFF_SERVER,    /* struct handoff_server */
+  HANDOFF_CLIENT,    /* struct handoff_client and its descriptors */
+  HANDOFF_OUTPUT,    /* a message queued for the last client, as encoded */
+  HANDOFF_END,
+  HANDOFF_DONE       /* from the new process once it has everything */
+};
+
+enum {
+  LISTENER_TCP, /* of the shard given by index */
+  LISTENER_LOCAL,
+  LISTENER_ADMIN
+};
+
+struct handoff_listener {
+  int32_t kind;
+  int32_t index;
+};
+
+struct handoff_room {
+  int32_t id;
+  int32_t num_members;
+  char name[EHLO_MAX_ROOM_NAME_LEN + 1];
+};
+
+/* The monotonic clock is the same for all processes */
+struct handoff_history {
+  uint32_t seq;
+  int32_t sender_id;
+  uint64_t time_ms;
+};
+
+struct handoff_server {
+  uint32_t last_seq;
+  int32_t next_room_id;
+};
+
+/*
+ * Followed by num_rooms room numbers (int32_t) and in_len bytes of input.
+ * The socket comes with it, and the three descriptors of the ring if the
+ * client has one.
+ */
+struct handoff_client {
+  int32_t id;
+  int32_t shard;
+  int32_t protocol;
+  int32_t caps;
+  int32_t local;
+  int32_t joined;
+  int32_t peer;
+  int32_t peer_node;
+  uint32_t peer_seq;
+  uint32_t replay_seq;
+  int32_t replay_count;
+  uint32_t ring_pos;
+  uint64_t last_recv_ms;
+  uint64_t ping_sent_ms;
+  int32_t num_rooms;
+  int32_t in_len;
+  char nick[EHLO_MAX_NICK_LEN + 1];
+};
+
+static int hand_over_listener(struct handoff *handoff,
+                              int kind,
+                              int index,
+                              socket_t sock)
+{
+  struct handoff_listener listener;
+
+  listener.kind = kind;
+  listener.index = index;
+  return handoff_put(handoff,
+                     HANDOFF_LISTENER,
+                     &listener,
+                     sizeof(listener),
+                     &sock,
+                     1);
+}
+
+/* Sends the listeners, the rooms and the history */
+static int hand_over_server(struct handoff *handoff)
+{
+  char buf[sizeof(struct handoff_history) + EHLO_MAX_MESSAGE_LEN];
+  struct handoff_history record;
+  struct handoff_server server;
+  struct handoff_room room;
+  struct history_entry *entry;
+  int error = 0;
+  int len;
+  int i;
+
+  for (i = 0; i < num_shards && error == 0; i++) {
+    if (shards[i].server_sock != INVALID_SOCKET) {
+      error = hand_over_listener(handoff,
+                                 LISTENER_TCP,
+                                 i,
+                                 shards[i].server_sock);
+    }
+  }
+  if (error == 0 && local_sock != INVALID_SOCKET) {
+    error = hand_over_listener(handoff, LISTENER_LOCAL, 0, local_sock);
+  }
+  if (error == 0 && admin_sock != INVALID_SOCKET) {
+    error = hand_over_listener(handoff, LISTENER_ADMIN, 0, admin_sock);
+  }
+
+  lock_mutex(&rooms_lock);
+  for (i = EHLO_LOBBY_ROOM + 1; i < EHLO_MAX_ROOMS && error == 0; i++) {
+    if (rooms[i] != NULL) {
+      memset(&room, 0, sizeof(room));
+      room.id = i;
+      room.num_members = rooms[i]->num_members;
+      strcpy(room.name, rooms[i]->name);
+      error = handoff_put(handoff, HANDOFF_ROOM, &room, sizeof(room), NULL, 0);
+    }
+  }
+  server.next_room_id = next_room_id;
+  unlock_mutex(&rooms_lock);
+
+  lock_mutex(&history_lock);
+  for (i = 0; i < history.count && error == 0; i++) {
+    entry = &history.entries[(history.head + i) % history_limit];
+    record.seq = entry->message->seq;
+    record.sender_id = entry->message->sender_id;
+    record.time_ms = entry->time_ms;
+    len = entry->message->frame_len - EHLO_FRAME_HEADER_LEN;
+    memcpy(buf, &record, sizeof(record));
+    memcpy(buf + sizeof(record),
+           entry->message->frame + EHLO_FRAME_HEADER_LEN,
+           len);
+    error = handoff_put(handoff,
+                        HANDOFF_HISTORY,
+                        buf,
+                        (int)sizeof(record) + len,
+                        NULL,
+                        0);
+  }
+  server.last_seq = history.last_seq;
+  unlock_mutex(&history_lock);
+
+  if (error != 0) {
+    return error;
+  }
+  return handoff_put(handoff, HANDOFF_SERVER, &server, sizeof(server), NULL, 0);
+}
+
+/*
+ * Sends a client and the messages queued for it. buf must have room for
+ * HANDOFF_MAX_RECORD_LEN bytes.
+ */
+static int hand_over_client(struct handoff *handoff,
+                            struct client *client,
+                            char *buf)
+{
+  struct handoff_client record;
+  struct message *message;
+  const char *data;
+  int fds[4];
+  int num_fds = 0;
+  int32_t room;
+  int pos = 0;
+  int len;
+  int error;
+  int i;
+
+  memset(&record, 0, sizeof(record));
+  record.id = client->id;
+  record.shard = client->shard->index;
+  record.protocol = client->protocol;
+  record.caps = client->caps;
+  record.local = client->local;
+  record.joined = client->joined;
+  record.peer = client->peer;
+  record.peer_node = client->peer_node;
+  record.peer_seq = client->peer_seq;
+  record.replay_seq = client->replay_seq;
+  record.replay_count = client->replay_count;
+  record.last_recv_ms = client->last_recv_ms;
+  record.ping_sent_ms = client->ping_sent_ms;
+  strcpy(record.nick, client->nick);
+  fds[num_fds++] = client->sock;
+#ifdef HAVE_SHM
+  if (client_has_ring(client)) {
+    record.ring_pos = client->ring.pos;
+    fds[num_fds++] = client->ring.mem_fd;
+    fds[num_fds++] = client->ring.data_fd;
+    fds[num_fds++] = client->ring.space_fd;
+  }
+#endif
+
+  len = sizeof(record);
+  while ((room = id_set_next(&client->rooms, &pos)) >= 0) {
+    memcpy(buf + len, &room, sizeof(room));
+    len += sizeof(room);
+    record.num_rooms++;
+  }
+  record.in_len = recv_buffer_peek(&client->in, buf + len, client->in.len);
+  len += record.in_len;
+  memcpy(buf, &record, sizeof(record));
+  error = handoff_put(handoff, HANDOFF_CLIENT, buf, len, fds, num_fds);
+
+  for (i = 0; i < client->out_count && error == 0; i++) {
+    message = client->out_queue[
+        (client->out_head + i) & (client->out_capacity - 1)];
+    data = get_message_data(message, client, &len);
+    if (i == 0) {
+      data += client->out_offset;
+      len -= client->out_offset;
+    }
+    error = handoff_put(handoff, HANDOFF_OUTPUT, data, len, NULL, 0);
+  }
+  return error;
+}
+
+/* Sends everything, called while all shards are frozen */
+static int hand_over_state(struct handoff *handoff, int *num_clients)
+{
+  struct shard *shard;
+  char *buf;
+  int error;
+  int i;
+  int j;
+
+  buf = malloc(HANDOFF_MAX_RECORD_LEN);
+  if (buf == NULL) {
+    return ENOMEM;
+  }
+  error = hand_over_server(handoff);
+  for (i = 0; i < num_shards && error == 0; i++) {
+    shard = &shards[i];
+    for (j = 0; j < shard->clients.num_active && error == 0; j++) {
+      error = hand_over_client(handoff, shard->clients.active[j], buf);
+      (*num_clients)++;
+    }
+  }
+  free(buf);
+  if (error == 0) {
+    error = handoff_put(handoff, HANDOFF_END, NULL, 0, NULL, 0);
+  }
+  if (error == 0) {
+    error = handoff_flush(handoff);
+  }
+  return error;
+}
+
+static void freeze_shards(void)
+{
+  uint64_t value;
+  int i;
+
+  atomic_store_int(&upgrade_stage, UPGRADE_FREEZING);
+  for (i = 0; i < num_shards; i++) {
+    wake_shard(&shards[i]);
+  }
+  while (read(frozen_fd, &value, sizeof(value)) < 0 && errno == EINTR) {
+    continue;
+  }
+}
+
+static void thaw_shards(void)
+{
+  int i;
+
+  atomic_store_int(&upgrade_stage, UPGRADE_IDLE);
+  for (i = 0; i < num_shards; i++) {
+    wake_shard(&shards[i]);
+  }
+  while (atomic_load_int(&num_frozen_shards) > 0) {
+    sleep_ms(1);
+  }
+  atomic_store_int(&num_quiet_shards, 0);
+}
+
+/*
+ * Runs in the child between fork() and exec(). Client sockets aren't
+ * opened with FD_CLOEXEC, so everything but the channel is closed here.
+ */
+static void close_inherited_fds(int keep_fd, int max_fd)
+{
+  int fd;
+
+#ifdef CLOSE_RANGE_CLOEXEC
+  if (close_range(3, ~0U, CLOSE_RANGE_CLOEXEC) == 0) {
+    fcntl(keep_fd, F_SETFD, 0);
+    return;
+  }
+#endif
+  for (fd = 3; fd < max_fd; fd++) {
+    if (fd != keep_fd) {
+      close(fd);
+    }
+  }
+  fcntl(keep_fd, F_SETFD, 0);
+}
+
+/*
+ * Starts the new server with the same arguments and the other end of the
+ * channel as --inherit-fd. Returns 0 or an error code.
+ */
+static int start_successor(struct handoff *handoff, pid_t *pid)
+{
+  socket_t channel[2];
+  char fd_arg[16];
+  char **argv;
+  int argc = 0;
+  int max_fd;
+  int error;
+  int i;
+
+  for (i = 0; server_argv[i] != NULL; i++) {
+    continue;
+  }
+  argv = malloc((i + 3) * sizeof(*argv));
+  if (argv == NULL) {
+    return ENOMEM;
+  }
+  /* Leave out the channel this process got if it took over itself */
+  for (i = 0; server_argv[i] != NULL; i++) {
+    if (strcmp(server_argv[i], "--inherit-fd") == 0
+        && server_argv[i + 1] != NULL) {
+      i++;
+      continue;
+    }
+    argv[argc++] = server_argv[i];
+  }
+
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, channel) != 0) {
+    error = errno;
+    free(argv);
+    return error;
+  }
+  error = handoff_open(handoff, channel[0], HANDOFF_TIMEOUT_MS);
+  if (error != 0) {
+    handoff_close(handoff);
+    close_socket(channel[1]);
+    free(argv);
+    return error;
+  }
+  snprintf(fd_arg, sizeof(fd_arg), "%d", channel[1]);
+  argv[argc++] = "--inherit-fd";
+  argv[argc++] = fd_arg;
+  argv[argc] = NULL;
+  max_fd = (int)sysconf(_SC_OPEN_MAX);
+
+  *pid = fork();
+  if (*pid == 0) {
+    close_inherited_fds(channel[1], max_fd);
+    execvp(argv[0], argv);
+    _exit(127);
+  }
+  error = *pid < 0 ? errno : 0;
+  close_socket(channel[1]);
+  free(argv);
+  if (error != 0) {
+    handoff_close(handoff);
+  }
+  return error;
+}
+
+/* Waits for a record of the given type with len bytes of data */
+static int expect_record(struct handoff *handoff,
+                         int expected_type,
+                         const char **data,
+                         int len)
+{
+  int fds[EHLO_MAX_PASSED_FDS];
+  int num_fds;
+  int record_len;
+  int type;
+  int error;
+
+  error = handoff_get(handoff, &type, data, &record_len, fds, &num_fds);
+  if (error != 0) {
+    return error;
+  }
+  while (num_fds > 0) {
+    close(fds[--num_fds]);
+  }
+  return type == expected_type && record_len == len ? 0 : EPROTO;
+}
+
+/*
+ * Hands the server over to a new process started from the same binary
+ * path, which may have been replaced with a newer build by now. The
+ * shards are frozen only once the new process has started and said hello,
+ * so clients notice the upgrade as a pause while the state is copied over.
+ * Either this process exits or it goes on as if nothing had happened.
+ */
+static void upgrade_server(void)
+{
+  struct handoff handoff;
+  const char *data;
+  uint64_t start;
+  uint32_t version;
+  pid_t pid;
+  int num_clients = 0;
+  int error;
+
+  if (server_mode != SERVER_MODE_EVENT) {
+    log_warning("Hot upgrades need event mode, ignoring SIGUSR2");
+    return;
+  }
+  error = start_successor(&handoff, &pid);
+  if (error != 0) {
+    log_error("Failed to start a new server: %s",
+              error_to_str(error, NULL, 0));
+    return;
+  }
+  log_info("Started process %d to take over", (int)pid);
+
+  error = expect_record(&handoff, HANDOFF_READY, &data, sizeof(version));
+  if (error == 0) {
+    memcpy(&version, data, sizeof(version));
+    if (version != HANDOFF_VERSION) {
+      error = EPROTONOSUPPORT;
+    }
+  }
+  if (error == 0) {
+    start = get_time_ms();
+    freeze_shards();
+    error = hand_over_state(&handoff, &num_clients);
+    if (error == 0) {
+      error = expect_record(&handoff, HANDOFF_DONE, &data, 0);
+    }
+    if (error == 0) {
+      log_info("Handed over %d clients to process %d in %llu ms",
+               num_clients,
+               (int)pid,
+               (unsigned long long)(get_time_ms() - start));
+#ifdef HAVE_JOURNAL
+      /* The new process opens the journal once this one is gone */
+      if (journal_dir != NULL) {
+        journal_stop(&journal);
+      }
+#endif
+      /* The sockets live on in the new process, so no shutdown here */
+      exit(EXIT_SUCCESS);
+    }
+    thaw_shards();
+  }
+
+  log_error("Failed to hand over to process %d: %s",
+            (int)pid,
+            error_to_str(error, NULL, 0));
+  handoff_close(&handoff);
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+}
+
+static void handle_upgrade_signal(int signum)
+{
+  uint64_t value = 1;
+
+  (void)signum;
+  if (write(upgrade_fd, &value, sizeof(value)) < 0) {
+    /* An upgrade is pending already */
+  }
+}
+
+static void *upgrade_thread(void *arg)
+{
+  uint64_t value;
+
+  (void)arg;
+  for (;;) {
+    if (read(upgrade_fd, &value, sizeof(value)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      log_error("Failed to wait for upgrades: %s",
+                error_to_str(errno, NULL, 0));
+      break;
+    }
+    upgrade_server();
+  }
+  return NULL;
+}
+
+/* Upgrades are started by SIGUSR2 and run in a thread of their own */
+static void start_upgrade_thread(char **argv)
+{
   thread_t thread;
-} clients[EHLO_MAX_CLIENTS];
+  int error;
+
+  server_argv = argv;
+  upgrade_fd = eventfd(0, EFD_CLOEXEC);
+  frozen_fd = eventfd(0, EFD_CLOEXEC);
+  if (upgrade_fd == -1 || frozen_fd == -1) {
+    log_error("Failed to set up hot upgrades: %s",
+              error_to_str(errno, NULL, 0));
+    return;
+  }
+  error = create_thread(&thread, upgrade_thread, NULL);
+  if (error != 0) {
+    log_error("Failed to create upgrade thread: %s",
+              error_to_str(error, NULL, 0));
+    return;
+  }
+  signal(SIGUSR2, handle_upgrade_signal);
+}
 
-static int send_message(socket_t sock, int sender_id, const char *message)
+static void restore_listener(const struct handoff_listener *listener,
+                             socket_t sock)
 {
-  int8_t cmd = EHLO_CMD_MESSAGE;
-  int16_t client_id = htons(sender_id);
-  int result;
+  switch (listener->kind) {
+    case LISTENER_TCP:
+      if (listener->index >= 0
+          && listener->index < num_shards
+          && inherited_listeners[listener->index] == INVALID_SOCKET) {
+        inherited_listeners[listener->index] = sock;
+        return;
+      }
+      break;
+    case LISTENER_LOCAL:
+      if (local_path != NULL && local_sock == INVALID_SOCKET) {
+        local_sock = sock;
+        return;
+      }
+      break;
+    case LISTENER_ADMIN:
+      if (admin_port != NULL && admin_sock == INVALID_SOCKET) {
+        admin_sock = sock;
+        return;
+      }
+      break;
+  }
+  /* Not needed with the options this process was given */
+  close_socket(sock);
+}
 
-  result = send_n(sock, (char *)&cmd, 1, 0);
-  if (result <= 0) {
-    return socket_error();
+static int restore_room(const char *data, int len)
+{
+  struct handoff_room record;
+  struct room *room;
+
+  if (len != sizeof(record)) {
+    return EPROTO;
   }
-  result = send_n(sock, (char *)&client_id, sizeof(client_id), 0);
-  if (result <= 0) {
-    return socket_error();
+  memcpy(&record, data, len);
+  if (record.id <= EHLO_LOBBY_ROOM
+      || record.id >= EHLO_MAX_ROOMS
+      || rooms[record.id] != NULL) {
+    return EPROTO;
   }
-  result = send_n(sock, message, (int)(strlen(message) + 1), 0);
-  if (result <= 0) {
-    return socket_error();
+  room = malloc(sizeof(*room));
+  if (room == NULL) {
+    return ENOMEM;
+  }
+  room->num_members = record.num_members;
+  memcpy(room->name, record.name, sizeof(room->name));
+  room->name[EHLO_MAX_ROOM_NAME_LEN] = '\0';
+  rooms[record.id] = room;
+  return 0;
+}
+
+static int restore_history(const char *data, int len)
+{
+  struct handoff_history record;
+  struct message *message;
+
+  if (len < (int)sizeof(record)
+      || len - (int)sizeof(record) > EHLO_MAX_MESSAGE_LEN) {
+    return EPROTO;
+  }
+  if (history_limit == 0) {
+    return 0;
+  }
+  memcpy(&record, data, sizeof(record));
+  message = create_message(NULL,
+                           EHLO_CMD_MESSAGE,
+                           EHLO_LOBBY_ROOM,
+                           record.sender_id,
+                           record.seq,
+                           data + sizeof(record),
+                           len - (int)sizeof(record));
+  if (message == NULL) {
+    return ENOMEM;
+  }
+  push_history(message, record.time_ms);
+  release_message(message);
+  return 0;
+}
+
+static int restore_server(const char *data, int len)
+{
+  struct handoff_server record;
+
+  if (len != sizeof(record)) {
+    return EPROTO;
+  }
+  memcpy(&record, data, len);
+  history.last_seq = record.last_seq;
+  if (record.next_room_id > EHLO_LOBBY_ROOM
+      && record.next_room_id < EHLO_MAX_ROOMS) {
+    next_room_id = record.next_room_id;
   }
   return 0;
 }
 
-static int send_server_message(socket_t sock, const char *message)
+/* Frees a client taken over that never made it into a shard */
+static void discard_restored_client(struct client *client)
 {
-  return send_message(sock, EHLO_SERVER_ID, message);
+#ifdef HAVE_SHM
+  shm_ring_close(&client->ring);
+#endif
+  close_socket(client->sock);
+  recv_buffer_free(&client->in);
+  clear_client_queue(client);
+  id_set_free(&client->rooms);
+  free_client(client);
 }
 
-static void send_broadcast_message(int sender_id, const char *message)
+/*
+ * Sets up a client of the old process. It's registered under the same ID
+ * but joins its shard only after the shards have started. The descriptors
+ * belong to the client from now on, even if this fails.
+ */
+static int restore_client(const char *data,
+                          int len,
+                          const int *fds,
+                          int num_fds,
+                          struct client **client_ptr)
 {
+  struct restored_client *restored;
+  struct handoff_client record;
+  struct client *client;
+  int32_t room;
+  int error = 0;
   int i;
+
+  memset(&record, 0, sizeof(record));
+  if (len >= (int)sizeof(record)) {
+    memcpy(&record, data, sizeof(record));
+  }
+  if (len < (int)sizeof(record)
+      || record.num_rooms < 0
+      || record.num_rooms > EHLO_MAX_ROOMS
+      || record.in_len < 0
+      || record.in_len > EHLO_RECV_BUFFER_SIZE
+      || len != (int)sizeof(record)
+                + record.num_rooms * (int)sizeof(room)
+                + record.in_len
+      || (num_fds != 1 && num_fds != 4)) {
+    error = EPROTO;
+  }
+  restored = realloc(restored_clients,
+                     (num_restored_clients + 1) * sizeof(*restored));
+  if (restored != NULL) {
+    restored_clients = restored;
+  }
+  client = calloc(1, sizeof(*client));
+  if (client == NULL || restored == NULL || error != 0) {
+    free(client);
+    for (i = 0; i < num_fds; i++) {
+      close(fds[i]);
+    }
+    return error != 0 ? error : ENOMEM;
+  }
+  data += sizeof(record);
+
+  client->id = record.id;
+  client->sock = fds[0];
+  client->protocol = record.protocol;
+  client->caps = record.caps;
+  client->local = record.local;
+  client->joined = record.joined;
+  client->peer = record.peer;
+  client->peer_node = record.peer_node;
+  client->peer_seq = record.peer_seq;
+  client->replay_seq = record.replay_seq;
+  client->replay_count = record.replay_count;
+  client->last_recv_ms = record.last_recv_ms;
+  client->ping_sent_ms = record.ping_sent_ms;
+  client->restored = 1;
+  timer_init(&client->heartbeat_timer, client);
+  recv_buffer_init(&client->in, EHLO_RECV_BUFFER_SIZE);
+
+  if (num_fds == 4) {
+#ifdef HAVE_SHM
+    error = shm_ring_attach(&client->ring, fds[1], fds[2], fds[3]);
+    client->ring.pos = record.ring_pos;
+#else
+    close(fds[1]);
+    close(fds[2]);
+    close(fds[3]);
+    error = EPROTO;
+#endif
+  }
+  for (i = 0; i < record.num_rooms && error == 0; i++) {
+    memcpy(&room, data, sizeof(room));
+    data += sizeof(room);
+    if (room <= EHLO_LOBBY_ROOM || room >= EHLO_MAX_ROOMS) {
+      error = EPROTO;
+    } else if (id_set_add(&client->rooms, room) < 0) {
+      error = ENOMEM;
+    }
+  }
+  if (error == 0 && record.in_len > 0) {
+    error = recv_buffer_append(&client->in, data, record.in_len);
+  }
+  if (error == 0) {
+    lock_mutex(&clients_lock);
+    if (registry_add_id(&clients, client->id, client) != 0) {
+      error = EEXIST;
+    }
+    unlock_mutex(&clients_lock);
+  }
+  if (error != 0) {
+    discard_restored_client(client);
+    return error;
+  }
+#ifdef HAVE_ZLIB
+  if (client->caps & EHLO_CAP_DEFLATE) {
+    atomic_inc(&num_deflate_clients);
+  }
+#endif
+  record.nick[EHLO_MAX_NICK_LEN] = '\0';
+  len = (int)strlen(record.nick);
+  if (is_valid_nick(record.nick, len)) {
+    lock_mutex(&nicks_lock);
+    if (nick_table_add(&nicks, record.nick, len, client->id) == 0) {
+      strcpy(client->nick, record.nick);
+    }
+    unlock_mutex(&nicks_lock);
+  }
+
+  restored = &restored_clients[num_restored_clients++];
+  restored->client = client;
+  restored->shard = record.shard;
+  *client_ptr = client;
+  return 0;
+}
+
+/* Queues bytes that the old process had queued for the client */
+static int restore_output(struct client *client, const char *data, int len)
+{
+  struct message *message;
+  int max_len;
   int error;
 
-  if (sender_id == EHLO_SERVER_ID) {
-    printf_locked("[server]: %s\n", message);
+  max_len = client != NULL && client->protocol == EHLO_PROTOCOL_FRAMED
+      ? EHLO_MAX_FRAME_LEN
+      : MAX_LEGACY_MESSAGE_LEN;
+  if (client == NULL || len <= 0 || len > max_len) {
+    return EPROTO;
+  }
+  message = pool_alloc(&message_pool);
+  if (message == NULL) {
+    return ENOMEM;
+  }
+  message->refcount = 1;
+  message->room = EHLO_LOBBY_ROOM;
+  message->sender_id = EHLO_SERVER_ID;
+  message->seq = 0;
+  message->frame_len = 0;
+  message->legacy_len = 0;
+#ifdef HAVE_ZLIB
+  message->deflated_len = 0;
+#endif
+  if (client->protocol == EHLO_PROTOCOL_FRAMED) {
+    memcpy(message->frame, data, len);
+    message->frame_len = len;
   } else {
-    printf_locked("[%d]: %s\n", sender_id, message);
+    memcpy(message->legacy, data, len);
+    message->legacy_len = len;
   }
+  error = push_client_message(client, message);
+  release_message(message);
+  return error;
+}
 
-  for (i = 0; i < EHLO_MAX_CLIENTS; i++) {
-    if (i != sender_id && clients[i].sock != INVALID_SOCKET) {
-      error = send_message(clients[i].sock, sender_id, message);
-      if (error != 0) {
-        fprintf_locked(stderr,
-            "Error sending message to client %d: %s\n",
-            i,
-            error_to_str(error, NULL, 0));
+static int restore_record(int type,
+                          const char *data,
+                          int len,
+                          const int *fds,
+                          int num_fds,
+                          struct client **client)
+{
+  struct handoff_listener listener;
+
+  switch (type) {
+    case HANDOFF_LISTENER:
+      if (len != sizeof(listener) || num_fds != 1) {
+        return EPROTO;
       }
+      memcpy(&listener, data, len);
+      restore_listener(&listener, fds[0]);
+      return 0;
+    case HANDOFF_ROOM:
+      return restore_room(data, len);
+    case HANDOFF_HISTORY:
+      return restore_history(data, len);
+    case HANDOFF_SERVER:
+      return restore_server(data, len);
+    case HANDOFF_CLIENT:
+      return restore_client(data, len, fds, num_fds, client);
+    case HANDOFF_OUTPUT:
+      return restore_output(*client, data, len);
+  }
+  return EPROTO;
+}
+
+/*
+ * Takes over from the process that started this one with --inherit-fd and
+ * waits for it to exit, after which the journal is free. The clients are
+ * kept in restored_clients until the shards are up. Returns 0 or an error
+ * code.
+ */
+static int take_over_server(socket_t sock)
+{
+  struct handoff handoff;
+  struct client *client = NULL;
+  const char *data;
+  uint32_t version = HANDOFF_VERSION;
+  int fds[EHLO_MAX_PASSED_FDS];
+  int num_fds;
+  int type;
+  int len;
+  int error;
+  int i;
+
+  inherited_listeners = malloc(num_shards * sizeof(*inherited_listeners));
+  if (inherited_listeners == NULL) {
+    close_socket(sock);
+    return ENOMEM;
+  }
+  for (i = 0; i < num_shards; i++) {
+    inherited_listeners[i] = INVALID_SOCKET;
+  }
+
+  error = handoff_open(&handoff, sock, HANDOFF_TIMEOUT_MS);
+  if (error == 0) {
+    error = handoff_put(&handoff,
+                        HANDOFF_READY,
+                        &version,
+                        sizeof(version),
+                        NULL,
+                        0);
+  }
+  if (error == 0) {
+    error = handoff_flush(&handoff);
+  }
+  while (error == 0) {
+    error = handoff_get(&handoff, &type, &data, &len, fds, &num_fds);
+    if (error != 0 || type == HANDOFF_END) {
+      break;
     }
+    error = restore_record(type, data, len, fds, num_fds, &client);
+  }
+  if (error == 0) {
+    error = handoff_put(&handoff, HANDOFF_DONE, NULL, 0, NULL, 0);
+  }
+  if (error == 0) {
+    error = handoff_flush(&handoff);
+  }
+  if (error == 0) {
+    /* The old process closes the channel by exiting */
+    error = handoff_get(&handoff, &type, &data, &len, fds, &num_fds);
+    error = error == EPIPE ? 0 : (error != 0 ? error : EPROTO);
   }
+  handoff_close(&handoff);
+  return error;
 }
 
-static void send_connect_message(int client_id)
+/* Passes the clients taken over to their shards, which resume them */
+static void post_restored_clients(void)
 {
-  char *buf;
+  struct client *client;
+  struct shard *shard;
+  int error;
+  int i;
 
-  asprintf(&buf, "Client %d has joined the chat", client_id);
-  send_broadcast_message(EHLO_SERVER_ID, buf);
-  free(buf);
+  for (i = 0; i < num_restored_clients; i++) {
+    client = restored_clients[i].client;
+    shard = &shards[restored_clients[i].shard % num_shards];
+    atomic_store_ptr(&client->shard, shard);
+    atomic_inc(&shard->num_clients);
+    error = post_shard_event(&shards[0],
+                             shard,
+                             SHARD_EVENT_CLIENT,
+                             NULL,
+                             client);
+    if (error != 0) {
+      log_error("Failed to hand over client %d: %s",
+                client->id,
+                error_to_str(error, NULL, 0));
+      atomic_dec(&shard->num_clients);
+      remove_client(client);
+      discard_restored_client(client);
+    }
+  }
+  free(restored_clients);
+  restored_clients = NULL;
+  free(inherited_listeners);
+  inherited_listeners = NULL;
 }
 
-static void send_disconnect_message(int client_id)
+#endif /* HAVE_HANDOFF */
+
+#endif /* HAVE_EPOLL */
+
+static void print_queue_stats(void)
 {
-  char *buf;
+  struct client *client;
+  uint64_t dropped;
+  int num_clients;
+  int total_count = 0;
+  int max_count = 0;
+  int max_count_id = -1;
+  int count;
+  int i;
 
-  asprintf(&buf, "Client %d has left the chat", client_id);
-  send_broadcast_message(EHLO_SERVER_ID, buf);
-  free(buf);
+  lock_mutex(&clients_lock);
+  num_clients = clients.num_active;
+  for (i = 0; i < clients.num_active; i++) {
+    client = clients.active[i];
+    count = atomic_load_int(&client->out_count);
+    total_count += count;
+    if (count > max_count) {
+      max_count = count;
+      max_count_id = client->id;
+    }
+    dropped = atomic_load_u64(&client->out_dropped);
+    if (dropped > client->out_dropped_reported) {
+      log_info("  client %d: queue depth %d (max %d), %llu dropped",
+               client->id,
+               count,
+               atomic_load_int(&client->out_max_count),
+               (unsigned long long)(dropped - client->out_dropped_reported));
+      client->out_dropped_reported = dropped;
+    }
+  }
+  unlock_mutex(&clients_lock);
+
+#ifdef HAVE_EPOLL
+  if (shards != NULL && num_shards > 1) {
+    for (i = 0; i < num_shards; i++) {
+      log_info("  shard %d: %d clients",
+               i,
+               atomic_load_int(&shards[i].num_clients));
+    }
+  }
+#endif
+
+  log_info("  %d clients, queued messages: %d, deepest queue: %d (client %d)",
+           num_clients,
+           total_count,
+           max_count,
+           max_count_id);
 }
 
-static void *client_thread(void *arg)
+static void *stats_thread(void *arg)
 {
-  struct client *client = arg;
+  uint64_t last_counters[NUM_METRIC_COUNTERS] = {0};
+  uint64_t broadcasts, send_calls, sent_frames, dropped, ring_submits;
+  uint64_t rejects;
+  uint64_t log_dropped, last_log_dropped = 0;
+  struct metrics snapshot;
+  struct pool_stats pool_stats;
+  uint64_t last_pool_allocs = 0;
+  uint64_t last_pool_slabs = 0;
+  const uint64_t *counters = snapshot.counters;
+  uint64_t relayed, last_relayed = 0;
+  uint64_t relay_writes, last_relay_writes = 0;
+  uint64_t relay_dropped, last_relay_dropped = 0;
+#ifdef HAVE_JOURNAL
+  uint64_t journaled, last_journaled = 0;
+  uint64_t journal_syncs, last_journal_syncs = 0;
+#endif
 
-  send_server_message(client->sock, "Welcome to the chat!");
+  (void)arg;
 
   for (;;) {
-    int recv_size;
-    int8_t cmd;
-
-    recv_size = recv(client->sock, (char *)&cmd, 1, 0);
-    if (recv_size <= 0) {
-      if (recv_size == 0) {
-        printf_locked("Client %d disconnected\n", client->id);
-        close_socket_nicely(client->sock);
-        client->sock = INVALID_SOCKET;
-        client->thread = INVALID_THREAD;
-        send_disconnect_message(client->id);
-      } else {
-        printf_locked("Failed to read command from client %d: %s\n",
-                      client->id,
-                      error_to_str(socket_error(), NULL, 0));
-      }
+    sleep_ms(stats_interval * 1000);
+    get_metrics_snapshot(&snapshot);
+    broadcasts = counters[METRIC_BROADCASTS] - last_counters[METRIC_BROADCASTS];
+    send_calls = counters[METRIC_SEND_CALLS] - last_counters[METRIC_SEND_CALLS];
+    sent_frames =
+        counters[METRIC_MESSAGES_OUT] - last_counters[METRIC_MESSAGES_OUT];
+    dropped = counters[METRIC_DROPPED] - last_counters[METRIC_DROPPED];
+    ring_submits =
+        counters[METRIC_RING_SUBMITS] - last_counters[METRIC_RING_SUBMITS];
+    rejects = counters[METRIC_REJECTS] - last_counters[METRIC_REJECTS];
+    log_dropped = log_get_dropped();
+    log_info("Stats: %llu broadcasts, %llu send calls (%.2f per broadcast), "
+             "%llu messages dropped",
+             (unsigned long long)broadcasts,
+             (unsigned long long)send_calls,
+             broadcasts > 0 ? (double)send_calls / broadcasts : 0.0,
+             (unsigned long long)dropped);
+    log_info("Stats: %llu frames written, %.2f per send call",
+             (unsigned long long)sent_frames,
+             send_calls > 0 ? (double)sent_frames / send_calls : 0.0);
+    get_pool_stats(&pool_stats);
+    log_info("Stats: %llu messages and events allocated, %llu heap allocations "
+             "(%llu KiB pooled, %llu in use)",
+             (unsigned long long)(pool_stats.allocs - last_pool_allocs),
+             (unsigned long long)(pool_stats.slabs - last_pool_slabs),
+             (unsigned long long)(pool_stats.bytes / 1024),
+             (unsigned long long)pool_stats.in_use);
+    if (ring_submits > 0) {
+      log_info("Stats: %llu ring submissions",
+               (unsigned long long)ring_submits);
+    }
+    if (rejects > 0) {
+      log_info("Stats: %llu connections rejected by admission control",
+               (unsigned long long)rejects);
+    }
+    if (log_dropped > last_log_dropped) {
+      log_info("Stats: %llu log messages dropped",
+               (unsigned long long)(log_dropped - last_log_dropped));
+    }
+#ifdef HAVE_JOURNAL
+    if (journal_dir != NULL) {
+      journaled = atomic_load_u64(&journal.num_records);
+      journal_syncs = atomic_load_u64(&journal.num_syncs);
+      log_info("Stats: %llu messages journaled, %llu syncs, %llu errors, "
+               "%llu dropped",
+               (unsigned long long)(journaled - last_journaled),
+               (unsigned long long)(journal_syncs - last_journal_syncs),
+               (unsigned long long)atomic_load_u64(&journal.num_errors),
+               (unsigned long long)atomic_load_u64(&journal.num_dropped));
+      last_journaled = journaled;
+      last_journal_syncs = journal_syncs;
+    }
+#endif
+    if (federation.num_peers > 0) {
+      relayed = atomic_load_u64(&federation.num_relayed);
+      relay_writes = atomic_load_u64(&federation.num_writes);
+      relay_dropped = atomic_load_u64(&federation.num_dropped);
+      log_info("Stats: %llu messages relayed in %llu writes, %llu dropped",
+               (unsigned long long)(relayed - last_relayed),
+               (unsigned long long)(relay_writes - last_relay_writes),
+               (unsigned long long)(relay_dropped - last_relay_dropped));
+      last_relayed = relayed;
+      last_relay_writes = relay_writes;
+      last_relay_dropped = relay_dropped;
+    }
+    print_queue_stats();
+    memcpy(last_counters, counters, sizeof(last_counters));
+    last_log_dropped = log_dropped;
+    last_pool_allocs = pool_stats.allocs;
+    last_pool_slabs = pool_stats.slabs;
+  }
+
+  return NULL;
+}
+
+/*
+ * Answers every connection to the admin port with the metrics and closes
+ * it. A request starting with GET gets an HTTP response, so that scrapers
+ * and browsers can read it too.
+ */
+static void *admin_thread(void *arg)
+{
+  socket_t admin_sock = *(socket_t *)arg;
+  socket_t sock;
+  char request[512];
+  char *text;
+  char header[128];
+  int is_http;
+  int header_len;
+  int len;
+
+  for (;;) {
+    sock = accept(admin_sock, NULL, NULL);
+    if (sock == INVALID_SOCKET) {
+      log_error("Failed to accept admin connection: %s",
+                error_to_str(socket_error(), NULL, 0));
       break;
     }
 
-    switch (cmd) {
-      case EHLO_CMD_PING:
-        /* not implemented yet */
-        break;
-      case EHLO_CMD_MESSAGE: {
-        char message[EHLO_MAX_MESSAGE_LEN];
-        size_t offset = 0;
-        /*
-         * Read the message one character at a time until we hit the trailing
-         * NUL ('\0') character. This is probably inefficient...
-         */
-        for (;
-             (recv_size = recv(client->sock, message + offset, 1, 0)) >= 0;
-             offset++) {
-          if (recv_size == 0 || message[offset] == '\0') {
-            /* End of message */
-            break;
-          }
-          if (offset >= sizeof(message)) {
-            /* Message is too long, skip remaining text */
-            continue;
-          }
-        }
-        send_broadcast_message(client->id, message);
-        break;
+    is_http = 0;
+    if (socket_wait_readable(sock, ADMIN_REQUEST_TIMEOUT_MS) > 0) {
+      len = recv(sock, request, sizeof(request), 0);
+      is_http = len >= 3 && memcmp(request, "GET", 3) == 0;
+    }
+
+    text = format_metrics(&len);
+    if (text == NULL) {
+      log_error("Out of memory formatting metrics");
+    } else {
+      if (is_http) {
+        header_len = snprintf(header,
+                              sizeof(header),
+                              "HTTP/1.0 200 OK\r\n"
+                              "Content-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %d\r\n"
+                              "\r\n",
+                              len);
+        send_n(sock, header, header_len, 0);
       }
-      default:
-        fprintf_locked(stderr,
-           "Received unknown command %d from client %d\n", cmd, client->id);
-        break;
+      send_n(sock, text, len, 0);
+      free(text);
     }
+    close_socket_nicely(sock);
   }
 
   return NULL;
 }
 
+static void print_usage(const char *program_name)
+{
+  fprintf(stderr,
+      "Usage: %s [options] <host> <port>\n"
+      "Options:\n"
+#ifdef HAVE_EPOLL
+      "  --mode <event|thread>  handle clients in an event loop (default) or\n"
+      "                         in a thread per client\n"
+      "  --batch-writes         queue messages and write them to each client\n"
+      "                         once per event loop iteration\n"
+      "  --flush-delay <us>     hold batched messages for up to us\n"
+      "                         microseconds (implies --batch-writes)\n"
+      "  --flush-bytes <n>      write batched messages as soon as n bytes\n"
+      "                         are queued for a client (%d)\n"
+      "  --threads <n>          number of event loop threads, 0 means one per\n"
+      "                         CPU (1)\n"
+      "  --pin-cpus             bind each event loop thread to its own CPU\n"
+      "  --balance <policy>     how connections are spread across threads:\n"
+#ifdef SO_REUSEPORT
+      "                         reuseport (default, every thread listens) or\n"
+      "                         least-loaded (the first thread accepts and\n"
+      "                         hands clients to the one with the fewest)\n"
+#else
+      "                         least-loaded (the first thread accepts and\n"
+      "                         hands clients to the one with the fewest)\n"
+#endif
+#ifdef HAVE_IO_URING
+      "  --io <epoll|uring>     how event loops do I/O; uring (default) falls\n"
+      "                         back to epoll if the kernel lacks support\n"
+#endif
+#endif
+      "  --max-clients <n>      maximum number of connected clients (%d)\n"
+      "  --backlog <n>          connections the kernel queues up until they\n"
+      "                         are accepted (%d)\n"
+      "  --accept-rate <n>      connections per second accepted from one\n"
+      "                         address, 0 means no limit (0)\n"
+      "  --accept-burst <n>     connections from one address accepted in a\n"
+      "                         row before the rate applies (accept rate)\n"
+      "  --queue-limit <n>      maximum number of messages queued for a\n"
+      "                         client (%d)\n"
+      "  --overflow <policy>    what to do when a client's queue is full:\n"
+      "                         drop-oldest (default), disconnect or\n"
+      "                         coalesce (replace the backlog with a notice)\n"
+      "  --history <n>          number of recent messages replayed to new\n"
+      "                         clients, 0 disables the history (%d)\n"
+      "  --history-age <s>      forget messages older than s seconds, 0 keeps\n"
+      "                         them until newer ones push them out (0)\n"
+#ifdef HAVE_JOURNAL
+      "  --journal <dir>        write the history to segment files in dir and\n"
+      "                         restore it from there on startup\n"
+      "  --journal-sync <mode>  none, batch (default, one fsync for all the\n"
+      "                         messages written together) or always\n"
+      "  --journal-segment-size <MiB>\n"
+      "                         start a new segment file at this size (%d)\n"
+#endif
+#ifndef _WIN32
+      "  --unix <path>          also accept local clients on a Unix domain\n"
+#ifdef HAVE_SHM
+      "                         socket, which can hand them a shared memory\n"
+      "                         ring to write into (event mode)\n"
+#else
+      "                         socket\n"
+#endif
+#endif
+      "  --node-id <n>          run as node n of a cluster, each node needs a\n"
+      "                         different one\n"
+      "  --peer <host:port>     relay lobby messages to this node and deliver\n"
+      "                         those it relays, every node has to list all\n"
+      "                         the others and only takes links from their\n"
+      "                         addresses (repeatable)\n"
+      "  --stats-interval <s>   print send statistics every s seconds\n"
+      "  --admin-port <port>    serve metrics on this port of localhost\n"
+#ifdef HAVE_ZLIB
+      "  --compress-min <n>     compress messages of at least n bytes for\n"
+      "                         clients that support it, 0 disables\n"
+      "                         compression (%d)\n"
+#endif
+      "  --heartbeat-interval <s>\n"
+      "                         ping clients that have been quiet for s\n"
+      "                         seconds, 0 disables heartbeats (%d)\n"
+      "  --heartbeat-timeout <s>\n"
+      "                         close connections that have been quiet for\n"
+      "                         s seconds (%d)\n"
+      "  --log-level <level>    debug, info (default), warning or error\n"
+      "  --log-format <format>  text (default) or binary log records\n",
+      program_name,
+#ifdef HAVE_EPOLL
+      DEFAULT_FLUSH_BYTES,
+#endif
+      EHLO_MAX_CLIENTS,
+      DEFAULT_LISTEN_BACKLOG,
+      DEFAULT_QUEUE_LIMIT,
+      DEFAULT_HISTORY_LIMIT,
+#ifdef HAVE_JOURNAL
+      DEFAULT_JOURNAL_SEGMENT_SIZE,
+#endif
+#ifdef HAVE_ZLIB
+      DEFLATE_DEFAULT_MIN_LEN,
+#endif
+      DEFAULT_HEARTBEAT_INTERVAL,
+      DEFAULT_HEARTBEAT_TIMEOUT);
+}
+
 int main(int argc, char **argv)
 {
   int error;
-  socket_t server_sock;
-  int opt_reuseaddr;
-  struct sockaddr_in server_addr;
-  const char *host, *port;
+  socket_t server_sock = INVALID_SOCKET;
+  const char *host = NULL, *port = NULL;
+  const char *program_name = get_program_name(argv[0]);
+  const char *peers[FEDERATION_MAX_PEERS];
+  int num_peers = 0;
+  enum log_level log_level = LOG_INFO;
+  enum log_format log_format = LOG_FORMAT_TEXT;
+#ifdef HAVE_JOURNAL
+  int taken_over = 0;
+#endif
   int i;
 
-  if (argc < 3) {
-    fprintf(stderr, "Usage: %s <host> <port>\n", get_program_name(argv[0]));
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--mode") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "thread") == 0) {
+        server_mode = SERVER_MODE_THREAD;
+#ifdef HAVE_EPOLL
+      } else if (strcmp(argv[i], "event") == 0) {
+        server_mode = SERVER_MODE_EVENT;
+#endif
+      } else {
+        fprintf(stderr, "Unsupported mode: %s\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+#ifdef HAVE_EPOLL
+    } else if (strcmp(argv[i], "--batch-writes") == 0) {
+      batch_writes = 1;
+    } else if (strcmp(argv[i], "--flush-delay") == 0 && i + 1 < argc) {
+      flush_delay_us = atoi(argv[++i]);
+      if (flush_delay_us < 0) {
+        fprintf(stderr, "Flush delay can't be negative\n");
+        exit(EXIT_FAILURE);
+      }
+      batch_writes = 1;
+    } else if (strcmp(argv[i], "--flush-bytes") == 0 && i + 1 < argc) {
+      flush_bytes = atoi(argv[++i]);
+      if (flush_bytes <= 0) {
+        fprintf(stderr, "Flush threshold must be positive\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      num_shards = atoi(argv[++i]);
+      if (num_shards == 0) {
+        num_shards = (int)sysconf(_SC_NPROCESSORS_ONLN);
+      }
+      if (num_shards <= 0) {
+        fprintf(stderr, "Number of threads must be positive\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--pin-cpus") == 0) {
+      pin_cpus = 1;
+    } else if (strcmp(argv[i], "--balance") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "least-loaded") == 0) {
+        shard_balance = BALANCE_LEAST_LOADED;
+#ifdef SO_REUSEPORT
+      } else if (strcmp(argv[i], "reuseport") == 0) {
+        shard_balance = BALANCE_REUSEPORT;
+#endif
+      } else {
+        fprintf(stderr, "Unsupported balancing: %s\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+#ifdef HAVE_IO_URING
+    } else if (strcmp(argv[i], "--io") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "epoll") == 0) {
+        io_backend = IO_BACKEND_EPOLL;
+      } else if (strcmp(argv[i], "uring") == 0) {
+        io_backend = IO_BACKEND_URING;
+      } else {
+        fprintf(stderr, "Unsupported I/O backend: %s\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+#endif
+#endif
+#ifdef HAVE_HANDOFF
+    } else if (strcmp(argv[i], "--inherit-fd") == 0 && i + 1 < argc) {
+      /* Passed on by the process that is being upgraded */
+      inherit_sock = atoi(argv[++i]);
+#endif
+    } else if (strcmp(argv[i], "--backlog") == 0 && i + 1 < argc) {
+      listen_backlog = atoi(argv[++i]);
+      if (listen_backlog <= 0) {
+        fprintf(stderr, "Listen backlog must be positive\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--accept-rate") == 0 && i + 1 < argc) {
+      accept_rate = atoi(argv[++i]);
+      if (accept_rate < 0 || accept_rate > ADMISSION_MAX_RATE) {
+        fprintf(stderr, "Accept rate must be between 0 and %d\n",
+            ADMISSION_MAX_RATE);
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--accept-burst") == 0 && i + 1 < argc) {
+      accept_burst = atoi(argv[++i]);
+      if (accept_burst <= 0 || accept_burst > ADMISSION_MAX_RATE) {
+        fprintf(stderr, "Accept burst must be between 1 and %d\n",
+            ADMISSION_MAX_RATE);
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--queue-limit") == 0 && i + 1 < argc) {
+      queue_limit = atoi(argv[++i]);
+      if (queue_limit <= 0) {
+        fprintf(stderr, "Queue limit must be positive\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--overflow") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "drop-oldest") == 0) {
+        overflow_policy = OVERFLOW_DROP_OLDEST;
+      } else if (strcmp(argv[i], "disconnect") == 0) {
+        overflow_policy = OVERFLOW_DISCONNECT;
+      } else if (strcmp(argv[i], "coalesce") == 0) {
+        overflow_policy = OVERFLOW_COALESCE;
+      } else {
+        fprintf(stderr, "Unknown overflow policy: %s\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--history") == 0 && i + 1 < argc) {
+      history_limit = atoi(argv[++i]);
+      if (history_limit < 0) {
+        fprintf(stderr, "History size can't be negative\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--history-age") == 0 && i + 1 < argc) {
+      history_age_ms = (uint64_t)atoi(argv[++i]) * 1000;
+#ifdef HAVE_JOURNAL
+    } else if (strcmp(argv[i], "--journal") == 0 && i + 1 < argc) {
+      journal_dir = argv[++i];
+    } else if (strcmp(argv[i], "--journal-sync") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "none") == 0) {
+        journal_sync = JOURNAL_SYNC_NONE;
+      } else if (strcmp(argv[i], "batch") == 0) {
+        journal_sync = JOURNAL_SYNC_BATCH;
+      } else if (strcmp(argv[i], "always") == 0) {
+        journal_sync = JOURNAL_SYNC_ALWAYS;
+      } else {
+        fprintf(stderr, "Unknown journal sync mode: %s\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--journal-segment-size") == 0
+               && i + 1 < argc) {
+      journal_segment_size = (size_t)atoi(argv[++i]) << 20;
+      if (journal_segment_size == 0) {
+        fprintf(stderr, "Journal segment size must be positive\n");
+        exit(EXIT_FAILURE);
+      }
+#endif
+#ifndef _WIN32
+    } else if (strcmp(argv[i], "--unix") == 0 && i + 1 < argc) {
+      local_path = argv[++i];
+#endif
+    } else if (strcmp(argv[i], "--stats-interval") == 0 && i + 1 < argc) {
+      stats_interval = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--admin-port") == 0 && i + 1 < argc) {
+      admin_port = argv[++i];
+#ifdef HAVE_ZLIB
+    } else if (strcmp(argv[i], "--compress-min") == 0 && i + 1 < argc) {
+      compress_min_len = atoi(argv[++i]);
+      if (compress_min_len < 0) {
+        fprintf(stderr, "Compression threshold can't be negative\n");
+        exit(EXIT_FAILURE);
+      }
+#endif
+    } else if (strcmp(argv[i], "--heartbeat-interval") == 0 && i + 1 < argc) {
+      heartbeat_interval_ms = (uint64_t)atoi(argv[++i]) * 1000;
+    } else if (strcmp(argv[i], "--heartbeat-timeout") == 0 && i + 1 < argc) {
+      heartbeat_timeout_ms = (uint64_t)atoi(argv[++i]) * 1000;
+    } else if (strcmp(argv[i], "--max-clients") == 0 && i + 1 < argc) {
+      max_clients = atoi(argv[++i]);
+      if (max_clients <= 0 || max_clients > REGISTRY_MAX_SLOTS) {
+        fprintf(stderr, "Maximum number of clients must be between 1 and %d\n",
+            REGISTRY_MAX_SLOTS);
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--node-id") == 0 && i + 1 < argc) {
+      node_id = atoi(argv[++i]);
+      if (node_id < 0) {
+        fprintf(stderr, "Node ID can't be negative\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--peer") == 0 && i + 1 < argc) {
+      if (num_peers == FEDERATION_MAX_PEERS) {
+        fprintf(stderr, "Too many peers (maximum is %d)\n",
+            FEDERATION_MAX_PEERS);
+        exit(EXIT_FAILURE);
+      }
+      peers[num_peers++] = argv[++i];
+    } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "debug") == 0) {
+        log_level = LOG_DEBUG;
+      } else if (strcmp(argv[i], "info") == 0) {
+        log_level = LOG_INFO;
+      } else if (strcmp(argv[i], "warning") == 0) {
+        log_level = LOG_WARNING;
+      } else if (strcmp(argv[i], "error") == 0) {
+        log_level = LOG_ERROR;
+      } else {
+        fprintf(stderr, "Unknown log level: %s\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--log-format") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "text") == 0) {
+        log_format = LOG_FORMAT_TEXT;
+      } else if (strcmp(argv[i], "binary") == 0) {
+        log_format = LOG_FORMAT_BINARY;
+      } else {
+        fprintf(stderr, "Unknown log format: %s\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (argv[i][0] == '-' && argv[i][1] == '-') {
+      print_usage(program_name);
+      exit(EXIT_FAILURE);
+    } else if (host == NULL) {
+      host = argv[i];
+    } else if (port == NULL) {
+      port = argv[i];
+    }
+  }
+
+  if (host == NULL || port == NULL) {
+    print_usage(program_name);
+    exit(EXIT_FAILURE);
+  }
+  if (heartbeat_interval_ms > 0
+      && heartbeat_timeout_ms <= heartbeat_interval_ms) {
+    fprintf(stderr, "Heartbeat timeout must be longer than the interval\n");
+    exit(EXIT_FAILURE);
+  }
+  if (num_peers > 0 && node_id < 0) {
+    fprintf(stderr, "Peers need a node ID\n");
     exit(EXIT_FAILURE);
   }
+  if (node_id >= REGISTRY_MAX_SLOTS / max_clients) {
+    fprintf(stderr, "Node ID must be less than %d with %d clients per node\n",
+        REGISTRY_MAX_SLOTS / max_clients,
+        max_clients);
+    exit(EXIT_FAILURE);
+  }
+#ifdef HAVE_JOURNAL
+  if (journal_dir != NULL && history_limit == 0) {
+    fprintf(stderr, "The journal needs the history to be enabled\n");
+    exit(EXIT_FAILURE);
+  }
+#endif
+  if (server_mode == SERVER_MODE_THREAD) {
+    batch_writes = 0;
+#ifdef HAVE_EPOLL
+    num_shards = 1;
+#endif
+  }
+#ifdef HAVE_HANDOFF
+  if (inherit_sock != INVALID_SOCKET && server_mode != SERVER_MODE_EVENT) {
+    fprintf(stderr, "Hot upgrades need event mode\n");
+    exit(EXIT_FAILURE);
+  }
+#endif
 
-  host = argv[1];
-  port = argv[2];
+  /* Without the writer thread everything is printed synchronously */
+  error = log_start(log_level, log_format);
+  if (error != 0) {
+    fprintf(stderr, "Failed to start logging thread: %s\n",
+        error_to_str(error, NULL, 0));
+  }
 
   socket_init();
   atexit(socket_cleanup);
 
-  server_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-  if (server_sock == -1) {
-    fprintf(stderr, "Failed to open socket: %s\n",
-        error_to_str(socket_error(), NULL, 0));
-    exit(EXIT_FAILURE);
-  }
+#ifndef _WIN32
+  /* Report writes to closed connections as errors instead of dying */
+  signal(SIGPIPE, SIG_IGN);
+#endif
 
   /*
-   * Allow reuse of this socket address (port) - this makes restarts faster.
-   *
-   * Sockets are usually waited on for some time by the system after they are
-   * closed (netstat shows them in a TIME_WAIT state).
+   * The registry grows with the number of connected clients. Nodes of a
+   * cluster each take their own range of slots.
    */
-  opt_reuseaddr = 1;
-  setsockopt(server_sock,
-             SOL_SOCKET,
-             SO_REUSEADDR,
-             (const void *)&opt_reuseaddr,
-             sizeof(opt_reuseaddr));
-
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_addr.s_addr = INADDR_ANY;
-  server_addr.sin_port = htons(atoi(port));
-
-  error = bind(server_sock,
-               (struct sockaddr *)&server_addr,
-               sizeof(server_addr));
-  if (error != 0) {
-    fprintf(stderr, "Failed to bind address: %s\n",
-        error_to_str(socket_error(), NULL, 0));
-    close_socket(server_sock);
-    exit(EXIT_FAILURE);
+  registry_init_range(&clients,
+                      node_id >= 0 ? node_id * max_clients : 0,
+                      max_clients);
+  create_mutex(&clients_lock);
+  epoch_init(&client_list_epoch);
+  create_mutex(&retired_lock);
+  create_mutex(&rooms_lock);
+  nick_table_init(&nicks);
+  create_mutex(&nicks_lock);
+  create_mutex(&history_lock);
+  if (history_limit > 0) {
+    history.entries = calloc(history_limit, sizeof(*history.entries));
+    if (history.entries == NULL) {
+      log_error("Out of memory");
+      exit(EXIT_FAILURE);
+    }
   }
-
-  error = listen(server_sock, 128);
-  if (error != 0) {
-    fprintf(stderr, "Listen error: %s\n",
-        error_to_str(socket_error(), NULL, 0));
-    close_socket(server_sock);
+  pool_init(&message_pool, sizeof(struct message), POOL_SLAB_OBJECTS, 1);
+  if (accept_rate > 0
+      && admission_init(&admission,
+                        ADMISSION_ENTRIES,
+                        accept_rate,
+                        accept_burst > 0 ? accept_burst : accept_rate) != 0) {
+    log_error("Out of memory");
     exit(EXIT_FAILURE);
   }
-
-  printf("Listening at %s:%s\n", host, port);
-
-  for (i = 0; i < EHLO_MAX_CLIENTS; i++) {
-    clients[i].id = i;
-    clients[i].sock = INVALID_SOCKET;
-    clients[i].thread = INVALID_THREAD;
+  if (server_mode == SERVER_MODE_THREAD) {
+    metrics_init(&thread_metrics, 1);
+#ifdef HAVE_ZLIB
+    create_mutex(&thread_codec_lock);
+    if (compress_min_len > 0 && deflate_codec_init(&thread_codec) != 0) {
+      log_error("Out of memory");
+      exit(EXIT_FAILURE);
+    }
+#endif
+    room_members = calloc(EHLO_MAX_ROOMS, sizeof(*room_members));
+    if (room_members == NULL) {
+      log_error("Out of memory");
+      exit(EXIT_FAILURE);
+    }
   }
 
-  for (;;) {
-    socket_t client_sock;
-    struct sockaddr_in client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
+#ifdef HAVE_HANDOFF
+  /* The listeners come from the old process, only new ones are opened */
+  if (inherit_sock != INVALID_SOCKET) {
+    error = take_over_server(inherit_sock);
+    if (error != 0) {
+      log_error("Failed to take over from the old process: %s",
+                error_to_str(error, NULL, 0));
+      exit(EXIT_FAILURE);
+    }
+    log_info("Took over %d clients from the old process",
+             num_restored_clients);
+    server_sock = inherited_listeners[0];
+#ifdef HAVE_JOURNAL
+    taken_over = 1;
+#endif
+  }
+#endif
+  if (server_sock == INVALID_SOCKET) {
+#ifdef HAVE_EPOLL
+    server_sock = open_server_socket(port,
+        num_shards > 1 && shard_balance == BALANCE_REUSEPORT,
+        0);
+#else
+    server_sock = open_server_socket(port, 0, 0);
+#endif
+    if (server_sock == INVALID_SOCKET) {
+      exit(EXIT_FAILURE);
+    }
+  }
+#ifndef _WIN32
+  if (local_path != NULL && local_sock == INVALID_SOCKET) {
+    local_sock = open_local_socket(local_path);
+    if (local_sock == INVALID_SOCKET) {
+      exit(EXIT_FAILURE);
+    }
+  }
+#endif
 
-    client_sock = accept(server_sock,
-                         (struct sockaddr *)&client_addr,
-                         &client_addr_len);
-    if (client_sock == INVALID_SOCKET) {
-      fprintf_locked(stderr,
-                     "Failed to accept connection: %s\n",
-                     error_to_str(socket_error(), NULL, 0));
-      break;
+#ifdef HAVE_JOURNAL
+  if (journal_dir != NULL) {
+    error = journal_open(&journal,
+                         journal_dir,
+                         journal_sync,
+                         journal_segment_size,
+                         release_journal_record);
+    /* The history came along with the clients after a hot upgrade */
+    if (error == 0 && !taken_over) {
+      log_info("Restored %d messages from the journal in %s",
+               journal_replay(&journal,
+                              history_limit,
+                              restore_history_message,
+                              NULL),
+               journal_dir);
     }
+    if (error == 0) {
+      error = journal_start(&journal);
+    }
+    if (error != 0) {
+      log_error("Failed to open the journal in %s: %s",
+                journal_dir,
+                error_to_str(error, NULL, 0));
+      exit(EXIT_FAILURE);
+    }
+  }
+#endif
 
-    for (i = 0; i < EHLO_MAX_CLIENTS; i++) {
-      if (clients[i].sock == INVALID_SOCKET) {
-        clients[i].sock = client_sock;
-        break;
+  if (node_id >= 0) {
+    error = federation_init(&federation, node_id, release_relay_record);
+    for (i = 0; i < num_peers && error == 0; i++) {
+      error = federation_add_peer(&federation, peers[i]);
+      if (error == EINVAL) {
+        log_error("Invalid peer address %s, expected host:port", peers[i]);
+        exit(EXIT_FAILURE);
+      }
+      if (error == EHOSTUNREACH) {
+        log_error("Failed to resolve peer address %s", peers[i]);
+        exit(EXIT_FAILURE);
       }
     }
-
-    if (i == EHLO_MAX_CLIENTS) {
-      fprintf_locked(stderr,
-          "Aborting connection from %s because reached maximum number of clients\n",
-          inet_ntoa(client_addr.sin_addr));
-      close_socket_nicely(client_sock);
-      continue;
+    if (error == 0) {
+      log_info("Running as node %d with %d peers (client IDs from slot %d)",
+               node_id,
+               num_peers,
+               node_id * max_clients);
+    }
+    if (error == 0 && num_peers > 0) {
+      error = federation_start(&federation);
+    }
+    if (error != 0) {
+      log_error("Failed to set up the cluster: %s",
+                error_to_str(error, NULL, 0));
+      exit(EXIT_FAILURE);
     }
+  }
 
-    printf_locked(
-        "Client connected: %s (%d)\n", inet_ntoa(client_addr.sin_addr), i);
+  log_info("Listening at %s:%s", host, port);
+#ifndef _WIN32
+  if (local_path != NULL) {
+    log_info("Listening at %s", local_path);
+  }
+#endif
+  if (history_limit > 0) {
+    log_info("Keeping the last %d messages (up to %d KiB)",
+             history_limit,
+             (int)((uint64_t)history_limit * sizeof(struct message) / 1024));
+  }
+#ifdef HAVE_EPOLL
+  if (num_shards > 1) {
+    log_info("Running %d event loops (%s balancing)",
+             num_shards,
+             shard_balance == BALANCE_REUSEPORT ? "reuseport" : "least-loaded");
+  }
+#endif
 
-    error = create_thread(&clients[i].thread, client_thread, &clients[i]);
+  if (admin_port != NULL) {
+    thread_t admin_thread_handle;
+    if (admin_sock == INVALID_SOCKET) {
+      admin_sock = open_server_socket(admin_port, 0, 1);
+    }
+    if (admin_sock == INVALID_SOCKET) {
+      exit(EXIT_FAILURE);
+    }
+    error = create_thread(&admin_thread_handle, admin_thread, &admin_sock);
     if (error != 0) {
-      fprintf_locked(stderr,
-                     "Failed to create client thread: %s\n",
-                     error_to_str(error, NULL, 0));
-      close_socket_nicely(clients[i].sock);
-      clients[i].sock = INVALID_SOCKET;
-      clients[i].thread = INVALID_THREAD;
+      log_error("Failed to create admin thread: %s",
+                error_to_str(error, NULL, 0));
+    } else {
+      log_info("Serving metrics at 127.0.0.1:%s", admin_port);
     }
+  }
 
-    send_connect_message(i);
+  if (server_mode == SERVER_MODE_THREAD) {
+    thread_t reclaim_thread_handle;
+    error = create_thread(&reclaim_thread_handle, reclaim_thread, NULL);
+    if (error != 0) {
+      log_error("Failed to create reclaim thread: %s",
+                error_to_str(error, NULL, 0));
+      exit(EXIT_FAILURE);
+    }
   }
 
-  printf("Server is shutting down\n");
+  if (stats_interval > 0) {
+    thread_t stats_thread_handle;
+    error = create_thread(&stats_thread_handle, stats_thread, NULL);
+    if (error != 0) {
+      log_error("Failed to create stats thread: %s",
+                error_to_str(error, NULL, 0));
+    }
+  }
 
-  for (i = 0; i < EHLO_MAX_CLIENTS; i++) {
-    if (clients[i].sock != INVALID_SOCKET) {
-      close_socket_nicely(clients[i].sock);
+#ifdef HAVE_EPOLL
+  if (server_mode == SERVER_MODE_EVENT) {
+    error = start_shards(server_sock, port);
+    if (error == 0) {
+#ifdef HAVE_HANDOFF
+      post_restored_clients();
+      start_upgrade_thread(argv);
+#endif
+      run_shard(&shards[0]);
+    } else {
+      log_error("Failed to start event loops: %s",
+                error_to_str(error, NULL, 0));
     }
+  } else {
+#ifdef HAVE_HANDOFF
+    start_upgrade_thread(argv);
+#endif
+    start_local_thread();
+    run_thread_loop(server_sock);
+  }
+#else
+  start_local_thread();
+  run_thread_loop(server_sock);
+#endif
+
+  log_info("Server is shutting down");
+
+  if (federation.num_peers > 0) {
+    federation_stop(&federation);
   }
+#ifdef HAVE_JOURNAL
+  if (journal_dir != NULL) {
+    journal_stop(&journal);
+  }
+#endif
+
+  lock_mutex(&clients_lock);
+  for (i = 0; i < clients.num_active; i++) {
+    close_socket_nicely(((struct client *)clients.active[i])->sock);
+  }
+  unlock_mutex(&clients_lock);
 
   close_socket_nicely(server_sock);
+#ifndef _WIN32
+  if (local_path != NULL) {
+    close_socket(local_sock);
+    unlink(local_path);
+  }
+#endif
 }
@@ -1,5 +1,6 @@
 #include <limits.h>
 #include <stdlib.h>
+#include <time.h>
 #include "ehlo-shared.h"
 
 static int stdio_lock_created;
@@ -50,6 +51,101 @@ int socket_error(void)
   return WSAGetLastError();
 }
 
+int socket_would_block(int error)
+{
+  return error == WSAEWOULDBLOCK;
+}
+
+int set_socket_nonblocking(socket_t sock)
+{
+  u_long mode = 1;
+
+  return ioctlsocket(sock, FIONBIO, &mode) == 0 ? 0 : WSAGetLastError();
+}
+
+/*
+ * Waits until the socket becomes readable and/or writable. Returns a mask
+ * of SOCKET_READABLE and SOCKET_WRITABLE, 0 on timeout or -1 on error.
+ */
+int socket_wait(socket_t sock, int events, int timeout_ms)
+{
+  fd_set read_fds, write_fds;
+  struct timeval timeout;
+  int result;
+
+  FD_ZERO(&read_fds);
+  FD_ZERO(&write_fds);
+  if (events & SOCKET_READABLE) {
+    FD_SET(sock, &read_fds);
+  }
+  if (events & SOCKET_WRITABLE) {
+    FD_SET(sock, &write_fds);
+  }
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_usec = (timeout_ms % 1000) * 1000;
+  result = select(0,
+                  &read_fds,
+                  &write_fds,
+                  NULL,
+                  timeout_ms >= 0 ? &timeout : NULL);
+  if (result <= 0) {
+    return result;
+  }
+  return (FD_ISSET(sock, &read_fds) ? SOCKET_READABLE : 0)
+      | (FD_ISSET(sock, &write_fds) ? SOCKET_WRITABLE : 0);
+}
+
+uint64_t get_time_ms(void)
+{
+  return GetTickCount64();
+}
+
+uint64_t get_time_us(void)
+{
+  static LARGE_INTEGER frequency;
+  LARGE_INTEGER counter;
+
+  if (frequency.QuadPart == 0) {
+    QueryPerformanceFrequency(&frequency);
+  }
+  QueryPerformanceCounter(&counter);
+  return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000
+      + (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000
+          / frequency.QuadPart;
+}
+
+uint64_t get_time_ns(void)
+{
+  static LARGE_INTEGER frequency;
+  LARGE_INTEGER counter;
+
+  if (frequency.QuadPart == 0) {
+    QueryPerformanceFrequency(&frequency);
+  }
+  QueryPerformanceCounter(&counter);
+  return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000000
+      + (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000000
+          / frequency.QuadPart;
+}
+
+/* Milliseconds since the Unix epoch */
+uint64_t get_wall_time_ms(void)
+{
+  FILETIME file_time;
+  ULARGE_INTEGER time;
+
+  GetSystemTimeAsFileTime(&file_time);
+  time.LowPart = file_time.dwLowDateTime;
+  time.HighPart = file_time.dwHighDateTime;
+  /* 100 ns intervals since 1601 */
+  return time.QuadPart / 10000 - 11644473600000ULL;
+}
+
+void sleep_ms(int ms)
+{
+  Sleep(ms);
+}
+
 char *error_to_str(int error, char *buf, size_t size)
 {
   static char static_buf[1024];
@@ -108,6 +204,15 @@ int cancel_thread(thread_t thread)
   return TerminateThread(thread, 0) ? 0 : GetLastError();
 }
 
+int join_thread(thread_t thread)
+{
+  if (WaitForSingleObject(thread, INFINITE) == WAIT_FAILED) {
+    return GetLastError();
+  }
+  CloseHandle(thread);
+  return 0;
+}
+
 int create_mutex(mutex_t *mutex)
 {
   *mutex = CreateMutex(NULL, FALSE, NULL);
@@ -187,6 +292,95 @@ int socket_error(void)
   return errno;
 }
 
+int socket_would_block(int error)
+{
+  return error == EAGAIN || error == EWOULDBLOCK;
+}
+
+int set_socket_nonblocking(socket_t sock)
+{
+  int flags;
+
+  flags = fcntl(sock, F_GETFL, 0);
+  if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) {
+    return errno;
+  }
+  return 0;
+}
+
+/*
+ * Waits until the socket becomes readable and/or writable. Returns a mask
+ * of SOCKET_READABLE and SOCKET_WRITABLE, 0 on timeout or -1 on error.
+ * Errors and hangups are reported as readable so that the following recv
+ * picks them up.
+ */
+int socket_wait(socket_t sock, int events, int timeout_ms)
+{
+  struct pollfd fd;
+  int result;
+
+  fd.fd = sock;
+  fd.events = 0;
+  if (events & SOCKET_READABLE) {
+    fd.events |= POLLIN;
+  }
+  if (events & SOCKET_WRITABLE) {
+    fd.events |= POLLOUT;
+  }
+  do {
+    result = poll(&fd, 1, timeout_ms);
+  } while (result < 0 && errno == EINTR);
+  if (result <= 0) {
+    return result;
+  }
+  return ((fd.revents & (POLLIN | POLLERR | POLLHUP)) ? SOCKET_READABLE : 0)
+      | ((fd.revents & POLLOUT) ? SOCKET_WRITABLE : 0);
+}
+
+uint64_t get_time_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t get_time_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t get_time_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Milliseconds since the Unix epoch */
+uint64_t get_wall_time_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void sleep_ms(int ms)
+{
+  struct timespec ts;
+
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (long)(ms % 1000) * 1000000;
+  while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    continue;
+  }
+}
+
 char *error_to_str(int error, char *buf, size_t size)
 {
   if (buf != NULL) {
@@ -207,6 +401,11 @@ int cancel_thread(thread_t thread)
   return pthread_cancel(thread);
 }
 
+int join_thread(thread_t thread)
+{
+  return pthread_join(thread, NULL);
+}
+
 int create_mutex(mutex_t *mutex)
 {
   return pthread_mutex_init(mutex, NULL);
@@ -227,6 +426,122 @@ int destroy_mutex(mutex_t *mutex)
   return pthread_mutex_destroy(mutex);
 }
 
+/*
+ * Older systems (macOS among them) have neither flag. Writes to a closed
+ * socket then rely on SO_NOSIGPIPE and received descriptors are marked
+ * close-on-exec one by one.
+ */
+#ifdef MSG_NOSIGNAL
+  #define SEND_FDS_FLAGS MSG_NOSIGNAL
+#else
+  #define SEND_FDS_FLAGS 0
+#endif
+#ifdef MSG_CMSG_CLOEXEC
+  #define RECV_FDS_FLAGS MSG_CMSG_CLOEXEC
+#else
+  #define RECV_FDS_FLAGS 0
+#endif
+
+/*
+ * Sends data along with open file descriptors over a Unix domain socket.
+ * The descriptors arrive with the first byte of the data. Returns the
+ * number of bytes sent or -1 on error.
+ */
+int send_fds(socket_t sock,
+             const char *buf,
+             int len,
+             const int *fds,
+             int num_fds)
+{
+  union {
+    struct cmsghdr header;
+    char buf[CMSG_SPACE(EHLO_MAX_PASSED_FDS * sizeof(int))];
+  } control;
+  struct cmsghdr *cmsg;
+  struct msghdr msg;
+  struct iovec iov;
+#if !defined(MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
+  int opt_nosigpipe = 1;
+#endif
+
+  if (num_fds > EHLO_MAX_PASSED_FDS) {
+    errno = EINVAL;
+    return -1;
+  }
+  iov.iov_base = (void *)buf;
+  iov.iov_len = len;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = CMSG_SPACE(num_fds * sizeof(int));
+  memset(&control, 0, sizeof(control));
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, num_fds * sizeof(int));
+#if !defined(MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
+  setsockopt(sock,
+             SOL_SOCKET,
+             SO_NOSIGPIPE,
+             &opt_nosigpipe,
+             sizeof(opt_nosigpipe));
+#endif
+  return (int)sendmsg(sock, &msg, SEND_FDS_FLAGS);
+}
+
+/*
+ * Receives data and whatever descriptors came with it, up to
+ * EHLO_MAX_PASSED_FDS of them. num_fds is set to the number received.
+ * Returns the number of bytes received, 0 if the connection was closed or
+ * -1 on error.
+ */
+int recv_fds(socket_t sock, char *buf, int len, int *fds, int *num_fds)
+{
+  union {
+    struct cmsghdr header;
+    char buf[CMSG_SPACE(EHLO_MAX_PASSED_FDS * sizeof(int))];
+  } control;
+  struct cmsghdr *cmsg;
+  struct msghdr msg;
+  struct iovec iov;
+  ssize_t recv_len;
+  int count;
+#ifndef MSG_CMSG_CLOEXEC
+  int i;
+#endif
+
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  *num_fds = 0;
+  recv_len = recvmsg(sock, &msg, RECV_FDS_FLAGS);
+  if (recv_len < 0) {
+    return -1;
+  }
+  for (cmsg = CMSG_FIRSTHDR(&msg);
+       cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    memcpy(fds + *num_fds, CMSG_DATA(cmsg), count * sizeof(int));
+    *num_fds += count;
+  }
+#ifndef MSG_CMSG_CLOEXEC
+  for (i = 0; i < *num_fds; i++) {
+    fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+  }
+#endif
+  return (int)recv_len;
+}
+
 #endif /* !_WIN32 */
 
 int close_socket_nicely(socket_t sock)
@@ -331,3 +646,396 @@ int send_n(socket_t sock, const char *buf, int size, int flags)
 
   return len;
 }
+
+void encode_frame_header(
+    char *buf, int cmd, int room, int sender_id, uint32_t seq, uint32_t len)
+{
+  uint16_t net_room = htons((uint16_t)room);
+  uint32_t net_sender_id = htonl((uint32_t)sender_id);
+  uint32_t net_seq = htonl(seq);
+  uint32_t net_len = htonl(len);
+
+  buf[0] = (char)cmd;
+  buf[1] = 0;
+  memcpy(buf + 2, &net_room, sizeof(net_room));
+  memcpy(buf + 4, &net_sender_id, sizeof(net_sender_id));
+  memcpy(buf + 8, &net_seq, sizeof(net_seq));
+  memcpy(buf + 12, &net_len, sizeof(net_len));
+}
+
+void decode_frame_header(const char *buf, struct frame_header *header)
+{
+  uint16_t net_room;
+  uint32_t net_sender_id;
+  uint32_t net_seq;
+  uint32_t net_len;
+
+  memcpy(&net_room, buf + 2, sizeof(net_room));
+  memcpy(&net_sender_id, buf + 4, sizeof(net_sender_id));
+  memcpy(&net_seq, buf + 8, sizeof(net_seq));
+  memcpy(&net_len, buf + 12, sizeof(net_len));
+  header->cmd = (uint8_t)buf[0];
+  header->flags = (uint8_t)buf[1];
+  header->room = ntohs(net_room);
+  header->sender_id = (int32_t)ntohl(net_sender_id);
+  header->seq = ntohl(net_seq);
+  header->len = ntohl(net_len);
+}
+
+/* Sets the flags of an encoded frame header */
+void set_frame_flags(char *buf, int flags)
+{
+  buf[1] = (char)flags;
+}
+
+/*
+ * last_seq is the last message seen on an earlier connection or 0, caps
+ * are the EHLO_CAP_* flags of the features to ask for (or agree to).
+ */
+int encode_hello_frame(char *buf, int size, uint32_t last_seq, int caps)
+{
+  const char *deflate = caps & EHLO_CAP_DEFLATE ? " deflate" : "";
+  const char *shm = caps & EHLO_CAP_SHM ? " shm" : "";
+  int len;
+
+  if (last_seq != 0) {
+    len = snprintf(buf + EHLO_FRAME_HEADER_LEN,
+                   size - EHLO_FRAME_HEADER_LEN,
+                   "ehlo/%d %lu%s%s",
+                   EHLO_PROTOCOL_VERSION,
+                   (unsigned long)last_seq,
+                   deflate,
+                   shm);
+  } else {
+    len = snprintf(buf + EHLO_FRAME_HEADER_LEN,
+                   size - EHLO_FRAME_HEADER_LEN,
+                   "ehlo/%d%s%s",
+                   EHLO_PROTOCOL_VERSION,
+                   deflate,
+                   shm);
+  }
+  if (len < 0 || len >= size - EHLO_FRAME_HEADER_LEN) {
+    return -1;
+  }
+  encode_frame_header(buf, EHLO_CMD_HELLO, EHLO_LOBBY_ROOM, 0, 0, len);
+  return EHLO_FRAME_HEADER_LEN + len;
+}
+
+/*
+ * Returns the version from a HELLO payload or -1 if it's malformed. The
+ * last sequence number seen, if any, is stored in last_seq and the known
+ * capabilities in caps (either may be NULL).
+ */
+int parse_hello(const char *payload, int len, uint32_t *last_seq, int *caps)
+{
+  uint32_t seq = 0;
+  int found_caps = 0;
+  int version = 0;
+  int start;
+  int i;
+
+  if (len <= 5 || memcmp(payload, "ehlo/", 5) != 0) {
+    return -1;
+  }
+  for (i = 5; i < len && payload[i] >= '0' && payload[i] <= '9'; i++) {
+    version = version * 10 + (payload[i] - '0');
+  }
+  while (i < len && payload[i] == ' ') {
+    start = ++i;
+    if (i < len && payload[i] >= '0' && payload[i] <= '9') {
+      for (; i < len && payload[i] >= '0' && payload[i] <= '9'; i++) {
+        seq = seq * 10 + (payload[i] - '0');
+      }
+      continue;
+    }
+    while (i < len && payload[i] != ' ') {
+      i++;
+    }
+    if (i - start == 7 && memcmp(payload + start, "deflate", 7) == 0) {
+      found_caps |= EHLO_CAP_DEFLATE;
+    } else if (i - start == 3 && memcmp(payload + start, "shm", 3) == 0) {
+      found_caps |= EHLO_CAP_SHM;
+    }
+  }
+  if (last_seq != NULL) {
+    *last_seq = seq;
+  }
+  if (caps != NULL) {
+    *caps = found_caps;
+  }
+  return version;
+}
+
+int socket_wait_readable(socket_t sock, int timeout_ms)
+{
+  return socket_wait(sock, SOCKET_READABLE, timeout_ms);
+}
+
+/* Sends data from several buffers with one call, returns bytes sent or -1 */
+int send_vec(socket_t sock, io_vec_t *vec, int count)
+{
+#ifdef _WIN32
+  DWORD send_len = 0;
+
+  if (WSASend(sock, vec, count, &send_len, 0, NULL, NULL) != 0) {
+    return -1;
+  }
+  return (int)send_len;
+#else
+  struct msghdr msg;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = vec;
+  msg.msg_iovlen = count;
+  return (int)sendmsg(sock, &msg, 0);
+#endif
+}
+
+void recv_buffer_init(struct recv_buffer *buffer, int size)
+{
+  buffer->data = NULL;
+  buffer->size = size;
+  buffer->start = 0;
+  buffer->len = 0;
+}
+
+void recv_buffer_free(struct recv_buffer *buffer)
+{
+  free(buffer->data);
+  buffer->data = NULL;
+  buffer->start = 0;
+  buffer->len = 0;
+}
+
+void recv_buffer_trim(struct recv_buffer *buffer)
+{
+  if (buffer->len == 0) {
+    recv_buffer_free(buffer);
+  }
+}
+
+/*
+ * Reads as much as fits into the free space of the buffer with a single
+ * call, even if that space wraps around the end of the ring. Returns the
+ * number of bytes read, 0 if the connection was closed or -1 on error.
+ */
+int recv_buffer_fill(struct recv_buffer *buffer, socket_t sock)
+{
+  int end;
+  int free_len[2];
+#ifdef _WIN32
+  WSABUF bufs[2];
+  DWORD recv_len = 0;
+  DWORD flags = 0;
+#else
+  struct iovec iov[2];
+  struct msghdr msg;
+  ssize_t recv_len;
+#endif
+
+  if (buffer->data == NULL) {
+    buffer->data = malloc(buffer->size);
+    if (buffer->data == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+
+  if (buffer->start + buffer->len < buffer->size) {
+    end = buffer->start + buffer->len;
+    free_len[0] = buffer->size - end;
+    free_len[1] = buffer->start;
+  } else {
+    end = buffer->start + buffer->len - buffer->size;
+    free_len[0] = buffer->size - buffer->len;
+    free_len[1] = 0;
+  }
+  if (free_len[0] == 0) {
+#ifdef _WIN32
+    WSASetLastError(WSAENOBUFS);
+#else
+    errno = ENOBUFS;
+#endif
+    return -1;
+  }
+
+#ifdef _WIN32
+  bufs[0].buf = buffer->data + end;
+  bufs[0].len = free_len[0];
+  bufs[1].buf = buffer->data;
+  bufs[1].len = free_len[1];
+  if (WSARecv(sock,
+              bufs,
+              free_len[1] > 0 ? 2 : 1,
+              &recv_len,
+              &flags,
+              NULL,
+              NULL) != 0) {
+    return -1;
+  }
+#else
+  iov[0].iov_base = buffer->data + end;
+  iov[0].iov_len = free_len[0];
+  iov[1].iov_base = buffer->data;
+  iov[1].iov_len = free_len[1];
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = free_len[1] > 0 ? 2 : 1;
+  recv_len = recvmsg(sock, &msg, 0);
+  if (recv_len < 0) {
+    return -1;
+  }
+#endif
+
+  buffer->len += (int)recv_len;
+  return (int)recv_len;
+}
+
+/*
+ * Copies data that has already been received into the buffer. Returns 0,
+ * ENOBUFS if it doesn't fit or ENOMEM.
+ */
+int recv_buffer_append(struct recv_buffer *buffer, const char *data, int len)
+{
+  int end;
+  int first_len;
+
+  if (buffer->data == NULL) {
+    buffer->data = malloc(buffer->size);
+    if (buffer->data == NULL) {
+      return ENOMEM;
+    }
+  }
+  if (len > buffer->size - buffer->len) {
+    return ENOBUFS;
+  }
+
+  end = (buffer->start + buffer->len) & (buffer->size - 1);
+  first_len = buffer->size - end < len ? buffer->size - end : len;
+  memcpy(buffer->data + end, data, first_len);
+  memcpy(buffer->data, data + first_len, len - first_len);
+  buffer->len += len;
+  return 0;
+}
+
+int recv_buffer_peek(const struct recv_buffer *buffer, char *buf, int len)
+{
+  struct buffer_view view;
+
+  if (len > buffer->len) {
+    len = buffer->len;
+  }
+  recv_buffer_view(buffer, 0, len, &view);
+  memcpy(buf, view.data[0], view.len[0]);
+  memcpy(buf + view.len[0], view.data[1], view.len[1]);
+  return len;
+}
+
+void recv_buffer_view(const struct recv_buffer *buffer,
+                      int offset,
+                      int len,
+                      struct buffer_view *view)
+{
+  int pos = (buffer->start + offset) & (buffer->size - 1);
+
+  view->data[0] = buffer->data + pos;
+  view->len[0] = len < buffer->size - pos ? len : buffer->size - pos;
+  view->data[1] = buffer->data;
+  view->len[1] = len - view->len[0];
+}
+
+void recv_buffer_consume(struct recv_buffer *buffer, int len)
+{
+  buffer->start = (buffer->start + len) & (buffer->size - 1);
+  buffer->len -= len;
+  if (buffer->len == 0) {
+    buffer->start = 0;
+  }
+}
+
+/*
+ * Parses the frame at the start of the buffer without copying its payload.
+ * Returns the length of the whole frame, 0 if it's not complete yet or -1
+ * if the payload is longer than EHLO_MAX_MESSAGE_LEN.
+ */
+int recv_buffer_parse_frame(const struct recv_buffer *buffer,
+                            struct frame_header *header,
+                            struct buffer_view *payload)
+{
+  char header_buf[EHLO_FRAME_HEADER_LEN];
+
+  if (buffer->len < EHLO_FRAME_HEADER_LEN) {
+    return 0;
+  }
+  recv_buffer_peek(buffer, header_buf, EHLO_FRAME_HEADER_LEN);
+  decode_frame_header(header_buf, header);
+  if (header->len > EHLO_MAX_MESSAGE_LEN) {
+    return -1;
+  }
+  if (buffer->len < EHLO_FRAME_HEADER_LEN + (int)header->len) {
+    return 0;
+  }
+  recv_buffer_view(buffer, EHLO_FRAME_HEADER_LEN, (int)header->len, payload);
+  return EHLO_FRAME_HEADER_LEN + (int)header->len;
+}
+
+/*
+ * Parses a legacy command: a command byte and, for messages, header_len - 1
+ * more bytes (the sender ID when sent by the server) followed by
+ * NUL-terminated text. Return values are the same as for frames.
+ */
+int recv_buffer_parse_legacy(const struct recv_buffer *buffer,
+                             int header_len,
+                             struct buffer_view *text)
+{
+  struct buffer_view rest;
+  const char *nul;
+  int text_len;
+
+  if (buffer->len == 0) {
+    return 0;
+  }
+  if (buffer->data[buffer->start] != EHLO_CMD_MESSAGE) {
+    recv_buffer_view(buffer, 1, 0, text);
+    return 1;
+  }
+  if (buffer->len < header_len) {
+    return 0;
+  }
+
+  recv_buffer_view(buffer, header_len, buffer->len - header_len, &rest);
+  nul = memchr(rest.data[0], '\0', rest.len[0]);
+  if (nul != NULL) {
+    text_len = (int)(nul - rest.data[0]);
+  } else if (rest.len[1] > 0
+             && (nul = memchr(rest.data[1], '\0', rest.len[1])) != NULL) {
+    text_len = rest.len[0] + (int)(nul - rest.data[1]);
+  } else {
+    return buffer->len - header_len > EHLO_MAX_MESSAGE_LEN ? -1 : 0;
+  }
+  if (text_len > EHLO_MAX_MESSAGE_LEN) {
+    return -1;
+  }
+
+  recv_buffer_view(buffer, header_len, text_len, text);
+  return header_len + text_len + 1;
+}
+
+int buffer_view_len(const struct buffer_view *view)
+{
+  return view->len[0] + view->len[1];
+}
+
+/*
+ * Returns a pointer to the viewed data, copying it to buf only if it wraps
+ * around the end of the ring.
+ */
+const char *buffer_view_linearize(const struct buffer_view *view, char *buf)
+{
+  if (view->len[1] == 0) {
+    return view->data[0];
+  }
+  memcpy(buf, view->data[0], view->len[0]);
+  memcpy(buf + view->len[0], view->data[1], view->len[1]);
+  return buf;
+}
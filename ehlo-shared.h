@@ -13,13 +13,16 @@
   #define SHUT_WR SD_SEND
   #define SHUT_RDWR SD_BOTH
 #else
+  #include <fcntl.h>
   #include <netdb.h>
+  #include <poll.h>
   #include <pthread.h>
   #include <unistd.h>
   #include <arpa/inet.h>
   #include <netinet/in.h>
   #include <sys/types.h>
   #include <sys/socket.h>
+  #include <sys/uio.h>
   #define close_socket close
 #endif
 #ifndef INVALID_SOCKET
@@ -34,10 +37,16 @@
   typedef SOCKET socket_t;
   typedef HANDLE thread_t;
   typedef HANDLE mutex_t;
+  typedef WSABUF io_vec_t;
+  #define io_vec_set(vec, data, size) \
+      ((vec)->buf = (char *)(data), (vec)->len = (ULONG)(size))
 #else
   typedef int socket_t;
   typedef pthread_t thread_t;
   typedef pthread_mutex_t mutex_t;
+  typedef struct iovec io_vec_t;
+  #define io_vec_set(vec, data, size) \
+      ((vec)->iov_base = (void *)(data), (vec)->iov_len = (size))
 #endif
 
 #ifdef _MSC_VER
@@ -53,21 +62,221 @@
   #include <stdint.h>
 #endif
 
+/*
+ * Atomic operations on integers shared between threads. Counters use
+ * relaxed ordering, reference counts and exchanges use full barriers.
+ * Pointers are published with release and read with acquire ordering, as
+ * are integers with atomic_store_release() and atomic_load_acquire().
+ */
+#ifdef _MSC_VER
+  #define atomic_inc(ptr) _InterlockedIncrement((volatile long *)(ptr))
+  #define atomic_dec(ptr) _InterlockedDecrement((volatile long *)(ptr))
+  #define atomic_add_u64(ptr, value) \
+      _InterlockedExchangeAdd64((volatile __int64 *)(ptr), (__int64)(value))
+  #define atomic_load_u64(ptr) \
+      _InterlockedCompareExchange64((volatile __int64 *)(ptr), 0, 0)
+  #define atomic_store_u64(ptr, value) \
+      _InterlockedExchange64((volatile __int64 *)(ptr), (__int64)(value))
+  #define atomic_load_int(ptr) \
+      _InterlockedCompareExchange((volatile long *)(ptr), 0, 0)
+  #define atomic_store_int(ptr, value) \
+      _InterlockedExchange((volatile long *)(ptr), (value))
+  #define atomic_exchange_int(ptr, value) \
+      _InterlockedExchange((volatile long *)(ptr), (value))
+  #define atomic_exchange_ptr(ptr, value) \
+      _InterlockedExchangePointer((void *volatile *)(ptr), (value))
+  #define atomic_load_ptr(ptr) \
+      _InterlockedCompareExchangePointer((void *volatile *)(ptr), NULL, NULL)
+  #define atomic_store_ptr(ptr, value) \
+      _InterlockedExchangePointer((void *volatile *)(ptr), (value))
+  #define atomic_load_acquire(ptr) \
+      _InterlockedCompareExchange((volatile long *)(ptr), 0, 0)
+  #define atomic_store_release(ptr, value) \
+      _InterlockedExchange((volatile long *)(ptr), (long)(value))
+  #define atomic_fence() MemoryBarrier()
+#else
+  #define atomic_inc(ptr) __atomic_add_fetch((ptr), 1, __ATOMIC_SEQ_CST)
+  #define atomic_dec(ptr) __atomic_sub_fetch((ptr), 1, __ATOMIC_SEQ_CST)
+  #define atomic_add_u64(ptr, value) \
+      __atomic_fetch_add((ptr), (value), __ATOMIC_RELAXED)
+  #define atomic_load_u64(ptr) __atomic_load_n((ptr), __ATOMIC_RELAXED)
+  #define atomic_store_u64(ptr, value) \
+      __atomic_store_n((ptr), (uint64_t)(value), __ATOMIC_RELAXED)
+  #define atomic_load_int(ptr) __atomic_load_n((ptr), __ATOMIC_RELAXED)
+  #define atomic_store_int(ptr, value) \
+      __atomic_store_n((ptr), (value), __ATOMIC_RELAXED)
+  #define atomic_exchange_int(ptr, value) \
+      __atomic_exchange_n((ptr), (value), __ATOMIC_SEQ_CST)
+  #define atomic_exchange_ptr(ptr, value) \
+      __atomic_exchange_n((ptr), (value), __ATOMIC_SEQ_CST)
+  #define atomic_load_ptr(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+  #define atomic_store_ptr(ptr, value) \
+      __atomic_store_n((ptr), (value), __ATOMIC_RELEASE)
+  #define atomic_load_acquire(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+  #define atomic_store_release(ptr, value) \
+      __atomic_store_n((ptr), (value), __ATOMIC_RELEASE)
+  #define atomic_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
 typedef int (*recv_handler_t)(
     const char *buf, int len, int chunk_offset, int chunk_len);
 
+/*
+ * A PING is answered with a PONG that echoes its payload. The server pings
+ * framed clients that have been quiet for a while and closes connections
+ * that stay silent; any data received counts as a sign of life.
+ *
+ * JOIN carries the name of a room. The server answers with a JOIN whose
+ * header holds the room's number, which then goes into the header of
+ * messages for that room. LEAVE takes the number and is answered the same
+ * way. Everyone is in the lobby (room 0), which can't be left.
+ *
+ * STATS asks for the server's metrics. They come back as a series of STATS
+ * frames holding one line of text each, the last one is empty.
+ *
+ * PEER takes the place of HELLO on links between the servers of a cluster.
+ * Its sender_id is the node ID of the server that sends it and the payload
+ * is "ehlo/<version>"; the other end answers with a PEER of its own, or
+ * with an ERROR if the connection isn't from one of its peers. After that
+ * the link only carries MESSAGE frames relayed from the connecting node,
+ * whose sender_id is the cluster-wide ID of one of that node's clients and
+ * whose seq is a number that the connecting node gives to everything it
+ * relays.
+ *
+ * NICK registers the nickname in its payload for the sender, an empty one
+ * drops it. The server answers with a NICK holding the name now in effect
+ * or with an ERROR if someone else has it. Nicknames start with a letter,
+ * are made of letters, digits, '-' and '_' and are compared regardless of
+ * case.
+ *
+ * DIRECT sends a message to one client only. From a client, the payload
+ * is the recipient's nickname or ID, a space and the text. The recipient
+ * gets a DIRECT whose sender_id is the sender and whose payload is the
+ * text. Nicknames and direct messages stay within one server of a cluster.
+ */
 enum {
   EHLO_CMD_HELLO = 1,
   EHLO_CMD_MESSAGE = 2,
   EHLO_CMD_PING = 3,
-  EHLO_CMD_PONG = 4
+  EHLO_CMD_PONG = 4,
+  EHLO_CMD_ERROR = 5,
+  EHLO_CMD_JOIN = 6,
+  EHLO_CMD_LEAVE = 7,
+  EHLO_CMD_STATS = 8,
+  EHLO_CMD_PEER = 9,
+  EHLO_CMD_NICK = 10,
+  EHLO_CMD_DIRECT = 11
+};
+
+enum {
+  EHLO_PROTOCOL_UNKNOWN,
+  EHLO_PROTOCOL_LEGACY, /* command byte, client ID, NUL-terminated text */
+  EHLO_PROTOCOL_FRAMED  /* length-prefixed frames, see below */
 };
 
 #define EHLO_MAX_MESSAGE_LEN 128
-#define EHLO_MAX_CLIENTS 32
+#define EHLO_MAX_CLIENTS 65536
 
 #define EHLO_SERVER_ID -1
 
+#define EHLO_LOBBY_ROOM 0
+#define EHLO_MAX_ROOMS 4096
+#define EHLO_MAX_ROOM_NAME_LEN 32
+#define EHLO_MAX_NICK_LEN 16
+
+/* Events for socket_wait() */
+#define SOCKET_READABLE 1
+#define SOCKET_WRITABLE 2
+
+/*
+ * Framed protocol version. Clients start by sending a HELLO frame whose
+ * payload is "ehlo/<version>" and the server answers with its own HELLO.
+ * Peers that don't send (or answer) HELLO speak the legacy protocol.
+ *
+ * The HELLO frame never contains a byte equal to EHLO_CMD_MESSAGE, so a
+ * legacy server skips it as a series of unknown commands.
+ *
+ * Optional features are negotiated by listing their names after the
+ * version ("ehlo/4 deflate"). The server answers with those it supports
+ * and either side uses a feature only if both have listed it. Names that
+ * aren't known are ignored.
+ *
+ * A client connected over a Unix domain socket may ask for "shm". The
+ * server then passes a shared memory ring along with its HELLO (as
+ * SCM_RIGHTS ancillary data) and the client writes all further frames into
+ * the ring instead of the socket. Everything from the server still comes
+ * over the socket, which also ends the connection when it's closed.
+ */
+#define EHLO_PROTOCOL_VERSION 4
+#define EHLO_HELLO_TIMEOUT_MS 250
+
+/* Capabilities for the HELLO handshake */
+#define EHLO_CAP_DEFLATE 1 /* "deflate", see ehlo-deflate.h */
+#define EHLO_CAP_SHM 2     /* "shm", see ehlo-shm.h */
+
+/*
+ * Every frame starts with a fixed size header followed by len bytes of
+ * payload (at most EHLO_MAX_MESSAGE_LEN). Multi-byte fields are sent in
+ * network byte order:
+ *
+ *   uint8_t cmd
+ *   uint8_t flags
+ *   uint16_t room
+ *   int32_t sender_id
+ *   uint32_t seq
+ *   uint32_t len
+ *
+ * Lobby messages that the server keeps in its history are numbered by seq,
+ * which is 0 for everything else. When a client joins, recent history is
+ * replayed to it. A client that reconnects can put the last number it saw
+ * after the version in its HELLO ("ehlo/4 1234") to get only what it has
+ * missed.
+ *
+ * With EHLO_FLAG_DEFLATE set, the payload of a MESSAGE is compressed and
+ * len is its compressed length. Only peers that negotiated "deflate" send
+ * such frames, and only when it makes them shorter.
+ *
+ * Legacy messages only have room for a 16-bit client ID. Legacy peers see
+ * IDs below EHLO_LEGACY_UNKNOWN_ID as they are and every other one as
+ * EHLO_LEGACY_UNKNOWN_ID, so that no sender passes for someone else.
+ */
+#define EHLO_LEGACY_UNKNOWN_ID 0x7fff
+#define EHLO_FRAME_HEADER_LEN 16
+#define EHLO_FLAG_DEFLATE 1
+#define EHLO_MAX_FRAME_LEN (EHLO_FRAME_HEADER_LEN + EHLO_MAX_MESSAGE_LEN)
+
+struct frame_header {
+  int cmd;
+  int flags;
+  int room;
+  int sender_id;
+  uint32_t seq;
+  uint32_t len;
+};
+
+#define EHLO_RECV_BUFFER_SIZE 16384
+
+/*
+ * Ring buffer for data received from a socket. Storage is allocated on the
+ * first fill and may be released with recv_buffer_trim() once everything
+ * has been consumed, so that idle connections don't hold on to it.
+ */
+struct recv_buffer {
+  char *data;
+  int size; /* must be a power of two */
+  int start;
+  int len;
+};
+
+/*
+ * Buffered bytes handed out by the parsers. Data that wraps around the end
+ * of the ring is split in two parts, otherwise the second part is empty.
+ */
+struct buffer_view {
+  const char *data[2];
+  int len[2];
+};
+
 const char *get_program_name(const char *path);
 
 void socket_init(void);
@@ -75,10 +284,21 @@ void socket_cleanup(void);
 int close_socket_nicely(socket_t sock);
 
 int socket_error(void);
+int socket_would_block(int error);
+int set_socket_nonblocking(socket_t sock);
+int socket_wait(socket_t sock, int events, int timeout_ms);
+int socket_wait_readable(socket_t sock, int timeout_ms);
 char *error_to_str(int error, char *buf, size_t size);
 
+uint64_t get_time_ms(void);
+uint64_t get_time_us(void);
+uint64_t get_time_ns(void);
+uint64_t get_wall_time_ms(void);
+void sleep_ms(int ms);
+
 int create_thread(thread_t *thread, void *(*start)(void *arg), void *arg);
 int cancel_thread(thread_t thread);
+int join_thread(thread_t thread);
 int create_mutex(mutex_t *mutex);
 int lock_mutex(mutex_t *mutex);
 int unlock_mutex(mutex_t *mutex);
@@ -96,3 +316,42 @@ int printf_locked(const char *format, ...);
 int recv_n(
     socket_t sock, char *buf, int size, int flags, recv_handler_t handler);
 int send_n(socket_t sock, const char *buf, int size, int flags);
+int send_vec(socket_t sock, io_vec_t *vec, int count);
+#ifndef _WIN32
+  /* Most descriptors passed with one message */
+  #define EHLO_MAX_PASSED_FDS 64
+  int send_fds(socket_t sock,
+               const char *buf,
+               int len,
+               const int *fds,
+               int num_fds);
+  int recv_fds(socket_t sock, char *buf, int len, int *fds, int *num_fds);
+#endif
+
+void encode_frame_header(
+    char *buf, int cmd, int room, int sender_id, uint32_t seq, uint32_t len);
+void decode_frame_header(const char *buf, struct frame_header *header);
+void set_frame_flags(char *buf, int flags);
+int encode_hello_frame(char *buf, int size, uint32_t last_seq, int caps);
+int parse_hello(const char *payload, int len, uint32_t *last_seq, int *caps);
+
+void recv_buffer_init(struct recv_buffer *buffer, int size);
+void recv_buffer_free(struct recv_buffer *buffer);
+void recv_buffer_trim(struct recv_buffer *buffer);
+int recv_buffer_fill(struct recv_buffer *buffer, socket_t sock);
+int recv_buffer_append(struct recv_buffer *buffer, const char *data, int len);
+int recv_buffer_peek(const struct recv_buffer *buffer, char *buf, int len);
+void recv_buffer_view(const struct recv_buffer *buffer,
+                      int offset,
+                      int len,
+                      struct buffer_view *view);
+void recv_buffer_consume(struct recv_buffer *buffer, int len);
+int recv_buffer_parse_frame(const struct recv_buffer *buffer,
+                            struct frame_header *header,
+                            struct buffer_view *payload);
+int recv_buffer_parse_legacy(const struct recv_buffer *buffer,
+                             int header_len,
+                             struct buffer_view *text);
+
+int buffer_view_len(const struct buffer_view *view);
+const char *buffer_view_linearize(const struct buffer_view *view, char *buf);
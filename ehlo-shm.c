@@ -0,0 +1,241 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ehlo-shared.h"
+#include "ehlo-shm.h"
+
+#define SHM_RING_MAGIC 0x45484c52 /* "EHLR" */
+
+/*
+ * The size of the memory is fixed once the ring is set up. Otherwise the
+ * other side could truncate it and the next access would raise SIGBUS.
+ */
+#define SHM_RING_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+
+static void init_ring(struct shm_ring *ring)
+{
+  memset(ring, 0, sizeof(*ring));
+  ring->mem_fd = -1;
+  ring->data_fd = -1;
+  ring->space_fd = -1;
+}
+
+static int map_ring(struct shm_ring *ring, size_t map_size)
+{
+  void *memory;
+
+  memory = mmap(NULL,
+                map_size,
+                PROT_READ | PROT_WRITE,
+                MAP_SHARED,
+                ring->mem_fd,
+                0);
+  if (memory == MAP_FAILED) {
+    return errno;
+  }
+  ring->header = memory;
+  ring->data = (char *)memory + SHM_RING_DATA_OFFSET;
+  return 0;
+}
+
+/* Wakes up the other side if it said it would wait on fd */
+static void signal_waiting(int *waiting, int fd)
+{
+  uint64_t value = 1;
+
+  /* Pairs with the fence in shm_ring_want_*() */
+  atomic_fence();
+  if (atomic_load_int(waiting) && atomic_exchange_int(waiting, 0)) {
+    if (write(fd, &value, sizeof(value)) < 0) {
+      /* The counter is full, so a wakeup is pending anyway */
+    }
+  }
+}
+
+/*
+ * Creates a ring with size bytes of data, which must be a power of two.
+ * Returns 0 or an error code.
+ */
+int shm_ring_create(struct shm_ring *ring, uint32_t size)
+{
+  int error;
+
+  init_ring(ring);
+  ring->size = size;
+  ring->mem_fd = memfd_create("ehlo-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  ring->data_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  ring->space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (ring->mem_fd < 0 || ring->data_fd < 0 || ring->space_fd < 0) {
+    error = errno;
+  } else if (ftruncate(ring->mem_fd, SHM_RING_DATA_OFFSET + size) != 0
+             || fcntl(ring->mem_fd, F_ADD_SEALS, SHM_RING_SEALS) != 0) {
+    error = errno;
+  } else {
+    error = map_ring(ring, SHM_RING_DATA_OFFSET + size);
+  }
+  if (error != 0) {
+    shm_ring_close(ring);
+    return error;
+  }
+  ring->header->magic = SHM_RING_MAGIC;
+  ring->header->size = size;
+  return 0;
+}
+
+/*
+ * Maps a ring created by the other side, which must have sealed its size.
+ * The descriptors belong to the ring from now on, even if this fails.
+ * Returns 0 or an error code.
+ */
+int shm_ring_attach(struct shm_ring *ring,
+                    int mem_fd,
+                    int data_fd,
+                    int space_fd)
+{
+  struct stat st;
+  int seals;
+  int error;
+
+  init_ring(ring);
+  ring->mem_fd = mem_fd;
+  ring->data_fd = data_fd;
+  ring->space_fd = space_fd;
+  seals = fcntl(mem_fd, F_GET_SEALS);
+  if (seals < 0 || fstat(mem_fd, &st) != 0) {
+    error = errno;
+  } else if ((seals & SHM_RING_SEALS) != SHM_RING_SEALS
+             || st.st_size <= SHM_RING_DATA_OFFSET) {
+    error = EINVAL;
+  } else {
+    error = map_ring(ring, st.st_size);
+  }
+  if (error == 0) {
+    ring->size = ring->header->size;
+    if (ring->header->magic != SHM_RING_MAGIC
+        || ring->size == 0
+        || (ring->size & (ring->size - 1)) != 0
+        || ring->size != st.st_size - SHM_RING_DATA_OFFSET) {
+      munmap(ring->header, st.st_size);
+      ring->header = NULL;
+      error = EINVAL;
+    }
+  }
+  if (error != 0) {
+    shm_ring_close(ring);
+    return error;
+  }
+  ring->pos = ring->header->tail;
+  return 0;
+}
+
+void shm_ring_close(struct shm_ring *ring)
+{
+  if (ring->header != NULL) {
+    munmap(ring->header, SHM_RING_DATA_OFFSET + ring->size);
+  }
+  if (ring->mem_fd >= 0) {
+    close(ring->mem_fd);
+  }
+  if (ring->data_fd >= 0) {
+    close(ring->data_fd);
+  }
+  if (ring->space_fd >= 0) {
+    close(ring->space_fd);
+  }
+  init_ring(ring);
+}
+
+/*
+ * Copies as much of buf into the ring as fits and wakes up the reader if
+ * it's waiting. Returns the number of bytes written.
+ */
+int shm_ring_write(struct shm_ring *ring, const char *buf, int len)
+{
+  uint32_t head = atomic_load_acquire(&ring->header->head);
+  uint32_t space = ring->size - (ring->pos - head);
+  uint32_t offset = ring->pos & (ring->size - 1);
+  uint32_t first_len;
+
+  if ((uint32_t)len > space) {
+    len = (int)space;
+  }
+  if (len == 0) {
+    return 0;
+  }
+  first_len = ring->size - offset < (uint32_t)len
+      ? ring->size - offset
+      : (uint32_t)len;
+  memcpy(ring->data + offset, buf, first_len);
+  memcpy(ring->data, buf + first_len, len - first_len);
+  ring->pos += len;
+  atomic_store_release(&ring->header->tail, ring->pos);
+  signal_waiting(&ring->header->reader_waiting, ring->data_fd);
+  return len;
+}
+
+/*
+ * Tells the reader that the writer is about to wait on space_fd. Returns
+ * non-zero if there's room in the ring already, in which case it shouldn't.
+ */
+int shm_ring_want_space(struct shm_ring *ring)
+{
+  atomic_store_int(&ring->header->writer_waiting, 1);
+  atomic_fence();
+  if (ring->pos - atomic_load_acquire(&ring->header->head) < ring->size) {
+    atomic_store_int(&ring->header->writer_waiting, 0);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Points data at the unread bytes up to the end of the ring and returns
+ * their number, or -1 if the writer has published a position that can't
+ * be right.
+ */
+int shm_ring_peek(const struct shm_ring *ring, const char **data)
+{
+  uint32_t len = atomic_load_acquire(&ring->header->tail) - ring->pos;
+  uint32_t offset = ring->pos & (ring->size - 1);
+
+  if (len > ring->size) {
+    return -1;
+  }
+  *data = ring->data + offset;
+  return (int)(ring->size - offset < len ? ring->size - offset : len);
+}
+
+/* Frees len bytes for the writer and wakes it up if it's waiting */
+void shm_ring_consume(struct shm_ring *ring, int len)
+{
+  ring->pos += len;
+  atomic_store_release(&ring->header->head, ring->pos);
+  signal_waiting(&ring->header->writer_waiting, ring->space_fd);
+}
+
+/*
+ * Tells the writer that the reader is about to wait on data_fd. Returns
+ * non-zero if there's data in the ring already, in which case it shouldn't.
+ */
+int shm_ring_want_data(struct shm_ring *ring)
+{
+  atomic_store_int(&ring->header->reader_waiting, 1);
+  atomic_fence();
+  if (atomic_load_acquire(&ring->header->tail) != ring->pos) {
+    atomic_store_int(&ring->header->reader_waiting, 0);
+    return 1;
+  }
+  return 0;
+}
+
+/* Resets an eventfd after waking up on it */
+void shm_ring_clear_signal(int fd)
+{
+  uint64_t value;
+
+  if (read(fd, &value, sizeof(value)) < 0) {
+    /* Nothing was signaled */
+  }
+}
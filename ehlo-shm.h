@@ -0,0 +1,72 @@
+#ifndef EHLO_SHM_H
+#define EHLO_SHM_H
+
+/*
+ * Single-producer single-consumer byte ring in shared memory, through which
+ * a client on the same host hands its frames to the server without a
+ * system call for every write. The server creates a ring for each client
+ * that asks for one and passes it on as three descriptors: the memory (a
+ * memfd sealed against changes of its size) and two eventfds, data_fd for
+ * waking up the reader and space_fd for waking up the writer.
+ *
+ * Neither side signals the other unless it has announced that it's about
+ * to wait. The reader does that with shm_ring_want_data() before it goes to
+ * sleep on data_fd and the writer only writes data_fd if it sees the flag;
+ * it's the same with shm_ring_want_space() the other way round. A writer
+ * that stays ahead of a busy reader never makes a system call.
+ *
+ * The memory starts with a page holding the header, the data follows:
+ *
+ *   uint32_t magic
+ *   uint32_t size (of the data, a power of two)
+ *   uint32_t head (reader position, on its own cache line)
+ *   int reader_waiting
+ *   uint32_t tail (writer position, on its own cache line)
+ *   int writer_waiting
+ *
+ * Positions grow without bound and wrap around, the data between head and
+ * tail is unread. Each side keeps its own position in private memory and
+ * only publishes it, the other side could scribble over the header.
+ */
+
+#define SHM_RING_DEFAULT_SIZE (1 << 20)
+#define SHM_RING_DATA_OFFSET 4096
+
+struct shm_ring_header {
+  uint32_t magic;
+  uint32_t size;
+  char pad1[56];
+  uint32_t head;
+  int reader_waiting;
+  char pad2[56];
+  uint32_t tail;
+  int writer_waiting;
+};
+
+struct shm_ring {
+  struct shm_ring_header *header;
+  char *data;
+  uint32_t size;
+  uint32_t pos; /* head for the reader, tail for the writer */
+  int mem_fd;   /* kept so that the ring can be passed on */
+  int data_fd;
+  int space_fd;
+};
+
+int shm_ring_create(struct shm_ring *ring, uint32_t size);
+int shm_ring_attach(struct shm_ring *ring,
+                    int mem_fd,
+                    int data_fd,
+                    int space_fd);
+void shm_ring_close(struct shm_ring *ring);
+
+int shm_ring_write(struct shm_ring *ring, const char *buf, int len);
+int shm_ring_want_space(struct shm_ring *ring);
+
+int shm_ring_peek(const struct shm_ring *ring, const char **data);
+void shm_ring_consume(struct shm_ring *ring, int len);
+int shm_ring_want_data(struct shm_ring *ring);
+
+void shm_ring_clear_signal(int fd);
+
+#endif /* EHLO_SHM_H */
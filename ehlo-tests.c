@@ -0,0 +1,389 @@
+#include <stdlib.h>
+#include "ehlo-shared.h"
+#include "ehlo-nicks.h"
+#include "ehlo-registry.h"
+#include "ehlo-timer.h"
+
+/*
+ * Unit tests for the modules that don't need sockets or threads. Every
+ * failed check is printed and makes the program exit with an error.
+ */
+
+static int num_checks;
+static int num_failures;
+
+#define CHECK(condition) \
+    check((condition), #condition, __FILE__, __LINE__)
+
+static void check(int condition, const char *text, const char *file, int line)
+{
+  num_checks++;
+  if (!condition) {
+    num_failures++;
+    fprintf(stderr, "%s:%d: check failed: %s\n", file, line, text);
+  }
+}
+
+/* Returns the number of timers in a list returned by timer_wheel_expire() */
+static int count_expired(const struct timer *expired)
+{
+  int count = 0;
+
+  for (; expired != NULL; expired = expired->next) {
+    count++;
+  }
+  return count;
+}
+
+/* Timers on both sides of the first level's end */
+static void test_timer_wheel_wrap(void)
+{
+  struct timer_wheel wheel;
+  struct timer early, late;
+  struct timer *expired;
+
+  timer_wheel_init(&wheel, 1, 0);
+  timer_init(&early, NULL);
+  timer_init(&late, NULL);
+  timer_add(&wheel, &early, TIMER_WHEEL_SIZE - 1);
+  timer_add(&wheel, &late, TIMER_WHEEL_SIZE);
+
+  CHECK(timer_wheel_expire(&wheel, TIMER_WHEEL_SIZE - 2) == NULL);
+  expired = timer_wheel_expire(&wheel, TIMER_WHEEL_SIZE - 1);
+  CHECK(expired == &early && count_expired(expired) == 1);
+  CHECK(!timer_pending(&early) && timer_pending(&late));
+  expired = timer_wheel_expire(&wheel, TIMER_WHEEL_SIZE);
+  CHECK(expired == &late && count_expired(expired) == 1);
+  CHECK(wheel.count == 0);
+  CHECK(timer_wheel_timeout(&wheel, TIMER_WHEEL_SIZE) == -1);
+}
+
+/* Timers that have to come down two levels, at 4096 ticks and after */
+static void test_timer_wheel_cascade(void)
+{
+  const uint64_t level2 = (uint64_t)TIMER_WHEEL_SIZE * TIMER_WHEEL_SIZE;
+  struct timer_wheel wheel;
+  struct timer first, second, third;
+  struct timer *expired;
+
+  timer_wheel_init(&wheel, 1, 0);
+  timer_init(&first, NULL);
+  timer_init(&second, NULL);
+  timer_init(&third, NULL);
+  timer_add(&wheel, &first, level2);
+  timer_add(&wheel, &second, level2 + TIMER_WHEEL_SIZE);
+  timer_add(&wheel, &third, level2 - 1);
+
+  expired = timer_wheel_expire(&wheel, level2 - 1);
+  CHECK(expired == &third && count_expired(expired) == 1);
+  expired = timer_wheel_expire(&wheel, level2);
+  CHECK(expired == &first && count_expired(expired) == 1);
+  CHECK(timer_wheel_expire(&wheel, level2 + TIMER_WHEEL_SIZE - 1) == NULL);
+  expired = timer_wheel_expire(&wheel, level2 + TIMER_WHEEL_SIZE);
+  CHECK(expired == &second && count_expired(expired) == 1);
+  CHECK(wheel.count == 0);
+}
+
+/* A wheel that doesn't start at zero cascades at the same boundaries */
+static void test_timer_wheel_offset(void)
+{
+  struct timer_wheel wheel;
+  struct timer timers[3];
+  struct timer *expired;
+  int i;
+
+  /* 10 ms ticks, starting at tick 100 */
+  timer_wheel_init(&wheel, 10, 1000);
+  for (i = 0; i < 3; i++) {
+    timer_init(&timers[i], NULL);
+  }
+  timer_add(&wheel, &timers[0], 1900);
+  timer_add(&wheel, &timers[1], 1281);
+  timer_add(&wheel, &timers[2], 1280);
+
+  /* 1281 ms rounds up to tick 129, timers never go off early */
+  expired = timer_wheel_expire(&wheel, 1289);
+  CHECK(expired == &timers[2] && count_expired(expired) == 1);
+  expired = timer_wheel_expire(&wheel, 1290);
+  CHECK(expired == &timers[1] && count_expired(expired) == 1);
+  CHECK(timer_wheel_expire(&wheel, 1899) == NULL);
+  CHECK(timer_wheel_timeout(&wheel, 1899) == 1);
+  expired = timer_wheel_expire(&wheel, 5000);
+  CHECK(expired == &timers[0] && count_expired(expired) == 1);
+}
+
+/* Timers expire in order and can be moved or removed while pending */
+static void test_timer_wheel_order(void)
+{
+  const uint64_t far = (uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS);
+  struct timer_wheel wheel;
+  struct timer timers[4];
+  struct timer *expired;
+  int i;
+
+  timer_wheel_init(&wheel, 1, 0);
+  for (i = 0; i < 4; i++) {
+    timer_init(&timers[i], NULL);
+  }
+  timer_add(&wheel, &timers[0], 70);
+  timer_add(&wheel, &timers[1], 65);
+  timer_add(&wheel, &timers[2], 200);
+  timer_add(&wheel, &timers[3], 64);
+  timer_add(&wheel, &timers[2], 66);
+  CHECK(wheel.count == 4);
+  timer_remove(&wheel, &timers[1]);
+  CHECK(!timer_pending(&timers[1]) && wheel.count == 3);
+
+  expired = timer_wheel_expire(&wheel, 70);
+  CHECK(count_expired(expired) == 3);
+  CHECK(expired == &timers[3]);
+  CHECK(expired != NULL && expired->next == &timers[2]);
+  CHECK(expired != NULL && expired->next != NULL
+        && expired->next->next == &timers[0]);
+
+  /* Beyond the reach of the wheel, a timer goes off at its far end */
+  timer_add(&wheel, &timers[0], 71 + 2 * far);
+  CHECK(timer_wheel_expire(&wheel, 70 + far - 2) == NULL);
+  expired = timer_wheel_expire(&wheel, 71 + far);
+  CHECK(expired == &timers[0] && count_expired(expired) == 1);
+}
+
+/* An ID whose client is gone doesn't find the next one in its slot */
+static void test_registry_stale_id(void)
+{
+  struct registry registry;
+  int a = 1, b = 2, c = 3;
+  int id_a;
+  int id_b;
+  int id_c;
+
+  registry_init(&registry, 16);
+  id_a = registry_add(&registry, &a);
+  CHECK(id_a >= 0 && registry_lookup(&registry, id_a) == &a);
+  registry_remove(&registry, id_a);
+  CHECK(registry_lookup(&registry, id_a) == NULL);
+  CHECK(registry.num_active == 0);
+
+  id_b = registry_add(&registry, &b);
+  CHECK(registry_id_slot(id_b) == registry_id_slot(id_a));
+  CHECK(id_b != id_a);
+  CHECK(registry_lookup(&registry, id_a) == NULL);
+  CHECK(registry_lookup(&registry, id_b) == &b);
+
+  /* Removing through the stale ID leaves the new client alone */
+  registry_remove(&registry, id_a);
+  CHECK(registry_lookup(&registry, id_b) == &b);
+  CHECK(registry.num_active == 1);
+
+  id_c = registry_add(&registry, &c);
+  CHECK(registry_id_slot(id_c) != registry_id_slot(id_b));
+  registry_remove(&registry, id_b);
+  CHECK(registry.num_active == 1 && registry.active[0] == &c);
+  CHECK(registry.active_ids[0] == id_c);
+  CHECK(registry_lookup(&registry, -1) == NULL);
+  registry_destroy(&registry);
+}
+
+/* The generation wraps around after REGISTRY_GENERATION_MASK reuses */
+static void test_registry_generations(void)
+{
+  struct registry registry;
+  int entry = 1;
+  int first_id;
+  int id;
+  int i;
+
+  registry_init(&registry, 1);
+  first_id = registry_add(&registry, &entry);
+  id = first_id;
+  for (i = 0; i < REGISTRY_GENERATION_MASK; i++) {
+    registry_remove(&registry, id);
+    id = registry_add(&registry, &entry);
+    CHECK(id >= 0 && id != first_id);
+  }
+  registry_remove(&registry, id);
+  CHECK(registry_add(&registry, &entry) == first_id);
+  CHECK(registry_add(&registry, &entry) == -1);
+  registry_destroy(&registry);
+}
+
+/* Registries of different nodes hand out IDs from their own range */
+static void test_registry_range(void)
+{
+  struct registry registry;
+  int a = 1, b = 2;
+  int id_a;
+  int id_b;
+
+  registry_init_range(&registry, 1000, 4);
+  id_a = registry_add(&registry, &a);
+  CHECK(registry_id_slot(id_a) == 1000);
+  CHECK(registry_lookup(&registry, registry_id_slot(id_a) - 1) == NULL);
+  CHECK(registry_lookup(&registry, 0) == NULL);
+
+  /* An ID from elsewhere takes its own slot and is never handed out */
+  CHECK(registry_add_id(&registry, 1001, &b) == 0);
+  CHECK(registry_add_id(&registry, 1001, &b) == -1);
+  CHECK(registry_add_id(&registry, 1004, &b) == -1);
+  id_b = registry_add(&registry, &b);
+  CHECK(registry_id_slot(id_b) == 1002);
+  CHECK(registry_lookup(&registry, 1001) == &b);
+  registry_destroy(&registry);
+}
+
+/* Returns the home position of the name in the table */
+static uint32_t get_nick_home(struct nick_table *table, const char *name)
+{
+  int i;
+
+  for (i = 0; i < table->capacity; i++) {
+    if (table->entries[i].id >= 0
+        && strcmp(table->entries[i].name, name) == 0) {
+      return table->entries[i].hash & (uint32_t)(table->capacity - 1);
+    }
+  }
+  return (uint32_t)-1;
+}
+
+static void test_nicks_case(void)
+{
+  struct nick_table table;
+
+  nick_table_init(&table);
+  CHECK(nick_table_find(&table, "alice", 5) == -1);
+  CHECK(nick_table_add(&table, "Alice", 5, 7) == 0);
+  CHECK(nick_table_find(&table, "aLICE", 5) == 7);
+  CHECK(nick_table_find(&table, "Alic", 4) == -1);
+  CHECK(nick_table_find(&table, "Alicex", 6) == -1);
+  CHECK(nick_table_add(&table, "ALICE", 5, 8) == EEXIST);
+  nick_table_remove(&table, "alice", 5);
+  CHECK(nick_table_find(&table, "Alice", 5) == -1);
+  CHECK(nick_table_add(&table, "ALICE", 5, 8) == 0);
+  CHECK(table.count == 1);
+  nick_table_free(&table);
+}
+
+/*
+ * Removes every name of a crowded table in turn, each time checking that
+ * all the others can still be found, which fails if removal leaves a gap
+ * in a cluster.
+ */
+static void test_nicks_remove_in_cluster(void)
+{
+  struct nick_table table;
+  char names[32][EHLO_MAX_NICK_LEN + 1];
+  int num_names = 32;
+  int displaced = 0;
+  int i;
+  int j;
+
+  nick_table_init(&table);
+  for (i = 0; i < num_names; i++) {
+    sprintf(names[i], "user%d", i);
+    CHECK(nick_table_add(&table, names[i], (int)strlen(names[i]), i) == 0);
+  }
+  CHECK(table.capacity == 64);
+  for (i = 0; i < table.capacity; i++) {
+    if (table.entries[i].id >= 0
+        && (table.entries[i].hash & (table.capacity - 1)) != (uint32_t)i) {
+      displaced++;
+    }
+  }
+  CHECK(displaced > 0);
+
+  for (i = 0; i < num_names; i++) {
+    nick_table_remove(&table, names[i], (int)strlen(names[i]));
+    CHECK(nick_table_find(&table, names[i], (int)strlen(names[i])) == -1);
+    for (j = 0; j < num_names; j++) {
+      if (j != i) {
+        CHECK(nick_table_find(&table, names[j], (int)strlen(names[j])) == j);
+      }
+    }
+    CHECK(nick_table_add(&table, names[i], (int)strlen(names[i]), i) == 0);
+  }
+  nick_table_free(&table);
+}
+
+/* A cluster that wraps around the end of the table */
+static void test_nicks_remove_wrapped(void)
+{
+  struct nick_table table;
+  struct nick_table scratch;
+  char names[3][EHLO_MAX_NICK_LEN + 1];
+  char name[EHLO_MAX_NICK_LEN + 1];
+  int found = 0;
+  int i;
+
+  /* Names that hash to the last entry of a table of 64 */
+  nick_table_init(&scratch);
+  for (i = 0; found < 3 && i < 100000; i++) {
+    sprintf(name, "n%d", i);
+    nick_table_add(&scratch, name, (int)strlen(name), i);
+    if (scratch.capacity == 64 && get_nick_home(&scratch, name) == 63) {
+      strcpy(names[found++], name);
+    }
+    nick_table_remove(&scratch, name, (int)strlen(name));
+  }
+  nick_table_free(&scratch);
+  CHECK(found == 3);
+  if (found < 3) {
+    return;
+  }
+
+  nick_table_init(&table);
+  for (i = 0; i < 3; i++) {
+    CHECK(nick_table_add(&table, names[i], (int)strlen(names[i]), i) == 0);
+  }
+  CHECK(strcmp(table.entries[63].name, names[0]) == 0);
+  CHECK(strcmp(table.entries[0].name, names[1]) == 0);
+  CHECK(strcmp(table.entries[1].name, names[2]) == 0);
+
+  nick_table_remove(&table, names[0], (int)strlen(names[0]));
+  CHECK(nick_table_find(&table, names[1], (int)strlen(names[1])) == 1);
+  CHECK(nick_table_find(&table, names[2], (int)strlen(names[2])) == 2);
+  CHECK(table.entries[63].id == 1 && table.entries[0].id == 2);
+  CHECK(table.entries[1].id == -1);
+
+  nick_table_remove(&table, names[1], (int)strlen(names[1]));
+  CHECK(nick_table_find(&table, names[2], (int)strlen(names[2])) == 2);
+  CHECK(table.entries[63].id == 2 && table.count == 1);
+  nick_table_free(&table);
+}
+
+/* Growing the table keeps every name */
+static void test_nicks_grow(void)
+{
+  struct nick_table table;
+  char name[EHLO_MAX_NICK_LEN + 1];
+  int i;
+
+  nick_table_init(&table);
+  for (i = 0; i < 1000; i++) {
+    sprintf(name, "Nick%d", i);
+    CHECK(nick_table_add(&table, name, (int)strlen(name), i) == 0);
+  }
+  CHECK(table.count == 1000 && table.capacity >= 2000);
+  for (i = 0; i < 1000; i++) {
+    sprintf(name, "nick%d", i);
+    CHECK(nick_table_find(&table, name, (int)strlen(name)) == i);
+  }
+  nick_table_free(&table);
+}
+
+int main(void)
+{
+  test_timer_wheel_wrap();
+  test_timer_wheel_cascade();
+  test_timer_wheel_offset();
+  test_timer_wheel_order();
+  test_registry_stale_id();
+  test_registry_generations();
+  test_registry_range();
+  test_nicks_case();
+  test_nicks_remove_in_cluster();
+  test_nicks_remove_wrapped();
+  test_nicks_grow();
+
+  printf("%d checks, %d failed\n", num_checks, num_failures);
+  return num_failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
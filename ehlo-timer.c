@@ -0,0 +1,171 @@
+#include <stddef.h>
+#include "ehlo-timer.h"
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_MAX_TICKS \
+    (((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+void timer_wheel_init(struct timer_wheel *wheel, int tick_ms, uint64_t now_ms)
+{
+  struct timer *head;
+  int level;
+  int i;
+
+  wheel->tick_ms = tick_ms;
+  wheel->tick = now_ms / tick_ms;
+  wheel->count = 0;
+  for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    for (i = 0; i < TIMER_WHEEL_SIZE; i++) {
+      head = &wheel->slots[level][i];
+      head->next = head;
+      head->prev = head;
+    }
+  }
+}
+
+void timer_init(struct timer *timer, void *data)
+{
+  timer->next = NULL;
+  timer->prev = NULL;
+  timer->expires = 0;
+  timer->data = data;
+}
+
+int timer_pending(const struct timer *timer)
+{
+  return timer->prev != NULL;
+}
+
+static void unlink_timer(struct timer *timer)
+{
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->next = NULL;
+  timer->prev = NULL;
+}
+
+/* Links the timer into the slot that covers its expiry time */
+static void place_timer(struct timer_wheel *wheel, struct timer *timer)
+{
+  struct timer *head;
+  uint64_t delta;
+  int level;
+
+  /* Timers that are already due go off on the next tick */
+  if (timer->expires < wheel->tick) {
+    timer->expires = wheel->tick;
+  }
+  delta = timer->expires - wheel->tick;
+  if (delta > TIMER_WHEEL_MAX_TICKS) {
+    delta = TIMER_WHEEL_MAX_TICKS;
+    timer->expires = wheel->tick + delta;
+  }
+  for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+    if (delta < (uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1))) {
+      break;
+    }
+  }
+
+  head = &wheel->slots[level]
+                      [(timer->expires >> (TIMER_WHEEL_BITS * level))
+                           & TIMER_WHEEL_MASK];
+  timer->next = head;
+  timer->prev = head->prev;
+  head->prev->next = timer;
+  head->prev = timer;
+}
+
+/* Starts the timer or moves it to a new expiry time */
+void timer_add(struct timer_wheel *wheel,
+               struct timer *timer,
+               uint64_t expires_ms)
+{
+  if (timer_pending(timer)) {
+    unlink_timer(timer);
+  } else {
+    wheel->count++;
+  }
+  /* Round up so that timers never go off early */
+  timer->expires = (expires_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+  place_timer(wheel, timer);
+}
+
+void timer_remove(struct timer_wheel *wheel, struct timer *timer)
+{
+  if (timer_pending(timer)) {
+    unlink_timer(timer);
+    wheel->count--;
+  }
+}
+
+/* Moves the timers of a slot down to the levels below */
+static void cascade_timers(struct timer_wheel *wheel, int level, int index)
+{
+  struct timer *head = &wheel->slots[level][index];
+  struct timer *timer;
+
+  while (head->next != head) {
+    timer = head->next;
+    unlink_timer(timer);
+    place_timer(wheel, timer);
+  }
+}
+
+/*
+ * Advances the wheel to the given time. Returns the timers that expired on
+ * the way, linked through their next pointers in order of expiry. They
+ * are no longer pending and may be added again.
+ */
+struct timer *timer_wheel_expire(struct timer_wheel *wheel, uint64_t now_ms)
+{
+  uint64_t now = now_ms / wheel->tick_ms;
+  struct timer *expired = NULL;
+  struct timer **expired_tail = &expired;
+  struct timer *head;
+  struct timer *timer;
+  int index;
+  int slot_index;
+  int level;
+
+  while (wheel->tick <= now) {
+    if (wheel->count == 0) {
+      /* Nothing to cascade, skip straight to the present */
+      wheel->tick = now + 1;
+      break;
+    }
+
+    index = (int)(wheel->tick & TIMER_WHEEL_MASK);
+    slot_index = index;
+    for (level = 1; slot_index == 0 && level < TIMER_WHEEL_LEVELS; level++) {
+      slot_index = (int)((wheel->tick >> (TIMER_WHEEL_BITS * level))
+                         & TIMER_WHEEL_MASK);
+      cascade_timers(wheel, level, slot_index);
+    }
+
+    head = &wheel->slots[0][index];
+    while (head->next != head) {
+      timer = head->next;
+      unlink_timer(timer);
+      wheel->count--;
+      *expired_tail = timer;
+      expired_tail = &timer->next;
+    }
+    wheel->tick++;
+  }
+
+  return expired;
+}
+
+/*
+ * Returns the number of milliseconds until the next tick or -1 if no timer
+ * is pending.
+ */
+int timer_wheel_timeout(const struct timer_wheel *wheel, uint64_t now_ms)
+{
+  uint64_t next_ms = wheel->tick * wheel->tick_ms;
+
+  if (wheel->count == 0) {
+    return -1;
+  }
+  return now_ms >= next_ms ? 0 : (int)(next_ms - now_ms);
+}
@@ -0,0 +1,45 @@
+#ifndef EHLO_TIMER_H
+#define EHLO_TIMER_H
+
+/*
+ * Hierarchical timer wheel. Each level has TIMER_WHEEL_SIZE slots, a slot
+ * of the first level covers one tick and a slot of every next level covers
+ * as many ticks as the whole previous level. Timers are linked into the
+ * slot of their expiry time, so adding and removing them is O(1). Every
+ * tick handles a single slot of the first level; once per revolution a
+ * slot of the next level is moved down (cascaded) into the one below.
+ *
+ * Timers due further out than the wheel reaches expire at its far end.
+ */
+
+#include <stdint.h>
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SIZE (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+struct timer {
+  struct timer *next;
+  struct timer *prev; /* NULL while the timer isn't pending */
+  uint64_t expires;   /* in ticks */
+  void *data;
+};
+
+struct timer_wheel {
+  int tick_ms;
+  uint64_t tick; /* the next tick to be handled */
+  int count;
+  struct timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+};
+
+void timer_wheel_init(struct timer_wheel *wheel, int tick_ms, uint64_t now_ms);
+void timer_init(struct timer *timer, void *data);
+int timer_pending(const struct timer *timer);
+void timer_add(struct timer_wheel *wheel,
+               struct timer *timer,
+               uint64_t expires_ms);
+void timer_remove(struct timer_wheel *wheel, struct timer *timer);
+struct timer *timer_wheel_expire(struct timer_wheel *wheel, uint64_t now_ms);
+int timer_wheel_timeout(const struct timer_wheel *wheel, uint64_t now_ms);
+
+#endif /* EHLO_TIMER_H */
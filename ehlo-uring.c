@@ -0,0 +1,279 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "ehlo-uring.h"
+
+static int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd,
+                       unsigned to_submit,
+                       unsigned min_complete,
+                       unsigned flags,
+                       void *arg,
+                       size_t arg_size)
+{
+  return (int)syscall(__NR_io_uring_enter,
+                      fd,
+                      to_submit,
+                      min_complete,
+                      flags,
+                      arg,
+                      arg_size);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned count)
+{
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+/*
+ * Sets up a ring with room for the given number of submissions and four
+ * times as many completions. Returns 0 or an error code.
+ */
+int uring_init(struct uring *ring, unsigned entries, unsigned flags)
+{
+  struct io_uring_params params;
+  char *ptr;
+  size_t sq_size;
+  size_t cq_size;
+  unsigned i;
+  int error;
+
+  memset(ring, 0, sizeof(*ring));
+  memset(&params, 0, sizeof(params));
+  params.flags = flags | IORING_SETUP_CQSIZE;
+  params.cq_entries = entries * 4;
+
+  ring->fd = uring_setup(entries, &params);
+  if (ring->fd < 0) {
+    return errno;
+  }
+  ring->features = params.features;
+
+  /* Both rings share a single mapping on every kernel we support */
+  if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0) {
+    close(ring->fd);
+    return ENOTSUP;
+  }
+  sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_size = params.cq_off.cqes
+      + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+  ring->ring_ptr = mmap(NULL,
+                        ring->ring_size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE,
+                        ring->fd,
+                        IORING_OFF_SQ_RING);
+  if (ring->ring_ptr == MAP_FAILED) {
+    error = errno;
+    close(ring->fd);
+    return error;
+  }
+
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL,
+                    ring->sqes_size,
+                    PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE,
+                    ring->fd,
+                    IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    error = errno;
+    munmap(ring->ring_ptr, ring->ring_size);
+    close(ring->fd);
+    return error;
+  }
+
+  ptr = ring->ring_ptr;
+  ring->sq_head = (unsigned *)(ptr + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(ptr + params.sq_off.tail);
+  ring->sq_array = (unsigned *)(ptr + params.sq_off.array);
+  ring->sq_mask = *(unsigned *)(ptr + params.sq_off.ring_mask);
+  ring->sq_entries = params.sq_entries;
+  ring->sqe_tail = *ring->sq_tail;
+  ring->cq_head = (unsigned *)(ptr + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(ptr + params.cq_off.tail);
+  ring->cq_mask = *(unsigned *)(ptr + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(ptr + params.cq_off.cqes);
+
+  /* SQEs are always submitted in order, so the index array is fixed */
+  for (i = 0; i < ring->sq_entries; i++) {
+    ring->sq_array[i] = i;
+  }
+
+  return 0;
+}
+
+void uring_destroy(struct uring *ring)
+{
+  munmap(ring->sqes, ring->sqes_size);
+  munmap(ring->ring_ptr, ring->ring_size);
+  close(ring->fd);
+  ring->fd = -1;
+}
+
+/*
+ * Returns a cleared SQE to fill in or NULL if the submission queue is full,
+ * in which case uring_submit() has to be called first.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+  struct io_uring_sqe *sqe;
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+  if (ring->sqe_tail - head >= ring->sq_entries) {
+    return NULL;
+  }
+  sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sqe_tail++;
+  return sqe;
+}
+
+/*
+ * Submits all pending SQEs. If timeout_us is non-zero it also waits for at
+ * least one completion, up to timeout_us microseconds (or forever if it's
+ * negative). Returns 0 or an error code; timeouts and signals aren't errors.
+ */
+int uring_submit(struct uring *ring, int timeout_us)
+{
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned to_submit;
+  unsigned flags = 0;
+  int result;
+
+  to_submit = ring->sqe_tail - *ring->sq_tail;
+  __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+  memset(&arg, 0, sizeof(arg));
+  if (timeout_us != 0) {
+    flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    if (timeout_us > 0) {
+      ts.tv_sec = timeout_us / 1000000;
+      ts.tv_nsec = (timeout_us % 1000000) * 1000L;
+      arg.ts = (unsigned long long)(uintptr_t)&ts;
+    }
+  }
+
+  result = uring_enter(ring->fd,
+                       to_submit,
+                       timeout_us != 0 ? 1 : 0,
+                       flags,
+                       timeout_us != 0 ? &arg : NULL,
+                       timeout_us != 0 ? sizeof(arg) : 0);
+  if (result < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+    return errno;
+  }
+  return 0;
+}
+
+/* Returns the number of completions waiting to be seen */
+unsigned uring_cq_ready(struct uring *ring)
+{
+  return __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) - *ring->cq_head;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+  unsigned head = *ring->cq_head;
+
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+  __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Registers entries buffers of buf_size bytes each (entries must be a power
+ * of two) under the given group ID. Returns 0 or an error code.
+ */
+int uring_init_buf_ring(struct uring *ring,
+                        struct uring_buf_ring *buf_ring,
+                        int group_id,
+                        unsigned entries,
+                        int buf_size)
+{
+  struct io_uring_buf_reg reg;
+  size_t ring_size = entries * sizeof(struct io_uring_buf);
+  unsigned i;
+  int error;
+
+  buf_ring->ring = mmap(NULL,
+                        ring_size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1,
+                        0);
+  if (buf_ring->ring == MAP_FAILED) {
+    return errno;
+  }
+  buf_ring->buffers = malloc((size_t)entries * buf_size);
+  if (buf_ring->buffers == NULL) {
+    munmap(buf_ring->ring, ring_size);
+    return ENOMEM;
+  }
+  buf_ring->buf_size = buf_size;
+  buf_ring->entries = entries;
+  buf_ring->tail = 0;
+  buf_ring->group_id = group_id;
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long long)(uintptr_t)buf_ring->ring;
+  reg.ring_entries = entries;
+  reg.bgid = (unsigned short)group_id;
+  if (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+    error = errno;
+    free(buf_ring->buffers);
+    munmap(buf_ring->ring, ring_size);
+    return error;
+  }
+
+  for (i = 0; i < entries; i++) {
+    uring_recycle_buf(buf_ring, (int)i);
+  }
+  return 0;
+}
+
+void uring_destroy_buf_ring(struct uring *ring, struct uring_buf_ring *buf_ring)
+{
+  struct io_uring_buf_reg reg;
+
+  memset(&reg, 0, sizeof(reg));
+  reg.bgid = (unsigned short)buf_ring->group_id;
+  uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+  free(buf_ring->buffers);
+  munmap(buf_ring->ring, buf_ring->entries * sizeof(struct io_uring_buf));
+}
+
+char *uring_get_buf(struct uring_buf_ring *buf_ring, int id)
+{
+  return buf_ring->buffers + (size_t)id * buf_ring->buf_size;
+}
+
+/* Gives a buffer back to the kernel once its data has been consumed */
+void uring_recycle_buf(struct uring_buf_ring *buf_ring, int id)
+{
+  struct io_uring_buf *buf;
+
+  buf = &buf_ring->ring->bufs[buf_ring->tail & (buf_ring->entries - 1)];
+  buf->addr = (unsigned long long)(uintptr_t)uring_get_buf(buf_ring, id);
+  buf->len = (unsigned)buf_ring->buf_size;
+  buf->bid = (unsigned short)id;
+  buf_ring->tail++;
+  __atomic_store_n(&buf_ring->ring->tail, buf_ring->tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,58 @@
+#ifndef EHLO_URING_H
+#define EHLO_URING_H
+
+/*
+ * Minimal io_uring wrapper built directly on the system calls so that no
+ * extra library is needed. A ring must be used by one thread only.
+ */
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+struct uring {
+  int fd;
+  unsigned features;
+  void *ring_ptr;
+  size_t ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_array;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned sqe_tail; /* SQEs handed out but not yet submitted end here */
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+};
+
+/* A ring of buffers the kernel picks from for buffer-select receives */
+struct uring_buf_ring {
+  struct io_uring_buf_ring *ring;
+  char *buffers;
+  int buf_size;
+  unsigned entries;
+  unsigned short tail;
+  int group_id;
+};
+
+int uring_init(struct uring *ring, unsigned entries, unsigned flags);
+void uring_destroy(struct uring *ring);
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+int uring_submit(struct uring *ring, int timeout_us);
+unsigned uring_cq_ready(struct uring *ring);
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+
+int uring_init_buf_ring(struct uring *ring,
+                        struct uring_buf_ring *buf_ring,
+                        int group_id,
+                        unsigned entries,
+                        int buf_size);
+void uring_destroy_buf_ring(struct uring *ring, struct uring_buf_ring *buf_ring);
+char *uring_get_buf(struct uring_buf_ring *buf_ring, int id);
+void uring_recycle_buf(struct uring_buf_ring *buf_ring, int id);
+
+#endif /* EHLO_URING_H */
@@ -1,90 +1,725 @@
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include "ehlo-shared.h"
+#ifdef HAVE_ZLIB
+  #include "ehlo-deflate.h"
+#endif
+#ifdef HAVE_SHM
+  #include "ehlo-shm.h"
+#endif
+#ifdef _WIN32
+  #include <fcntl.h>
+  #include <io.h>
+  #define open _open
+  #define read _read
+  #define STDIN_FILENO 0
+#else
+  #include <sys/un.h>
+#endif
+
+#define MAX_JOINED_ROOMS 64
+
+/*
+ * Lines are read in large chunks and framed into the output buffer, so
+ * that piped input goes out in a few large writes instead of one per line.
+ */
+#define INPUT_BUFFER_SIZE 65536
+#define OUTPUT_BUFFER_SIZE 65536
+
+static int protocol = EHLO_PROTOCOL_UNKNOWN;
+static int caps; /* agreed on with the server */
+static struct recv_buffer in_buffer;
+
+static int pipe_mode; /* send every line as a message, no prompt */
+static int quiet; /* count messages instead of printing them */
+static uint64_t start_time;
+static uint64_t num_sent;
+static uint64_t num_received;
+
+static char input[INPUT_BUFFER_SIZE];
+static int input_len;
+static char output[OUTPUT_BUFFER_SIZE];
+static int output_len;
+
+#ifdef HAVE_ZLIB
+static struct deflate_codec codec;
+#endif
+
+#ifdef HAVE_SHM
+/*
+ * Once the server has handed over a ring, everything is sent through it
+ * and the socket only receives.
+ */
+static int use_ring; /* ask for one */
+static struct shm_ring ring;
+#endif
+
+#ifdef _WIN32
+/*
+ * The console can't be polled, so on Windows a command thread receives
+ * from the server while the main thread reads input. Both of them send.
+ */
+static mutex_t output_lock;
+#define lock_output() lock_mutex(&output_lock)
+#define unlock_output() unlock_mutex(&output_lock)
+#else
+#define lock_output()
+#define unlock_output()
+static volatile sig_atomic_t stop_requested;
+#endif
+
+/*
+ * Rooms confirmed by the server. The room that messages go to is switched
+ * by both the sending and the receiving side.
+ */
+static struct {
+  int id;
+  char name[EHLO_MAX_ROOM_NAME_LEN + 1];
+} joined_rooms[MAX_JOINED_ROOMS];
+static int num_joined_rooms;
+static int current_room = EHLO_LOBBY_ROOM;
 
 static void print_prompt(void)
 {
+  if (pipe_mode) {
+    return;
+  }
   printf_locked("> ");
   fflush(stdout);
 }
 
-static void *command_thread(void *arg)
+static const char *get_room_name(int room)
 {
-  socket_t sock = *((socket_t *)arg);
+  int i;
 
-  for (;;) {
-    int recv_size;
-    int8_t cmd;
+  for (i = 0; i < num_joined_rooms; i++) {
+    if (joined_rooms[i].id == room) {
+      return joined_rooms[i].name;
+    }
+  }
+  return NULL;
+}
+
+static void add_joined_room(int room, const char *name, int len)
+{
+  if (get_room_name(room) != NULL || num_joined_rooms == MAX_JOINED_ROOMS) {
+    return;
+  }
+  joined_rooms[num_joined_rooms].id = room;
+  memcpy(joined_rooms[num_joined_rooms].name, name, len);
+  joined_rooms[num_joined_rooms].name[len] = '\0';
+  num_joined_rooms++;
+}
+
+static void remove_joined_room(int room)
+{
+  int i;
+
+  for (i = 0; i < num_joined_rooms; i++) {
+    if (joined_rooms[i].id == room) {
+      joined_rooms[i] = joined_rooms[--num_joined_rooms];
+      break;
+    }
+  }
+}
+
+static void print_message(int room,
+                          int client_id,
+                          const char *message,
+                          int len)
+{
+  char prefix[EHLO_MAX_ROOM_NAME_LEN + 16];
+  const char *name;
+
+  prefix[0] = '\0';
+  if (room != EHLO_LOBBY_ROOM) {
+    name = get_room_name(room);
+    if (name != NULL) {
+      snprintf(prefix, sizeof(prefix), "[#%s] ", name);
+    } else {
+      snprintf(prefix, sizeof(prefix), "[#%d] ", room);
+    }
+  }
+  if (client_id == EHLO_SERVER_ID) {
+    printf_locked("\r%s[server]: %.*s\n", prefix, len, message);
+  } else if (protocol == EHLO_PROTOCOL_LEGACY
+             && client_id == EHLO_LEGACY_UNKNOWN_ID) {
+    /* Someone whose ID doesn't fit in a legacy message */
+    printf_locked("\r%s[?]: %.*s\n", prefix, len, message);
+  } else {
+    printf_locked("\r%s[%d]: %.*s\n", prefix, client_id, len, message);
+  }
+  print_prompt();
+}
+
+#ifdef HAVE_SHM
+
+/*
+ * Receives into the input buffer like recv_buffer_fill(), but keeps the
+ * descriptors of the ring that the server passes along with its HELLO.
+ */
+static int recv_hello_data(socket_t sock, int *fds, int *num_fds)
+{
+  char buf[EHLO_MAX_FRAME_LEN];
+  int received_fds[EHLO_MAX_PASSED_FDS];
+  int num_received_fds;
+  int recv_size;
+  int len;
+  int i;
 
-    recv_size = recv(sock, &cmd, 1, 0);
+  len = in_buffer.size - in_buffer.len;
+  if (len > (int)sizeof(buf)) {
+    len = (int)sizeof(buf);
+  }
+  recv_size = recv_fds(sock, buf, len, received_fds, &num_received_fds);
+  for (i = 0; i < num_received_fds; i++) {
+    if (*num_fds < EHLO_MAX_PASSED_FDS) {
+      fds[(*num_fds)++] = received_fds[i];
+    } else {
+      close(received_fds[i]);
+    }
+  }
+  if (recv_size > 0) {
+    errno = recv_buffer_append(&in_buffer, buf, recv_size);
+    if (errno != 0) {
+      return -1;
+    }
+  }
+  return recv_size;
+}
+
+#endif /* HAVE_SHM */
+
+/*
+ * Sends HELLO and waits for the server to answer. Servers that answer with
+ * anything else speak the legacy protocol.
+ */
+static int negotiate_protocol(socket_t sock)
+{
+  char buf[EHLO_MAX_FRAME_LEN];
+  struct frame_header header;
+  struct buffer_view payload;
+  char first_byte;
+  int wanted_caps = 0;
+  int len;
+  int recv_size;
+#ifdef HAVE_SHM
+  int ring_fds[EHLO_MAX_PASSED_FDS];
+  int num_ring_fds = 0;
+  int error;
+  int i;
+#endif
+
+#ifdef HAVE_ZLIB
+  if (deflate_codec_init(&codec) == 0) {
+    wanted_caps |= EHLO_CAP_DEFLATE;
+  }
+#endif
+#ifdef HAVE_SHM
+  if (use_ring) {
+    wanted_caps |= EHLO_CAP_SHM;
+  }
+#endif
+  len = encode_hello_frame(buf, sizeof(buf), 0, wanted_caps);
+  if (send_n(sock, buf, len, 0) <= 0) {
+    return socket_error();
+  }
+
+  for (;;) {
+    if (socket_wait_readable(sock, 5000) <= 0) {
+      return ETIMEDOUT;
+    }
+#ifdef HAVE_SHM
+    if (use_ring) {
+      recv_size = recv_hello_data(sock, ring_fds, &num_ring_fds);
+    } else
+#endif
+    recv_size = recv_buffer_fill(&in_buffer, sock);
     if (recv_size <= 0) {
-      if (recv_size == 0) {
-        printf_locked("Connection closed\n");
-        exit(EXIT_SUCCESS);
-      } else {
-        printf_locked("Failed to read command: %s\n",
-                      error_to_str(socket_error(), NULL, 0));
-        continue;
+      return recv_size == 0 ? ECONNRESET : socket_error();
+    }
+    recv_buffer_peek(&in_buffer, &first_byte, 1);
+    if (first_byte != EHLO_CMD_HELLO) {
+      protocol = EHLO_PROTOCOL_LEGACY;
+      return 0;
+    }
+    len = recv_buffer_parse_frame(&in_buffer, &header, &payload);
+    if (len < 0) {
+      return EPROTO;
+    }
+    if (len > 0) {
+      break;
+    }
+  }
+
+  if (parse_hello(buffer_view_linearize(&payload, buf),
+                  buffer_view_len(&payload),
+                  NULL,
+                  &caps) != EHLO_PROTOCOL_VERSION) {
+    fprintf(stderr, "Server speaks unsupported protocol version\n");
+    return EPROTO;
+  }
+  recv_buffer_consume(&in_buffer, len);
+  caps &= wanted_caps;
+
+#ifdef HAVE_SHM
+  if ((caps & EHLO_CAP_SHM) && num_ring_fds == 3) {
+    num_ring_fds = 0;
+    error = shm_ring_attach(&ring, ring_fds[0], ring_fds[1], ring_fds[2]);
+    if (error != 0) {
+      return error;
+    }
+  } else {
+    caps &= ~EHLO_CAP_SHM;
+  }
+  for (i = 0; i < num_ring_fds; i++) {
+    close(ring_fds[i]);
+  }
+#endif
+
+  protocol = EHLO_PROTOCOL_FRAMED;
+  return 0;
+}
+
+/*
+ * Frames a command into the output buffer. Returns 0 or ENOBUFS if there's
+ * no room for it.
+ */
+static int queue_command(int cmd, int room, const char *payload, int len)
+{
+  char *buf = output + output_len;
+  int flags = 0;
+
+  if (OUTPUT_BUFFER_SIZE - output_len < EHLO_MAX_FRAME_LEN + 1) {
+    return ENOBUFS;
+  }
+  if (len > EHLO_MAX_MESSAGE_LEN) {
+    len = EHLO_MAX_MESSAGE_LEN;
+  }
+  if (protocol == EHLO_PROTOCOL_FRAMED) {
+#ifdef HAVE_ZLIB
+    int result;
+
+    /* Only the main thread sends messages */
+    if (cmd == EHLO_CMD_MESSAGE
+        && (caps & EHLO_CAP_DEFLATE)
+        && len >= DEFLATE_DEFAULT_MIN_LEN) {
+      result = deflate_payload(&codec,
+                               payload,
+                               len,
+                               buf + EHLO_FRAME_HEADER_LEN);
+      if (result > 0) {
+        len = result;
+        flags = EHLO_FLAG_DEFLATE;
       }
     }
+#endif
+    if (flags == 0) {
+      memcpy(buf + EHLO_FRAME_HEADER_LEN, payload, len);
+    }
+    encode_frame_header(buf, cmd, room, 0, 0, len);
+    set_frame_flags(buf, flags);
+    len += EHLO_FRAME_HEADER_LEN;
+  } else {
+    buf[0] = (char)cmd;
+    memcpy(buf + 1, payload, len);
+    buf[len + 1] = '\0';
+    len += 2;
+  }
 
-    switch (cmd) {
-      case EHLO_CMD_PING:
-        /* not implemented yet */
-        break;
-      case EHLO_CMD_MESSAGE: {
-        int16_t client_id;
-        char message[EHLO_MAX_MESSAGE_LEN];
-        size_t offset = 0;
-        recv_size =
-            recv_n(sock, (char *)&client_id, sizeof(client_id), 0, NULL);
-        if (recv_size <= 0) {
-          fprintf_locked(stderr,
-                         "Failed to receive message: %s\n",
-                         error_to_str(socket_error(), NULL, 0));
-          break;
-        }
-        client_id = ntohs(client_id);
-        /*
-         * Read the message one chracter at a time until we hit the trailing
-         * NUL ('\0') character. This is probably inefficient...
-         */
-        for (;
-             (recv_size = recv(sock, message + offset, 1, 0)) >= 0;
-             offset++) {
-          if (recv_size == 0 || message[offset] == '\0') {
-            /* End of message */
-            break;
-          }
-          if (offset >= sizeof(message)) {
-            /* Message is too long, skip remaining text */
-            continue;
-          }
-        }
-        if (client_id == EHLO_SERVER_ID) {
-          printf_locked("\r[server]: %s\n", message);
-        } else {
-          printf_locked("\r[%d]: %s\n", client_id, message);
-        }
-        print_prompt();
+  output_len += len;
+  if (cmd == EHLO_CMD_MESSAGE) {
+    num_sent++;
+  }
+  return 0;
+}
+
+/*
+ * Sends as much of the output buffer as the socket or the ring takes
+ * without blocking, or all of it if the socket is blocking.
+ */
+static int flush_output(socket_t sock)
+{
+  int len = 0;
+  int result;
+  int error;
+
+#ifdef HAVE_SHM
+  if (ring.header != NULL) {
+    len = shm_ring_write(&ring, output, output_len);
+    memmove(output, output + len, output_len - len);
+    output_len -= len;
+    return 0;
+  }
+#endif
+
+  while (len < output_len) {
+    result = send(sock, output + len, output_len - len, 0);
+    if (result < 0) {
+      error = socket_error();
+      if (!socket_would_block(error)) {
+        return error;
+      }
+      break;
+    }
+    len += result;
+  }
+  memmove(output, output + len, output_len - len);
+  output_len -= len;
+  return 0;
+}
+
+/* Waits until the output buffer can be flushed, at least in part */
+static void wait_for_output_space(socket_t sock)
+{
+#ifdef HAVE_SHM
+  struct pollfd fd;
+
+  if (ring.header != NULL) {
+    if (!shm_ring_want_space(&ring)) {
+      fd.fd = ring.space_fd;
+      fd.events = POLLIN;
+      poll(&fd, 1, -1);
+      shm_ring_clear_signal(ring.space_fd);
+    }
+    return;
+  }
+#endif
+  socket_wait(sock, SOCKET_WRITABLE, -1);
+}
+
+/* Sends a command right away, after whatever is queued before it */
+static int send_command(socket_t sock,
+                        int cmd,
+                        int room,
+                        const char *payload,
+                        int len)
+{
+  int error;
+
+  lock_output();
+  while ((error = queue_command(cmd, room, payload, len)) == ENOBUFS) {
+    wait_for_output_space(sock);
+    error = flush_output(sock);
+    if (error != 0) {
+      break;
+    }
+  }
+  if (error == 0) {
+    error = flush_output(sock);
+  }
+  unlock_output();
+  return error;
+}
+
+/* The payload is echoed back, so it's simply the time the PING was sent */
+static int send_ping(socket_t sock)
+{
+  char token[32];
+  int len;
+
+  len = snprintf(token,
+                 sizeof(token),
+                 "%llu",
+                 (unsigned long long)get_time_ms());
+  return send_command(sock, EHLO_CMD_PING, EHLO_LOBBY_ROOM, token, len);
+}
+
+static void handle_connection_closed(int recv_size)
+{
+  if (recv_size == 0) {
+    printf_locked("\rConnection closed\n");
+    exit(EXIT_SUCCESS);
+  }
+  fprintf_locked(stderr,
+                 "\rFailed to receive data: %s\n",
+                 error_to_str(socket_error(), NULL, 0));
+  exit(EXIT_FAILURE);
+}
+
+/*
+ * Handles the next complete frame or legacy command in the input buffer.
+ * Returns its length, 0 if it's incomplete or -1 if it's too long.
+ */
+static int process_next_command(socket_t sock)
+{
+  struct frame_header header;
+  struct buffer_view payload;
+  char legacy_header[3];
+  char scratch[EHLO_MAX_MESSAGE_LEN];
+#ifdef HAVE_ZLIB
+  char inflated[EHLO_MAX_MESSAGE_LEN];
+#endif
+  char token[32];
+  const char *data;
+  uint64_t sent_ms;
+  int16_t client_id;
+  int data_len;
+  int len;
+
+  if (protocol == EHLO_PROTOCOL_FRAMED) {
+    len = recv_buffer_parse_frame(&in_buffer, &header, &payload);
+    if (len <= 0) {
+      return len;
+    }
+  } else {
+    len = recv_buffer_parse_legacy(&in_buffer, sizeof(legacy_header), &payload);
+    if (len <= 0) {
+      return len;
+    }
+    recv_buffer_peek(&in_buffer, legacy_header, sizeof(legacy_header));
+    memcpy(&client_id, legacy_header + 1, sizeof(client_id));
+    header.cmd = (int8_t)legacy_header[0];
+    header.room = EHLO_LOBBY_ROOM;
+    header.sender_id = (int16_t)ntohs(client_id);
+  }
+
+  /* Counting doesn't need the payload, compressed or not */
+  if (quiet && header.cmd == EHLO_CMD_MESSAGE) {
+    num_received++;
+    recv_buffer_consume(&in_buffer, len);
+    return len;
+  }
+
+  data = buffer_view_linearize(&payload, scratch);
+  data_len = buffer_view_len(&payload);
+  if (protocol == EHLO_PROTOCOL_FRAMED && (header.flags & EHLO_FLAG_DEFLATE)) {
+#ifdef HAVE_ZLIB
+    data_len = inflate_payload(&codec,
+                               data,
+                               data_len,
+                               inflated,
+                               sizeof(inflated));
+    data = inflated;
+#else
+    data_len = -1;
+#endif
+    if (data_len < 0) {
+      fprintf_locked(stderr, "\rServer sent a malformed compressed message\n");
+      recv_buffer_consume(&in_buffer, len);
+      return len;
+    }
+  }
+
+  switch (header.cmd) {
+    case EHLO_CMD_PING:
+      send_command(sock,
+                   EHLO_CMD_PONG,
+                   EHLO_LOBBY_ROOM,
+                   data,
+                   data_len);
+      break;
+    case EHLO_CMD_PONG:
+      if (data_len >= (int)sizeof(token)) {
         break;
       }
-      default:
-        fprintf_locked(stderr, "Received unknown command %d\n", cmd);
+      memcpy(token, data, data_len);
+      token[data_len] = '\0';
+      sent_ms = strtoull(token, NULL, 10);
+      printf_locked("\rRound-trip time: %llu ms\n",
+                    (unsigned long long)(get_time_ms() - sent_ms));
+      print_prompt();
+      break;
+    case EHLO_CMD_MESSAGE:
+      num_received++;
+      print_message(header.room,
+                    header.sender_id,
+                    data,
+                    data_len);
+      break;
+    case EHLO_CMD_DIRECT:
+      num_received++;
+      printf_locked("\r[%d] (private): %.*s\n",
+                    header.sender_id,
+                    data_len,
+                    data);
+      print_prompt();
+      break;
+    case EHLO_CMD_NICK:
+      if (data_len == 0) {
+        printf_locked("\rYou no longer have a nickname\n");
+      } else {
+        printf_locked("\rYou are now known as %.*s\n", data_len, data);
+      }
+      print_prompt();
+      break;
+    case EHLO_CMD_JOIN:
+      if (data_len > EHLO_MAX_ROOM_NAME_LEN) {
         break;
-    }
+      }
+      add_joined_room(header.room, data, data_len);
+      atomic_store_int(&current_room, header.room);
+      printf_locked("\rNow talking in #%.*s\n",
+                    data_len,
+                    data);
+      print_prompt();
+      break;
+    case EHLO_CMD_LEAVE:
+      remove_joined_room(header.room);
+      if (atomic_load_int(&current_room) == header.room) {
+        atomic_store_int(&current_room, EHLO_LOBBY_ROOM);
+      }
+      printf_locked("\rLeft #%.*s\n", data_len, data);
+      print_prompt();
+      break;
+    case EHLO_CMD_STATS:
+      if (data_len == 0) {
+        print_prompt();
+      } else {
+        printf_locked("\r%.*s\n", data_len, data);
+      }
+      break;
+    case EHLO_CMD_ERROR:
+      fprintf_locked(stderr,
+          "\rServer error: %.*s\n", data_len, data);
+      print_prompt();
+      break;
+    default:
+      fprintf_locked(stderr, "Received unknown command %d\n", header.cmd);
+      break;
   }
 
-  return NULL;
+  recv_buffer_consume(&in_buffer, len);
+  return len;
+}
+
+/* Handles every complete command in the input buffer */
+static void process_commands(socket_t sock)
+{
+  int len;
+
+  while ((len = process_next_command(sock)) > 0) {
+    continue;
+  }
+  if (len < 0) {
+    fprintf_locked(stderr,
+        "\rServer sent a message longer than %d bytes\n",
+        EHLO_MAX_MESSAGE_LEN);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* A single read may bring in many commands */
+static void receive_commands(socket_t sock)
+{
+  int recv_size;
+
+  recv_size = recv_buffer_fill(&in_buffer, sock);
+  if (recv_size <= 0) {
+    if (recv_size < 0 && socket_would_block(socket_error())) {
+      return;
+    }
+    handle_connection_closed(recv_size);
+  }
+  process_commands(sock);
 }
 
 static void execute_chat_command(socket_t sock, const char *cmd)
 {
+  const char *name;
+  const char *text;
+  int room;
+  int error;
+
   if (strncmp(cmd, "/help", sizeof("/help") - 1) == 0) {
     printf_locked("Available commands:\n"
       "  /help - show this help message\n"
+      "  /ping - measure the round-trip time to the server\n"
+      "  /join <room> - join a room and talk there\n"
+      "  /leave - leave the room you're talking in\n"
+      "  /lobby - talk in the lobby again\n"
+      "  /nick [name] - take a nickname or drop yours\n"
+      "  /msg <client> <message> - send a message to one client, by\n"
+      "                            nickname or ID\n"
+      "  /stats - show the server's metrics\n"
       "  /exit - exit the program\n"
     );
+  } else if (strncmp(cmd, "/ping", sizeof("/ping") - 1) == 0) {
+    if (protocol != EHLO_PROTOCOL_FRAMED) {
+      printf_locked("The server doesn't support /ping\n");
+    } else if ((error = send_ping(sock)) != 0) {
+      fprintf_locked(stderr,
+                     "Failed to send PING: %s\n",
+                     error_to_str(error, NULL, 0));
+    }
+  } else if (strncmp(cmd, "/join", sizeof("/join") - 1) == 0) {
+    name = cmd + sizeof("/join") - 1;
+    while (*name == ' ') {
+      name++;
+    }
+    if (protocol != EHLO_PROTOCOL_FRAMED) {
+      printf_locked("The server doesn't support rooms\n");
+    } else if (*name == '\0') {
+      printf_locked("Usage: /join <room>\n");
+    } else if ((error = send_command(sock,
+                                     EHLO_CMD_JOIN,
+                                     EHLO_LOBBY_ROOM,
+                                     name,
+                                     (int)strlen(name))) != 0) {
+      fprintf_locked(stderr,
+                     "Failed to send JOIN: %s\n",
+                     error_to_str(error, NULL, 0));
+    }
+  } else if (strncmp(cmd, "/leave", sizeof("/leave") - 1) == 0) {
+    room = atomic_load_int(&current_room);
+    if (room == EHLO_LOBBY_ROOM) {
+      printf_locked("You can't leave the lobby\n");
+    } else if ((error = send_command(sock, EHLO_CMD_LEAVE, room, "", 0))
+               != 0) {
+      fprintf_locked(stderr,
+                     "Failed to send LEAVE: %s\n",
+                     error_to_str(error, NULL, 0));
+    }
+  } else if (strncmp(cmd, "/nick", sizeof("/nick") - 1) == 0) {
+    name = cmd + sizeof("/nick") - 1;
+    while (*name == ' ') {
+      name++;
+    }
+    if (protocol != EHLO_PROTOCOL_FRAMED) {
+      printf_locked("The server doesn't support nicknames\n");
+    } else if ((error = send_command(sock,
+                                     EHLO_CMD_NICK,
+                                     EHLO_LOBBY_ROOM,
+                                     name,
+                                     (int)strlen(name))) != 0) {
+      fprintf_locked(stderr,
+                     "Failed to send NICK: %s\n",
+                     error_to_str(error, NULL, 0));
+    }
+  } else if (strncmp(cmd, "/msg", sizeof("/msg") - 1) == 0) {
+    name = cmd + sizeof("/msg") - 1;
+    while (*name == ' ') {
+      name++;
+    }
+    text = strchr(name, ' ');
+    if (protocol != EHLO_PROTOCOL_FRAMED) {
+      printf_locked("The server doesn't support direct messages\n");
+    } else if (text == NULL || text[1] == '\0') {
+      printf_locked("Usage: /msg <client> <message>\n");
+    } else if ((error = send_command(sock,
+                                     EHLO_CMD_DIRECT,
+                                     EHLO_LOBBY_ROOM,
+                                     name,
+                                     (int)strlen(name))) != 0) {
+      fprintf_locked(stderr,
+                     "Failed to send DIRECT: %s\n",
+                     error_to_str(error, NULL, 0));
+    }
+  } else if (strncmp(cmd, "/lobby", sizeof("/lobby") - 1) == 0) {
+    atomic_store_int(&current_room, EHLO_LOBBY_ROOM);
+  } else if (strncmp(cmd, "/stats", sizeof("/stats") - 1) == 0) {
+    if (protocol != EHLO_PROTOCOL_FRAMED) {
+      printf_locked("The server doesn't support /stats\n");
+    } else if ((error = send_command(sock,
+                                     EHLO_CMD_STATS,
+                                     EHLO_LOBBY_ROOM,
+                                     "",
+                                     0)) != 0) {
+      fprintf_locked(stderr,
+                     "Failed to send STATS: %s\n",
+                     error_to_str(error, NULL, 0));
+    }
   } else if (strncmp(cmd, "/exit", sizeof("/exit") - 1) == 0) {
     close_socket_nicely(sock);
     exit(EXIT_SUCCESS);
@@ -94,26 +729,407 @@ static void execute_chat_command(socket_t sock, const char *cmd)
   }
 }
 
-int main(int argc, char **argv)
+static void handle_line(socket_t sock, const char *line, int len)
+{
+  char cmd[EHLO_MAX_MESSAGE_LEN + 1];
+
+  if (len > EHLO_MAX_MESSAGE_LEN) {
+    len = EHLO_MAX_MESSAGE_LEN;
+  }
+  if (!pipe_mode && len > 0 && line[0] == '/') {
+    memcpy(cmd, line, len);
+    cmd[len] = '\0';
+    execute_chat_command(sock, cmd);
+  } else {
+    queue_command(EHLO_CMD_MESSAGE,
+                  atomic_load_int(&current_room),
+                  line,
+                  len);
+  }
+  print_prompt();
+}
+
+/*
+ * Handles the complete lines in the input buffer, as many as there's room
+ * for in the output buffer. Returns nonzero if some didn't fit. A line
+ * that fills the whole buffer is cut, as is the last line at the end of
+ * input.
+ */
+static int process_input(socket_t sock, int eof)
+{
+  char *line = input;
+  char *end = input + input_len;
+  char *next;
+  int full = 0;
+  int len;
+
+  while (line < end) {
+    if (OUTPUT_BUFFER_SIZE - output_len < EHLO_MAX_FRAME_LEN + 1) {
+      full = 1;
+      break;
+    }
+    next = memchr(line, '\n', end - line);
+    if (next != NULL) {
+      len = (int)(next - line);
+      next++;
+    } else if (eof || (line == input && input_len == INPUT_BUFFER_SIZE)) {
+      len = (int)(end - line);
+      next = end;
+    } else {
+      break;
+    }
+    if (len > 0 && line[len - 1] == '\r') {
+      len--;
+    }
+    handle_line(sock, line, len);
+    line = next;
+  }
+
+  input_len = (int)(end - line);
+  memmove(input, line, input_len);
+  return full;
+}
+
+static void print_summary(void)
+{
+  double seconds = (get_time_ms() - start_time) / 1000.0;
+
+  if (seconds <= 0) {
+    seconds = 0.001;
+  }
+  if (pipe_mode) {
+    fprintf_locked(stderr,
+                   "Sent %llu messages in %.3f s (%.0f messages/s)\n",
+                   (unsigned long long)num_sent,
+                   seconds,
+                   num_sent / seconds);
+  }
+  if (quiet) {
+    fprintf_locked(stderr,
+                   "Received %llu messages in %.3f s (%.0f messages/s)\n",
+                   (unsigned long long)num_received,
+                   seconds,
+                   num_received / seconds);
+  }
+}
+
+#ifdef _WIN32
+
+static void *command_thread(void *arg)
+{
+  socket_t sock = *((socket_t *)arg);
+
+  for (;;) {
+    receive_commands(sock);
+  }
+
+  return NULL;
+}
+
+/*
+ * Reads input on this thread while the command thread receives. The socket
+ * stays blocking, so flushing sends everything that was queued.
+ */
+static int run_client(socket_t sock, int input_fd)
+{
+  thread_t command_thread_handle;
+  int input_eof = 0;
+  int more_input;
+  int len;
+  int error;
+
+  error = create_mutex(&output_lock);
+  if (error != 0) {
+    return error;
+  }
+  process_commands(sock);
+  error = create_thread(&command_thread_handle, command_thread, &sock);
+  if (error != 0) {
+    return error;
+  }
+
+  print_prompt();
+  while (!input_eof) {
+    len = read(input_fd, input + input_len, INPUT_BUFFER_SIZE - input_len);
+    if (len <= 0) {
+      input_eof = 1;
+    } else {
+      input_len += len;
+    }
+    lock_output();
+    do {
+      more_input = process_input(sock, input_eof);
+      error = flush_output(sock);
+    } while (error == 0 && more_input);
+    unlock_output();
+    if (error != 0) {
+      return error;
+    }
+  }
+
+  if (!pipe_mode) {
+    printf_locked("EOF\n");
+    cancel_thread(command_thread_handle);
+    return 0;
+  }
+  /* Everything sent is handled once the server closes the connection */
+  shutdown(sock, SHUT_WR);
+  join_thread(command_thread_handle);
+  return 0;
+}
+
+#else /* _WIN32 */
+
+static void handle_stop_signal(int signal)
+{
+  (void)signal;
+  stop_requested = 1;
+}
+
+/*
+ * Waits for the server and the input on a single thread. Input is only
+ * read while there's room to buffer it, so piped input is held back by
+ * the rate at which the server takes it.
+ */
+static int run_client(socket_t sock, int input_fd)
 {
+  struct pollfd fds[3];
+  int input_eof = 0;
+  int closing = 0;
+  int num_fds;
+  int input_index;
+#ifdef HAVE_SHM
+  int space_index;
+#endif
+  int more_input;
+  int len;
   int error;
+
+  error = set_socket_nonblocking(sock);
+  if (error != 0) {
+    return error;
+  }
+  process_commands(sock);
+
+  fds[0].fd = sock;
+
+  print_prompt();
+  while (!stop_requested) {
+    /* Keep going for as long as the socket takes everything */
+    do {
+      more_input = process_input(sock, input_eof);
+      error = flush_output(sock);
+    } while (error == 0 && more_input && output_len == 0);
+    if (error != 0) {
+      return error;
+    }
+
+    if (input_eof && input_len == 0 && output_len == 0 && !closing) {
+      if (!pipe_mode) {
+        printf_locked("EOF\n");
+        return 0;
+      }
+      /*
+       * Everything sent is handled once the server closes the connection,
+       * it empties the ring before it does
+       */
+      shutdown(sock, SHUT_WR);
+      closing = 1;
+    }
+
+    fds[0].events = POLLIN;
+    num_fds = 1;
+#ifdef HAVE_SHM
+    space_index = -1;
+    if (output_len > 0 && ring.header != NULL) {
+      if (shm_ring_want_space(&ring)) {
+        continue;
+      }
+      space_index = num_fds++;
+      fds[space_index].fd = ring.space_fd;
+      fds[space_index].events = POLLIN;
+    } else
+#endif
+    if (output_len > 0) {
+      fds[0].events |= POLLOUT;
+    }
+    input_index = -1;
+    if (!input_eof && input_len < INPUT_BUFFER_SIZE) {
+      input_index = num_fds++;
+      fds[input_index].fd = input_fd;
+      fds[input_index].events = POLLIN;
+    }
+    if (poll(fds, num_fds, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    }
+
+    if (fds[0].revents & ~POLLOUT) {
+      receive_commands(sock);
+    }
+#ifdef HAVE_SHM
+    if (space_index >= 0 && fds[space_index].revents != 0) {
+      shm_ring_clear_signal(ring.space_fd);
+    }
+#endif
+    if (input_index >= 0 && fds[input_index].revents != 0) {
+      len = (int)read(input_fd,
+                      input + input_len,
+                      INPUT_BUFFER_SIZE - input_len);
+      if (len > 0) {
+        input_len += len;
+      } else if (len == 0 || errno != EINTR) {
+        if (len < 0) {
+          fprintf_locked(stderr,
+                         "\rError reading input: %s\n",
+                         error_to_str(errno, NULL, 0));
+        }
+        input_eof = 1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/* Connects to a server on this host through its Unix domain socket */
+static socket_t connect_local(const char *path)
+{
+  struct sockaddr_un addr;
   socket_t sock;
+  int error;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return INVALID_SOCKET;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock == INVALID_SOCKET) {
+    return INVALID_SOCKET;
+  }
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    error = errno;
+    close_socket(sock);
+    errno = error;
+    return INVALID_SOCKET;
+  }
+  return sock;
+}
+
+#endif /* _WIN32 */
+
+static void print_usage(const char *program_name)
+{
+  fprintf(stderr,
+      "Usage: %s [options] <host> <port>\n"
+      "Options:\n"
+      "  --pipe                 send every line of input as a message, with\n"
+      "                         many lines to a write, and exit at its end\n"
+      "  --input <file>         read input from a file instead of stdin\n"
+      "                         (implies --pipe)\n"
+      "  --quiet                count received messages instead of printing\n"
+      "                         them\n"
+#ifndef _WIN32
+      "  --unix <path>          connect to a server on this host through its\n"
+      "                         Unix domain socket, instead of <host> <port>\n"
+#endif
+#ifdef HAVE_SHM
+      "  --shm                  with --unix, send through a ring in shared\n"
+      "                         memory if the server offers one\n"
+#endif
+      , program_name);
+}
+
+int main(int argc, char **argv)
+{
+  int error;
+  socket_t sock = INVALID_SOCKET;
   struct addrinfo ai_hints, *ai_result = NULL, *ai_cur;
-  const char *host, *port;
-  char *addr_str = NULL;
-  thread_t command_thread_handle;
+  const char *program_name = get_program_name(argv[0]);
+  const char *host = NULL, *port = NULL;
+  const char *input_path = NULL;
+  const char *local_path = NULL;
+  int input_fd = STDIN_FILENO;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--pipe") == 0) {
+      pipe_mode = 1;
+    } else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc) {
+      input_path = argv[++i];
+      pipe_mode = 1;
+    } else if (strcmp(argv[i], "--quiet") == 0) {
+      quiet = 1;
+#ifndef _WIN32
+    } else if (strcmp(argv[i], "--unix") == 0 && i + 1 < argc) {
+      local_path = argv[++i];
+#endif
+#ifdef HAVE_SHM
+    } else if (strcmp(argv[i], "--shm") == 0) {
+      use_ring = 1;
+#endif
+    } else if (argv[i][0] == '-' && argv[i][1] == '-') {
+      print_usage(program_name);
+      exit(EXIT_FAILURE);
+    } else if (host == NULL) {
+      host = argv[i];
+    } else if (port == NULL) {
+      port = argv[i];
+    }
+  }
 
-  if (argc < 3) {
-    fprintf(stderr, "Usage: %s <host> <port>\n", get_program_name(argv[0]));
+  if (local_path != NULL ? host != NULL : host == NULL || port == NULL) {
+    print_usage(program_name);
+    exit(EXIT_FAILURE);
+  }
+#ifdef HAVE_SHM
+  if (use_ring && local_path == NULL) {
+    fprintf(stderr, "--shm only works with --unix\n");
     exit(EXIT_FAILURE);
   }
+#endif
 
-  host = argv[1];
-  port = argv[2];
+  if (input_path != NULL) {
+    input_fd = open(input_path, O_RDONLY);
+    if (input_fd < 0) {
+      fprintf(stderr,
+              "Could not open %s: %s\n",
+              input_path,
+              error_to_str(errno, NULL, 0));
+      exit(EXIT_FAILURE);
+    }
+  }
 
   socket_init();
   atexit(socket_cleanup);
 
+#ifndef _WIN32
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, handle_stop_signal);
+  signal(SIGTERM, handle_stop_signal);
+#endif
+
+  recv_buffer_init(&in_buffer, EHLO_RECV_BUFFER_SIZE);
+
+#ifndef _WIN32
+  if (local_path != NULL) {
+    fprintf(pipe_mode ? stderr : stdout, "Connecting to %s\n", local_path);
+    sock = connect_local(local_path);
+    if (sock == INVALID_SOCKET) {
+      fprintf(stderr,
+          "Could not connect: %s\n", error_to_str(socket_error(), NULL, 0));
+      goto fatal_error;
+    }
+    goto connected;
+  }
+#endif
+
   sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
   if (sock == INVALID_SOCKET) {
     fprintf(stderr, "socket: %s\n",
@@ -133,15 +1149,13 @@ int main(int argc, char **argv)
     goto fatal_error;
   }
 
-  printf("Connecting to %s:%s\n", host, port);
+  fprintf(pipe_mode ? stderr : stdout, "Connecting to %s:%s\n", host, port);
 
   for (ai_cur = ai_result; ai_cur != NULL; ai_cur = ai_cur->ai_next) {
     error = connect(sock,
                     (struct sockaddr *)ai_cur->ai_addr,
                     (int)ai_cur->ai_addrlen);
     if (error == 0) {
-      addr_str = strdup(
-          inet_ntoa(((struct sockaddr_in *)ai_cur->ai_addr)->sin_addr));
       break;
     }
   }
@@ -155,53 +1169,36 @@ int main(int argc, char **argv)
   freeaddrinfo(ai_result);
   ai_result = NULL;
 
-  error = create_thread(&command_thread_handle, command_thread, &sock);
+#ifndef _WIN32
+connected:
+#endif
+  error = negotiate_protocol(sock);
   if (error != 0) {
     fprintf(stderr,
-            "Failed to create command thread: %s\n",
+            "Failed to negotiate protocol: %s\n",
             error_to_str(error, NULL, 0));
     goto fatal_error;
   }
 
-  for (;;) {
-    char line[EHLO_MAX_MESSAGE_LEN];
-    int8_t cmd;
-
-    print_prompt();
-
-    if (fgets(line, sizeof(line), stdin) == NULL) {
-      if (feof(stdin)) {
-        printf("EOF\n");
-      } else {
-        fprintf(stderr, 
-                "Error reading input: %s\n", 
-                error_to_str(errno, NULL, 0));
-      }
-      break;
-    }
-
-    /* Remove trailing newline */
-    line[strlen(line) - 1] = '\0';
-
-    if (line[0] == '/') {
-      execute_chat_command(sock, line);
-      continue;
-    }
+  start_time = get_time_ms();
+  if (pipe_mode || quiet) {
+    atexit(print_summary);
+  }
 
-    /* Send this message to the server */
-    cmd = EHLO_CMD_MESSAGE;
-    send_n(sock, (char *)&cmd, 1, 0);
-    send_n(sock, line, (int)strlen(line) + 1, 0);
+  error = run_client(sock, input_fd);
+  if (error != 0) {
+    fprintf_locked(stderr,
+                   "\rConnection failed: %s\n",
+                   error_to_str(error, NULL, 0));
+    close_socket(sock);
+    exit(EXIT_FAILURE);
   }
 
-  cancel_thread(command_thread_handle);
   close_socket_nicely(sock);
-  free(addr_str);
   exit(EXIT_SUCCESS);
 
 fatal_error:
   freeaddrinfo(ai_result);
-  free(addr_str);
   close_socket_nicely(sock);
   exit(EXIT_FAILURE);
 }